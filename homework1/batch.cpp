@@ -0,0 +1,363 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include "batch.h"
+#include "threadpool.h"
+#include "ioring.h"
+#include "imagehash.h"
+#include "resultcache.h"
+
+#define BATCH_PREFETCH  2   // Decoded jobs the reader keeps ready ahead of the filters
+#define BATCH_WRITEBACK 2   // Filtered images waiting on the writer
+
+typedef std::chrono::steady_clock Clock;
+
+static double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+std::vector<BatchJob> readManifest(const std::string& path) {
+    std::ifstream         in(path);
+    std::vector<BatchJob> jobs;
+    std::string           text;
+    int                   line = 0;
+
+    if (!in) {
+        throw(BitmapException("Error opening manifest " + path, 0));
+    }
+
+    while (std::getline(in, text)) {
+        std::istringstream       words(text);
+        std::vector<std::string> fields;
+        std::string              word;
+
+        line++;
+        while (words >> word) fields.push_back(word);
+        if (fields.empty() || fields[0][0] == '#') continue;
+
+        if (fields.size() < 2) {
+            throw(BitmapException("Manifest line has no output file", line));
+        }
+
+        BatchJob job;
+        job.input  = fields.front();
+        job.output = fields.back();
+        for (size_t i = 1; i + 1 < fields.size(); i++) {
+            if (!job.pipeline.add(fields[i])) {
+                throw(BitmapException("Unknown option " + fields[i] + " in manifest", line));
+            }
+            job.options += (job.options.empty() ? "" : " ") + fields[i];
+        }
+        jobs.push_back(std::move(job));
+    }
+
+    return jobs;
+}
+
+/**
+ * BoundedQueue - hands items from one stage of a batch to the next.  push()
+ * waits while the queue is full, so a stage can only get so far ahead, and
+ * pop() waits for an item until the queue is closed and empty.
+ */
+template<typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> guard(lock);
+        not_full.wait(guard, [&]() { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> guard(lock);
+        not_empty.wait(guard, [&]() { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t                  capacity;
+    std::deque<T>           items;
+    bool                    closed = false;
+    std::mutex              lock;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+// Whether a job's result depends on nothing but its input and its options
+static bool cacheable(const BatchJob& job) {
+    std::istringstream words(job.options);
+    std::string        word;
+
+    while (words >> word) {
+        if (!canCache(word)) return false;
+    }
+    return true;
+}
+
+/**
+ * Decoded - a job with its input, from the reader.  Jobs that share an input
+ * share one decoded image.
+ */
+struct Decoded
+{
+    size_t                  index = 0;
+    std::shared_ptr<Bitmap> source;
+    std::string             error;      // Why the decode failed, if it did
+    std::string             duplicate;  // The earlier input this job already ran on, if it's a near duplicate
+    std::string             cached;     // How the result cache served the job, if it did
+    std::string             key;        // The job's result cache key, if its output is to be stored
+    double                  load = -1;  // Negative when the input was decoded for an earlier job
+};
+
+/**
+ * Filtered - a job's output, waiting for the writer.
+ */
+struct Filtered
+{
+    size_t      index = 0;
+    Bitmap      image;
+    std::string error;
+    std::string duplicate;
+    std::string cached;
+    std::string key;
+    double      load = -1;
+    double      filter = 0;
+};
+
+int runBatch(const std::vector<BatchJob>& jobs, std::ostream& report, int dedupe, const ResultCache *cache) {
+    std::vector<size_t>           order(jobs.size());  // Jobs grouped by input, in manifest order within an input
+    std::map<std::string, size_t> first_use;
+    BoundedQueue<Decoded>         decoded(BATCH_PREFETCH);
+    BoundedQueue<Filtered>        filtered(BATCH_WRITEBACK);
+    int                           failed = 0;
+    int                           skipped = 0;
+    int                           served = 0;    // From the result cache
+    double                        total_load = 0, total_filter = 0, total_write = 0;
+    Clock::time_point             start = Clock::now();
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        first_use.emplace(jobs[i].input, i);
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return first_use.at(jobs[a].input) < first_use.at(jobs[b].input);
+    });
+
+    // Reader: decode each input once, in job order, staying BATCH_PREFETCH jobs ahead of the filters.  With a
+    // cache, the jobs of an input are looked up first, and the input is only decoded if one of them missed.
+    // With dedupe, it also hashes each input, and passes a job on as a duplicate when an earlier job ran the
+    // same options on an input within dedupe bits of it
+    std::thread reader([&]() {
+        IoRing                                     ring;
+        std::shared_ptr<Bitmap>                    source;
+        std::string                                error;
+        HashIndex                                  hashes;   // One hash per decoded input
+        std::vector<std::string>                   hashed;   // The input of each hash
+        std::set<std::pair<uint32_t, std::string>> ran;      // (hash id, options) of every job that wasn't skipped
+        uint64_t                                   hash = 0;
+        uint32_t                                   id = 0;
+
+        for (size_t k = 0; k < order.size(); ) {
+            const std::string& input = jobs[order[k]].input;
+            size_t             end   = k;
+            Clock::time_point  begin = Clock::now();
+
+            while (end < order.size() && jobs[order[end]].input == input) end++;
+
+            std::vector<std::string> keys(end - k), hits(end - k);
+            bool                     needed = true;
+            if (cache) {
+                std::string file_hash = cache->hashFile(input);
+
+                needed = false;
+                for (size_t j = k; j < end; j++) {
+                    if (!file_hash.empty() && cacheable(jobs[order[j]])) {
+                        keys[j - k] = cache->key(file_hash, jobs[order[j]].options);
+                        CacheHit hit = cache->fetch(keys[j - k], jobs[order[j]].output);
+                        if (hit != CacheHit::Miss) hits[j - k] = cacheHitName(hit);
+                    }
+                    needed = needed || hits[j - k].empty();
+                }
+            }
+
+            if (needed) {
+                source = std::make_shared<Bitmap>();
+                error.clear();
+                try {
+                    source->load(input, &ring);
+                }
+                catch (BitmapException& e) {
+                    error = e.what();
+                }
+                catch (std::bad_alloc&) {
+                    error = "Error - out of memory";
+                }
+                if (!error.empty()) source.reset();
+                if (source && dedupe >= 0) {
+                    hash = perceptualHash(*source);
+                    hashed.push_back(input);
+                    id = hashes.insert(hash);
+                }
+            }
+            double load = millisecondsSince(begin);   // Goes to the first job that needed the input decoded, or the first one
+
+            for (size_t j = k; j < end; j++) {
+                if (!hits[j - k].empty()) {
+                    decoded.push({order[j], nullptr, "", "", hits[j - k], "", needed ? -1 : load});
+                    if (!needed) load = -1;
+                    continue;
+                }
+
+                std::string duplicate;
+                if (source && dedupe >= 0) {
+                    const std::string& options = jobs[order[j]].options;
+                    for (const auto& match : hashes.find(hash, dedupe)) {
+                        if (ran.count({match.first, options})) {
+                            duplicate = hashed[match.first] + ", " + std::to_string(match.second) + " bits apart";
+                            break;
+                        }
+                    }
+                    if (duplicate.empty()) ran.insert({id, options});
+                }
+                decoded.push({order[j], source, error, duplicate, "", keys[j - k], load});
+                load = -1;
+            }
+
+            // Once the last job of an input has it, the reader lets go, so that job can end up holding the only reference
+            source.reset();
+            k = end;
+        }
+        decoded.close();
+    });
+
+    // Writer: save each filtered image as it comes, and report the job
+    std::thread writer([&]() {
+        IoRing   ring;
+        Filtered done;
+
+        while (filtered.pop(done)) {
+            const BatchJob& job   = jobs[done.index];
+            double          write = 0;
+
+            if (done.error.empty() && done.duplicate.empty() && done.cached.empty()) {
+                Clock::time_point mark = Clock::now();
+                try {
+                    done.image.save(job.output, &ring);
+                    if (!done.key.empty()) cache->store(done.key, job.output);
+                }
+                catch (BitmapException& e) {
+                    done.error = e.what();
+                }
+                write = millisecondsSince(mark);
+            }
+            done.image = Bitmap();   // Back to the pool before waiting on the next one
+
+            report << "[" << done.index + 1 << "/" << jobs.size() << "] " << job.input << " "
+                   << (job.options.empty() ? "" : job.options + " ") << "-> " << job.output;
+            if (!done.error.empty()) {
+                report << "  FAILED: " << done.error << std::endl;
+                failed++;
+                continue;
+            }
+            if (!done.cached.empty()) {
+                report << "  from the result cache (" << done.cached << ")" << std::endl;
+                total_load += std::max(done.load, 0.0);
+                served++;
+                continue;
+            }
+            if (!done.duplicate.empty()) {
+                report << "  skipped, near duplicate of " << done.duplicate << std::endl;
+                total_load += std::max(done.load, 0.0);
+                skipped++;
+                continue;
+            }
+            report << std::fixed << std::setprecision(2);
+            if (done.load < 0) report << "  load cached";
+            else               report << "  load " << done.load << " ms";
+            report << "  filter " << done.filter << " ms  write " << write << " ms" << std::endl;
+            total_load   += std::max(done.load, 0.0);
+            total_filter += done.filter;
+            total_write  += write;
+        }
+    });
+
+    // Filters: one task per thread, each taking the next decoded job, so a job
+    // takes its input over when nothing else needs it and copies it otherwise
+    int threads = std::max<int>(1, std::min<size_t>(getThreadCount(), jobs.size()));
+    parallelFor(threads, [&](size_t) {
+        Decoded job;
+
+        while (decoded.pop(job)) {
+            Filtered done;
+            done.index     = job.index;
+            done.error     = job.error;
+            done.duplicate = job.duplicate;
+            done.cached    = job.cached;
+            done.key       = job.key;
+            done.load      = job.load;
+
+            if (job.source && job.duplicate.empty()) {
+                Clock::time_point mark = Clock::now();
+                try {
+                    if (job.source.use_count() == 1) {
+                        std::atomic_thread_fence(std::memory_order_acquire);   // After every other job's copy of it
+                        done.image = std::move(*job.source);
+                    }
+                    else {
+                        done.image = *job.source;
+                    }
+                    job.source.reset();
+                    jobs[job.index].pipeline.run(done.image);
+                }
+                catch (BitmapException& e) {
+                    done.error = e.what();
+                }
+                catch (std::bad_alloc&) {
+                    done.error = "Error - out of memory";
+                }
+                done.filter = millisecondsSince(mark);
+            }
+            job.source.reset();   // A skipped duplicate lets go too
+            filtered.push(std::move(done));
+        }
+    });
+    filtered.close();
+    reader.join();
+    writer.join();
+
+    report << std::fixed << std::setprecision(2)
+           << jobs.size() << " jobs, " << failed << " failed, "
+           << (dedupe >= 0 ? std::to_string(skipped) + " skipped as duplicates, " : "")
+           << (cache ? std::to_string(served) + " from the result cache, " : "") << millisecondsSince(start) << " ms"
+           << " (load " << total_load << " ms, filter " << total_filter << " ms, write " << total_write << " ms)" << std::endl;
+
+    return failed;
+}
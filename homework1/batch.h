@@ -0,0 +1,68 @@
+// Author:  Charles Lucas
+// CS510
+//
+// Batch mode: run a manifest of (input, options, output) jobs in one
+// process, decoding each input once and spreading the jobs over the
+// thread pool.
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "pipeline.h"
+
+class ResultCache;
+
+/**
+ * BatchJob - one line of a manifest.
+ */
+struct BatchJob
+{
+    std::string input;
+    std::string output;
+    std::string options;    // The options as written, for the report
+    Pipeline    pipeline;
+};
+
+/**
+ * Read a manifest with one job per line, written as
+ *     input.bmp [option ...] output.bmp
+ * Blank lines and lines starting with # are skipped.
+ *
+ * @throws BitmapException if the manifest can't be read, or a line has an
+ *         unknown option or no output (the position is the line number).
+ */
+std::vector<BatchJob> readManifest(const std::string& path);
+
+/**
+ * Run every job as a three stage pipeline, so the disk and the filters keep
+ * each other busy: a reader thread decodes the inputs ahead of the filters,
+ * the filters run one job per thread at a time, and a writer thread saves
+ * the outputs behind them.  The stages hand jobs on through short bounded
+ * queues.  The reader and writer keep their reads and writes in flight
+ * together through an IoRing, without touching the thread pool.
+ *
+ * Jobs that share an input are run next to each other and share one
+ * decoded image, which the last of them takes over instead of copying, so
+ * only the jobs in the queues and in flight have images in memory.  One line
+ * of timing per job is printed to report as each job is written, and the
+ * total time at the end along with the time each stage spent busy.
+ *
+ * With dedupe of 0 or more, the reader takes the perceptual hash of each
+ * input as it decodes it, and a job with the same options as an earlier job
+ * whose input is within dedupe bits of its own is skipped (and reported as a
+ * near duplicate of that input) instead of filtered and written.
+ *
+ * With a cache, each input is hashed before it's decoded, every job whose
+ * result is in the cache gets its output from there, and the input is only
+ * decoded if some job missed.  The outputs of the jobs that missed are
+ * stored in the cache as they're written.
+ *
+ * @return the number of jobs that failed.
+ */
+int runBatch(const std::vector<BatchJob>& jobs, std::ostream& report, int dedupe = -1,
+             const ResultCache *cache = nullptr);
+
+#endif
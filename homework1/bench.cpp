@@ -0,0 +1,408 @@
+// Author:  Charles Lucas
+// CS510
+//
+// Benchmarks loading, storing and every filter on synthetic images from
+// 1 to 100 megapixels (24-bit, and 32-bit with alpha) and on the example
+// images.  Each operation runs on a fresh copy of the image until it has
+// enough samples, and is reported as median and percentile times, MP/s and
+// bytes per cycle, on the console and as JSON.
+// Run from the homework1 directory (make bench).
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "bitmap.h"
+#include "bitmap_simd.h"
+#include "threadpool.h"
+#include "stats.h"
+#include "imagehash.h"
+#include "pointop.h"
+#include "convolve.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+#define GROW_LIMIT_PIXELS (25 * 1000 * 1000)   // grow makes an image 4 times the size, so bigger ones skip it
+
+/**
+ * Operation - one thing to time.  run gets a fresh copy of the image each
+ * sample (the copy isn't timed).
+ */
+struct Operation
+{
+    string                      name;
+    function<void(Bitmap&)>     run;
+    bool                        needs_alpha;   // Only meaningful on images with alpha
+};
+
+/**
+ * Result - the samples of one operation on one image.
+ */
+struct Result
+{
+    string           image;
+    string           op;
+    int              width;
+    int              height;
+    int              bits;
+    vector<double>   seconds;
+    vector<uint64_t> cycles;
+};
+
+static uint64_t readCycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return chrono::duration_cast<chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Cycle counter ticks per second, measured against the steady clock
+static double cycleRate()
+{
+    Clock::time_point start = Clock::now();
+    uint64_t          first = readCycles();
+
+    while(Clock::now() - start < chrono::milliseconds(100)) {}
+    return (readCycles() - first) / chrono::duration<double>(Clock::now() - start).count();
+}
+
+// The value p percent of the way through sorted samples (nearest rank)
+template<typename T>
+static T percentile(vector<T> samples, double p)
+{
+    sort(samples.begin(), samples.end());
+    size_t rank = (size_t)ceil(p / 100 * samples.size());
+    return samples[min(samples.size() - 1, rank ? rank - 1 : 0)];
+}
+
+// An image of the given size with the header of an example, filled with smooth
+// gradients, hard edges and noise, so no filter gets an easy time
+static Bitmap syntheticImage(int megapixels, int bits)
+{
+    Bitmap b;
+    b.open_mapped(bits == 24 ? "examples/bear2_24.bmp" : "examples/bear3_32.bmp");
+    b.loadMapped();
+    if(bits == 32)
+    {
+        b.red_mask   = 0x00FF0000;
+        b.green_mask = 0x0000FF00;
+        b.blue_mask  = 0x000000FF;
+        b.alpha_mask = 0xFF000000;
+        b.decodeMasks();
+    }
+
+    int width  = (int)lround(sqrt(megapixels * 1e6 * 4 / 3));
+    int height = (int)lround(megapixels * 1e6 / width);
+    int bytes  = bits / 8;
+    b.setDimensions(width, height);
+    b.data.resize((size_t)width * height * bytes);
+
+    parallelRows(height, [&](int first, int last)
+    {
+        uint32_t seed = 2463534242u + first;
+        for(int y = first; y < last; y++)
+        {
+            uint8_t* p = (uint8_t*)b.row(y);
+            for(int x = 0; x < width; x++, p += bytes)
+            {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                int noise = (seed & 31) - 16;
+                p[0] = (uint8_t)min(255, max(0, x * 255 / width + noise));
+                p[1] = (uint8_t)min(255, max(0, y * 255 / height + noise));
+                p[2] = (uint8_t)(((x / 64 + y / 64) & 1) ? 220 : 30);
+                if(bytes == 4) p[3] = (uint8_t)((x + y) * 255 / (width + height));
+            }
+        }
+    });
+    return b;
+}
+
+static vector<Operation> operations()
+{
+    return {
+        {"cell shade",      [](Bitmap& b) { cellShade(b); },                              false},
+        {"grayscale",       [](Bitmap& b) { grayscale(b); },                              false},
+        {"pixelate",        [](Bitmap& b) { pixelate(b); },                               false},
+        {"pixelate 7x5",    [](Bitmap& b) { pixelate(b, 7, 5); },                         false},
+        {"blur",            [](Bitmap& b) { blur(b); },                                   false},
+        {"blur sigma 3",    [](Bitmap& b) { blur(b, 3); },                                false},
+        {"rot90",           rot90,                                                        false},
+        {"rot180",          rot180,                                                       false},
+        {"rot270",          rot270,                                                       false},
+        {"flipv",           flipv,                                                        false},
+        {"fliph",           fliph,                                                        false},
+        {"flipd1",          flipd1,                                                       false},
+        {"flipd2",          flipd2,                                                       false},
+        {"grow",            scaleUp,                                                      false},
+        {"shrink",          scaleDown,                                                    false},
+        {"resize bilinear", [](Bitmap& b) { resize(b, b.width_in_pixels * 3 / 4, b.height_in_pixels * 3 / 4, ResampleFilter::Bilinear); }, false},
+        {"resize lanczos",  [](Bitmap& b) { resize(b, b.width_in_pixels * 3 / 4, b.height_in_pixels * 3 / 4, ResampleFilter::Lanczos); },  false},
+        {"sharpen",         [](Bitmap& b) { sharpen(b); },                                false},
+        {"edges",           [](Bitmap& b) { edgeDetect(b); },                             false},
+        {"box 5",           [](Bitmap& b) { boxBlur(b, 5); },                             false},
+        {"gamma",           [](Bitmap& b) { gammaCorrect(b, 2.2); },                      false},
+        {"invert",          invert,                                                       false},
+        {"auto levels",     [](Bitmap& b) { autoLevels(b, 0.005); },                      false},
+        {"equalize",        equalize,                                                     false},
+        {"statistics",      [](Bitmap& b) { imageStats(b); },                             false},
+        {"dhash",           [](Bitmap& b) { differenceHash(b); },                         false},
+        {"phash",           [](Bitmap& b) { perceptualHash(b); },                         false},
+        {"premultiply",     premultiply,                                                  true},
+        {"unpremultiply",   [](Bitmap& b) { b.premultiplied = true; unpremultiply(b); },  true},
+        {"composite",       [](Bitmap& b) { composite(b, b, b.width_in_pixels / 4, b.height_in_pixels / 4); }, true},
+    };
+}
+
+static bool wanted(const vector<string>& only, const string& name)
+{
+    return only.empty() || find(only.begin(), only.end(), name) != only.end();
+}
+
+// Time f until there are at least min_samples samples and min_seconds spent, or max_samples.
+// prepare runs before each sample and isn't timed
+static void sample(Result& result, const function<void()>& prepare, const function<void()>& f,
+                   double min_seconds, int min_samples, int max_samples)
+{
+    double total = 0;
+
+    while((int)result.seconds.size() < max_samples && ((int)result.seconds.size() < min_samples || total < min_seconds))
+    {
+        prepare();
+        Clock::time_point start  = Clock::now();
+        uint64_t          cycles = readCycles();
+        f();
+        cycles = readCycles() - cycles;
+        double seconds = chrono::duration<double>(Clock::now() - start).count();
+
+        result.seconds.push_back(seconds);
+        result.cycles.push_back(cycles);
+        total += seconds;
+    }
+}
+
+static void report(ostream& out, const Result& r)
+{
+    double pixels = (double)r.width * r.height;
+    double bytes  = pixels * (r.bits / 8);
+    double median = percentile(r.seconds, 50);
+
+    out << left << setw(28) << r.image << setw(18) << r.op << right << fixed
+        << setprecision(3) << setw(11) << median * 1000 << " ms"
+        << setw(11) << percentile(r.seconds, 10) * 1000 << setw(11) << percentile(r.seconds, 90) * 1000
+        << setprecision(1) << setw(10) << pixels / 1e6 / median << " MP/s"
+        << setprecision(3) << setw(9) << bytes / percentile(r.cycles, 50) << " B/cycle" << endl;
+}
+
+static string quoted(const string& text)
+{
+    string escaped = "\"";
+    for(char c : text)
+    {
+        if(c == '"' || c == '\\') escaped += '\\';
+        escaped += c;
+    }
+    return escaped + "\"";
+}
+
+static void writeJson(ostream& out, const vector<Result>& results, double rate)
+{
+    out << "{\n  \"simd\": " << quoted(simdLevelName(getSimdLevel())) << ",\n"
+        << "  \"threads\": " << getThreadCount() << ",\n"
+        << "  \"cycles_per_second\": " << setprecision(0) << fixed << rate << ",\n"
+        << "  \"results\": [";
+    for(size_t i = 0; i < results.size(); i++)
+    {
+        const Result& r = results[i];
+        double pixels = (double)r.width * r.height;
+        double median = percentile(r.seconds, 50);
+
+        out << (i ? "," : "") << "\n    {\"image\": " << quoted(r.image) << ", \"op\": " << quoted(r.op)
+            << ", \"width\": " << r.width << ", \"height\": " << r.height << ", \"bits\": " << r.bits
+            << ", \"samples\": " << r.seconds.size() << setprecision(6)
+            << ", \"median_ms\": " << median * 1000
+            << ", \"min_ms\": " << *min_element(r.seconds.begin(), r.seconds.end()) * 1000
+            << ", \"p10_ms\": " << percentile(r.seconds, 10) * 1000
+            << ", \"p90_ms\": " << percentile(r.seconds, 90) * 1000
+            << ", \"mp_per_s\": " << pixels / 1e6 / median
+            << ", \"median_cycles\": " << setprecision(0) << (double)percentile(r.cycles, 50) << setprecision(6)
+            << ", \"bytes_per_cycle\": " << pixels * (r.bits / 8) / percentile(r.cycles, 50) << "}";
+    }
+    out << "\n  ]\n}" << endl;
+}
+
+static vector<string> splitList(const string& text)
+{
+    vector<string> items;
+    stringstream   in(text);
+    string         item;
+    while(getline(in, item, ',')) items.push_back(item);
+    return items;
+}
+
+int main(int argc, char** argv)
+{
+    vector<int>    sizes = {1, 4, 16, 100};
+    vector<string> only;
+    string         json_path = "bench.json";
+    double         min_seconds = 0.5;
+    int            min_samples = 5, max_samples = 50;
+    bool           examples = true;
+
+    for(int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+        if(option.compare(0, 2, "-j") == 0) setThreadCount(atoi(argv[i] + 2));
+        else if(option == "--quick")
+        {
+            sizes = {1, 4};
+            min_seconds = 0.1;
+            min_samples = 3;
+        }
+        else if(option == "--no-examples") examples = false;
+        else if(option == "--sizes" && i + 1 < argc)
+        {
+            sizes.clear();
+            for(const string& size : splitList(argv[++i])) sizes.push_back(atoi(size.c_str()));
+        }
+        else if(option == "--only" && i + 1 < argc) only = splitList(argv[++i]);
+        else if(option == "--json" && i + 1 < argc) json_path = argv[++i];
+        else
+        {
+            cout << "usage:\n"
+                 << "bench [-j<threads>] [--quick] [--sizes <megapixels>,...] [--only <op>,...] [--no-examples] [--json file]\n"
+                 << "  times load, store and every filter on synthetic 24- and 32-bit images (1, 4, 16 and 100 MP\n"
+                 << "  by default, 1 and 4 with --quick) and the examples, and writes the results to bench.json\n"
+                 << "  ops: load, store";
+            for(const Operation& op : operations()) cout << ", " << op.name;
+            cout << endl;
+            return option == "--help" ? 0 : 1;
+        }
+    }
+
+    // The filters print a line each time they run, so only the report goes to the console
+    streambuf* console = cout.rdbuf();
+    ostream    out(console);
+    cout.rdbuf(nullptr);
+
+    double rate = cycleRate();
+    out << "simd " << simdLevelName(getSimdLevel()) << ", " << getThreadCount() << " threads, "
+        << fixed << setprecision(2) << rate / 1e9 << " GHz cycle counter" << endl;
+    out << left << setw(28) << "image" << setw(18) << "op" << right << setw(14) << "median"
+        << setw(11) << "p10" << setw(11) << "p90" << setw(15) << "" << setw(17) << "" << endl;
+
+    // Every image to run: synthetic ones by size, then the examples
+    vector<pair<string, function<Bitmap()>>> images;
+    for(int megapixels : sizes)
+    {
+        for(int bits : {24, 32})
+        {
+            images.push_back({"synthetic " + to_string(megapixels) + "MP " + to_string(bits) + "-bit",
+                              [megapixels, bits]() { return syntheticImage(megapixels, bits); }});
+        }
+    }
+    if(examples)
+    {
+        ifstream names("bitmapnames.txt");
+        string   name;
+        while(names >> name)
+        {
+            if(access(("examples/" + name + ".bmp").c_str(), R_OK) != 0) continue;
+            images.push_back({name, [name]()
+            {
+                Bitmap b;
+                b.open_mapped("examples/" + name + ".bmp");
+                b.loadMapped();
+                return b;
+            }});
+        }
+    }
+
+    vector<Result> results;
+    string         path = "/tmp/bench_" + to_string(getpid()) + ".bmp";
+
+    try
+    {
+        for(const auto& image : images)
+        {
+            Bitmap source = image.second();
+            Bitmap b;
+            bool   alpha = source.color_depth == 32 && source.alpha_mask != 0;
+            Result base{image.first, "", source.width_in_pixels, source.height_in_pixels, source.color_depth, {}, {}};
+
+            // Store, then load what was stored (it's in the page cache, so this is the decoding, not the disk)
+            if(wanted(only, "store") || wanted(only, "load"))
+            {
+                Result store = base;
+                store.op = "store";
+                sample(store, []() {}, [&]() { source.save(path); }, min_seconds, min_samples, max_samples);
+                if(wanted(only, "store"))
+                {
+                    report(out, store);
+                    results.push_back(store);
+                }
+            }
+            if(wanted(only, "load"))
+            {
+                Result load = base;
+                load.op = "load";
+                sample(load, [&]() { b = Bitmap(); }, [&]() { b.load(path); },
+                       min_seconds, min_samples, max_samples);
+                report(out, load);
+                results.push_back(load);
+            }
+            unlink(path.c_str());
+
+            for(const Operation& op : operations())
+            {
+                if(!wanted(only, op.name) || (op.needs_alpha && !alpha) ||
+                   (op.name == "grow" && (double)source.width_in_pixels * source.height_in_pixels > GROW_LIMIT_PIXELS))
+                {
+                    continue;
+                }
+
+                Result result = base;
+                result.op = op.name;
+                sample(result, [&]() { b = Bitmap(); b = source; }, [&]() { op.run(b); }, min_seconds, min_samples, max_samples);
+                report(out, result);
+                results.push_back(result);
+            }
+        }
+    }
+    catch(BitmapException& e)
+    {
+        cout.rdbuf(console);
+        e.print_exception();
+        unlink(path.c_str());
+        return 1;
+    }
+    cout.rdbuf(console);
+
+    ofstream json(json_path);
+    writeJson(json, results, rate);
+    if(!json)
+    {
+        cout << "Error - could not write " << json_path << endl;
+        return 1;
+    }
+    cout << "Results written to " << json_path << endl;
+    return 0;
+}
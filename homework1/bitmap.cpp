@@ -8,173 +8,320 @@
 #include <cstring>
 #include <vector>
 #include <iomanip>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cerrno>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "bitmap.h"
+#include "pixelformat.h"
+#include "bitmap_simd.h"
+#include "threadpool.h"
+#include "planar.h"
+#include "ioring.h"
 
 #define DEBUG 0          // Turn on/off all debug messages
-#define PIXEL_SIZE 16    // NxN array of pixels to average color over for pixellation
-#define GAUSS_SIZE 5     // NxN array of pixels to calulate gausian blue over for each pixel
+#define PIXEL_SIZE 16    // NxN blocks of pixels pixelate() averages over
+#define TRANSPOSE_TILE 32 // NxN block of pixels copied at a time by rotations (two blocks fit in L1)
+#define MAX_HEADER_SIZE 138                 // Both headers of a 32-bit bitmap
+#define WRITE_CHUNK_BYTES (256 * 1024)      // Padded rows operator<< gathers into each write
+#define DIRECT_CHUNK_BYTES (4 * 1024 * 1024) // Bytes save() sends per O_DIRECT write
+#define DIRECT_RING_CHUNKS 4                // O_DIRECT chunks save() keeps in flight through a ring
+#define IO_BAND_BYTES (1024 * 1024)         // Bytes of rows per transfer sent through a ring
+
+#ifndef DIRECT_WRITE_BYTES
+#define DIRECT_WRITE_BYTES (64 * 1024 * 1024)  // Files this big are written by save() through O_DIRECT (make test lowers it)
+#endif
 
 Bitmap::Bitmap() {}
 
-void Bitmap::readPixel(int x, int y, uint &red, uint &green, uint &blue, uint &alpha) {
-    std::vector<char>::iterator ptr;
-    //if (DEBUG) std::cout << "Reading pixel color values at " << x << "," << y << std::endl;
+/**
+ * MappedFile - read-only memory mapping of a whole file, unmapped when the last Bitmap using it goes away
+ */
+class MappedFile
+{
+public:
+    const char *base;
+    size_t      size;
+
+    MappedFile(const char *base, size_t size) : base(base), size(size) {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { munmap((void*)base, size); }
+};
+
+// Copy a little-endian header field out of the mapping and advance the offset past it
+template<typename T>
+static void readField(const char *base, uint32_t &file_offset, T &field) {
+    memcpy(&field, base + file_offset, sizeof(field));
+    file_offset += sizeof(field);
+}
 
-    if (this->color_depth == 32) {
-        uint32_t color_value;   // 4-byte pixel color value in format [N bits of red, N bits of green, N bits of blue, N bits of alpha]
-        uint32_t red_unmasked;
-        uint32_t green_unmasked;
-        uint32_t blue_unmasked;
-        uint32_t alpha_unmasked;
- 
-        ptr = data.begin();
-        ptr = ptr + ((y * this->width_in_pixels) + x) * 4;  // Should point to the blue value of the pixel at x,y
-
-        // Concatenate our ASCII character values into one 32-bit value 
-        color_value = (uint8_t)*(ptr+3) << 24 | (uint8_t)*(ptr+2) << 16 | (uint8_t)*(ptr+1) << 8 | (uint8_t)*ptr;
-         
-        //std::cout << "Color Value " << std::dec << (((y * this->width_in_pixels) + x) * 4) << " = "<< std::hex << color_value << std::endl;
-
-        // Use the color masks to mask off the bits that aren't relevant for each color
-        red_unmasked   = color_value & this->red_mask;
-        green_unmasked = color_value & this->green_mask;
-        blue_unmasked  = color_value & this->blue_mask;
-        alpha_unmasked = color_value & this->alpha_mask;
-
-        //std::cout << "ColorValue = " << std::hex << color_value << " Red  " << " = " << std::hex << red_unmasked << "  Green  " << " = " << std::hex << green_unmasked << "  Blue  " << " = " << std::hex << blue_unmasked << "  Alpha  " << " = " << std::hex << alpha_unmasked << std::endl;
-
-        // Bit shift the unmasked pixel values to be bit0-aligned according to the mask value
-        uint temp_mask = this->red_mask;
-        if (temp_mask > 0) {
-            while (temp_mask%2 != 1) {   // While the mask is not odd
-                temp_mask    = temp_mask >> 1;
-                red_unmasked = red_unmasked >> 1;
-            }
-        }
+uint32_t Bitmap::decodeHeader(const char *file, size_t file_size) {
+    uint32_t file_offset = 0;          // Position in the header we are reading (for Exceptions)
 
-        temp_mask = this->green_mask;
-        if (temp_mask > 0) {
-            while (temp_mask%2 != 1) {   // While the mask is not odd
-                temp_mask      = temp_mask >> 1;
-                green_unmasked = green_unmasked >> 1;
-            }
-        }
+    if (file_size < 54) {
+        throw(BitmapException("Error reading bitmap header", 0));
+    }
 
-        temp_mask = this->blue_mask;
-        if (temp_mask > 0) {
-            while (temp_mask%2 != 1) {   // While the mask is not odd
-                temp_mask      = temp_mask >> 1;
-                blue_unmasked  = blue_unmasked >> 1;
-            }
+    // Check the header fields in place, with the same rules as operator>>
+    readField(file, file_offset, bitmap_type);
+    if (strncmp(bitmap_type, "BM", 2) != 0) {
+        throw(BitmapException("Error reading bitmap_type", (uint32_t)1));
+    }
+    readField(file, file_offset, length);
+    readField(file, file_offset, garbage);
+    readField(file, file_offset, offset);
+    readField(file, file_offset, size_second_header);
+    readField(file, file_offset, width_in_pixels);
+    readField(file, file_offset, height_in_pixels);
+    if (width_in_pixels <= 0 || height_in_pixels <= 0) {
+        throw(BitmapException("Error reading image dimensions", file_offset));
+    }
+    readField(file, file_offset, number_of_color_planes);
+    if (number_of_color_planes != 1) {
+        throw(BitmapException("Error reading number_of_color_planes", file_offset));
+    }
+    readField(file, file_offset, color_depth);
+    if (color_depth != 24 && color_depth != 32) {
+        throw(BitmapException("Error reading color_depth", file_offset));
+    }
+    readField(file, file_offset, compression_method);
+    if (!((color_depth == 24 && compression_method == 0) || (color_depth == 32 && compression_method == 3))) {
+        throw(BitmapException("Error reading compression_method", file_offset));
+    }
+    readField(file, file_offset, data_size);
+    readField(file, file_offset, horizontal_resolution);
+    readField(file, file_offset, vertical_resolution);
+    readField(file, file_offset, number_of_colors);
+    readField(file, file_offset, important_colors);
+
+    // These fields only exist in bitmaps with 32-bit color depth
+    if (color_depth == 32) {
+        if (file_size < file_offset + 84) {
+            throw(BitmapException("Error reading color masks", file_offset));
         }
+        readField(file, file_offset, red_mask);
+        readField(file, file_offset, green_mask);
+        readField(file, file_offset, blue_mask);
+        readField(file, file_offset, alpha_mask);
+        readField(file, file_offset, color_space);
+    }
 
-        temp_mask = this->alpha_mask;
-        if (temp_mask > 0) {
-            while (temp_mask%2 != 1) {   // While the mask is not odd
-                temp_mask      = temp_mask >> 1;
-                alpha_unmasked = alpha_unmasked >> 1;
-            }
+    decodeMasks();
+
+    // Every row has to be inside the file before anything reads it
+    uint64_t stride = (uint64_t)width_in_pixels * (color_depth / 8) + getRowPaddingSize();
+    if (offset < file_offset || offset > file_size || stride * height_in_pixels > file_size - offset) {
+        throw(BitmapException("Error - pixel data extends past the end of the file", offset));
+    }
+    return file_offset;
+}
+
+void Bitmap::open_mapped(const std::string& path) {
+    struct stat file_stat;
+    int         fd;
+    void       *base;
+
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw(BitmapException("Error opening " + path, 0));
+    }
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < 54) {
+        close(fd);
+        throw(BitmapException("Error reading bitmap header", 0));
+    }
+
+    base = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);  // The mapping keeps its own reference to the file
+    if (base == MAP_FAILED) {
+        throw(BitmapException("Error mapping " + path, 0));
+    }
+    mapping = std::make_shared<const MappedFile>((const char*)base, file_stat.st_size);
+    madvise(base, file_stat.st_size, MADV_SEQUENTIAL);
+
+    decodeHeader(mapping->base, mapping->size);
+
+    mapped_stride = width_in_pixels * (color_depth / 8) + getRowPaddingSize();
+    mapped_pixels = mapping->base + offset;
+    data.clear();
+
+    std::cout << "Bitmap mapped successfully - " << std::dec << mapping->size << " bytes mapped." << std::endl;
+}
+
+void Bitmap::loadMapped() {
+    if (!isMapped()) return;
+
+    uint32_t row_data_length = width_in_pixels * (color_depth / 8);
+
+    if (color_depth == 32) {
+        // 32-bit rows have no padding, so keep everything up to the stated file length (as operator>> does)
+        size_t data_end    = std::min<size_t>(length, mapping->size);
+        size_t data_length = (data_end > offset) ? data_end - offset : 0;
+        data.assign(mapped_pixels, mapped_pixels + std::max<size_t>(data_length, (size_t)row_data_length * height_in_pixels));
+    }
+    else {
+        data.resize((size_t)row_data_length * height_in_pixels);
+        for (int i = 0; i < height_in_pixels; i++) {
+            memcpy(data.data() + (size_t)i * row_data_length, mapped_pixels + (size_t)i * mapped_stride, row_data_length);
         }
+    }
+
+    mapping.reset();
+    mapped_pixels = nullptr;
+    mapped_stride = 0;
+}
+
+bool Bitmap::isMapped() const {
+    return(mapped_pixels != nullptr);
+}
+
+size_t Bitmap::trailingLength() const {
+    uint64_t end = MAX_HEADER_SIZE + (uint64_t)width_in_pixels * 4 * height_in_pixels;   // 32-bit rows have no padding
 
-        // Cast the calculated values back to unit before returning
-        red   = red_unmasked;
-        green = green_unmasked;
-        blue  = blue_unmasked;
-        alpha = alpha_unmasked;
+    if (color_depth != 32 || length <= end) return 0;
+    return length - end;
+}
+
+void Bitmap::copyTrailing(size_t start, size_t count, char *out) const {
+    size_t      rows_length = (size_t)width_in_pixels * (color_depth / 8) * height_in_pixels;
+    const char *kept        = data.data() + rows_length;
+    size_t      kept_length = data.size() > rows_length ? data.size() - rows_length : 0;
+
+    if (isMapped()) {
+        size_t end  = std::min<size_t>(length, mapping->size);
+        kept        = mapped_pixels + rows_length;
+        kept_length = end > offset + rows_length ? end - offset - rows_length : 0;
     }
-    else {  // Currently only supports 24-bit color depth
-        ptr = data.begin();
-        ptr = ptr + ((y * this->width_in_pixels) + x) * 3;  // Should point to the blue value of the pixel at x,y
 
-        red   = (uint8_t)*(ptr+2);
-        green = (uint8_t)*(ptr+1);
-        blue  = (uint8_t)*ptr;
+    size_t copied = start < kept_length ? std::min(count, kept_length - start) : 0;
+    memcpy(out, kept + start, copied);
+    memset(out + copied, 0, count - copied);
+}
+
+void Bitmap::releaseMappedRows(int first, int last) const {
+    if (!isMapped()) return;
+
+    uintptr_t page  = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)(mapped_pixels + (size_t)first * mapped_stride);
+    uintptr_t end   = (uintptr_t)(mapped_pixels + (size_t)last  * mapped_stride);
+
+    // Only whole pages inside the rows, so the rows either side stay resident
+    begin = (begin + page - 1) / page * page;
+    end   = end / page * page;
+    if (begin < end) {
+        madvise((void*)begin, end - begin, MADV_DONTNEED);
     }
+}
 
-    return;
+const char* Bitmap::row(int y) const {
+    if (isMapped()) return(mapped_pixels + (size_t)y * mapped_stride);
+    return(data.data() + (size_t)y * getRowStride());
 }
 
-void Bitmap::writePixel(int x, int y, uint &red, uint &green, uint &blue, uint &alpha) {
-    std::vector<char>::iterator ptr;
+char* Bitmap::row(int y) {
+    return(data.data() + (size_t)y * width_in_pixels * (color_depth / 8));
+}
+
+uint32_t Bitmap::getRowStride() const {
+    if (isMapped()) return(mapped_stride);
+    return(width_in_pixels * (color_depth / 8));
+}
+
+void ChannelFormat::decode(uint32_t channel_mask) {
+    uint32_t kept_width;  // Channel bits that survive scaling to 8 bits
+
+    mask  = channel_mask;
+    shift = (mask != 0) ? __builtin_ctz(mask) : 0;
+    width = __builtin_popcount(mask);
+    down  = (width > 8) ? width - 8 : 0;
+
+    kept_width = width - down;
+    if (kept_width == 0) {  // No mask (e.g. no alpha channel) - always reads as 0 and writes nothing
+        to8   = 0;
+        from8 = 0;
+    }
+    else {
+        uint64_t kept_max = (1u << kept_width) - 1;
+        to8   = (255 * 65536 + kept_max - 1) / kept_max;
+        from8 = (kept_max * 65536 + 127) / 255;
+    }
+}
 
-    //if (DEBUG) std::cout << "Writing pixel color values at " << "x = " << x << ", y = " << y << " - index = " << (((y * this->width_in_pixels) + x) * 4) << std::endl;
+/**
+ * Decode the color masks into the per-image pixel format.
+ * 24-bit images have no masks, so they get the fixed BGR byte layout.
+ */
+void Bitmap::decodeMasks() {
+    if (color_depth == 32) {
+        format.red  .decode(red_mask);
+        format.green.decode(green_mask);
+        format.blue .decode(blue_mask);
+        format.alpha.decode(alpha_mask);
+    }
+    else {
+        format.red  .decode(0x00FF0000);
+        format.green.decode(0x0000FF00);
+        format.blue .decode(0x000000FF);
+        format.alpha.decode(0);
+    }
+}
+
+void Bitmap::readPixel(int x, int y, uint &red, uint &green, uint &blue, uint &alpha) {
+    const uint8_t *ptr;
 
     if (this->color_depth == 32) {
-        uint32_t color_value = 0;   // 4-byte pixel color value in format [N bits of red, N bits of green, N bits of blue, N bits of alpha]
-        uint32_t red_masked = 0;
-        uint32_t green_masked = 0;
-        uint32_t blue_masked = 0;
-        uint32_t alpha_masked = 0;
- 
-        ptr = data.begin();
-        ptr = ptr + ((y * this->width_in_pixels) + x) * 4;  // Should point to the blue value of the pixel at x,y
-
-        // Bit shift the red color values to be mask-aligned and OR them into the combined color value
-        uint temp_mask = this->red_mask;
-        uint temp_value = red;
-        if (temp_mask > 0) {
-            while (temp_mask%2 != 1) {   // While the mask is not odd
-                //std::cout << "Red Mask " << std::dec << (((y * this->width_in_pixels) + x) * 4) << " = "<< std::hex << temp_mask << "  temp_value = " << temp_value << std::endl;
-                temp_mask  = temp_mask  >> 1;
-                temp_value = temp_value << 1;
-            }
-            color_value = color_value | temp_value;  // OR our red value into the appropriate bits in the color value
-        }
+        uint32_t color_value;   // 4-byte pixel color value in format [N bits of red, N bits of green, N bits of blue, N bits of alpha]
 
-        // Bit shift the green color values to be mask-aligned and OR them into the combined color value
-        temp_mask = this->green_mask;
-        temp_value = green;
-        if (temp_mask > 0) {
-            while (temp_mask%2 != 1) {   // While the mask is not odd
-                //std::cout << "Green Mask " << std::dec << (((y * this->width_in_pixels) + x) * 4) << " = "<< std::hex << temp_mask << "  temp_value = " << temp_value << std::endl;
-                temp_mask  = temp_mask  >> 1;
-                temp_value = temp_value << 1;
-            }
-            color_value = color_value | temp_value;  // OR our red value into the appropriate bits in the color value
-        }
+        ptr = (const uint8_t*)data.data() + ((y * this->width_in_pixels) + x) * 4;  // Should point to the first byte of the pixel at x,y
+        memcpy(&color_value, ptr, 4);
 
-        // Bit shift the blue color values to be mask-aligned and OR them into the combined color value
-        temp_mask = this->blue_mask;
-        temp_value = blue;
-        if (temp_mask > 0) {
-            while (temp_mask%2 != 1) {   // While the mask is not odd
-                //std::cout << "Blue Mask " << std::dec << (((y * this->width_in_pixels) + x) * 4) << " = "<< std::hex << temp_mask << "  temp_value = " << temp_value << std::endl;
-                temp_mask   = temp_mask  >> 1;
-                temp_value  = temp_value << 1;
-            }
-            color_value = color_value | temp_value;  // OR our red value into the appropriate bits in the color value
-        }
+        // Mask off and shift down each channel using the decoded pixel format
+        red   = format.red  .read(color_value);
+        green = format.green.read(color_value);
+        blue  = format.blue .read(color_value);
+        alpha = format.alpha.read(color_value);
+    }
+    else {  // Currently only supports 24-bit color depth
+        ptr = (const uint8_t*)data.data() + ((y * this->width_in_pixels) + x) * 3;  // Should point to the blue value of the pixel at x,y
 
-        // Bit shift the alpha color values to be mask-aligned and OR them into the combined color value
-        temp_mask = this->alpha_mask;
-        temp_value = alpha;
-        if (temp_mask > 0) {
-            while (temp_mask%2 != 1) {   // While the mask is not odd
-                //std::cout << "Alpha Mask " << std::dec << (((y * this->width_in_pixels) + x) * 4) << " = "<< std::hex << temp_mask << "  temp_value = " << temp_value << std::endl;
-                temp_mask   = temp_mask  >> 1;
-                temp_value  = temp_value << 1;
-            }
-            color_value = color_value | temp_value;  // OR our red value into the appropriate bits in the color value
-        }
+        red   = ptr[2];
+        green = ptr[1];
+        blue  = ptr[0];
+    }
 
-        // Write our combined value back into the proper bytes in the vector
-        for (int i = 0; i < 4; i++) {
-            uint8_t byte;
+    return;
+}
 
-            byte = (color_value >> (i * 8)) & 0x000000FF;  // Get the value one byte at a time
-            *(ptr+i) = byte;
-            //std::cout << "ColorValue[" << std::dec << i << "] = " << std::hex << byte << " ptr  " << " = " << std::hex << *(ptr+i) << std::endl;
+void Bitmap::writePixel(int x, int y, uint &red, uint &green, uint &blue, uint &alpha) {
+    uint8_t *ptr;
 
-        }
+    if (this->color_depth == 32) {
+        uint32_t color_value;   // 4-byte pixel color value in format [N bits of red, N bits of green, N bits of blue, N bits of alpha]
+
+        ptr = (uint8_t*)data.data() + ((y * this->width_in_pixels) + x) * 4;  // Should point to the first byte of the pixel at x,y
 
+        // Shift each channel up into its mask and OR them into the combined color value
+        color_value = format.red  .write(red)
+                    | format.green.write(green)
+                    | format.blue .write(blue)
+                    | format.alpha.write(alpha);
+        memcpy(ptr, &color_value, 4);
     }
     else {  // Currently only supports 24-bit color depth
-        ptr = data.begin();
-        ptr = ptr + ((y * this->width_in_pixels) + x) * 3;  // Should point to the blue value of the pixel at x,y
+        ptr = (uint8_t*)data.data() + ((y * this->width_in_pixels) + x) * 3;  // Should point to the blue value of the pixel at x,y
 
-        *(ptr+2) = (uint8_t)red  ;
-        *(ptr+1) = (uint8_t)green;
-        *ptr     = (uint8_t)blue ;
+        ptr[2] = (uint8_t)red  ;
+        ptr[1] = (uint8_t)green;
+        ptr[0] = (uint8_t)blue ;
     }
 
     return;
@@ -220,6 +367,59 @@ int32_t  Bitmap::getHeightinPixels() const {
 void     Bitmap::setHeightinPixels(int height) {
     height_in_pixels = height;
 }
+void     Bitmap::setDimensions(int width, int height) {
+    uint32_t old_pixel_bytes;  // Padded pixel data size before the resize
+    uint32_t new_pixel_bytes;  // Padded pixel data size after the resize
+
+    old_pixel_bytes = (width_in_pixels * (color_depth / 8) + getRowPaddingSize()) * height_in_pixels;
+    width_in_pixels  = width;
+    height_in_pixels = height;
+    new_pixel_bytes = (width_in_pixels * (color_depth / 8) + getRowPaddingSize()) * height_in_pixels;
+
+    // The header size doesn't change, so both lengths move by the change in pixel bytes
+    setFileLength(getFileLength() + new_pixel_bytes - old_pixel_bytes);
+    setDataSize  (getDataSize()   + new_pixel_bytes - old_pixel_bytes);
+}
+
+void Bitmap::copyHeader(const Bitmap& other) {
+    memcpy(bitmap_type, other.bitmap_type, sizeof(bitmap_type));
+    length                 = other.length;
+    garbage                = other.garbage;
+    offset                 = other.offset;
+    size_second_header     = other.size_second_header;
+    width_in_pixels        = other.width_in_pixels;
+    height_in_pixels       = other.height_in_pixels;
+    number_of_color_planes = other.number_of_color_planes;
+    color_depth            = other.color_depth;
+    compression_method     = other.compression_method;
+    data_size              = other.data_size;
+    horizontal_resolution  = other.horizontal_resolution;
+    vertical_resolution    = other.vertical_resolution;
+    number_of_colors       = other.number_of_colors;
+    important_colors       = other.important_colors;
+    red_mask               = other.red_mask;
+    green_mask             = other.green_mask;
+    blue_mask              = other.blue_mask;
+    alpha_mask             = other.alpha_mask;
+    memcpy(color_space, other.color_space, sizeof(color_space));
+    format                 = other.format;
+    premultiplied          = other.premultiplied;
+}
+
+// Reuse data when it's already the right size (the usual case of merging planes or tiles back into the image they came from)
+void Bitmap::copyHeaderForPixels(const Bitmap& other) {
+    size_t size = (size_t)other.width_in_pixels * other.height_in_pixels * (other.color_depth / 8);
+
+    if (isMapped() || data.size() != size) {
+        PixelBuffer pixels;
+        pixels.resize(size);
+        data.swap(pixels);
+    }
+    copyHeader(other);
+    mapping.reset();
+    mapped_pixels = nullptr;
+    mapped_stride = 0;
+}
 
 
 /**
@@ -356,47 +556,36 @@ std::istream& operator>>(std::istream& in, Bitmap& b)
         file_offset += sizeof(b.color_space);
     }
 
+    b.decodeMasks();
+
     if (DEBUG) std::cout << std::endl << "Finished parsing header - " << std::dec << file_offset << " bytes read." << std::endl << std::endl;
     if (DEBUG) std::cout << "Bitmap data starts at offset 0x" << std::hex << file_offset << "." << std::endl;
 
-    // Read in the actual picture data
+    // Read in the actual picture data, straight into the vector (no intermediate row buffer)
+    b.mapping.reset();
+    b.mapped_pixels = nullptr;
+    b.mapped_stride = 0;
+
     if (b.color_depth == 24) {
-        int  row_data_length = b.width_in_pixels * 3;
-        int  row_total_length = row_data_length + b.getRowPaddingSize();
-        char row_buffer[row_total_length];
+        uint32_t row_data_length = b.width_in_pixels * 3;
+        char     padding[3];
 
-        b.data.reserve(row_data_length * b.height_in_pixels);  // If we're going to throw a memory exception, do it here
+        b.data.assign((size_t)row_data_length * b.height_in_pixels, 0);  // Cleared, in case the file is short; if we're going to throw a memory exception, do it here
 
         if (DEBUG) std::cout << "row_data_length:  " << std::dec << row_data_length << std::endl;
-        //if (DEBUG) std::cout << "Size of b.data:  " << std::dec << b.data.size() << std::endl;
 
         for (int i=0; i<b.height_in_pixels; i++) {
-            in.read(row_buffer, sizeof(row_buffer));  // Read in the entire row of data, including the padding
-            file_offset += sizeof(row_buffer);
-            b.data.insert(b.data.end(), row_buffer, row_buffer + row_data_length);  // Only transfer the data into the vector, not the padding
-
-            // DEBUG - Print the first two rows we read in
-            //if ((DEBUG) && (i == 0 || i == 1)) {
-            //    std::cout << "Size of b.data:  " << b.data.size() << std::endl;
-            //    for (int j = row_data_length * i; j < (row_data_length * i) + row_data_length ; j++) {
-            //        if (j%16 == 0) { printf("%03x:  ", j); }
-            //        printf("%02hhx ", b.data[j]);
-            //        if (j%16 == 15) { printf("\n"); }
-            //    }
-            //    printf("\n\n");
-            //    std::cout << std::endl;
-            //}
+            in.read(b.data.data() + (size_t)i * row_data_length, row_data_length);  // Only the pixel data goes into the vector
+            in.read(padding, b.getRowPaddingSize());                               // Then skip the padding
+            file_offset += row_data_length + b.getRowPaddingSize();
         }
     }
     else {  // Must be 32-bit color depth
-        int data_length = b.length - file_offset;         // The remaining length to read in is the total file length - the header
-        char buffer[data_length];
-
-        b.data.reserve(data_length);                      // If we're going to throw a memory exception, do it here
+        uint32_t data_length = b.length - file_offset;    // The remaining length to read in is the total file length - the header
 
-        in.read(buffer, sizeof(buffer));
-        b.data.insert(b.data.end(), buffer, buffer+sizeof(buffer));
-        file_offset += sizeof(buffer);
+        b.data.assign(data_length, 0);                    // Cleared, in case the file is short; if we're going to throw a memory exception, do it here
+        in.read(b.data.data(), data_length);
+        file_offset += data_length;
     }
 
     std::cout << "Bitmap parsed successfully - " << file_offset << " bytes read." << std::endl;
@@ -404,6 +593,75 @@ std::istream& operator>>(std::istream& in, Bitmap& b)
     return in;
 }
 
+// Copy a header field into the buffer at file_offset, the mirror of readField
+template<typename T>
+static void writeField(char *base, uint32_t &file_offset, const T &field) {
+    memcpy(base + file_offset, &field, sizeof(field));
+    file_offset += sizeof(field);
+}
+
+/**
+ * Fill header with just the file and info headers (and the masks of a
+ * 32-bit image), as they go at the start of the file.
+ *
+ * @return the number of bytes filled in.
+ */
+uint32_t Bitmap::encodeHeader(char *header) const
+{
+    uint32_t file_offset = 0;          // Position in the header we are writing (for Exceptions)
+
+    writeField(header, file_offset, bitmap_type);          // Bitmap Type                          (2 bytes - always "BM"/0x424D)
+    writeField(header, file_offset, length);               // Length in Bytes                      (4 bytes)
+    writeField(header, file_offset, garbage);              // Garbage                              (4 bytes - ignore)
+    writeField(header, file_offset, offset);               // Offset to start of the data          (4 bytes)
+    writeField(header, file_offset, size_second_header);   // Size of the Second Header            (4 bytes - always 40 bytes)
+    writeField(header, file_offset, width_in_pixels);      // Width in Pixels                      (4 bytes signed)
+    writeField(header, file_offset, height_in_pixels);     // Height in Pixels                     (4 bytes signed)
+    if (number_of_color_planes != 1) {
+        throw(BitmapException("Error writing number_of_color_planes", file_offset));
+    }
+    writeField(header, file_offset, number_of_color_planes); // Number of Color Planes             (2 bytes - *MUST* be 1)
+    writeField(header, file_offset, color_depth);          // Color Depth of the Image             (2 bytes - either 24 (RGB) or 32 (RGBA))
+    writeField(header, file_offset, compression_method);   // Compression Method being Used        (4 bytes - always 0(24-bit) or 3(32-bit))
+    writeField(header, file_offset, data_size);            // Size of the Raw Bitmap Data in Bytes (4 bytes)
+    writeField(header, file_offset, horizontal_resolution);// Horizontal Resolution in Pixels      (4 bytes - always 2835 - ignore)
+    writeField(header, file_offset, vertical_resolution);  // Vertical Resolution in Pixels        (4 bytes - always 2835 - ignore)
+    writeField(header, file_offset, number_of_colors);     // Number of Colors in Color Palette    (4 bytes - always 0 - ignore)
+    writeField(header, file_offset, important_colors);     // Number of Important Colors Used      (4 bytes - always 0 - ignore)
+
+    // These fields only exist in bitmaps with 32-bit color depth
+    if (color_depth == 32) {
+        writeField(header, file_offset, red_mask);
+        writeField(header, file_offset, green_mask);
+        writeField(header, file_offset, blue_mask);
+        writeField(header, file_offset, alpha_mask);
+        writeField(header, file_offset, color_space);
+    }
+
+    if (DEBUG) std::cout << "Finished encoding header - " << std::dec << file_offset << " bytes." << std::endl;
+
+    return file_offset;
+}
+
+uint32_t Bitmap::writeHeader(std::ostream& out) const
+{
+    char     header[MAX_HEADER_SIZE];
+    uint32_t header_length = encodeHeader(header);
+
+    out.write(header, header_length);
+    return header_length;
+}
+
+// The message every writer prints once the whole file is out
+static void reportWritten(const Bitmap& b, uint64_t file_offset) {
+    if (file_offset == b.length) {
+        std::cout << "Bitmap written successfully - " << file_offset << " bytes written." << std::endl;
+    }
+    else {
+        std::cout << "Error:  Mismatch between expected file size and bytes written - expected file size = " << std::dec << b.length << ", bytes written = " << file_offset << std::endl;
+    }
+}
+
 /**
  * Write the binary representation of the image to the stream.
  *
@@ -416,162 +674,278 @@ std::istream& operator>>(std::istream& in, Bitmap& b)
  */
 std::ostream& operator<<(std::ostream& out, const Bitmap& b)
 {
-    uint32_t    file_offset = 0;          // Position in the stream we are writing (for Exceptions)
-
-    if (DEBUG) std::cout << std::endl;
-
-    // Bitmap Type                          (2 bytes - always "BM"/0x424D)
-    //out << b.bitmap_type;
-    out.write((char*)&b.bitmap_type, 2);
-    if (DEBUG) std::cout << "Bitmap Type write [" << std::dec << file_offset << "]:  " << b.bitmap_type[0] << b.bitmap_type[1] << std::endl;
-    file_offset += sizeof(b.bitmap_type);
+    uint64_t file_offset = b.writeHeader(out);  // Position in the stream we are writing
+    size_t   row_data_length = (size_t)b.width_in_pixels * (b.color_depth / 8);
+    uint32_t padding = b.getRowPaddingSize();
+
+    if (padding == 0 && !b.isMapped()) {
+        // The rows are back to back in data already
+        out.write(b.data.data(), row_data_length * b.height_in_pixels);
+        file_offset += row_data_length * b.height_in_pixels;
+    }
+    else {
+        // Put the padding back into whole chunks of rows, so the stream sees a few large writes
+        size_t            chunk_rows = std::max<size_t>(1, WRITE_CHUNK_BYTES / (row_data_length + padding));
+        std::vector<char> chunk(chunk_rows * (row_data_length + padding), 0);
+
+        for (int y = 0; y < b.height_in_pixels; ) {
+            char *p = chunk.data();
+            for (size_t i = 0; i < chunk_rows && y < b.height_in_pixels; i++, y++) {
+                memcpy(p, b.row(y), row_data_length);
+                p += row_data_length + padding;                // The padding bytes stay 0
+            }
+            out.write(chunk.data(), p - chunk.data());
+            file_offset += p - chunk.data();
+        }
+    }
 
-    // Length in Bytes                      (4 bytes)
-    out.write((char*)&b.length, 4);
-    if (DEBUG) std::cout << "Length write [" << std::dec << file_offset << "]:  " << std::dec << b.length << std::endl;
-    file_offset += sizeof(b.length);
+    std::vector<char> trailing(b.trailingLength());
+    b.copyTrailing(0, trailing.size(), trailing.data());
+    out.write(trailing.data(), trailing.size());
+    file_offset += trailing.size();
 
-    // Garbage                              (4 bytes - ignore)
-    out.write((char*)&b.garbage, 4);
-    if (DEBUG) std::cout << "Garbage write [" << std::dec << file_offset << "]:  " << std::hex << b.garbage << std::endl;
-    file_offset += sizeof(b.garbage);
-
-    // Offset to start of the data          (4 bytes)
-    out.write((char*)&b.offset, 4);
-    if (DEBUG) std::cout << "Offset write [" << std::dec << file_offset << "]:  " << std::hex << b.offset << std::endl;
-    file_offset += sizeof(b.offset);
+    reportWritten(b, file_offset);
+    return out;
+}
 
-    // Size of the Second Header            (4 bytes - always 40 bytes)
-    out.write((char*)&b.size_second_header, 4);
-    if (DEBUG) std::cout << "Size write [" << std::dec << file_offset << "]:  " << std::dec << b.size_second_header << std::endl;
-    file_offset += sizeof(b.size_second_header);
+static bool readBytes(int fd, char *bytes, size_t length, uint64_t offset) {
+    IoTransfer transfer{fd, {{bytes, length}}, offset, false};
+    return length == 0 || transferNow(transfer);
+}
 
-    // Width in Pixels                      (4 bytes signed)
-    out.write((char*)&b.width_in_pixels, 4);
-    if (DEBUG) std::cout << "Width write [" << std::dec << file_offset << "]:  " << std::dec << b.width_in_pixels << std::endl;
-    file_offset += sizeof(b.width_in_pixels);
+static bool writeBytes(int fd, const char *bytes, size_t length, uint64_t offset) {
+    IoTransfer transfer{fd, {{(void*)bytes, length}}, offset, true};
+    return length == 0 || transferNow(transfer);
+}
 
-    // Height in Pixels                     (4 bytes signed)
-    out.write((char*)&b.height_in_pixels, 4);
-    if (DEBUG) std::cout << "Height write [" << std::dec << file_offset << "]:  " << std::dec << b.height_in_pixels << std::endl;
-    file_offset += sizeof(b.height_in_pixels);
+// The parts of a band of rows as they lie in the file: each row, then its padding from pad.
+// Rows without padding are one run of bytes (in data or in the mapping)
+static std::vector<iovec> bandParts(const Bitmap& b, int first, int last, const char *pad) {
+    size_t             row_data_length = (size_t)b.width_in_pixels * (b.color_depth / 8);
+    uint32_t           padding = b.getRowPaddingSize();
+    std::vector<iovec> parts;
 
-    // Number of Color Planes               (2 bytes - *MUST* be 1 - error test)
-    out.write((char*)&b.number_of_color_planes, 2);
-    if (DEBUG) std::cout << "Color planes write [" << std::dec << file_offset << "]:  " << std::dec << b.number_of_color_planes << std::endl;
-    if(b.number_of_color_planes != 1) {
-        throw(BitmapException("Error writing number_of_color_planes", file_offset));
+    if (padding == 0) {
+        parts.push_back({(void*)b.row(first), row_data_length * (last - first)});
+        return parts;
     }
-    file_offset += sizeof(b.number_of_color_planes);
+    parts.reserve(2 * (last - first));
+    for (int y = first; y < last; y++) {
+        parts.push_back({(void*)b.row(y), row_data_length});
+        parts.push_back({(void*)pad, padding});
+    }
+    return parts;
+}
 
-    // Color Depth of the Image             (2 bytes - either 24 (RGB) or 32 (RGBA))
-    out.write((char*)&b.color_depth, 2);
-    if (DEBUG) std::cout << "Color depth write [" << std::dec << file_offset << "]:  " << std::dec << b.color_depth << std::endl;
-    file_offset += sizeof(b.color_depth);
+/**
+ * Read or write every row of b, at the offsets the rows have in a file whose
+ * pixels start at pixels.  Row offsets are fixed, so each band of rows is one
+ * preadv()/pwritev() of its own, with the padding going to or coming from pad.
+ * The bands run across the thread pool, or through ring on the calling
+ * thread when there is one.
+ */
+static bool transferRows(const Bitmap& b, int fd, uint64_t pixels, bool write, const char *pad, IoRing *ring) {
+    uint64_t stride = (uint64_t)b.width_in_pixels * (b.color_depth / 8) + b.getRowPaddingSize();
 
-    // Compression Method being Used        (4 bytes - always 0(24-bit) or 3(32-bit))
-    out.write((char*)&b.compression_method, 4);
-    if (DEBUG) std::cout << "Compression method write [" << std::dec << file_offset << "]:  " << std::dec << b.compression_method << std::endl;
-    file_offset += sizeof(b.compression_method);
+    if (ring) {
+        int                     band = std::max<uint64_t>(1, std::min<uint64_t>(IOV_MAX / 2, IO_BAND_BYTES / stride));
+        std::vector<IoTransfer> transfers;
 
-    // Size of the Raw Bitmap Data in Bytes (4 bytes)
-    out.write((char*)&b.data_size, 4);
-    if (DEBUG) std::cout << "Data size write [" << std::dec << file_offset << "]:  " << std::dec << b.data_size << std::endl;
-    file_offset += sizeof(b.data_size);
+        for (int first = 0; first < b.height_in_pixels; first += band) {
+            int last = std::min(first + band, b.height_in_pixels);
+            transfers.push_back({fd, bandParts(b, first, last, pad), pixels + first * stride, write});
+        }
+        return ring->run(transfers);
+    }
 
-    // Horizontal Resolution in Pixels      (4 bytes - dots per meter - always 2835 - ignore)
-    out.write((char*)&b.horizontal_resolution, 4);
-    if (DEBUG) std::cout << "Horizontal resolution write [" << std::dec << file_offset << "]:  " << std::dec << b.horizontal_resolution << std::endl;
-    file_offset += sizeof(b.horizontal_resolution);
+    std::atomic<bool> ok(true);
+    parallelRows(b.height_in_pixels, [&](int first, int last) {
+        IoTransfer transfer{fd, bandParts(b, first, last, pad), pixels + first * stride, write};
+        if (!transferNow(transfer)) ok = false;
+    });
+    return ok;
+}
 
-    // Vertical Resolution in Pixels        (4 bytes - dots per meter - always 2835 - ignore)
-    out.write((char*)&b.vertical_resolution, 4);
-    if (DEBUG) std::cout << "Vertical resolution write [" << std::dec << file_offset << "]:  " << std::dec << b.vertical_resolution << std::endl;
-    file_offset += sizeof(b.vertical_resolution);
+void Bitmap::load(const std::string& path, IoRing *ring) {
+    char        header[MAX_HEADER_SIZE];
+    struct stat file_stat;
+    uint64_t    file_offset = 0;
+    int         fd;
 
-    // Number of Colors in Color Palette    (4 bytes - always 0 (not using a color palette - ignore))
-    out.write((char*)&b.number_of_colors, 4);
-    if (DEBUG) std::cout << "Number of colors write [" << std::dec << file_offset << "]:  " << std::dec << b.number_of_colors << std::endl;
-    file_offset += sizeof(b.number_of_colors);
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw(BitmapException("Error opening " + path, 0));
+    }
 
-    // Number of Important Colors Used      (4 bytes - always 0 (not using a color palette - ignore))
-    out.write((char*)&b.important_colors, 4);
-    if (DEBUG) std::cout << "Number of important colors write [" << std::dec << file_offset << "]:  " << std::dec << b.important_colors << std::endl;
-    file_offset += sizeof(b.important_colors);
+    try {
+        if (fstat(fd, &file_stat) != 0 || file_stat.st_size < 54 ||
+            !readBytes(fd, header, std::min<size_t>(MAX_HEADER_SIZE, file_stat.st_size), 0)) {
+            throw(BitmapException("Error reading bitmap header", 0));
+        }
+        decodeHeader(header, file_stat.st_size);
+        posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+
+        mapping.reset();
+        mapped_pixels = nullptr;
+        mapped_stride = 0;
+
+        uint32_t row_data_length = width_in_pixels * (color_depth / 8);
+        uint64_t stride          = row_data_length + getRowPaddingSize();
+        size_t   rows_length     = (size_t)row_data_length * height_in_pixels;
+        size_t   data_length     = rows_length;
+
+        if (color_depth == 32) {
+            // Keep everything up to the stated file length, as loadMapped() does
+            size_t data_end = std::min<size_t>(length, file_stat.st_size);
+            data_length = std::max<size_t>(rows_length, (data_end > offset) ? data_end - offset : 0);
+        }
+        data.resize(data_length);
 
-    // These fields only exist in bitmaps with 32-bit color depth
-    if (b.color_depth == 32) {
-        // Red Mask                             (4 bytes - only exists in 32-bit image)
-        out.write((char*)&b.red_mask, 4);
-        if (DEBUG) std::cout << "Red mask write [" << std::dec << file_offset << "]:  " << std::hex << b.red_mask << std::endl;
-        file_offset += sizeof(b.red_mask);
+        char skipped[4];    // The padding of every row is read into here
+        if (!transferRows(*this, fd, offset, false, skipped, ring)) {
+            throw(BitmapException("Error reading " + path, offset));
+        }
+        if (!readBytes(fd, data.data() + rows_length, data_length - rows_length, offset + rows_length)) {
+            throw(BitmapException("Error reading " + path, (uint32_t)(offset + rows_length)));
+        }
+        file_offset = offset + stride * height_in_pixels + (data_length - rows_length);
+    }
+    catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
 
-        // Green Mask                           (4 bytes - only exists in 32-bit image)
-        out.write((char*)&b.green_mask, 4);
-        if (DEBUG) std::cout << "Green mask write [" << std::dec << file_offset << "]:  " << std::hex << b.green_mask << std::endl;
-        file_offset += sizeof(b.green_mask);
+    std::cout << "Bitmap parsed successfully - " << file_offset << " bytes read." << std::endl;
+}
 
-        // Blue Mask                            (4 bytes - only exists in 32-bit image)
-        out.write((char*)&b.blue_mask, 4);
-        if (DEBUG) std::cout << "Blue mask write [" << std::dec << file_offset << "]:  " << std::hex << b.blue_mask << std::endl;
-        file_offset += sizeof(b.blue_mask);
+// Fill out with bytes start..end-1 of the file b is saved as: the header, then each row followed by zero padding,
+// then the bytes past the rows
+static void encodeFileBytes(const Bitmap& b, const char *header, uint32_t header_length, uint64_t start, uint64_t end, char *out) {
+    size_t   row_data_length = (size_t)b.width_in_pixels * (b.color_depth / 8);
+    uint64_t stride = row_data_length + b.getRowPaddingSize();
+    uint64_t rows_end = header_length + stride * b.height_in_pixels;
+
+    if (start < header_length) {
+        size_t count = std::min<uint64_t>(end, header_length) - start;
+        memcpy(out, header + start, count);
+        out   += count;
+        start += count;
+    }
+    if (end > rows_end) {
+        uint64_t from = std::max(start, rows_end);
+        b.copyTrailing(from - rows_end, end - from, out + (from - start));
+        end = from;
+    }
+    while (start < end) {
+        uint64_t y      = (start - header_length) / stride;
+        size_t   within = (start - header_length) % stride;
+        size_t   count  = std::min<uint64_t>(end - start, stride - within);
+        size_t   pixels = (within < row_data_length) ? std::min(count, row_data_length - within) : 0;
+
+        memcpy(out, b.row((int)y) + within, pixels);
+        memset(out + pixels, 0, count - pixels);
+        out   += count;
+        start += count;
+    }
+}
 
-        // Alpha Mask                           (4 bytes - only exists in 32-bit image)
-        out.write((char*)&b.alpha_mask, 4);
-        if (DEBUG) std::cout << "Alpha mask write [" << std::dec << file_offset << "]:  " << std::hex << b.alpha_mask << std::endl;
-        file_offset += sizeof(b.alpha_mask);
+/**
+ * Write a big file through O_DIRECT.  The file is cut into aligned chunks that
+ * are each encoded into a staging buffer and written at their offset: one
+ * chunk per task across the thread pool, or with a ring, a few at a time on
+ * the calling thread with their writes in flight together.  O_DIRECT needs
+ * aligned lengths, so the last partial block is written after switching it
+ * back off.
+ */
+static bool writeDirect(int fd, const Bitmap& b, const char *header, uint32_t header_length, uint64_t total, IoRing *ring) {
+    const uint64_t block  = 4096;
+    uint64_t       whole  = total / block * block;
+    size_t         chunks = (whole + DIRECT_CHUNK_BYTES - 1) / DIRECT_CHUNK_BYTES;
+    size_t         group  = ring ? DIRECT_RING_CHUNKS : 1;   // Chunks encoded before their writes go out
+    std::atomic<bool> written(true);
+
+    auto writeChunks = [&](size_t first) {
+        std::vector<PooledVector<char>> staging(std::min(group, chunks - first));   // Pooled buffers this big are aligned to a huge page,
+        std::vector<IoTransfer>         transfers;                                   // which covers the block alignment
+        try {
+            for (size_t i = 0; i < staging.size(); i++) {
+                uint64_t start = (uint64_t)(first + i) * DIRECT_CHUNK_BYTES;
+                uint64_t end   = std::min<uint64_t>(start + DIRECT_CHUNK_BYTES, whole);
+
+                staging[i].resize(DIRECT_CHUNK_BYTES);
+                encodeFileBytes(b, header, header_length, start, end, staging[i].data());
+                transfers.push_back({fd, {{staging[i].data(), end - start}}, start, true});
+            }
+        }
+        catch (std::bad_alloc&) {
+            written = false;
+            return;
+        }
+        if (ring ? !ring->run(transfers) : !transferNow(transfers[0])) written = false;
+    };
 
-        // Color Space Information              (68 bytes - only exists in 32-bit image - ignore)
-        out.write((char*)&b.color_space, 68);
-        if (DEBUG) std::cout << "Color space write [" << std::dec << file_offset << "]:  " << std::hex << b.color_space << std::endl;
-        file_offset += sizeof(b.color_space);
+    if (ring) {
+        for (size_t first = 0; first < chunks && written; first += group) writeChunks(first);
     }
+    else {
+        parallelFor(chunks, writeChunks);
+    }
+    if (!written) return false;
 
-    if (DEBUG) std::cout << std::endl << "Finished writing header - " << std::dec << file_offset << " bytes written." << std::endl;
-    if (DEBUG) std::cout << "Bitmap data starts at offset 0x" << std::hex << file_offset << "." << std::endl;
+    if (total > whole) {
+        char tail[block];
 
-    // Write out the actual picture data
-    if (b.color_depth == 32) {
-        int data_length;
-        const char* data_pointer;
+        encodeFileBytes(b, header, header_length, whole, total, tail);
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT) != 0) return false;
+        if (!writeBytes(fd, tail, total - whole, whole)) return false;
+    }
+    return true;
+}
 
-        data_length  = b.length - file_offset;  // Total length - the header length
-        data_pointer = b.data.data();
-        out.write(data_pointer, data_length);
-        file_offset += data_length;
+void Bitmap::save(const std::string& path, IoRing *ring) const {
+    char     header[MAX_HEADER_SIZE];
+    uint32_t header_length = encodeHeader(header);
+    size_t   row_data_length = (size_t)width_in_pixels * (color_depth / 8);
+    uint64_t stride = row_data_length + getRowPaddingSize();
+    uint64_t file_offset = 0;
+    uint64_t rows_end = header_length + stride * height_in_pixels;
+    uint64_t total = rows_end + trailingLength();
+    bool     direct = false;
+    int      fd = -1;
+
+#ifdef O_DIRECT
+    if (total >= DIRECT_WRITE_BYTES) {
+        fd     = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        direct = fd >= 0;    // Not every filesystem takes O_DIRECT - write it normally there
     }
-    else {  // Must be 24-bit color depth
-        uint32_t  row_data_length;
-        uint32_t  row_total_length;
-        const char *data_pointer;
-        const char padding[3] = {NULL,NULL,NULL};
-        int data_offset = 0;
-
-        row_data_length  = b.width_in_pixels * 3;
-        row_total_length = row_data_length + b.getRowPaddingSize();
-        if (DEBUG) std::cout << "write padding:  " << b.getRowPaddingSize() << std::endl;
-
-        for (int i = 0; i < b.getHeightinPixels(); i++) {
-            // Output each row of picture data
-            data_pointer = b.data.data() + data_offset;
-            out.write(data_pointer, row_data_length);
-            data_offset += row_data_length;
-            file_offset += row_data_length;
-
-            // Add padding to the end of the row
-            out.write(padding, b.getRowPaddingSize());
-            file_offset += b.getRowPaddingSize();
-        }
+#endif
+    if (fd < 0) {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+        throw(BitmapException("Error opening " + path + " for writing", 0));
     }
 
-    // Double-check that our final pointer value matches the expected bitmap length
-    if (file_offset == b.length) {
-        std::cout << "Bitmap written successfully - " << file_offset << " bytes written." << std::endl;
+    bool ok;
+    if (direct) {
+        posix_fallocate(fd, 0, total);   // Reserve the space in one extent (just a hint if it fails)
+        ok = writeDirect(fd, *this, header, header_length, total, ring);
     }
     else {
-        std::cout << "Error:  Mismatch between expected file size and bytes written - expected file size = " << std::dec << b.length << ", bytes written = " << file_offset << std::endl;
+        // The header, then the rows with the padding coming from a block of zeros, then the bytes past the rows
+        static const char zeros[4] = {0, 0, 0, 0};
+        std::vector<char> trailing(total - rows_end);
+        copyTrailing(0, trailing.size(), trailing.data());
+        ok = writeBytes(fd, header, header_length, 0) && transferRows(*this, fd, header_length, true, zeros, ring) &&
+             writeBytes(fd, trailing.data(), trailing.size(), rows_end);
     }
-    return out;
+    if (ok) file_offset = total;
+
+    if (close(fd) != 0 || !ok) {
+        throw(BitmapException("Error writing " + path, (uint32_t)file_offset));
+    }
+    reportWritten(*this, file_offset);
 }
 
 /**
@@ -583,162 +957,562 @@ std::ostream& operator<<(std::ostream& out, const Bitmap& b)
  * it was colored.
  */
 void cellShade(Bitmap& b) {
-    std::vector<char>::iterator ptr;
-    uint8_t value;
+    std::cout << "Applying cell shading transform." << std::endl;
 
+    parallelRows(b.height_in_pixels, [&](int first, int last) {
+        cellShadeRows(b, first, last);
+    });
+}
+
+void cellShadeRows(Bitmap& b, int first, int last) {
+    // Every byte in the data vector is rounded to one of three values, so this runs straight over the bytes
+    cellShadeBytes((uint8_t*)b.row(first), (size_t)(last - first) * b.width_in_pixels * (b.color_depth / 8), getSimdLevel());
+}
+
+// The planes hold every byte of the pixels, so every plane gets rounded
+void cellShade(PlanarImage& p) {
     std::cout << "Applying cell shading transform." << std::endl;
 
-    // Iterate over all the byte values in the data vector and round to one of three values
-    for (ptr = b.data.begin(); ptr < b.data.end(); ptr++) {
-        value = *ptr;
-        if      (value <= 64)                 value = 0;
-        else if (value >  64 && value < 192)  value = 127;
-        else if (value >= 192)                value = 255;
-        *ptr = value;
-    }
+    parallelRows(p.height, [&](int first, int last) {
+        for (int k = 0; k < p.count; k++) {
+            cellShadeBytes(p.row(k, first), (last - first) * p.pitch, getSimdLevel());
+        }
+    });
+}
+
+// Clear the plane no channel uses, the way storing a pixel clears the bits outside the masks
+static void clearUnusedPlane(PlanarImage& p) {
+    if (p.unused < 0) return;
+    parallelRows(p.height, [&](int first, int last) {
+        memset(p.row(p.unused, first), 0, (last - first) * p.pitch);
+    });
+}
+
+// The planes the filters that average pixels work on: the colors, and alpha once they're premultiplied by it
+static std::vector<int> averagedPlanes(const PlanarImage& p) {
+    std::vector<int> planes = {p.red, p.green, p.blue};
+    if (p.premultiplied) planes.push_back(p.alpha);
+    return planes;
 }
 
 /**
  * Grayscales an image by averaging all of the component colors.
  */
+template<typename Format>
+static void grayscaleRow(RowSpan<Format> row) {
+    Color c;
+
+    for (int x = 0; x < row.width; x++) {
+        row.load(x, c);
+        c.red = c.green = c.blue = (c.red + c.green + c.blue)/3;  // Set all colors to the average of all colors
+        row.store(x, c);
+    }
+}
+
 void grayscale(Bitmap& b) {
-    std::vector<char>::iterator ptr;
-    uint red;
-    uint green;
-    uint blue;
-    uint alpha;  // Unused for this transform
+    std::cout << "Applying grayscale transform." << std::endl;
+
+    parallelRows(b.height_in_pixels, [&](int first, int last) {
+        grayscaleRows(b, first, last);
+    });
+}
+
+void grayscaleRows(Bitmap& b, int first, int last) {
+    size_t pixels = (size_t)(last - first) * b.width_in_pixels;
+
+    // The rows are stored back to back, so the SIMD kernels can treat them as one long row
+    if (b.color_depth == 24) {
+        grayscaleBGR24((uint8_t*)b.row(first), pixels, getSimdLevel());
+        return;
+    }
+    if (grayscaleMasked32((uint8_t*)b.row(first), pixels, b.format, getSimdLevel())) {
+        return;
+    }
 
+    // Channels the SIMD kernels don't handle go through the row kernel
+    withPixelFormat(b, [&](auto format) {
+        for (int y = first; y < last; y++) {
+            grayscaleRow(rowSpan(b, y, format));
+        }
+    });
+}
+
+void grayscale(PlanarImage& p) {
     std::cout << "Applying grayscale transform." << std::endl;
 
-    // Iterate over all the pixels in the data vector and average their color values
-    // (Treating it as a one-dimensional array rather than a two-dimensional picture for simplicity)
-    for (int i = 0; i < (b.width_in_pixels * b.height_in_pixels); i++) {
-        b.readPixel(i, 0, red, green, blue, alpha);
-        //std::cout << "Before:  Red = " << std::hex << red << " Green = " << green << " Blue = " << blue << std::endl;
-        red = green = blue = (red + green + blue)/3;  // Set all colors to the average of all colors
-        //std::cout << "After:   Red = " << std::hex << red << " Green = " << green << " Blue = " << blue << std::endl << std::endl;
-        b.writePixel(i, 0, red, green, blue, alpha);
+    // The row padding is averaged too, so each band is one run per plane
+    parallelRows(p.height, [&](int first, int last) {
+        averagePlanes(p.row(p.red, first), p.row(p.green, first), p.row(p.blue, first), (last - first) * p.pitch, getSimdLevel());
+    });
+    clearUnusedPlane(p);
+}
+
+// Sum rows first..last-1 of the image into the table as if they were its bottom rows
+template<int Channels, typename Format>
+static void sumRows(const Bitmap& b, const Format& format, uint32_t *table, size_t stride, int first, int last) {
+    Color c;
+
+    for (int y = first; y < last; y++) {
+        auto            source = rowSpan(b, y, format);
+        uint32_t       *sums   = &table[(y + 1) * stride];
+        const uint32_t *above  = &table[y * stride];       // Row 0 of the table (all zeros) for the first row of a band
+        uint32_t        total[4] = {0, 0, 0, 0};
+
+        if (y == first) above = &table[0];
+        for (int k = 0; k < Channels; k++) sums[k] = 0;
+        for (int x = 0; x < b.width_in_pixels; x++) {
+            source.load(x, c);
+            total[0] += c.red;
+            total[1] += c.green;
+            total[2] += c.blue;
+            if (Channels == 4) total[3] += c.alpha;
+            for (int k = 0; k < Channels; k++) {
+                sums[(x + 1)*Channels + k] = above[(x + 1)*Channels + k] + total[k];
+            }
+        }
     }
+}
 
-    return;
+IntegralImage::IntegralImage(const Bitmap& b) {
+    int                                bands;
+    std::vector<std::vector<uint32_t>> carry;   // What each band's rows are missing: the totals of the bands below it
+
+    width    = b.width_in_pixels;
+    height   = b.height_in_pixels;
+    channels = b.premultiplied ? 4 : 3;
+    stride   = (size_t)(width + 1) * channels;
+    table.resize(stride * (height + 1));   // Pooled and not cleared: every entry gets written below
+    std::fill(&table[0], &table[stride], 0);
+
+    // Each thread sums a band of rows as if it were the bottom of the image, in one pass
+    bands = std::max(1, std::min(getThreadCount(), height));
+    withPixelFormat(b, [&](auto format) {
+        parallelFor(bands, [&](size_t band) {
+            int first = (size_t)height * band / bands;
+            int last  = (size_t)height * (band + 1) / bands;
+
+            if (channels == 4) sumRows<4>(b, format, table.data(), stride, first, last);
+            else               sumRows<3>(b, format, table.data(), stride, first, last);
+        });
+    });
+
+    // Then every band above the first adds in the totals of the bands below it
+    carry.assign(bands, std::vector<uint32_t>(stride, 0));
+    for (int band = 1; band < bands; band++) {
+        const uint32_t *below = &table[(size_t)height * band / bands * stride];   // Last row of the band below, as summed
+        for (size_t i = 0; i < stride; i++) {
+            carry[band][i] = carry[band - 1][i] + below[i];
+        }
+    }
+    parallelFor(bands - 1, [&](size_t band) {
+        band++;
+        for (int y = (size_t)height * band / bands; y < (int)((size_t)height * (band + 1) / bands); y++) {
+            uint32_t *sums = &table[(y + 1) * stride];
+            for (size_t i = 0; i < stride; i++) {
+                sums[i] += carry[band][i];
+            }
+        }
+    });
+}
+
+void IntegralImage::sum(int x0, int y0, int x1, int y1, uint32_t& red, uint32_t& green, uint32_t& blue) const {
+    uint32_t alpha;
+    sum(x0, y0, x1, y1, red, green, blue, alpha);
+}
+
+void IntegralImage::sum(int x0, int y0, int x1, int y1, uint32_t& red, uint32_t& green, uint32_t& blue, uint32_t& alpha) const {
+    const uint32_t *top_left     = &table[y0 * stride + x0 * channels];
+    const uint32_t *top_right    = &table[y0 * stride + x1 * channels];
+    const uint32_t *bottom_left  = &table[y1 * stride + x0 * channels];
+    const uint32_t *bottom_right = &table[y1 * stride + x1 * channels];
+
+    // Unsigned arithmetic wraps the same way the table did, so the difference is exact
+    red   = bottom_right[0] - bottom_left[0] - top_right[0] + top_left[0];
+    green = bottom_right[1] - bottom_left[1] - top_right[1] + top_left[1];
+    blue  = bottom_right[2] - bottom_left[2] - top_right[2] + top_left[2];
+    alpha = (channels == 4) ? bottom_right[3] - bottom_left[3] - top_right[3] + top_left[3] : 0;
+}
+
+/**
+ * Pixelates a region of an image with blocks of any size, averaging from a summed-area table.
+ */
+void pixelate(Bitmap& b, const IntegralImage& sums, int x, int y, int width, int height, int block_width, int block_height) {
+    if (block_width < 1 || block_height < 1) {
+        throw(BitmapException("Error - pixelate block size must be at least 1x1", 0));
+    }
+    if (sums.width != b.width_in_pixels || sums.height != b.height_in_pixels) {
+        throw(BitmapException("Error - summed-area table doesn't match the image", 0));
+    }
+
+    // Clip the region to the image
+    int x1 = std::min(x + width,  b.width_in_pixels);
+    int y1 = std::min(y + height, b.height_in_pixels);
+    x = std::max(x, 0);
+    y = std::max(y, 0);
+    if (x >= x1 || y >= y1) return;
+
+    withPixelFormat(b, [&](auto format) {
+        parallelRows(y1 - y, [&](int first, int last) {
+            Color c;
+
+            // Blocks start at the region's corner; the last ones in each direction may be partial
+            for (int top = y + first; top < y + last; top += block_height) {
+                int bottom = std::min(top + block_height, y1);
+
+                for (int left = x; left < x1; left += block_width) {
+                    int      right = std::min(left + block_width, x1);
+                    uint32_t count = (uint32_t)(right - left) * (bottom - top);
+                    uint32_t red, green, blue, alpha;
+
+                    sums.sum(left, top, right, bottom, red, green, blue, alpha);
+                    red   /= count;
+                    green /= count;
+                    blue  /= count;
+                    alpha /= count;
+
+                    // Write the average back to all the sub-pixels (keeping each pixel's own alpha, unless it's premultiplied)
+                    for (int py = top; py < bottom; py++) {
+                        auto row = rowSpan(b, py, format);
+                        for (int px = left; px < right; px++) {
+                            row.load(px, c);
+                            c.red   = red;
+                            c.green = green;
+                            c.blue  = blue;
+                            if (sums.channels == 4) c.alpha = alpha;
+                            row.store(px, c);
+                        }
+                    }
+                }
+            }
+        }, block_height);
+    });
+}
+
+/**
+ * Pixelates an image with block_width x block_height blocks.
+ */
+void pixelate(Bitmap& b, int block_width, int block_height) {
+    std::cout << "Applying pixelate transform (" << block_width << "x" << block_height << ")." << std::endl;
+
+    IntegralImage sums(b);
+    pixelate(b, sums, 0, 0, b.width_in_pixels, b.height_in_pixels, block_width, block_height);
 }
 
 /**
  * Pixelates an image by creating groups of 16*16 pixel blocks.
  */
 void pixelate(Bitmap& b) {
-    BitmapPixel pixel[PIXEL_SIZE][PIXEL_SIZE];  // NxN array of pixels to average the color over
-    int  number_of_colors;                      // Number of color fields per pixes (24-bit vs 32-bit encoding)
+    std::cout << "Applying pixelate transform." << std::endl;
+
+    IntegralImage sums(b);
+    pixelate(b, sums, 0, 0, b.width_in_pixels, b.height_in_pixels, PIXEL_SIZE, PIXEL_SIZE);
+}
+
+/**
+ * Pixelate the color planes with block_width x block_height blocks, summing
+ * each block straight from the planes (each pixel is in exactly one block,
+ * so no summed-area table is needed).
+ */
+static void pixelatePlanes(PlanarImage& p, int block_width, int block_height) {
+    if (block_width < 1 || block_height < 1) {
+        throw(BitmapException("Error - pixelate block size must be at least 1x1", 0));
+    }
+
+    int blocks = (p.width + block_width - 1) / block_width;   // Blocks across, the last one maybe partial
+    std::vector<int> planes = averagedPlanes(p);
+
+    parallelRows(p.height, [&](int first, int last) {
+        std::vector<uint32_t> sums(blocks);
+
+        for (int top = first; top < last; top += block_height) {
+            int bottom = std::min(top + block_height, p.height);
+
+            for (int plane : planes) {
+                std::fill(sums.begin(), sums.end(), 0);
+                for (int y = top; y < bottom; y++) {
+                    const uint8_t *row = p.row(plane, y);
+                    for (int block = 0, x = 0; block < blocks; block++) {
+                        int      right = std::min(x + block_width, p.width);
+                        uint32_t sum   = 0;
+                        for (; x < right; x++) sum += row[x];
+                        sums[block] += sum;
+                    }
+                }
+
+                for (int block = 0; block < blocks; block++) {
+                    int left  = block * block_width;
+                    int right = std::min(left + block_width, p.width);
+                    sums[block] /= (uint32_t)(right - left) * (bottom - top);
+                }
+                for (int y = top; y < bottom; y++) {
+                    uint8_t *row = p.row(plane, y);
+                    for (int block = 0; block < blocks; block++) {
+                        int left = block * block_width;
+                        memset(row + left, sums[block], std::min(block_width, p.width - left));
+                    }
+                }
+            }
+        }
+    }, block_height);
+    clearUnusedPlane(p);
+}
+
+void pixelate(PlanarImage& p, int block_width, int block_height) {
+    std::cout << "Applying pixelate transform (" << block_width << "x" << block_height << ")." << std::endl;
+
+    pixelatePlanes(p, block_width, block_height);
+}
 
+void pixelate(PlanarImage& p) {
     std::cout << "Applying pixelate transform." << std::endl;
 
-    if (b.color_depth == 32) number_of_colors = 4;
-    else                     number_of_colors = 3;
+    pixelatePlanes(p, PIXEL_SIZE, PIXEL_SIZE);
+}
 
-    // Iterate over all the pixels in the picture in blocks of 16
-    for (int y = 0; y <= (b.height_in_pixels-16); y += PIXEL_SIZE) {
-        for (int x = 0; x <= (b.width_in_pixels-16); x += PIXEL_SIZE) {
-            uint average_red   = 0;
-            uint average_green = 0;
-            uint average_blue  = 0;
+/**
+ * BlurKernel - the weights of one axis of a separable blur.
+ * Both passes use the same weights.  The horizontal sums are rounded down by
+ * row_shift bits to fit in 16 bits, and the vertical pass gives
+ * (bias + sum) >> shift.
+ */
+struct BlurKernel
+{
+    std::vector<uint16_t> weights;    // 2*radius+1 weights adding up to at most 256 << row_shift
+    int                   row_shift;
+    uint32_t              bias;       // Added before the final shift (0 truncates, half rounds)
+    int                   shift;      // log2 of the square of the weight total, less row_shift
+};
 
-            for (int py = 0; py < PIXEL_SIZE; py++) {
-                for (int px = 0; px < PIXEL_SIZE; px++) {
-                    uint red   = 0;
-                    uint green = 0;
-                    uint blue  = 0;
+/**
+ * The original 5x5 kernel is the outer product of [1,4,6,4,1] with itself, divided by 256
+ */
+static BlurKernel binomialKernel() {
+    return BlurKernel{{1, 4, 6, 4, 1}, 0, 0, 8};
+}
 
+int blurRadius(double sigma) {
+    if (!(sigma > 0)) return 1;
+    return std::max(1, (int)std::ceil(3 * std::min(sigma, (double)MAX_BLUR_SIGMA)));
+}
 
-                    // Now iterate over all the pixels inside the block of 16
-                    pixel[py][px].init(b, x + px, y + py);  // Init from the actual image pixel coordinates
-                    pixel[py][px].getrgb(red, green, blue);
+/**
+ * Gaussian weights for sigma out to 3 sigma, in 15-bit fixed point, so even
+ * the outer weights of wide kernels aren't rounded away to leave a box.  The
+ * horizontal sums (up to 255 << 15) lose 7 bits to fit the ring, and the
+ * vertical sums then stay under 1 << 31.
+ */
+static BlurKernel gaussianKernel(double sigma) {
+    int                 radius = blurRadius(sigma);
+    std::vector<double> exact(2*radius + 1);
+    double              total = 0;
+    BlurKernel          kernel{std::vector<uint16_t>(2*radius + 1), 7, 1u << 22, 23};
+    int                 fixed_total = 0;
+
+    for (int i = -radius; i <= radius; i++) {
+        exact[i + radius] = std::exp(-(i * i) / (2 * sigma * sigma));
+        total += exact[i + radius];
+    }
+    // Round down, then hand the leftover units to the weights that lost the most so they add up to exactly 1 << 15
+    std::vector<std::pair<double, int>> remainders;
+    for (int i = 0; i <= 2*radius; i++) {
+        double scaled = 32768 * exact[i] / total;
+        kernel.weights[i] = (uint16_t)scaled;
+        fixed_total += kernel.weights[i];
+        remainders.push_back({scaled - kernel.weights[i], i});
+    }
+    std::sort(remainders.begin(), remainders.end(), std::greater<std::pair<double, int>>());
+    for (int i = 0; fixed_total < 32768; i++, fixed_total++) {
+        kernel.weights[remainders[i].second]++;
+    }
 
-                    average_red   += red;
-                    average_green += green;
-                    average_blue  += blue;
-                }
+    return kernel;
+}
+
+/**
+ * Separable blur of rows first..last-1, in place.
+ *
+ * Each source row is run through the horizontal pass once, into a ring of
+ * 2*radius+1 rows of 16-bit sums; each output row is then the vertical pass
+ * over the ring.  A source row is only overwritten after its horizontal sums
+ * are in the ring, so no copy of the band is needed.  Pixels past the
+ * edges repeat the edge pixel.
+ *
+ * The rows just outside the band come from above and below instead of the
+ * image, since the bands next to this one may already have blurred them.
+ */
+template<typename Format>
+static void blurSeparable(Bitmap& b, const BlurKernel& kernel, const Format& format, int first, int last,
+                          const std::vector<uint8_t>& above, const std::vector<uint8_t>& below) {
+    int       taps   = kernel.weights.size();
+    int       radius = taps / 2;
+    int       width  = b.width_in_pixels;
+    int       height = b.height_in_pixels;
+    int       channels = b.premultiplied ? 4 : 3;      // Premultiplied alpha is blurred along with the colors
+    size_t    length = (size_t)width * channels;       // Channel bytes per row
+    size_t    stride = (size_t)width * Format::bytes;  // Pixel bytes per row
+    int       top    = std::max(first - radius, 0);    // First source row the band needs
+    SimdLevel level  = getSimdLevel();
+
+    std::vector<uint8_t>         padded((width + 2*radius) * channels);  // One source row with the edge pixels repeated
+    PooledVector<uint16_t>       ring(taps * length, 0);                 // Horizontal sums of the rows around the current one
+    std::vector<uint8_t>         blurred(length);                        // One finished output row
+    std::vector<const uint16_t*> rows(taps);
+    int                          next = top;                             // Next source row to run the horizontal pass on
+
+    for (int y = first; y < last; y++) {
+        // Bring the ring up to date with every source row the vertical pass needs
+        for (; next < height && next <= y + radius; next++) {
+            const uint8_t *source;
+            if      (next < first)  source = above.data() + (next - top) * stride;
+            else if (next >= last)  source = below.data() + (next - last) * stride;
+            else                    source = (const uint8_t*)b.row(next);
+
+            if (channels == 4) unpackPixels(source, width, padded.data() + radius*4, format);
+            else               unpackChannels(source, width, padded.data() + radius*3, format);
+            for (int i = 0; i < radius; i++) {
+                memcpy(padded.data() + i*channels,                    padded.data() + radius*channels,               channels);
+                memcpy(padded.data() + (radius + width + i)*channels, padded.data() + (radius + width - 1)*channels, channels);
             }
+            convolveRowHorizontal(padded.data(), length, channels, kernel.weights.data(), taps, kernel.row_shift,
+                                  ring.data() + (next % taps) * length, level);
+        }
 
-            average_red   /= (PIXEL_SIZE * PIXEL_SIZE);
-            average_green /= (PIXEL_SIZE * PIXEL_SIZE);
-            average_blue  /= (PIXEL_SIZE * PIXEL_SIZE);
+        for (int k = 0; k < taps; k++) {
+            int source = std::min(std::max(y - radius + k, 0), height - 1);
+            rows[k] = ring.data() + (source % taps) * length;
+        }
+        convolveRowsVertical(rows.data(), length, kernel.weights.data(), taps, kernel.bias, kernel.shift, blurred.data(), level);
+        if (channels == 4) packPixels(blurred.data(), width, (uint8_t*)b.row(y), format);
+        else               packChannels(blurred.data(), width, (uint8_t*)b.row(y), format);
+    }
+}
 
-            // Write our averaged values back to all the sub-pixels
-            for (int py = 0; py < PIXEL_SIZE; py++) {
-                for (int px = 0; px < PIXEL_SIZE; px++) {
-                    pixel[py][px].setrgb(average_red, average_green, average_blue);
-                    pixel[py][px].write();
-                }
-            }
+/**
+ * Blur the image in bands of rows across the thread pool.
+ * Every band first saves the radius rows on either side of it, then all the
+ * bands are blurred in place, each reading its neighbours' rows from the copies.
+ */
+template<typename Format>
+static void blurBands(Bitmap& b, const BlurKernel& kernel, const Format& format) {
+    int    radius = kernel.weights.size() / 2;
+    int    height = b.height_in_pixels;
+    size_t stride = (size_t)b.width_in_pixels * Format::bytes;
+
+    struct Band
+    {
+        int                  first, last;
+        std::vector<uint8_t> above, below;   // Original rows first-radius..first-1 and last..last+radius-1 (inside the image)
+    };
+    std::vector<Band> bands;
+    std::mutex        bands_lock;
+
+    parallelRows(height, [&](int first, int last) {
+        Band band;
+        band.first = first;
+        band.last  = last;
+        band.above.assign((const uint8_t*)b.row(std::max(first - radius, 0)), (const uint8_t*)b.row(first));
+        band.below.assign((const uint8_t*)b.row(last), (const uint8_t*)b.row(last) + (std::min(last + radius, height) - last) * stride);
+
+        std::lock_guard<std::mutex> guard(bands_lock);
+        bands.push_back(std::move(band));
+    });
+
+    parallelFor(bands.size(), [&](size_t i) {
+        blurSeparable(b, kernel, format, bands[i].first, bands[i].last, bands[i].above, bands[i].below);
+    });
+}
+
+/**
+ * Separable blur of rows first..last-1 of one plane into the spare plane,
+ * with the same ring of horizontal sums as blurSeparable.  The output goes
+ * to the spare, so the bands never see each other's blurred rows.
+ */
+static void blurPlane(PlanarImage& p, int plane, const BlurKernel& kernel, int first, int last) {
+    int       taps   = kernel.weights.size();
+    int       radius = taps / 2;
+    int       width  = p.width;
+    int       height = p.height;
+    SimdLevel level  = getSimdLevel();
+
+    std::vector<uint8_t>         padded(width + 2*radius);   // One source row with the edge pixels repeated
+    PooledVector<uint16_t>       ring(taps * width, 0);
+    std::vector<const uint16_t*> rows(taps);
+    int                          next = std::max(first - radius, 0);
+
+    for (int y = first; y < last; y++) {
+        for (; next < height && next <= y + radius; next++) {
+            const uint8_t *source = p.row(plane, next);
+            memcpy(padded.data() + radius, source, width);
+            memset(padded.data(), source[0], radius);
+            memset(padded.data() + radius + width, source[width - 1], radius);
+            convolveRowHorizontal(padded.data(), width, 1, kernel.weights.data(), taps, kernel.row_shift,
+                                  ring.data() + (next % taps) * width, level);
+        }
 
+        for (int k = 0; k < taps; k++) {
+            int source = std::min(std::max(y - radius + k, 0), height - 1);
+            rows[k] = ring.data() + (source % taps) * width;
         }
+        convolveRowsVertical(rows.data(), width, kernel.weights.data(), taps, kernel.bias, kernel.shift, p.spareRow(y), level);
     }
+}
 
-    return;
+static void blurPlanes(PlanarImage& p, const BlurKernel& kernel) {
+    for (int plane : averagedPlanes(p)) {
+        parallelRows(p.height, [&](int first, int last) {
+            blurPlane(p, plane, kernel, first, last);
+        });
+        p.swapSpare(plane);
+    }
+    clearUnusedPlane(p);
 }
 
+void blur(PlanarImage& p) {
+    std::cout << "Applying gaussian blurring transform." << std::endl;
+
+    blurPlanes(p, binomialKernel());
+}
+
+void blur(PlanarImage& p, double sigma) {
+    std::cout << "Applying gaussian blurring transform (sigma " << sigma << ")." << std::endl;
+
+    if (sigma > MAX_BLUR_SIGMA) {
+        throw(BitmapException("blur sigma is more than " + std::to_string(MAX_BLUR_SIGMA), 0));
+    }
+    if (!(sigma > 0)) {
+        return;
+    }
+    blurPlanes(p, gaussianKernel(sigma));
+}
 
 /**
  * Use gaussian bluring to blur an image.
  */
 void blur(Bitmap& b) {
-    Bitmap outbmp = b;    // Create a second bitmap to hold our output values
-
-    BitmapPixel target1_pixel;           // The target pixel we will modify the values for
-    BitmapPixel temp_pixel;             // Temporary pixel object to hold data while calculating
-    int         matrix[GAUSS_SIZE][GAUSS_SIZE] = {{1,  4,  6,  4, 1},
-                                                  {4, 16, 24, 16, 4},
-                                                  {6, 24, 36, 24, 6},
-                                                  {4, 16, 24, 16, 4},
-                                                  {1,  4,  6,  4, 1}};
-    int         gauss_offset = GAUSS_SIZE / 2;  // The number of pixels around the current pixes to calculate using
-    int         number_of_colors;               // Number of color fields per pixes (24-bit vs 32-bit encoding)
-
     std::cout << "Applying gaussian blurring transform." << std::endl;
-    
-    if (b.color_depth == 32) number_of_colors = 4;
-    else                     number_of_colors = 3;
-
-    // Iterate over all the pixels in the picture except a 2-pixel stripe around the edges
-    for (int y = gauss_offset; y < (b.height_in_pixels-GAUSS_SIZE); y++) {
-        for (int x = gauss_offset; x < (b.width_in_pixels-GAUSS_SIZE); x++) {
-            uint original_red  ;
-            uint original_green;
-            uint original_blue ;
-            uint gauss_red   = 0;
-            uint gauss_green = 0;
-            uint gauss_blue  = 0;
-
-            // Initialize our target pixel (in the center of the matrix)
-            target1_pixel.init(outbmp, x + gauss_offset, y + gauss_offset);    // Init from the center pixel coordinates (output bitmap)
-            target1_pixel.getrgb(original_red, original_green, original_blue); // Get it's original values
-
-            // Iterate over all the matrix values, multiply them by the R/G/B value of that pixel, and add them all together.
-            for (int py = 0; py < GAUSS_SIZE; py++) {
-                for (int px = 0; px < GAUSS_SIZE; px++) {
-                    uint pxred   = 0;
-                    uint pxgreen = 0;
-                    uint pxblue  = 0;
-
-                    temp_pixel.init(b, x + px, y + py);  // Init from the bitmap image pixel coordinates
-                    temp_pixel.getrgb(pxred, pxgreen, pxblue);
-
-                    gauss_red   += (pxred   * matrix[py][px]);
-                    gauss_green += (pxgreen * matrix[py][px]);
-                    gauss_blue  += (pxblue  * matrix[py][px]);
-                }
-            }
 
-            gauss_red   /= 256;
-            gauss_green /= 256;
-            gauss_blue  /= 256;
+    withPixelFormat(b, [&](auto format) {
+        blurBands(b, binomialKernel(), format);
+    });
 
-            target1_pixel.setrgb(gauss_red, gauss_green, gauss_blue);
-            target1_pixel.write();  // Write our calculated files to the output bitmap
-        }
-    }
+    return;
+}
 
-    b = outbmp;  // Return outbmp instead of b
+/**
+ * Use gaussian bluring with a chosen sigma to blur an image.
+ */
+void blur(Bitmap& b, double sigma) {
+    std::cout << "Applying gaussian blurring transform (sigma " << sigma << ")." << std::endl;
+
+    if (sigma > MAX_BLUR_SIGMA) {
+        throw(BitmapException("blur sigma is more than " + std::to_string(MAX_BLUR_SIGMA), 0));
+    }
+    if (!(sigma > 0)) {
+        return;
+    }
+    withPixelFormat(b, [&](auto format) {
+        blurBands(b, gaussianKernel(sigma), format);
+    });
 
     return;
 }
@@ -793,108 +1567,224 @@ void flipd2(Bitmap& b) {
 }
 
 /**
- * scales the image by a factor of 2.
+ * ResampleAxis - the weights that resample one axis of an image.
+ * Output pixel i is the sum over k < taps of weights[i*taps + k] times
+ * source pixel first[i] + k.  The weights are 14-bit fixed point and each
+ * output pixel's add up to exactly 1 << 14; taps is even for the SIMD kernels.
  */
-void scaleUp(Bitmap& b) {
-    Bitmap outbmp = b;                   // Create a second bitmap to hold our output values
-    BitmapPixel source_pixel;            // Pixel object to hold the source data
-    BitmapPixel target1_pixel;           // A pixel to write back to the target image
-    BitmapPixel target2_pixel;           // A pixel to write back to the target image
-    BitmapPixel target3_pixel;           // A pixel to write back to the target image
-    BitmapPixel target4_pixel;           // A pixel to write back to the target image
-    int  number_of_colors;               // Number of color fields per pixel (24-bit vs 32-bit encoding)
-    uint difference_in_pixels;           // The difference in the number of pixels between source and target
-    uint difference_in_bytes;            // The difference in the number of bytes between source and target
-    uint source_num_padding_bytes;       // The number of padding bytes in the source bitmap
-    uint target_num_padding_bytes;       // The number of padding bytes in the target bitmap
-
-    if (b.color_depth == 32) number_of_colors = 4;
-    else                     number_of_colors = 3;
-
-    std::cout << "Applying scale up transform." << std::endl;
+struct ResampleAxis
+{
+    int                  taps = 0;
+    std::vector<int>     first;
+    std::vector<int16_t> weights;
+};
+
+// How far from its center each filter reaches, in source pixels (before it's stretched to shrink)
+static double resampleSupport(ResampleFilter filter) {
+    switch (filter) {
+        case ResampleFilter::Box:       return 0.5;
+        case ResampleFilter::Bilinear:  return 1;
+        case ResampleFilter::Bicubic:   return 2;
+        default:                        return 3;
+    }
+}
 
-    // Double the width *and* height of our output bitmap
-    difference_in_pixels = ((b.getWidthinPixels()*2 * b.getHeightinPixels()*2)) - (b.getWidthinPixels() * b.getHeightinPixels());
-    difference_in_bytes  = difference_in_pixels * number_of_colors;
-    outbmp.setWidthinPixels(b.getWidthinPixels()*2);
-    outbmp.setHeightinPixels(b.getHeightinPixels()*2);
-    outbmp.data.resize(b.data.size()*4);  // Quadruple the size of our output bitmap's vector
-
-    // Adjust the file length and data size based on the changed number of padding bytes, if necessary.
-    source_num_padding_bytes =      b.getRowPaddingSize();  // If 32-bit, getRowPaddingSize will be 0
-    target_num_padding_bytes = outbmp.getRowPaddingSize();  // If 32-bit, getRowPaddingSize will be 0
-    if (DEBUG) std::cout << "Padding bytes - source: " << source_num_padding_bytes << "  target:  " << target_num_padding_bytes << std::endl;
-    
-    // Iterate over all the pixels in the picture
-    for (int y = 0; y < b.getHeightinPixels(); y++) {
-        for (int x = 0; x < b.getWidthinPixels(); x++) {
-            uint red   = 0;
-            uint green = 0;
-            uint blue  = 0;
-            uint alpha = 0;
-            uint target1_x, target1_y;
-            uint target2_x, target2_y;
-            uint target3_x, target3_y;
-            uint target4_x, target4_y;
-
-            // Initialize our source pixel
-            source_pixel.init(b, x, y);
-            if (b.color_depth == 32) {
-                source_pixel.getrgba(red, green, blue, alpha);
-            }
-            else {  // 24-bit
-                source_pixel.getrgb(red, green, blue);
-            }
+static double resampleKernel(ResampleFilter filter, double x) {
+    const double a = -0.5;
+    x = std::fabs(x);
+
+    switch (filter) {
+        case ResampleFilter::Bilinear:
+            return std::max(1 - x, 0.0);
+        case ResampleFilter::Bicubic:
+            if (x < 1) return ((a + 2) * x - (a + 3)) * x * x + 1;
+            if (x < 2) return ((a * x - 5 * a) * x + 8 * a) * x - 4 * a;
+            return 0;
+        default: {
+            if (x == 0) return 1;
+            if (x >= 3) return 0;
+            double px = M_PI * x;
+            return 3 * std::sin(px) * std::sin(px / 3) / (px * px);
+        }
+    }
+}
 
-            // *** Duplicate each row (doubling the number of rows) ***
-            target1_x =  2 * x;
-            target1_y =  2 * y;
-            target2_x =  2 * x;
-            target2_y = (2 * y) + 1;
-
-            // *** Duplicate each column (doubling the number of column) ***
-            target3_x = (2 * x) + 1;
-            target3_y =  2 * y;
-            target4_x = (2 * x) + 1;
-            target4_y = (2 * y) + 1;
-
-            // Set the colors for our 4x4 block of copied pixel(s) and write them to the target image
-            //if (DEBUG) std::cout << "Target pixel1:  x/y:  " << std::dec << y << "/" << x << " mx/my:  " << outbmp.getHeightinPixels() << "/" << outbmp.getWidthinPixels() << " tx/ty:  " << target1_y << "/" << target1_x << std::endl;
-            //if (DEBUG) std::cout << "Target pixel2:  x/y:  " << std::dec << y << "/" << x << " mx/my:  " << outbmp.getHeightinPixels() << "/" << outbmp.getWidthinPixels() << " tx/ty:  " << target2_y << "/" << target2_x << std::endl;
-            //if (DEBUG) std::cout << "Target pixel3:  x/y:  " << std::dec << y << "/" << x << " mx/my:  " << outbmp.getHeightinPixels() << "/" << outbmp.getWidthinPixels() << " tx/ty:  " << target3_y << "/" << target3_x << std::endl;
-            //if (DEBUG) std::cout << "Target pixel4:  x/y:  " << std::dec << y << "/" << x << " mx/my:  " << outbmp.getHeightinPixels() << "/" << outbmp.getWidthinPixels() << " tx/ty:  " << target4_y << "/" << target4_x << std::endl << std::endl;
-            target1_pixel.init(outbmp, target1_x, target1_y);
-            target2_pixel.init(outbmp, target2_x, target2_y);
-            target3_pixel.init(outbmp, target3_x, target3_y);
-            target4_pixel.init(outbmp, target4_x, target4_y);
-
-            if (b.color_depth == 32) {
-                target1_pixel.setrgb(red, green, blue);
-                target2_pixel.setrgb(red, green, blue);
-                target3_pixel.setrgb(red, green, blue);
-                target4_pixel.setrgb(red, green, blue);
+/**
+ * The weights for resampling source pixels down to target pixels, where each
+ * target pixel covers scale source pixels.
+ * Output pixel i is centered on source position (i + 0.5) * scale.  When
+ * shrinking, the filter is stretched by scale so it covers every source pixel
+ * the output pixel does.  The box filter weighs each source pixel by how much
+ * of it the output pixel covers.  The parts of a window outside the image are
+ * dropped and the rest renormalized.
+ */
+static ResampleAxis resampleAxis(int source, int target, double scale, ResampleFilter filter) {
+    double              stretch = std::max(scale, 1.0);
+    double              support = resampleSupport(filter) * stretch;
+    int                 window  = (int)std::ceil(2 * support) + 1;   // Most source pixels one window can touch
+    std::vector<double> exact(window);
+    std::vector<int>    fixed(window);
+    std::vector<int>    used(target, 0);                            // Source pixels each window really needs
+    std::vector<int>    all((size_t)target * window, 0);
+    ResampleAxis        axis;
+
+    axis.first.resize(target);
+
+    for (int i = 0; i < target; i++) {
+        double center = (i + 0.5) * scale;
+        int    lo     = std::max((int)std::floor(center - support), 0);
+        int    hi     = std::min({(int)std::ceil(center + support), source, lo + window});
+        double total  = 0;
+
+        lo = std::min(lo, source - 1);
+        hi = std::max(hi, lo + 1);
+        for (int j = lo; j < hi; j++) {
+            if (filter == ResampleFilter::Box) {
+                exact[j - lo] = std::max(std::min(j + 1.0, center + support) - std::max((double)j, center - support), 0.0);
             }
             else {
-                target1_pixel.setrgba(red, green, blue, alpha);
-                target2_pixel.setrgba(red, green, blue, alpha);
-                target3_pixel.setrgba(red, green, blue, alpha);
-                target4_pixel.setrgba(red, green, blue, alpha);
+                exact[j - lo] = resampleKernel(filter, (j + 0.5 - center) / stretch);
             }
+            total += exact[j - lo];
+        }
+        if (total == 0) {   // Nothing in the window - take the nearest pixel
+            exact[std::min((int)center, hi - 1) - lo] = total = 1;
+        }
+
+        // Round to fixed point, giving the rounding error to the biggest weight so they add up exactly
+        int sum     = 0;
+        int biggest = 0;
+        for (int j = 0; j < hi - lo; j++) {
+            fixed[j] = (int)std::lround(exact[j] / total * (1 << 14));
+            sum     += fixed[j];
+            if (fixed[j] > fixed[biggest]) biggest = j;
+        }
+        fixed[biggest] += (1 << 14) - sum;
 
-            target1_pixel.write();
-            target2_pixel.write();
-            target3_pixel.write();
-            target4_pixel.write();
+        axis.first[i] = lo;
+        for (int j = 0; j < hi - lo; j++) {
+            all[(size_t)i * window + j] = fixed[j];
+            if (fixed[j] != 0) used[i] = j + 1;
         }
+    }
 
-        // If source and target images have different sizes, recalculate the file length and data size fields
-        if (b.getWidthinPixels() != outbmp.getWidthinPixels() || b.getHeightinPixels() != outbmp.getHeightinPixels()) {
-            outbmp.setFileLength(b.getFileLength() + difference_in_bytes - (source_num_padding_bytes * b.getHeightinPixels()) + (target_num_padding_bytes * outbmp.getHeightinPixels()));
-            outbmp.setDataSize  (b.getDataSize()   + difference_in_bytes - (source_num_padding_bytes * b.getHeightinPixels()) + (target_num_padding_bytes * outbmp.getHeightinPixels()));
+    // Trim the zero weights every window ends with (a box shrinking by 2 needs 2 taps, not 4)
+    axis.taps = 1;
+    for (int i = 0; i < target; i++) axis.taps = std::max(axis.taps, used[i]);
+    axis.taps = (axis.taps + 1) & ~1;
+    axis.weights.assign((size_t)target * axis.taps, 0);
+    for (int i = 0; i < target; i++) {
+        for (int k = 0; k < std::min(axis.taps, window); k++) {
+            axis.weights[(size_t)i * axis.taps + k] = (int16_t)all[(size_t)i * window + k];
         }
     }
 
-    b = outbmp;  // Return outbmp instead of b
+    return axis;
+}
+
+/**
+ * Resample output rows first..last-1 of a resize into target (pixels with no padding).
+ *
+ * Each source row is unpacked to 4 channel bytes and run through the
+ * horizontal pass once, into a ring of down.taps rows; each output row is
+ * then the vertical pass over the ring.  The windows only move forward, so
+ * a row is only overwritten in the ring once no later output row needs it.
+ */
+template<typename Format>
+static void resampleRows(Bitmap& b, const ResampleAxis& across, const ResampleAxis& down, const Format& format,
+                         uint8_t *target, int first, int last) {
+    int       width  = across.first.size();          // Output width
+    int       height = b.height_in_pixels;           // Source height
+    size_t    length = (size_t)width * 4;            // Channels per row of the ring
+    SimdLevel level  = getSimdLevel();
+
+    std::vector<uint8_t>        unpacked((size_t)(b.width_in_pixels + across.taps) * 4, 0);  // Room for the last window to read past the edge
+    PooledVector<int16_t>       ring(down.taps * length, 0);
+    std::vector<const int16_t*> rows(down.taps);
+    std::vector<uint8_t>        resampled(length);
+    int                         next = 0;           // Next source row to run the horizontal pass on
+
+    for (int y = first; y < last; y++) {
+        int top = down.first[y];
+
+        for (next = std::max(next, top); next < std::min(top + down.taps, height); next++) {
+            unpackPixels((const uint8_t*)b.row(next), b.width_in_pixels, unpacked.data(), format);
+            resampleRowHorizontal(unpacked.data(), across.first.data(), across.weights.data(), across.taps, width,
+                                  ring.data() + (next % down.taps) * length, level);
+        }
+
+        // Rows past the bottom have no weight, but still need a valid row to point at
+        for (int k = 0; k < down.taps; k++) {
+            rows[k] = ring.data() + (std::min(top + k, height - 1) % down.taps) * length;
+        }
+        resampleRowsVertical(rows.data(), down.weights.data() + (size_t)y * down.taps, down.taps, length, resampled.data(), level);
+
+        packPixels(resampled.data(), width, target + (size_t)y * width * Format::bytes, format);
+    }
+}
+
+/**
+ * Resample the image to width x height, where each output pixel covers
+ * scale_x x scale_y source pixels.
+ */
+static void resample(Bitmap& b, int width, int height, double scale_x, double scale_y, ResampleFilter filter) {
+    PixelBuffer& target = b.scratch;  // Output pixels (no padding)
+    uint64_t     bytes  = b.color_depth / 8;
+
+    // The file's length has to fit in its 32-bit field, as setDimensions() will work it out
+    uint64_t old_pixel_bytes = ((uint64_t)b.width_in_pixels * bytes + b.getRowPaddingSize()) * b.height_in_pixels;
+    uint64_t new_pixel_bytes = ((uint64_t)width * bytes + 3) / 4 * 4 * height;
+    uint64_t other_bytes     = b.length > old_pixel_bytes ? b.length - old_pixel_bytes : 0;   // Header and anything past the rows
+    if (other_bytes + new_pixel_bytes > UINT32_MAX) {
+        throw(BitmapException("Error - a " + std::to_string(width) + "x" + std::to_string(height) + " bitmap is over 4 GiB", 0));
+    }
+
+    target.resize((size_t)width * height * (b.color_depth / 8));
+
+    withPixelFormat(b, [&](auto format) {
+        typedef decltype(format) Format;
+
+        if (filter == ResampleFilter::Nearest) {
+            std::vector<int> columns(width);
+            for (int x = 0; x < width; x++) {
+                columns[x] = std::min((int)((x + 0.5) * scale_x), b.width_in_pixels - 1);
+            }
+
+            parallelRows(height, [&](int first, int last) {
+                Color c;
+
+                for (int y = first; y < last; y++) {
+                    RowSpan<Format> source = rowSpan(b, std::min((int)((y + 0.5) * scale_y), b.height_in_pixels - 1), format);
+                    RowSpan<Format> out    = {(uint8_t*)target.data() + (size_t)y * width * Format::bytes, width, format};
+
+                    for (int x = 0; x < width; x++) {
+                        source.load(columns[x], c);
+                        out.store(x, c);
+                    }
+                }
+            });
+            return;
+        }
+
+        ResampleAxis across = resampleAxis(b.width_in_pixels,  width,  scale_x, filter);
+        ResampleAxis down   = resampleAxis(b.height_in_pixels, height, scale_y, filter);
+
+        parallelRows(height, [&](int first, int last) {
+            resampleRows(b, across, down, format, (uint8_t*)target.data(), first, last);
+        });
+    });
+
+    b.setDimensions(width, height);
+    b.data.swap(target);
+}
+
+/**
+ * scales the image by a factor of 2.
+ */
+void scaleUp(Bitmap& b) {
+    std::cout << "Applying scale up transform." << std::endl;
+
+    resample(b, b.width_in_pixels*2, b.height_in_pixels*2, 0.5, 0.5, ResampleFilter::Nearest);
 
     return;
 }
@@ -903,79 +1793,116 @@ void scaleUp(Bitmap& b) {
  * scales the image by a factor of 1/2.
  */
 void scaleDown(Bitmap& b) {
-    Bitmap outbmp = b;                   // Create a second bitmap to hold our output values
-    BitmapPixel source_pixel;            // Pixel object to hold the source data
-    BitmapPixel target1_pixel;           // A pixel to write back to the target image
-    int  number_of_colors;               // Number of color fields per pixel (24-bit vs 32-bit encoding)
-    uint difference_in_pixels;           // The difference in the number of pixels between source and target
-    uint difference_in_bytes;            // The difference in the number of bytes between source and target
-    uint source_num_padding_bytes;       // The number of padding bytes in the source bitmap
-    uint target_num_padding_bytes;       // The number of padding bytes in the target bitmap
-
-    if (b.color_depth == 32) number_of_colors = 4;
-    else                     number_of_colors = 3;
-
     std::cout << "Applying scale down transform." << std::endl;
 
-    // Halve the width *and* height of our output bitmap
-    outbmp.setWidthinPixels(b.getWidthinPixels()/2);
-    outbmp.setHeightinPixels(b.getHeightinPixels()/2);
-    difference_in_pixels = ((b.getWidthinPixels() * b.getHeightinPixels()) - (outbmp.getWidthinPixels() * outbmp.getHeightinPixels()));
-    difference_in_bytes  = difference_in_pixels * number_of_colors;
-    if (DEBUG) std::cout << "Difference in pixels: " << difference_in_pixels << "  Difference in bytes:  " << difference_in_bytes << std::endl;
-
-    outbmp.data.resize(outbmp.getWidthinPixels() * outbmp.getHeightinPixels() * number_of_colors);
-    if (DEBUG) std::cout << "Vector Sizes1 - Source: " << std::dec << b.data.size() << "  Target:  " << outbmp.data.size() << std::endl;
-
-    // Adjust the file length and data size based on the changed number of padding bytes, if necessary.
-    source_num_padding_bytes =      b.getRowPaddingSize();  // If 32-bit, getRowPaddingSize will be 0
-    target_num_padding_bytes = outbmp.getRowPaddingSize();  // If 32-bit, getRowPaddingSize will be 0
-    if (DEBUG) std::cout << "Padding bytes - source: " << source_num_padding_bytes << "  target:  " << target_num_padding_bytes << std::endl;
-    
-    // Iterate over the pixels in the picture, skipping every other row and column
-    for (int y = 0; y < outbmp.getHeightinPixels(); y++) {
-        for (int x = 0; x < outbmp.getWidthinPixels(); x++) {
-            uint red   = 0;
-            uint green = 0;
-            uint blue  = 0;
-            uint alpha = 0;
-            //uint target1_x, target1_y;
-
-            // Initialize our source pixel, skipping every other row and column
-            source_pixel.init(b, x*2, y*2);
-            if (b.color_depth == 32) {
-                source_pixel.getrgba(red, green, blue, alpha);
-            }
-            else {  // 24-bit
-                source_pixel.getrgb(red, green, blue);
-            }
+    // Exactly 2 source pixels per output pixel, even when a dimension is odd, so every block is a whole 2x2
+    resample(b, b.width_in_pixels/2, b.height_in_pixels/2, 2, 2, ResampleFilter::Box);
 
-            // Set the colors for our 4x4 block of copied pixel(s) and write them to the target image
-            //if (DEBUG) std::cout << "Target pixel1:  x/y:  " << std::dec << y << "/" << x << " mx/my:  " << outbmp.getHeightinPixels() << "/" << outbmp.getWidthinPixels() << " tx/ty:  " << target1_y << "/" << target1_x << std::endl;
-            target1_pixel.init(outbmp, x, y);
+    return;
+}
 
-            if (b.color_depth == 32) {
-                target1_pixel.setrgb(red, green, blue);
-            }
-            else {
-                target1_pixel.setrgba(red, green, blue, alpha);
+/**
+ * resizes the image to any size.
+ */
+void resize(Bitmap& b, int width, int height, ResampleFilter filter) {
+    std::cout << "Applying resize transform (" << width << "x" << height << ")." << std::endl;
+
+    if (width < 1 || height < 1) {
+        throw(BitmapException("Error - can't resize to " + std::to_string(width) + "x" + std::to_string(height), 0));
+    }
+    resample(b, width, height, (double)b.width_in_pixels / width, (double)b.height_in_pixels / height, filter);
+
+    return;
+}
+
+static bool hasAlpha(const Bitmap& b) {
+    return b.color_depth == 32 && b.alpha_mask != 0;
+}
+
+// Run kernel over every row of the image as BGRA pixels
+template<typename Kernel>
+static void forEachRowBGRA(Bitmap& b, const Kernel& kernel) {
+    withPixelFormat(b, [&](auto format) {
+        parallelRows(b.height_in_pixels, [&](int first, int last) {
+            PooledVector<uint8_t> pixels((size_t)b.width_in_pixels * 4);
+
+            for (int y = first; y < last; y++) {
+                unpackPixels((const uint8_t*)b.row(y), b.width_in_pixels, pixels.data(), format);
+                kernel(pixels.data(), (size_t)b.width_in_pixels);
+                packPixels(pixels.data(), b.width_in_pixels, (uint8_t*)b.row(y), format);
             }
+        });
+    });
+}
 
-            target1_pixel.write();
-        }
+void premultiply(Bitmap& b) {
+    if (!hasAlpha(b) || b.premultiplied) return;
 
-        // If source and target images have different sizes, recalculate the file length and data size fields
-        if (b.getWidthinPixels() != outbmp.getWidthinPixels() || b.getHeightinPixels() != outbmp.getHeightinPixels()) {
-            outbmp.setFileLength(b.getFileLength() - difference_in_bytes - (source_num_padding_bytes * b.getHeightinPixels()) + (target_num_padding_bytes * outbmp.getHeightinPixels()));
-            outbmp.setDataSize  (b.getDataSize()   - difference_in_bytes - (source_num_padding_bytes * b.getHeightinPixels()) + (target_num_padding_bytes * outbmp.getHeightinPixels()));
-        }
-    }
+    forEachRowBGRA(b, [](uint8_t *pixels, size_t count) { premultiplyBGRA(pixels, count, getSimdLevel()); });
+    b.premultiplied = true;
+}
 
-    if (DEBUG) std::cout << "Vector Sizes2 - Source: " << std::dec << b.data.size() << "  Target:  " << outbmp.data.size() << std::endl;
+void unpremultiply(Bitmap& b) {
+    if (!b.premultiplied) return;
 
-    b = outbmp;  // Return outbmp instead of b
+    forEachRowBGRA(b, [](uint8_t *pixels, size_t count) { unpremultiplyBGRA(pixels, count, getSimdLevel()); });
+    b.premultiplied = false;
+}
 
-    return;
+// Make every pixel of a BGRA row opaque
+static void setOpaque(uint8_t *pixels, size_t count) {
+    for (size_t i = 0; i < count; i++) pixels[i*4 + 3] = 255;
+}
+
+/**
+ * Composites src over dst.  Each row of the overlap is unpacked to BGRA,
+ * premultiplied (an image without alpha is opaque, which is its own
+ * premultiplied form), blended, and packed back into dst.
+ */
+void composite(Bitmap& dst, const Bitmap& src, int x, int y) {
+    std::cout << "Applying composite (" << src.width_in_pixels << "x" << src.height_in_pixels << " at " << x << "," << y << ")." << std::endl;
+
+    // The overlap, in dst pixels from the left and rows from the top
+    int left   = std::max(x, 0);
+    int right  = std::min(x + src.width_in_pixels, dst.width_in_pixels);
+    int top    = std::max(y, 0);
+    int bottom = std::min(y + src.height_in_pixels, dst.height_in_pixels);
+    if (left >= right || top >= bottom) return;
+
+    int  width     = right - left;
+    bool src_alpha = hasAlpha(src);
+    bool dst_alpha = hasAlpha(dst);
+
+    withPixelFormat(src, [&](auto src_format) {
+        withPixelFormat(dst, [&](auto dst_format) {
+            typedef decltype(src_format) SrcFormat;
+            typedef decltype(dst_format) DstFormat;
+
+            parallelRows(bottom - top, [&](int first, int last) {
+                PooledVector<uint8_t> over((size_t)width * 4);
+                PooledVector<uint8_t> under((size_t)width * 4);
+                SimdLevel             level = getSimdLevel();
+
+                for (int row = top + first; row < top + last; row++) {
+                    // Rows are stored bottom up
+                    const uint8_t *source = (const uint8_t*)src.row(src.height_in_pixels - 1 - (row - y)) + (size_t)(left - x) * SrcFormat::bytes;
+                    uint8_t       *target = (uint8_t*)dst.row(dst.height_in_pixels - 1 - row) + (size_t)left * DstFormat::bytes;
+
+                    unpackPixels(source, width, over.data(), src_format);
+                    if (!src_alpha)              setOpaque(over.data(), width);
+                    else if (!src.premultiplied) premultiplyBGRA(over.data(), width, level);
+
+                    unpackPixels(target, width, under.data(), dst_format);
+                    if (!dst_alpha)              setOpaque(under.data(), width);
+                    else if (!dst.premultiplied) premultiplyBGRA(under.data(), width, level);
+
+                    compositeBGRA(over.data(), under.data(), width, level);
+                    if (dst_alpha && !dst.premultiplied) unpremultiplyBGRA(under.data(), width, level);
+                    packPixels(under.data(), width, target, dst_format);
+                }
+            });
+        });
+    });
 }
 
 /**
@@ -987,131 +1914,110 @@ void scaleDown(Bitmap& b) {
  * 4 = FLIPH
  * 5 = FLIPD1
  * 6 = FLIPD2
+ *
+ * The transforms that keep the dimensions work in place: ROT180 reverses
+ * the whole pixel array, FLIPH reverses each row and FLIPV swaps rows.
+ * The others turn source columns into target rows, so they are copied
+ * TRANSPOSE_TILE x TRANSPOSE_TILE pixels at a time to keep both sides in cache.
  */
 void imageTransform(Bitmap& b, uint mode) {
-    Bitmap outbmp = b;                   // Create a second bitmap to hold our output values
-    BitmapPixel source_pixel;            // Pixel object to hold the source data
-    BitmapPixel target1_pixel;           // A pixel to write back to the target image
-    uint source_num_padding_bytes;       // The number of padding bytes in the source bitmap
-    uint target_num_padding_bytes;       // The number of padding bytes in the target bitmap
-
-    // Edit our output file header settings dependent on mode
-    if      (mode == 0) {   // ROT90
-        std::cout << "Applying rotate 90 transform." << std::endl;
-        // Swap the height and width values in our output bitmap
-        outbmp.setWidthinPixels(b.getHeightinPixels());
-        outbmp.setHeightinPixels(b.getWidthinPixels());
-    }
-    else if (mode == 1) {   // ROT180
-        std::cout << "Applying rotate 180 transform." << std::endl;
+    int      width  = b.getWidthinPixels();   // Source dimensions
+    int      height = b.getHeightinPixels();
+    int      bytes  = b.color_depth / 8;
+    uint8_t *pixels = (uint8_t*)b.data.data();
+    uint32_t keep   = 0xFFFFFFFF;             // Bits of a 32-bit pixel that belong to a channel
+
+    if (b.color_depth == 32) {
+        keep = b.red_mask | b.green_mask | b.blue_mask | b.alpha_mask;
     }
-    else if (mode == 2) {   // ROT270
-        std::cout << "Applying rotate 270 transform." << std::endl;
-        // Swap the height and width values in our output bitmap
-        outbmp.setWidthinPixels(b.getHeightinPixels());
-        outbmp.setHeightinPixels(b.getWidthinPixels());
+
+    if (mode == 1 || mode == 3 || mode == 4) {
+        size_t stride = (size_t)width * bytes;
+
+        if      (mode == 1) {   // ROT180 - row y swaps with row height-1-y, reversed
+            std::cout << "Applying rotate 180 transform." << std::endl;
+            parallelRows(height/2, [&](int first, int last) {
+                for (int y = first; y < last; y++) {
+                    std::swap_ranges(b.row(y), b.row(y) + stride, b.row(height - 1 - y));
+                    reversePixels((uint8_t*)b.row(y),              width, bytes);
+                    reversePixels((uint8_t*)b.row(height - 1 - y), width, bytes);
+                }
+            });
+            if (height % 2) {
+                reversePixels((uint8_t*)b.row(height/2), width, bytes);
+            }
+        }
+        else if (mode == 3) {   // FLIPV
+            std::cout << "Applying flip vertical transform." << std::endl;
+            parallelRows(height/2, [&](int first, int last) {
+                for (int y = first; y < last; y++) {
+                    std::swap_ranges(b.row(y), b.row(y) + stride, b.row(height - 1 - y));
+                }
+            });
+        }
+        else {                  // FLIPH
+            std::cout << "Applying flip horizontal transform." << std::endl;
+            parallelRows(height, [&](int first, int last) {
+                for (int y = first; y < last; y++) {
+                    reversePixels((uint8_t*)b.row(y), width, bytes);
+                }
+            });
+        }
+
+        if (bytes == 4 && keep != 0xFFFFFFFF) {
+            parallelRows(height, [&](int first, int last) {
+                clearUnusedBits((uint8_t*)b.row(first), (size_t)(last - first) * width, keep);
+            });
+        }
+        return;
     }
-    else if (mode == 3) {   // FLIPV
-        std::cout << "Applying flip vertical transform." << std::endl;
+
+    TransposeJob job;
+    if      (mode == 0) {   // ROT90  - target row y is source column width-1-y, bottom to top
+        std::cout << "Applying rotate 90 transform." << std::endl;
+        job.flip_x = true;  job.flip_y = false;
     }
-    else if (mode == 4) {   // FLIPH
-        std::cout << "Applying flip horizontal transform." << std::endl;
+    else if (mode == 2) {   // ROT270 - target row y is source column y, top to bottom
+        std::cout << "Applying rotate 270 transform." << std::endl;
+        job.flip_x = false; job.flip_y = true;
     }
-    else if (mode == 5) {   // FLIPD1
+    else if (mode == 5) {   // FLIPD1 - target row y is source column width-1-y, top to bottom
         std::cout << "Applying flip diagonal 1 transform." << std::endl;
-        // Swap the height and width values in our output bitmap
-        outbmp.setWidthinPixels(b.getHeightinPixels());
-        outbmp.setHeightinPixels(b.getWidthinPixels());
+        job.flip_x = true;  job.flip_y = true;
     }
-    else if (mode == 6) {   // FLIPD2
+    else if (mode == 6) {   // FLIPD2 - target row y is source column y, bottom to top
         std::cout << "Applying flip diagonal 2 transform." << std::endl;
-        // Swap the height and width values in our output bitmap
-        outbmp.setWidthinPixels(b.getHeightinPixels());
-        outbmp.setHeightinPixels(b.getWidthinPixels());
+        job.flip_x = false; job.flip_y = false;
     }
     else {
         std::cout << "Error - Invalid tranform mode selected." << std::endl;
         return;
     }
 
-    // Iterate over all the pixels in the picture
-    for (int y = 0; y < b.getHeightinPixels(); y++) {
-        for (int x = 0; x < b.getWidthinPixels(); x++) {
-            uint red   = 0;
-            uint green = 0;
-            uint blue  = 0;
-            uint alpha = 0;
-            uint target1_x, target1_y;
+    // The target is height pixels wide and width pixels tall
+    PixelBuffer& target = b.scratch;
+    SimdLevel    level  = getSimdLevel();
 
-            // Initialize our source pixel
-            source_pixel.init(b, x, y);
-            if (b.color_depth == 32) {
-                source_pixel.getrgba(red, green, blue, alpha);
-            }
-            else {  // 24-bit
-                source_pixel.getrgb(red, green, blue);
-            }
+    target.resize((size_t)width * height * bytes);
 
-            // Transform our picture depending on mode
-            if (mode == 0) {       // ROT90
-                // *** Swap X and Y, but reverse Y so we don't reverse the image ***
-                target1_x = y;
-                target1_y = (outbmp.getHeightinPixels()-1) - x;
-            }
-            else if (mode == 1) {  // ROT180
-                // *** Reverse X and Y ***
-                target1_x = (outbmp.getWidthinPixels()-1)  - x;
-                target1_y = (outbmp.getHeightinPixels()-1) - y;
-            }
-            else if (mode == 2) {  // ROT270
-                // *** Swap X and Y, but reverse Y so we don't reverse the image ***
-                target1_x = (outbmp.getWidthinPixels()-1) - y;
-                target1_y = x;
-            }
-            else if (mode == 3) {  // FLIPV
-                // *** Reverse Y ***
-                target1_x = x;
-                target1_y = (outbmp.getHeightinPixels()-1) - y;
-            }
-            else if (mode == 4) {  // FLIPH
-                // *** Reverse X ***
-                target1_x = (outbmp.getWidthinPixels()-1) - x;
-                target1_y = y;
-            }
-            else if (mode == 5) {  // FLIPD1
-                // *** Flip *and* Reverse X and Y ***
-                target1_x = (outbmp.getWidthinPixels()-1) - y;
-                target1_y = (outbmp.getHeightinPixels()-1)  - x;
-            }
-            else if (mode == 6) {  // FLIPD2
-                // *** Flip X and Y ***
-                target1_x = y;
-                target1_y = x;
-            }
+    job.source = pixels;
+    job.target = (uint8_t*)target.data();
+    job.width  = width;
+    job.height = height;
+    job.bytes  = bytes;
+    job.keep   = keep;
 
-            // Write our copied pixel to the target image
-            if (DEBUG) std::cout << "Target pixel1:  x/y:  " << std::dec << y << "/" << x << " mx/my:  " << outbmp.getHeightinPixels() << "/" << outbmp.getWidthinPixels() << " tx/ty:  " << target1_y << "/" << target1_x << std::endl;
-            target1_pixel.init(outbmp, target1_x, target1_y);
-            if (b.color_depth == 32) {
-                target1_pixel.setrgb(red, green, blue);
+    // Each task fills one row of tiles, so no two tasks write the same target bytes
+    parallelRows(width, [&](int first, int last) {
+        for (int ty = first; ty < last; ty += TRANSPOSE_TILE) {
+            for (int tx = 0; tx < height; tx += TRANSPOSE_TILE) {
+                transposeTile(job, tx, ty, std::min(TRANSPOSE_TILE, height - tx), std::min(TRANSPOSE_TILE, last - ty), level);
             }
-            else {
-                target1_pixel.setrgba(red, green, blue, alpha);
-            }
-            target1_pixel.write();
         }
-    }
+    }, TRANSPOSE_TILE);
 
-    if (b.getWidthinPixels() != outbmp.getWidthinPixels() || b.getHeightinPixels() != outbmp.getHeightinPixels()) {
-        // Adjust the file length and data size based on the changed number of padding bytes, if necessary.
-        source_num_padding_bytes =      b.getRowPaddingSize();  // If 32-bit, getRowPaddingSize will be 0
-        target_num_padding_bytes = outbmp.getRowPaddingSize();  // If 32-bit, getRowPaddingSize will be 0
-
-        outbmp.setFileLength(b.getFileLength() - (source_num_padding_bytes * b.height_in_pixels) + (target_num_padding_bytes * outbmp.height_in_pixels));
-        outbmp.setDataSize  (b.getDataSize()   - (source_num_padding_bytes * b.height_in_pixels) + (target_num_padding_bytes * outbmp.height_in_pixels));
-    }
-
-    b = outbmp;  // Return outbmp instead of b
+    b.setDimensions(height, width);
+    b.data.swap(target);
 
     return;
 }
@@ -1132,6 +2038,10 @@ void BitmapException::print_exception() {
     std::cout << "Exception:  " << _message << " - Position " << _position << std::endl;
 }
 
+const char* BitmapException::what() const noexcept {
+    return _message.c_str();
+}
+
 /**
  * BitmapPixel - to handle functions associated with Bitmap pixel transforms
  */
@@ -1,4 +1,47 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
 #include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <ostream>
+#include "bufferpool.h"
+
+#define MAX_BLUR_SIGMA 200   // Largest sigma blur(b, sigma) takes (a radius of 600 pixels)
+
+class MappedFile;
+class IoRing;
+
+/**
+ * ChannelFormat - where one color channel lives inside a pixel value.
+ * Decoded from the channel mask once at load time, so reading and writing
+ * a channel is a mask, a couple of shifts and a multiply.
+ */
+struct ChannelFormat
+{
+    uint32_t mask  = 0;  // Bits of the pixel value that hold this channel
+    uint32_t shift = 0;  // Position of the lowest bit of the mask
+    uint32_t width = 0;  // Number of bits in the mask
+    uint32_t down  = 0;  // Low bits dropped when the channel is wider than 8 bits
+    uint64_t to8   = 0;  // (channel * to8) >> 16 scales the channel to 0-255
+    uint64_t from8 = 0;  // (value * from8) >> 16, rounded, scales 0-255 back to the channel width
+
+    void     decode(uint32_t channel_mask);
+    uint     read (uint32_t pixel_value) const { return (uint)(((((pixel_value & mask) >> shift) >> down) * to8) >> 16); }
+    uint32_t write(uint value) const           { return (uint32_t)((((value * from8 + 32768) >> 16) << down) << shift) & mask; }
+};
+
+/**
+ * PixelFormat - the decoded channel layout of every pixel in an image
+ */
+struct PixelFormat
+{
+    ChannelFormat red;
+    ChannelFormat green;
+    ChannelFormat blue;
+    ChannelFormat alpha;
+};
 
 class Bitmap
 {
@@ -52,10 +95,70 @@ public:
     uint32_t     alpha_mask;             // Alpha Mask                           (4 bytes - only exists in 32-bit image)
     char         color_space[68];        // Color Space Information              (68 bytes - only exists in 32-bit image - ignore)
 
-    std::vector<char> data;              // Actual picture data                  (Formatted depending on 24/32 bit color)
+    PixelBuffer  data;                   // Actual picture data                  (Formatted depending on 24/32 bit color)
+    PixelBuffer  scratch;                // Spare pixel buffer: filters that change the size write here and swap it with data,
+                                         // so the old pixels' buffer is reused by the next such filter
+
+    PixelFormat  format;                 // Channel layout decoded from the masks (or the fixed 24-bit BGR layout)
+    bool         premultiplied = false;  // The colors are multiplied by alpha (see premultiply())
+
+    std::shared_ptr<const MappedFile> mapping;  // File mapping backing the pixel rows (only set by open_mapped)
+    const char  *mapped_pixels = nullptr;       // First pixel row inside the mapping (bottom row of the image)
+    uint32_t     mapped_stride = 0;             // Bytes between rows inside the mapping, including padding
 
     Bitmap();
 
+    /**
+     * Open an image by memory-mapping the file.
+     * The header is validated in place and the pixel rows are left in the
+     * mapping, so nothing is copied until loadMapped() is called.
+     *
+     * @param path the file to map.
+     *
+     * @throws BitmapException if the file can't be mapped or is an invalid bitmap.
+     */
+    void        open_mapped(const std::string& path);
+
+    /**
+     * Copy the mapped pixel rows into data (stripping the row padding) and
+     * release the mapping, so the filters can modify the image.
+     */
+    void        loadMapped();
+    bool        isMapped() const;
+
+    /**
+     * Read an image straight into data.  Row offsets in the file are fixed, so
+     * the rows are read in bands across the thread pool, each band with one
+     * preadv() that scatters the row padding into a few spare bytes.
+     *
+     * @param path the file to read.
+     * @param ring if given, the bands go through it on the calling thread
+     *        instead, so an I/O thread can load while the filters have the pool.
+     *
+     * @throws BitmapException if the file can't be read or is an invalid bitmap.
+     */
+    void        load(const std::string& path, IoRing *ring = nullptr);
+
+    /**
+     * Let the kernel drop mapped rows first..last-1 from memory once they've
+     * been read, so streaming a file doesn't keep all of it resident.
+     */
+    void        releaseMappedRows(int first, int last) const;
+
+    const char* row(int y) const;        // Pointer to the first byte of pixel row y (mapped or in data)
+    char*       row(int y);              // Pointer to the first byte of pixel row y in data
+    uint32_t    getRowStride() const;    // Number of bytes between consecutive row() pointers
+
+    /**
+     * The bytes a 32-bit file has after its last row, up to the length in its
+     * header.  load() and loadMapped() keep them in data after the rows, and a
+     * mapped image has them in the mapping; the writers put them back after
+     * the rows, so such a file is saved byte for byte.
+     */
+    size_t      trailingLength() const;
+    void        copyTrailing(size_t start, size_t count, char *out) const;  // Bytes start..start+count-1 of them, 0 where they weren't kept
+
+    void     decodeMasks();
     void     readPixel (int x, int y, uint &red, uint &green, uint &blue, uint &alpha);
     void     writePixel(int x, int y, uint &red, uint &green, uint &blue, uint &alpha);
     uint32_t getRowPaddingSize() const;
@@ -68,6 +171,29 @@ public:
     void     setWidthinPixels(int width);
     int32_t  getHeightinPixels() const;
     void     setHeightinPixels(int height);
+    void     setDimensions(int width, int height);  // Resize the header, adjusting the file length and data size
+    void     copyHeader(const Bitmap& other);   // Take other's header fields and pixel format, but not its pixels
+    void     copyHeaderForPixels(const Bitmap& other);  // copyHeader, and an unfilled data buffer of the right size in place of any mapping
+    uint32_t encodeHeader(char *header) const;      // Serialize the headers (at most 138 bytes), returning their length
+    uint32_t decodeHeader(const char *file, size_t file_size);  // Parse and check the headers at the start of a file, returning their length
+    uint32_t writeHeader(std::ostream& out) const;  // Write just the headers, returning the number of bytes written
+
+    /**
+     * Write the image to a file.
+     * Bands of rows go out across the thread pool, each in one pwritev() at
+     * its place in the file, with the row padding taken from a block of zeros
+     * instead of copied in.  Files of DIRECT_WRITE_BYTES or more have their
+     * space reserved up front and are written through O_DIRECT in large
+     * aligned chunks, so a big batch doesn't fill the page cache with output
+     * nobody will read back (filesystems without O_DIRECT get the pwritev()s).
+     *
+     * @param path the file to write.
+     * @param ring if given, the writes go through it on the calling thread
+     *        instead of the thread pool, as with load().
+     *
+     * @throws BitmapException if the file can't be written.
+     */
+    void     save(const std::string& path, IoRing *ring = nullptr) const;
 
 };
 
@@ -86,16 +212,85 @@ void cellShade(Bitmap& b);
  */
 void grayscale(Bitmap& b);
 
+/**
+ * The point-wise filters on rows first..last-1 only, without the message.
+ * A pipeline runs several of these over a band of rows while it's in cache.
+ */
+void cellShadeRows(Bitmap& b, int first, int last);
+void grayscaleRows(Bitmap& b, int first, int last);
+
+/**
+ * IntegralImage - summed-area table of the red, green and blue channels of an image,
+ * and of alpha when the image is premultiplied.
+ * Entry (x, y) is the sum over every pixel left of x and below y, so the sum
+ * over any rectangle is four lookups, whatever its size.  The sums are 32-bit
+ * and allowed to wrap: a rectangle's sum is still exact as long as it has
+ * fewer than 2^32 / 255 pixels.
+ */
+class IntegralImage
+{
+public:
+    explicit IntegralImage(const Bitmap& b);
+
+    /**
+     * Sum each channel over the pixels x0 <= x < x1, y0 <= y < y1.
+     * alpha comes out 0 unless channels is 4.
+     */
+    void sum(int x0, int y0, int x1, int y1, uint32_t& red, uint32_t& green, uint32_t& blue) const;
+    void sum(int x0, int y0, int x1, int y1, uint32_t& red, uint32_t& green, uint32_t& blue, uint32_t& alpha) const;
+
+    int width;
+    int height;
+    int channels;   // 3, or 4 when the image is premultiplied and alpha is summed too
+
+private:
+    size_t                      stride;   // Entries per row of the table (channels per column)
+    PooledVector<uint32_t>      table;    // (width + 1) x (height + 1) entries of red, green, blue (and alpha)
+};
+
 /**
  * Pixelats an image by creating groups of 16*16 pixel blocks.
+ * Partial blocks along the right and top edges are averaged over the pixels they have.
  */
 void pixelate(Bitmap& b);
 
+/**
+ * Pixelates an image with blocks of block_width x block_height pixels.
+ */
+void pixelate(Bitmap& b, int block_width, int block_height);
+
+/**
+ * Pixelates the width x height region at (x, y) (clipped to the image) with
+ * blocks starting at the region's corner, averaging from sums.  One table
+ * serves any number of regions and block sizes, as long as it was built from
+ * the pixels that should be averaged.
+ *
+ * @throws BitmapException if a block size is less than 1 or sums is for a different size of image.
+ */
+void pixelate(Bitmap& b, const IntegralImage& sums, int x, int y, int width, int height, int block_width, int block_height);
+
 /**
  * Use gaussian bluring to blur an image.
+ * Uses the 5x5 binomial kernel (the outer product of [1,4,6,4,1]).
  */
 void blur(Bitmap& b);
 
+/**
+ * Use gaussian bluring with the given sigma (in pixels) to blur an image.
+ * The kernel reaches out to 3 sigma, and the cost per pixel grows with
+ * sigma rather than its square since the blur is done in two passes.
+ * A sigma of 0 or less (or NaN) leaves the image alone.
+ *
+ * @throws BitmapException if sigma is more than MAX_BLUR_SIGMA.
+ */
+void blur(Bitmap& b, double sigma);
+
+/**
+ * The number of rows (and columns) on each side of a pixel that blur(b, sigma) reads.
+ * Sigmas past MAX_BLUR_SIGMA count as MAX_BLUR_SIGMA.
+ */
+int blurRadius(double sigma);
+
 /**
  * rotates image 90 degrees, swapping the height and width.
  */
@@ -132,15 +327,57 @@ void flipd1(Bitmap& b);
 void flipd2(Bitmap& b);
 
 /**
- * scales the image by a factor of 2.
+ * scales the image by a factor of 2, repeating each pixel.
  */
 void scaleUp(Bitmap& b);
 
 /**
- * scales the image by a factor of 1/2.
+ * scales the image by a factor of 1/2, averaging each 2x2 block of pixels.
+ * An odd last row or column is dropped.
  */
 void scaleDown(Bitmap& b);
 
+/**
+ * Filters resize() can resample with.
+ */
+enum class ResampleFilter
+{
+    Nearest,    // Copy the closest source pixel
+    Box,        // Average the source pixels each output pixel covers (thumbnails)
+    Bilinear,   // Triangle filter
+    Bicubic,    // Keys cubic, a = -0.5
+    Lanczos     // Lanczos, 3 lobes
+};
+
+/**
+ * Resize the image to width x height pixels with a separable filter.
+ * When shrinking, the filter is stretched over every source pixel the
+ * output pixel covers, so nothing aliases.  Alpha is resampled like the
+ * colors, so premultiply() an image with transparency first.
+ *
+ * @throws BitmapException if width or height is less than 1, or the file
+ *         would be too big for a bitmap's 32-bit length (over 4 GiB).
+ */
+void resize(Bitmap& b, int width, int height, ResampleFilter filter);
+
+/**
+ * Multiply the colors of an image with alpha by its alpha, and divide it
+ * back out.  While an image is premultiplied, blur, pixelate and the resizes
+ * weigh every pixel by how opaque it is and work on alpha too, so the color
+ * of transparent pixels doesn't bleed into their neighbours.  The point-wise
+ * filters and saving expect straight alpha.
+ * Does nothing to an image without alpha, or one already in that state.
+ */
+void premultiply(Bitmap& b);
+void unpremultiply(Bitmap& b);
+
+/**
+ * Lay src over dst ("over" compositing, for watermarks), with src's top
+ * left corner x pixels from dst's left edge and y pixels down from its top.
+ * A src without alpha is opaque.  Anything outside dst is clipped.
+ */
+void composite(Bitmap& dst, const Bitmap& src, int x, int y);
+
 /**
  * Perform the image transforms depending on mode
  * 0 = ROT90
@@ -179,6 +416,11 @@ public:
      * message"
      */
     void print_exception();
+
+    /**
+     * The message, without the position.
+     */
+    const char* what() const noexcept override;
 };
 
 
@@ -209,4 +451,6 @@ public:
      * Averages the values of the RGB color fields
      */
     //void average(Pixel& p);
- };
\ No newline at end of file
+ };
+
+#endif
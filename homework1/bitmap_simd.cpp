@@ -0,0 +1,1226 @@
+// Author:  Charles Lucas
+// CS510
+//
+// SIMD kernels for the point-wise filters (grayscale, cell shading, plane
+// split/merge, premultiply and compositing), the row passes of the blur
+// convolution and resampling, and the tile transposes behind rotation.
+//
+// The SSE2/SSSE3/AVX2 versions are compiled with target attributes, so the
+// rest of the program is still built for the baseline instruction set and
+// the kernel is chosen at runtime from what the CPU reports.
+
+#include <algorithm>
+#include <cstring>
+#include "bitmap_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BITMAP_X86 1
+#include <immintrin.h>
+#else
+#define BITMAP_X86 0
+#endif
+
+SimdLevel detectSimdLevel() {
+    static const SimdLevel detected = []() {
+#if BITMAP_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))  return SimdLevel::AVX2;
+        if (__builtin_cpu_supports("ssse3")) return SimdLevel::SSSE3;
+        if (__builtin_cpu_supports("sse2"))  return SimdLevel::SSE2;
+#endif
+        return SimdLevel::Scalar;
+    }();
+
+    return detected;
+}
+
+static SimdLevel& currentSimdLevel() {
+    static SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+SimdLevel getSimdLevel() {
+    return currentSimdLevel();
+}
+
+void setSimdLevel(SimdLevel level) {
+    currentSimdLevel() = std::min(level, detectSimdLevel());
+}
+
+const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX2:  return "avx2";
+        case SimdLevel::SSSE3: return "ssse3";
+        case SimdLevel::SSE2:  return "sse2";
+        default:               return "scalar";
+    }
+}
+
+/////////////////////////////////
+// Scalar kernels
+/////////////////////////////////
+
+static void cellShadeScalar(uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        uint8_t value = data[i];
+        if      (value <= 64)                 value = 0;
+        else if (value >  64 && value < 192)  value = 127;
+        else if (value >= 192)                value = 255;
+        data[i] = value;
+    }
+}
+
+static void grayscaleBGR24Scalar(uint8_t *pixels, size_t count) {
+    for (size_t i = 0; i < count; i++, pixels += 3) {
+        uint8_t average = (pixels[0] + pixels[1] + pixels[2]) / 3;
+        pixels[0] = pixels[1] = pixels[2] = average;
+    }
+}
+
+static void grayscaleMasked32Scalar(uint8_t *pixels, size_t count, const PixelFormat &f) {
+    for (size_t i = 0; i < count; i++, pixels += 4) {
+        uint32_t value;
+        uint32_t average;
+
+        memcpy(&value, pixels, 4);
+        average = (((value >> f.red.shift) & 0xFF) + ((value >> f.green.shift) & 0xFF) + ((value >> f.blue.shift) & 0xFF)) / 3;
+        value   = (average << f.red.shift) | (average << f.green.shift) | (average << f.blue.shift) | (value & f.alpha.mask);
+        memcpy(pixels, &value, 4);
+    }
+}
+
+static void convolveRowHorizontalScalar(const uint8_t *padded, size_t length, size_t step,
+                                        const uint16_t *weights, int taps, int shift, uint16_t *out) {
+    for (size_t i = 0; i < length; i++) {
+        uint32_t sum = (1u << shift) >> 1;
+        for (int k = 0; k < taps; k++) {
+            sum += weights[k] * padded[i + k*step];
+        }
+        out[i] = (uint16_t)(sum >> shift);
+    }
+}
+
+static void convolveRowsVerticalScalar(const uint16_t *const *rows, size_t first, size_t length, const uint16_t *weights,
+                                       int taps, uint32_t bias, int shift, uint8_t *out) {
+    for (size_t i = first; i < length; i++) {
+        uint32_t sum = bias;
+        for (int k = 0; k < taps; k++) {
+            sum += (uint32_t)weights[k] * rows[k][i];
+        }
+        out[i] = (uint8_t)(sum >> shift);
+    }
+}
+
+static void resampleRowHorizontalScalar(const uint8_t *row, const int *first, const int16_t *weights, int taps,
+                                        int x, int width, int16_t *out) {
+    for (; x < width; x++) {
+        const uint8_t *pixels = row + first[x] * 4;
+        const int16_t *w      = weights + (size_t)x * taps;
+
+        for (int c = 0; c < 4; c++) {
+            int32_t sum = 128;
+            for (int k = 0; k < taps; k++) {
+                sum += w[k] * pixels[k*4 + c];
+            }
+            out[x*4 + c] = (int16_t)std::min(std::max(sum >> 8, -32768), 32767);
+        }
+    }
+}
+
+static void resampleRowsVerticalScalar(const int16_t *const *rows, const int16_t *weights, int taps,
+                                       size_t first, size_t length, uint8_t *out) {
+    for (size_t i = first; i < length; i++) {
+        int32_t sum = 1 << 19;
+        for (int k = 0; k < taps; k++) {
+            sum += weights[k] * rows[k][i];
+        }
+        out[i] = (uint8_t)std::min(std::max(sum >> 20, 0), 255);
+    }
+}
+
+static void expandBGR24Scalar(const uint8_t *pixels, size_t count, uint8_t *out) {
+    for (size_t i = 0; i < count; i++) {
+        memcpy(out + i*4, pixels + i*3, 3);
+        out[i*4 + 3] = 0;
+    }
+}
+
+static void compressBGR24Scalar(const uint8_t *pixels, size_t count, uint8_t *out) {
+    for (size_t i = 0; i < count; i++) {
+        memcpy(out + i*3, pixels + i*4, 3);
+    }
+}
+
+static void splitPixelsScalar(const uint8_t *pixels, size_t first, size_t count, int bytes, uint8_t *const *planes) {
+    for (size_t i = first; i < count; i++) {
+        for (int k = 0; k < bytes; k++) planes[k][i] = pixels[i*bytes + k];
+    }
+}
+
+static void mergePixelsScalar(const uint8_t *const *planes, size_t first, size_t count, int bytes, uint8_t *pixels) {
+    for (size_t i = first; i < count; i++) {
+        for (int k = 0; k < bytes; k++) pixels[i*bytes + k] = planes[k][i];
+    }
+}
+
+static void averagePlanesScalar(uint8_t *red, uint8_t *green, uint8_t *blue, size_t first, size_t count) {
+    for (size_t i = first; i < count; i++) {
+        red[i] = green[i] = blue[i] = (uint8_t)((red[i] + green[i] + blue[i]) / 3);
+    }
+}
+
+// x/255 rounded, for x up to 255*255
+static inline uint32_t divideBy255(uint32_t x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static void premultiplyBGRAScalar(uint8_t *pixels, size_t first, size_t count) {
+    for (size_t i = first; i < count; i++) {
+        uint8_t *p = pixels + i*4;
+        for (int k = 0; k < 3; k++) p[k] = (uint8_t)divideBy255(p[k] * p[3]);
+    }
+}
+
+// In single precision, one operation at a time, so the SIMD versions round exactly the same way
+static void unpremultiplyBGRAScalar(uint8_t *pixels, size_t first, size_t count) {
+    for (size_t i = first; i < count; i++) {
+        uint8_t *p = pixels + i*4;
+        for (int k = 0; k < 3; k++) {
+            if (p[3] == 0) {
+                p[k] = 0;
+                continue;
+            }
+            float value = (float)p[k] * 255.0f;
+            value = value / (float)p[3];
+            value = value + 0.5f;
+            p[k] = (uint8_t)std::min(255, (int)value);
+        }
+    }
+}
+
+static void compositeBGRAScalar(const uint8_t *src, uint8_t *dst, size_t first, size_t count) {
+    for (size_t i = first; i < count; i++) {
+        uint32_t keep = 255 - src[i*4 + 3];
+        for (int k = 0; k < 4; k++) {
+            dst[i*4 + k] = (uint8_t)std::min<uint32_t>(255, src[i*4 + k] + divideBy255(dst[i*4 + k] * keep));
+        }
+    }
+}
+
+// Copy target pixel (tx, ty) of a transpose job from its source pixel
+static inline void transposePixel(const TransposeJob &job, int tx, int ty) {
+    int sx = job.flip_x ? job.width  - 1 - ty : ty;
+    int sy = job.flip_y ? job.height - 1 - tx : tx;
+    const uint8_t *source = job.source + ((size_t)sy * job.width  + sx) * job.bytes;
+    uint8_t       *target = job.target + ((size_t)ty * job.height + tx) * job.bytes;
+
+    if (job.bytes == 4) {
+        uint32_t value;
+        memcpy(&value, source, 4);
+        value &= job.keep;
+        memcpy(target, &value, 4);
+    }
+    else {
+        target[0] = source[0];
+        target[1] = source[1];
+        target[2] = source[2];
+    }
+}
+
+#if BITMAP_X86
+
+/////////////////////////////////
+// SSE2 kernels
+/////////////////////////////////
+
+// x/3 for 16-bit lanes holding at most 765:  (x * 0xAAAB) >> 17
+__attribute__((target("sse2")))
+static inline __m128i divideBy3(__m128i x) {
+    return _mm_srli_epi16(_mm_mulhi_epu16(x, _mm_set1_epi16((short)0xAAAB)), 1);
+}
+
+__attribute__((target("sse2")))
+static void averagePlanesSSE2(uint8_t *red, uint8_t *green, uint8_t *blue, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i r = _mm_loadu_si128((const __m128i*)(red   + i));
+        __m128i g = _mm_loadu_si128((const __m128i*)(green + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(blue  + i));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(g, zero)), _mm_unpacklo_epi8(b, zero));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero)), _mm_unpackhi_epi8(b, zero));
+        __m128i average = _mm_packus_epi16(divideBy3(lo), divideBy3(hi));
+        _mm_storeu_si128((__m128i*)(red   + i), average);
+        _mm_storeu_si128((__m128i*)(green + i), average);
+        _mm_storeu_si128((__m128i*)(blue  + i), average);
+    }
+    averagePlanesScalar(red, green, blue, i, count);
+}
+
+// x/255 rounded, for 16-bit lanes holding at most 255*255
+__attribute__((target("sse2")))
+static inline __m128i divideBy255(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// The alpha of each of the two pixels in 16-bit lanes, copied to all four of its lanes
+__attribute__((target("sse2")))
+static inline __m128i spreadAlpha(__m128i pixels) {
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+__attribute__((target("sse2")))
+static void premultiplyBGRASSE2(uint8_t *pixels, size_t count) {
+    const __m128i zero   = _mm_setzero_si128();
+    const __m128i colors = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    const __m128i opaque = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);   // Alpha lanes are multiplied by 255/255
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i v  = _mm_loadu_si128((const __m128i*)(pixels + i*4));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        lo = divideBy255(_mm_mullo_epi16(lo, _mm_or_si128(_mm_and_si128(spreadAlpha(lo), colors), opaque)));
+        hi = divideBy255(_mm_mullo_epi16(hi, _mm_or_si128(_mm_and_si128(spreadAlpha(hi), colors), opaque)));
+        _mm_storeu_si128((__m128i*)(pixels + i*4), _mm_packus_epi16(lo, hi));
+    }
+    premultiplyBGRAScalar(pixels, i, count);
+}
+
+// One pixel per vector of floats
+__attribute__((target("sse2")))
+static inline __m128i unpremultiplyPixel(__m128i pixel) {
+    const __m128  zero   = _mm_setzero_ps();
+    const __m128i colors = _mm_set_epi32(0, -1, -1, -1);
+    __m128 v     = _mm_cvtepi32_ps(pixel);
+    __m128 alpha = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+    __m128 value = _mm_add_ps(_mm_div_ps(_mm_mul_ps(v, _mm_set1_ps(255.0f)), alpha), _mm_set1_ps(0.5f));
+    __m128i out  = _mm_andnot_si128(_mm_castps_si128(_mm_cmpeq_ps(alpha, zero)), _mm_cvttps_epi32(value));
+    return _mm_or_si128(_mm_and_si128(out, colors), _mm_andnot_si128(colors, pixel));
+}
+
+__attribute__((target("sse2")))
+static void unpremultiplyBGRASSE2(uint8_t *pixels, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i v  = _mm_loadu_si128((const __m128i*)(pixels + i*4));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i p0 = unpremultiplyPixel(_mm_unpacklo_epi16(lo, zero));
+        __m128i p1 = unpremultiplyPixel(_mm_unpackhi_epi16(lo, zero));
+        __m128i p2 = unpremultiplyPixel(_mm_unpacklo_epi16(hi, zero));
+        __m128i p3 = unpremultiplyPixel(_mm_unpackhi_epi16(hi, zero));
+        _mm_storeu_si128((__m128i*)(pixels + i*4), _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3)));
+    }
+    unpremultiplyBGRAScalar(pixels, i, count);
+}
+
+__attribute__((target("sse2")))
+static void compositeBGRASSE2(const uint8_t *src, uint8_t *dst, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(255);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i s  = _mm_loadu_si128((const __m128i*)(src + i*4));
+        __m128i d  = _mm_loadu_si128((const __m128i*)(dst + i*4));
+        __m128i slo = _mm_unpacklo_epi8(s, zero);
+        __m128i shi = _mm_unpackhi_epi8(s, zero);
+        __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, spreadAlpha(slo)));
+        __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, spreadAlpha(shi)));
+        lo = _mm_add_epi16(slo, divideBy255(lo));
+        hi = _mm_add_epi16(shi, divideBy255(hi));
+        _mm_storeu_si128((__m128i*)(dst + i*4), _mm_packus_epi16(lo, hi));
+    }
+    compositeBGRAScalar(src, dst, i, count);
+}
+
+__attribute__((target("sse2")))
+static void cellShadeSSE2(uint8_t *data, size_t length) {
+    const __m128i bias  = _mm_set1_epi8((char)0x80);          // Flip the sign bit so signed compares act unsigned
+    const __m128i above = _mm_set1_epi8((char)(64  ^ 0x80));
+    const __m128i top   = _mm_set1_epi8((char)(191 ^ 0x80));
+    const __m128i mid   = _mm_set1_epi8(127);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(data + i)), bias);
+        __m128i r = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(v, above), mid), _mm_cmpgt_epi8(v, top));
+        _mm_storeu_si128((__m128i*)(data + i), r);
+    }
+    cellShadeScalar(data + i, length - i);
+}
+
+__attribute__((target("sse2")))
+static void grayscaleMasked32SSE2(uint8_t *pixels, size_t count, const PixelFormat &f) {
+    const __m128i byte  = _mm_set1_epi32(0xFF);
+    const __m128i alpha = _mm_set1_epi32((int)f.alpha.mask);
+    const __m128i rs    = _mm_cvtsi32_si128(f.red.shift);
+    const __m128i gs    = _mm_cvtsi32_si128(f.green.shift);
+    const __m128i bs    = _mm_cvtsi32_si128(f.blue.shift);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i v[2];
+        __m128i sum[2];
+
+        for (int k = 0; k < 2; k++) {
+            v[k]   = _mm_loadu_si128((const __m128i*)(pixels + (i + 4*k) * 4));
+            sum[k] = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(_mm_srl_epi32(v[k], rs), byte),
+                                                 _mm_and_si128(_mm_srl_epi32(v[k], gs), byte)),
+                                                 _mm_and_si128(_mm_srl_epi32(v[k], bs), byte));
+        }
+
+        __m128i average = divideBy3(_mm_packs_epi32(sum[0], sum[1]));
+        __m128i zero    = _mm_setzero_si128();
+        __m128i a[2]    = {_mm_unpacklo_epi16(average, zero), _mm_unpackhi_epi16(average, zero)};
+
+        for (int k = 0; k < 2; k++) {
+            __m128i out = _mm_or_si128(_mm_or_si128(_mm_sll_epi32(a[k], rs), _mm_sll_epi32(a[k], gs)),
+                                       _mm_or_si128(_mm_sll_epi32(a[k], bs), _mm_and_si128(v[k], alpha)));
+            _mm_storeu_si128((__m128i*)(pixels + (i + 4*k) * 4), out);
+        }
+    }
+    grayscaleMasked32Scalar(pixels + i * 4, count - i, f);
+}
+
+__attribute__((target("sse2")))
+static void convolveRowHorizontalSSE2(const uint8_t *padded, size_t length, size_t step,
+                                      const uint16_t *weights, int taps, int shift, uint16_t *out) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    // 32-bit sums, put back in 16 bits after the shift.  SSE2 can only pack
+    // signed words, so the sums are moved down by 32768 for the pack and back up after
+    for (; shift > 0 && i + 8 <= length; i += 8) {
+        __m128i lo = _mm_set1_epi32(((1 << shift) >> 1) - (32768 << shift));
+        __m128i hi = lo;
+
+        for (int k = 0; k < taps; k++) {
+            __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(padded + i + k*step)), zero);
+            __m128i w = _mm_set1_epi16((short)weights[k]);
+            __m128i product_lo = _mm_mullo_epi16(v, w);
+            __m128i product_hi = _mm_mulhi_epu16(v, w);
+            lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(product_lo, product_hi));
+            hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(product_lo, product_hi));
+        }
+
+        const __m128i count  = _mm_cvtsi32_si128(shift);
+        __m128i       result = _mm_packs_epi32(_mm_sra_epi32(lo, count), _mm_sra_epi32(hi, count));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_xor_si128(result, _mm_set1_epi16((short)0x8000)));
+    }
+    for (; shift == 0 && i + 16 <= length; i += 16) {
+        __m128i lo = zero;
+        __m128i hi = zero;
+
+        for (int k = 0; k < taps; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(padded + i + k*step));
+            __m128i w = _mm_set1_epi16((short)weights[k]);
+            lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), w));
+            hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), w));
+        }
+        _mm_storeu_si128((__m128i*)(out + i),     lo);
+        _mm_storeu_si128((__m128i*)(out + i + 8), hi);
+    }
+    convolveRowHorizontalScalar(padded + i, length - i, step, weights, taps, shift, out + i);
+}
+
+__attribute__((target("sse2")))
+static void convolveRowsVerticalSSE2(const uint16_t *const *rows, size_t first, size_t length, const uint16_t *weights,
+                                     int taps, uint32_t bias, int shift, uint8_t *out) {
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    size_t i = first;
+
+    for (; i + 8 <= length; i += 8) {
+        __m128i lo = _mm_set1_epi32((int)bias);
+        __m128i hi = lo;
+
+        for (int k = 0; k < taps; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+            __m128i w = _mm_set1_epi16((short)weights[k]);
+            __m128i product_lo = _mm_mullo_epi16(v, w);   // Low and high halves of the 32-bit products
+            __m128i product_hi = _mm_mulhi_epu16(v, w);
+            lo = _mm_add_epi32(lo, _mm_unpacklo_epi16(product_lo, product_hi));
+            hi = _mm_add_epi32(hi, _mm_unpackhi_epi16(product_lo, product_hi));
+        }
+
+        __m128i result = _mm_packs_epi32(_mm_srl_epi32(lo, count), _mm_srl_epi32(hi, count));
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(result, result));
+    }
+    convolveRowsVerticalScalar(rows, i, length, weights, taps, bias, shift, out);
+}
+
+// Two 4-channel pixels spread to 16-bit lanes and interleaved channel by channel, to madd with a pair of weights
+__attribute__((target("sse2")))
+static inline __m128i pixelPair(__m128i pixels) {
+    return _mm_unpacklo_epi16(pixels, _mm_srli_si128(pixels, 8));
+}
+
+// The horizontal sums of one output pixel, in the 4 32-bit lanes
+__attribute__((target("sse2")))
+static inline __m128i resamplePixel(const uint8_t *pixels, const int16_t *w, int taps) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i       sum  = _mm_set1_epi32(128);
+    int           k    = 0;
+    int32_t       pair[2];
+
+    for (; k + 4 <= taps; k += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(pixels + k*4));
+        memcpy(pair, w + k, 8);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(pixelPair(_mm_unpacklo_epi8(v, zero)), _mm_set1_epi32(pair[0])));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(pixelPair(_mm_unpackhi_epi8(v, zero)), _mm_set1_epi32(pair[1])));
+    }
+    for (; k < taps; k += 2) {
+        __m128i v = _mm_loadl_epi64((const __m128i*)(pixels + k*4));
+        memcpy(pair, w + k, 4);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(pixelPair(_mm_unpacklo_epi8(v, zero)), _mm_set1_epi32(pair[0])));
+    }
+    return _mm_srai_epi32(sum, 8);
+}
+
+__attribute__((target("sse2")))
+static void resampleRowHorizontalSSE2(const uint8_t *row, const int *first, const int16_t *weights, int taps,
+                                      int width, int16_t *out) {
+    int x = 0;
+
+    // Two output pixels at a time share one pack and store
+    for (; x + 2 <= width; x += 2) {
+        __m128i a = resamplePixel(row + first[x]     * 4, weights + (size_t)x       * taps, taps);
+        __m128i b = resamplePixel(row + first[x + 1] * 4, weights + (size_t)(x + 1) * taps, taps);
+        _mm_storeu_si128((__m128i*)(out + x*4), _mm_packs_epi32(a, b));
+    }
+    resampleRowHorizontalScalar(row, first, weights, taps, x, width, out);
+}
+
+__attribute__((target("sse2")))
+static void resampleRowsVerticalSSE2(const int16_t *const *rows, const int16_t *weights, int taps,
+                                     size_t first, size_t length, uint8_t *out) {
+    const __m128i round = _mm_set1_epi32(1 << 19);
+    size_t i = first;
+
+    for (; i + 8 <= length; i += 8) {
+        __m128i lo = round;
+        __m128i hi = round;
+
+        // Rows k and k+1 interleaved, so one madd does both taps
+        for (int k = 0; k < taps; k += 2) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(rows[k]     + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(rows[k + 1] + i));
+            __m128i w = _mm_set1_epi32((int)(((uint32_t)(uint16_t)weights[k + 1] << 16) | (uint16_t)weights[k]));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+
+        __m128i result = _mm_packs_epi32(_mm_srai_epi32(lo, 20), _mm_srai_epi32(hi, 20));
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(result, result));
+    }
+    resampleRowsVerticalScalar(rows, weights, taps, i, length, out);
+}
+
+/**
+ * Transpose 4 source rows of 4 pixels (as 32-bit lanes) into the 4 target rows of the block:
+ * the rows come out in reverse for flip_x and with their lanes reversed for flip_y.
+ */
+__attribute__((target("sse2")))
+static inline void transpose4x4(const __m128i row[4], bool flip_x, bool flip_y, __m128i out[4]) {
+    __m128i t0 = _mm_unpacklo_epi32(row[0], row[1]);
+    __m128i t1 = _mm_unpacklo_epi32(row[2], row[3]);
+    __m128i t2 = _mm_unpackhi_epi32(row[0], row[1]);
+    __m128i t3 = _mm_unpackhi_epi32(row[2], row[3]);
+    __m128i column[4] = {_mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+                         _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)};
+
+    for (int i = 0; i < 4; i++) {
+        out[i] = column[flip_x ? 3 - i : i];
+        if (flip_y) out[i] = _mm_shuffle_epi32(out[i], 0x1B);
+    }
+}
+
+// The source pixel at the low corner of the 4x4 block of target pixels at (tx, ty)
+static inline const uint8_t* blockSource(const TransposeJob &job, int tx, int ty) {
+    int sx0 = job.flip_x ? job.width  - 4 - ty : ty;
+    int sy0 = job.flip_y ? job.height - 4 - tx : tx;
+    return job.source + ((size_t)sy0 * job.width + sx0) * job.bytes;
+}
+
+__attribute__((target("sse2")))
+static inline void transposeBlock32(const TransposeJob &job, int tx, int ty, __m128i keep) {
+    const uint8_t *source = blockSource(job, tx, ty);
+    size_t         source_stride = (size_t)job.width * 4;
+    __m128i        row[4];
+    __m128i        out[4];
+
+    for (int r = 0; r < 4; r++) {
+        row[r] = _mm_loadu_si128((const __m128i*)(source + r * source_stride));
+    }
+    transpose4x4(row, job.flip_x, job.flip_y, out);
+    for (int i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i*)(job.target + ((size_t)(ty + i) * job.height + tx) * 4), _mm_and_si128(out[i], keep));
+    }
+}
+
+__attribute__((target("sse2")))
+static void transposeTileSSE2(const TransposeJob &job, int tx0, int ty0, int tile_width, int tile_height) {
+    const __m128i keep = _mm_set1_epi32((int)job.keep);
+
+    for (int ty = ty0; ty < ty0 + tile_height; ty += 4) {
+        for (int tx = tx0; tx < tx0 + tile_width; tx += 4) {
+            if (ty + 4 <= ty0 + tile_height && tx + 4 <= tx0 + tile_width) {
+                transposeBlock32(job, tx, ty, keep);
+                continue;
+            }
+            for (int y = ty; y < std::min(ty + 4, ty0 + tile_height); y++) {
+                for (int x = tx; x < std::min(tx + 4, tx0 + tile_width); x++) transposePixel(job, x, y);
+            }
+        }
+    }
+}
+
+/////////////////////////////////
+// SSSE3 kernels
+/////////////////////////////////
+
+/**
+ * Byte shuffles to split 48 bytes of BGR pixels (3 vectors) into 16 blue,
+ * green and red bytes, and to spread 16 averages back out over 48 bytes.
+ * A -1 index makes pshufb write a 0.
+ */
+struct BGR24Shuffles
+{
+    alignas(16) int8_t split[3][3][16];   // [channel][source vector][byte]
+    alignas(16) int8_t merge[3][16];      // [output vector][byte]
+    alignas(16) int8_t interleave[3][3][16]; // [output vector][channel][byte] - the inverse of split
+
+    BGR24Shuffles() {
+        for (int channel = 0; channel < 3; channel++) {
+            for (int vec = 0; vec < 3; vec++) {
+                for (int i = 0; i < 16; i++) {
+                    int source = 3*i + channel;  // Byte of pixel i's channel in the 48 bytes
+                    split[channel][vec][i] = (source / 16 == vec) ? (int8_t)(source % 16) : -1;
+                }
+            }
+        }
+        for (int vec = 0; vec < 3; vec++) {
+            for (int i = 0; i < 16; i++) {
+                merge[vec][i] = (int8_t)((16*vec + i) / 3);  // Output byte takes its pixel's average
+            }
+        }
+        for (int vec = 0; vec < 3; vec++) {
+            for (int channel = 0; channel < 3; channel++) {
+                for (int i = 0; i < 16; i++) {
+                    int target = 16*vec + i;    // Byte of the 48 that takes pixel target/3's channel from its plane
+                    interleave[vec][channel][i] = (target % 3 == channel) ? (int8_t)(target / 3) : -1;
+                }
+            }
+        }
+    }
+};
+
+static const BGR24Shuffles bgr24_shuffles;
+
+__attribute__((target("ssse3")))
+static void grayscaleBGR24SSSE3(uint8_t *pixels, size_t count) {
+    const BGR24Shuffles &s = bgr24_shuffles;
+    __m128i split[3][3];
+    __m128i merge[3];
+    size_t i = 0;
+
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 3; v++) split[c][v] = _mm_load_si128((const __m128i*)s.split[c][v]);
+        merge[c] = _mm_load_si128((const __m128i*)s.merge[c]);
+    }
+
+    for (; i + 16 <= count; i += 16) {
+        uint8_t *p = pixels + i * 3;
+        __m128i in[3] = {_mm_loadu_si128((const __m128i*)p),
+                         _mm_loadu_si128((const __m128i*)(p + 16)),
+                         _mm_loadu_si128((const __m128i*)(p + 32))};
+        __m128i zero  = _mm_setzero_si128();
+        __m128i lo    = zero;
+        __m128i hi    = zero;
+
+        for (int c = 0; c < 3; c++) {
+            __m128i channel = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in[0], split[c][0]),
+                                                        _mm_shuffle_epi8(in[1], split[c][1])),
+                                                        _mm_shuffle_epi8(in[2], split[c][2]));
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(channel, zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(channel, zero));
+        }
+
+        __m128i average = _mm_packus_epi16(divideBy3(lo), divideBy3(hi));
+        for (int v = 0; v < 3; v++) {
+            _mm_storeu_si128((__m128i*)(p + 16*v), _mm_shuffle_epi8(average, merge[v]));
+        }
+    }
+    grayscaleBGR24Scalar(pixels + i * 3, count - i);
+}
+
+// 3-byte pixels are spread out to 32-bit lanes for the transpose and packed back afterwards
+__attribute__((target("ssse3")))
+static inline void transposeBlock24(const TransposeJob &job, int tx, int ty, __m128i expand, __m128i compress) {
+    const uint8_t *source = blockSource(job, tx, ty);
+    size_t         source_stride = (size_t)job.width * 3;
+    __m128i        row[4];
+    __m128i        out[4];
+
+    for (int r = 0; r < 4; r++) {
+        row[r] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(source + r * source_stride)), expand);
+    }
+    transpose4x4(row, job.flip_x, job.flip_y, out);
+    for (int i = 0; i < 4; i++) {
+        uint8_t *target = job.target + ((size_t)(ty + i) * job.height + tx) * 3;
+        __m128i  packed = _mm_shuffle_epi8(out[i], compress);
+        uint32_t last   = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+
+        _mm_storel_epi64((__m128i*)target, packed);
+        memcpy(target + 8, &last, 4);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void transposeTileSSSE3(const TransposeJob &job, int tx0, int ty0, int tile_width, int tile_height) {
+    const __m128i expand   = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i compress = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t        source_size = (size_t)job.width * job.height * 3;
+
+    for (int ty = ty0; ty < ty0 + tile_height; ty += 4) {
+        for (int tx = tx0; tx < tx0 + tile_width; tx += 4) {
+            // Each source row of the block is read as 16 bytes for 12, so the last one has to stay inside the image
+            bool whole = ty + 4 <= ty0 + tile_height && tx + 4 <= tx0 + tile_width;
+
+            if (whole && (size_t)(blockSource(job, tx, ty) - job.source) + 3 * (size_t)job.width * 3 + 16 <= source_size) {
+                transposeBlock24(job, tx, ty, expand, compress);
+                continue;
+            }
+            for (int y = ty; y < std::min(ty + 4, ty0 + tile_height); y++) {
+                for (int x = tx; x < std::min(tx + 4, tx0 + tile_width); x++) transposePixel(job, x, y);
+            }
+        }
+    }
+}
+
+// 16 bytes are read or written for every 12 of 3-byte pixels, so the last few pixels are left to the scalar loop
+__attribute__((target("ssse3")))
+static void expandBGR24SSSE3(const uint8_t *pixels, size_t count, uint8_t *out) {
+    const __m128i expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    size_t i = 0;
+
+    for (; i + 6 <= count; i += 4) {
+        _mm_storeu_si128((__m128i*)(out + i*4), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pixels + i*3)), expand));
+    }
+    expandBGR24Scalar(pixels + i*3, count - i, out + i*4);
+}
+
+__attribute__((target("ssse3")))
+static void compressBGR24SSSE3(const uint8_t *pixels, size_t count, uint8_t *out) {
+    const __m128i compress = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t i = 0;
+
+    for (; i + 6 <= count; i += 4) {
+        _mm_storeu_si128((__m128i*)(out + i*3), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pixels + i*4)), compress));
+    }
+    compressBGR24Scalar(pixels + i*4, count - i, out + i*3);
+}
+
+// Bytes of 4 pixels regrouped so each 32-bit lane holds one byte position of all 4 (its own inverse)
+__attribute__((target("ssse3")))
+static inline __m128i gatherBytes(__m128i v) {
+    return _mm_shuffle_epi8(v, _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15));
+}
+
+__attribute__((target("ssse3")))
+static inline void transposeLanes(__m128i &a, __m128i &b, __m128i &c, __m128i &d) {
+    __m128i t0 = _mm_unpacklo_epi32(a, b);
+    __m128i t1 = _mm_unpacklo_epi32(c, d);
+    __m128i t2 = _mm_unpackhi_epi32(a, b);
+    __m128i t3 = _mm_unpackhi_epi32(c, d);
+    a = _mm_unpacklo_epi64(t0, t1);
+    b = _mm_unpackhi_epi64(t0, t1);
+    c = _mm_unpacklo_epi64(t2, t3);
+    d = _mm_unpackhi_epi64(t2, t3);
+}
+
+__attribute__((target("ssse3")))
+static void splitPixelsSSSE3(const uint8_t *pixels, size_t count, int bytes, uint8_t *const *planes) {
+    const BGR24Shuffles &s = bgr24_shuffles;
+    size_t i = 0;
+
+    if (bytes == 3) {
+        for (; i + 16 <= count; i += 16) {
+            const uint8_t *p = pixels + i * 3;
+            __m128i in[3] = {_mm_loadu_si128((const __m128i*)p),
+                             _mm_loadu_si128((const __m128i*)(p + 16)),
+                             _mm_loadu_si128((const __m128i*)(p + 32))};
+            for (int c = 0; c < 3; c++) {
+                __m128i plane = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in[0], _mm_load_si128((const __m128i*)s.split[c][0])),
+                                                          _mm_shuffle_epi8(in[1], _mm_load_si128((const __m128i*)s.split[c][1]))),
+                                                          _mm_shuffle_epi8(in[2], _mm_load_si128((const __m128i*)s.split[c][2])));
+                _mm_storeu_si128((__m128i*)(planes[c] + i), plane);
+            }
+        }
+    }
+    else {
+        for (; i + 16 <= count; i += 16) {
+            const uint8_t *p = pixels + i * 4;
+            __m128i a = gatherBytes(_mm_loadu_si128((const __m128i*)p));
+            __m128i b = gatherBytes(_mm_loadu_si128((const __m128i*)(p + 16)));
+            __m128i c = gatherBytes(_mm_loadu_si128((const __m128i*)(p + 32)));
+            __m128i d = gatherBytes(_mm_loadu_si128((const __m128i*)(p + 48)));
+            transposeLanes(a, b, c, d);
+            _mm_storeu_si128((__m128i*)(planes[0] + i), a);
+            _mm_storeu_si128((__m128i*)(planes[1] + i), b);
+            _mm_storeu_si128((__m128i*)(planes[2] + i), c);
+            _mm_storeu_si128((__m128i*)(planes[3] + i), d);
+        }
+    }
+    splitPixelsScalar(pixels, i, count, bytes, planes);
+}
+
+__attribute__((target("ssse3")))
+static void mergePixelsSSSE3(const uint8_t *const *planes, size_t count, int bytes, uint8_t *pixels) {
+    const BGR24Shuffles &s = bgr24_shuffles;
+    size_t i = 0;
+
+    if (bytes == 3) {
+        for (; i + 16 <= count; i += 16) {
+            uint8_t *p = pixels + i * 3;
+            __m128i in[3] = {_mm_loadu_si128((const __m128i*)(planes[0] + i)),
+                             _mm_loadu_si128((const __m128i*)(planes[1] + i)),
+                             _mm_loadu_si128((const __m128i*)(planes[2] + i))};
+            for (int v = 0; v < 3; v++) {
+                __m128i out = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in[0], _mm_load_si128((const __m128i*)s.interleave[v][0])),
+                                                        _mm_shuffle_epi8(in[1], _mm_load_si128((const __m128i*)s.interleave[v][1]))),
+                                                        _mm_shuffle_epi8(in[2], _mm_load_si128((const __m128i*)s.interleave[v][2])));
+                _mm_storeu_si128((__m128i*)(p + 16*v), out);
+            }
+        }
+    }
+    else {
+        for (; i + 16 <= count; i += 16) {
+            uint8_t *p = pixels + i * 4;
+            __m128i a = _mm_loadu_si128((const __m128i*)(planes[0] + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(planes[1] + i));
+            __m128i c = _mm_loadu_si128((const __m128i*)(planes[2] + i));
+            __m128i d = _mm_loadu_si128((const __m128i*)(planes[3] + i));
+            transposeLanes(a, b, c, d);
+            _mm_storeu_si128((__m128i*)p,        gatherBytes(a));
+            _mm_storeu_si128((__m128i*)(p + 16), gatherBytes(b));
+            _mm_storeu_si128((__m128i*)(p + 32), gatherBytes(c));
+            _mm_storeu_si128((__m128i*)(p + 48), gatherBytes(d));
+        }
+    }
+    mergePixelsScalar(planes, i, count, bytes, pixels);
+}
+
+/////////////////////////////////
+// AVX2 kernels
+/////////////////////////////////
+
+__attribute__((target("avx2")))
+static inline __m256i divideBy3AVX2(__m256i x) {
+    return _mm256_srli_epi16(_mm256_mulhi_epu16(x, _mm256_set1_epi16((short)0xAAAB)), 1);
+}
+
+__attribute__((target("avx2")))
+static void averagePlanesAVX2(uint8_t *red, uint8_t *green, uint8_t *blue, size_t count) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m256i r = _mm256_loadu_si256((const __m256i*)(red   + i));
+        __m256i g = _mm256_loadu_si256((const __m256i*)(green + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(blue  + i));
+        __m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(r, zero), _mm256_unpacklo_epi8(g, zero)), _mm256_unpacklo_epi8(b, zero));
+        __m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(r, zero), _mm256_unpackhi_epi8(g, zero)), _mm256_unpackhi_epi8(b, zero));
+        __m256i average = _mm256_packus_epi16(divideBy3AVX2(lo), divideBy3AVX2(hi));   // Unpack and pack undo each other within each lane
+        _mm256_storeu_si256((__m256i*)(red   + i), average);
+        _mm256_storeu_si256((__m256i*)(green + i), average);
+        _mm256_storeu_si256((__m256i*)(blue  + i), average);
+    }
+    averagePlanesSSE2(red + i, green + i, blue + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i divideBy255AVX2(__m256i x) {
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i spreadAlphaAVX2(__m256i pixels) {
+    return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+__attribute__((target("avx2")))
+static void premultiplyBGRAAVX2(uint8_t *pixels, size_t count) {
+    const __m256i zero   = _mm256_setzero_si256();
+    const __m256i colors = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1);
+    const __m256i opaque = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i v  = _mm256_loadu_si256((const __m256i*)(pixels + i*4));
+        __m256i lo = _mm256_unpacklo_epi8(v, zero);
+        __m256i hi = _mm256_unpackhi_epi8(v, zero);
+        lo = divideBy255AVX2(_mm256_mullo_epi16(lo, _mm256_or_si256(_mm256_and_si256(spreadAlphaAVX2(lo), colors), opaque)));
+        hi = divideBy255AVX2(_mm256_mullo_epi16(hi, _mm256_or_si256(_mm256_and_si256(spreadAlphaAVX2(hi), colors), opaque)));
+        _mm256_storeu_si256((__m256i*)(pixels + i*4), _mm256_packus_epi16(lo, hi));
+    }
+    premultiplyBGRASSE2(pixels + i*4, count - i);
+}
+
+__attribute__((target("avx2")))
+static void compositeBGRAAVX2(const uint8_t *src, uint8_t *dst, size_t count) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi16(255);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i s   = _mm256_loadu_si256((const __m256i*)(src + i*4));
+        __m256i d   = _mm256_loadu_si256((const __m256i*)(dst + i*4));
+        __m256i slo = _mm256_unpacklo_epi8(s, zero);
+        __m256i shi = _mm256_unpackhi_epi8(s, zero);
+        __m256i lo  = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(full, spreadAlphaAVX2(slo)));
+        __m256i hi  = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(full, spreadAlphaAVX2(shi)));
+        lo = _mm256_add_epi16(slo, divideBy255AVX2(lo));
+        hi = _mm256_add_epi16(shi, divideBy255AVX2(hi));
+        _mm256_storeu_si256((__m256i*)(dst + i*4), _mm256_packus_epi16(lo, hi));
+    }
+    compositeBGRASSE2(src + i*4, dst + i*4, count - i);
+}
+
+__attribute__((target("avx2")))
+static void cellShadeAVX2(uint8_t *data, size_t length) {
+    const __m256i bias  = _mm256_set1_epi8((char)0x80);
+    const __m256i above = _mm256_set1_epi8((char)(64  ^ 0x80));
+    const __m256i top   = _mm256_set1_epi8((char)(191 ^ 0x80));
+    const __m256i mid   = _mm256_set1_epi8(127);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(data + i)), bias);
+        __m256i r = _mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi8(v, above), mid), _mm256_cmpgt_epi8(v, top));
+        _mm256_storeu_si256((__m256i*)(data + i), r);
+    }
+    cellShadeSSE2(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void grayscaleMasked32AVX2(uint8_t *pixels, size_t count, const PixelFormat &f) {
+    const __m256i byte  = _mm256_set1_epi32(0xFF);
+    const __m256i alpha = _mm256_set1_epi32((int)f.alpha.mask);
+    const __m128i rs    = _mm_cvtsi32_si128(f.red.shift);
+    const __m128i gs    = _mm_cvtsi32_si128(f.green.shift);
+    const __m128i bs    = _mm_cvtsi32_si128(f.blue.shift);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i v[2];
+        __m256i sum[2];
+
+        for (int k = 0; k < 2; k++) {
+            v[k]   = _mm256_loadu_si256((const __m256i*)(pixels + (i + 8*k) * 4));
+            sum[k] = _mm256_add_epi32(_mm256_add_epi32(_mm256_and_si256(_mm256_srl_epi32(v[k], rs), byte),
+                                                       _mm256_and_si256(_mm256_srl_epi32(v[k], gs), byte)),
+                                                       _mm256_and_si256(_mm256_srl_epi32(v[k], bs), byte));
+        }
+
+        // packs/unpack work within 128-bit lanes, so unpacking undoes the pack's interleave
+        __m256i average = divideBy3AVX2(_mm256_packs_epi32(sum[0], sum[1]));
+        __m256i zero    = _mm256_setzero_si256();
+        __m256i a[2]    = {_mm256_unpacklo_epi16(average, zero), _mm256_unpackhi_epi16(average, zero)};
+
+        for (int k = 0; k < 2; k++) {
+            __m256i out = _mm256_or_si256(_mm256_or_si256(_mm256_sll_epi32(a[k], rs), _mm256_sll_epi32(a[k], gs)),
+                                          _mm256_or_si256(_mm256_sll_epi32(a[k], bs), _mm256_and_si256(v[k], alpha)));
+            _mm256_storeu_si256((__m256i*)(pixels + (i + 8*k) * 4), out);
+        }
+    }
+    grayscaleMasked32SSE2(pixels + i * 4, count - i, f);
+}
+
+__attribute__((target("avx2")))
+static void grayscaleBGR24AVX2(uint8_t *pixels, size_t count) {
+    const BGR24Shuffles &s = bgr24_shuffles;
+    __m256i split[3][3];
+    __m256i merge[3];
+    size_t i = 0;
+
+    // Each 128-bit lane runs the SSSE3 algorithm on its own 16 pixels
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 3; v++) split[c][v] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)s.split[c][v]));
+        merge[c] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)s.merge[c]));
+    }
+
+    for (; i + 32 <= count; i += 32) {
+        uint8_t *p = pixels + i * 3;
+        __m256i in[3];
+        __m256i zero = _mm256_setzero_si256();
+        __m256i lo   = zero;
+        __m256i hi   = zero;
+
+        for (int v = 0; v < 3; v++) {
+            in[v] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(p + 16*v))),
+                                            _mm_loadu_si128((const __m128i*)(p + 48 + 16*v)), 1);
+        }
+
+        for (int c = 0; c < 3; c++) {
+            __m256i channel = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(in[0], split[c][0]),
+                                                              _mm256_shuffle_epi8(in[1], split[c][1])),
+                                                              _mm256_shuffle_epi8(in[2], split[c][2]));
+            lo = _mm256_add_epi16(lo, _mm256_unpacklo_epi8(channel, zero));
+            hi = _mm256_add_epi16(hi, _mm256_unpackhi_epi8(channel, zero));
+        }
+
+        __m256i average = _mm256_packus_epi16(divideBy3AVX2(lo), divideBy3AVX2(hi));
+        for (int v = 0; v < 3; v++) {
+            __m256i out = _mm256_shuffle_epi8(average, merge[v]);
+            _mm_storeu_si128((__m128i*)(p + 16*v),      _mm256_castsi256_si128(out));
+            _mm_storeu_si128((__m128i*)(p + 48 + 16*v), _mm256_extracti128_si256(out, 1));
+        }
+    }
+    grayscaleBGR24SSSE3(pixels + i * 3, count - i);
+}
+
+__attribute__((target("avx2")))
+static void convolveRowHorizontalAVX2(const uint8_t *padded, size_t length, size_t step,
+                                      const uint16_t *weights, int taps, int shift, uint16_t *out) {
+    size_t i = 0;
+
+    // 32-bit sums; the unpacks and the pack both work within 128-bit lanes, so the words come back in order
+    for (; shift > 0 && i + 16 <= length; i += 16) {
+        __m256i lo = _mm256_set1_epi32((1 << shift) >> 1);
+        __m256i hi = lo;
+
+        for (int k = 0; k < taps; k++) {
+            __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(padded + i + k*step)));
+            __m256i w = _mm256_set1_epi16((short)weights[k]);
+            __m256i product_lo = _mm256_mullo_epi16(v, w);
+            __m256i product_hi = _mm256_mulhi_epu16(v, w);
+            lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(product_lo, product_hi));
+            hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(product_lo, product_hi));
+        }
+
+        const __m128i count = _mm_cvtsi32_si128(shift);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_packus_epi32(_mm256_srl_epi32(lo, count), _mm256_srl_epi32(hi, count)));
+    }
+    for (; shift == 0 && i + 32 <= length; i += 32) {
+        __m256i lo = _mm256_setzero_si256();
+        __m256i hi = _mm256_setzero_si256();
+
+        for (int k = 0; k < taps; k++) {
+            const uint8_t *p = padded + i + k*step;
+            __m256i w = _mm256_set1_epi16((short)weights[k]);
+            lo = _mm256_add_epi16(lo, _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p)),        w));
+            hi = _mm256_add_epi16(hi, _mm256_mullo_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(p + 16))), w));
+        }
+        _mm256_storeu_si256((__m256i*)(out + i),      lo);
+        _mm256_storeu_si256((__m256i*)(out + i + 16), hi);
+    }
+    convolveRowHorizontalSSE2(padded + i, length - i, step, weights, taps, shift, out + i);
+}
+
+__attribute__((target("avx2")))
+static void convolveRowsVerticalAVX2(const uint16_t *const *rows, size_t length, const uint16_t *weights,
+                                     int taps, uint32_t bias, int shift, uint8_t *out) {
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m256i lo = _mm256_set1_epi32((int)bias);
+        __m256i hi = lo;
+
+        for (int k = 0; k < taps; k++) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(rows[k] + i));
+            __m256i w = _mm256_set1_epi16((short)weights[k]);
+            __m256i product_lo = _mm256_mullo_epi16(v, w);
+            __m256i product_hi = _mm256_mulhi_epu16(v, w);
+            lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(product_lo, product_hi));
+            hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(product_lo, product_hi));
+        }
+
+        // The unpacks and packs both work within 128-bit lanes, so the words come back in order;
+        // the final pack leaves 8 bytes per lane, which the permute brings together
+        __m256i result = _mm256_packs_epi32(_mm256_srl_epi32(lo, count), _mm256_srl_epi32(hi, count));
+        result = _mm256_permute4x64_epi64(_mm256_packus_epi16(result, result), 0x08);
+        _mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(result));
+    }
+    convolveRowsVerticalSSE2(rows, i, length, weights, taps, bias, shift, out);
+}
+
+__attribute__((target("avx2")))
+static void resampleRowsVerticalAVX2(const int16_t *const *rows, const int16_t *weights, int taps,
+                                     size_t length, uint8_t *out) {
+    const __m256i round = _mm256_set1_epi32(1 << 19);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m256i lo = round;
+        __m256i hi = round;
+
+        for (int k = 0; k < taps; k += 2) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(rows[k]     + i));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(rows[k + 1] + i));
+            __m256i w = _mm256_set1_epi32((int)(((uint32_t)(uint16_t)weights[k + 1] << 16) | (uint16_t)weights[k]));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+
+        // The unpacks and packs all work within 128-bit lanes, so the bytes come out in order
+        // in the low half of each lane, and the permute gathers the two halves
+        __m256i result = _mm256_packs_epi32(_mm256_srai_epi32(lo, 20), _mm256_srai_epi32(hi, 20));
+        result = _mm256_permute4x64_epi64(_mm256_packus_epi16(result, result), 0x08);
+        _mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(result));
+    }
+    resampleRowsVerticalSSE2(rows, weights, taps, i, length, out);
+}
+
+#endif
+
+/////////////////////////////////
+// Dispatch
+/////////////////////////////////
+
+void cellShadeBytes(uint8_t *data, size_t length, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::AVX2) return cellShadeAVX2(data, length);
+    if (level >= SimdLevel::SSE2) return cellShadeSSE2(data, length);
+#endif
+    cellShadeScalar(data, length);
+}
+
+void grayscaleBGR24(uint8_t *pixels, size_t count, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::AVX2)  return grayscaleBGR24AVX2(pixels, count);
+    if (level >= SimdLevel::SSSE3) return grayscaleBGR24SSSE3(pixels, count);
+#endif
+    grayscaleBGR24Scalar(pixels, count);  // SSE2 has no byte shuffle to split the channels
+}
+
+bool grayscaleMasked32(uint8_t *pixels, size_t count, const PixelFormat &format, SimdLevel level) {
+    // Only 8-bit color channels (and an 8-bit alpha or none), with no bits shared between channels
+    if (format.red.width != 8 || format.green.width != 8 || format.blue.width != 8 ||
+        (format.alpha.width != 0 && format.alpha.width != 8) ||
+        (format.red.mask & format.green.mask) || (format.red.mask & format.blue.mask) || (format.green.mask & format.blue.mask) ||
+        ((format.red.mask | format.green.mask | format.blue.mask) & format.alpha.mask)) {
+        return false;
+    }
+
+#if BITMAP_X86
+    if (level >= SimdLevel::AVX2) { grayscaleMasked32AVX2(pixels, count, format); return true; }
+    if (level >= SimdLevel::SSE2) { grayscaleMasked32SSE2(pixels, count, format); return true; }
+#endif
+    grayscaleMasked32Scalar(pixels, count, format);
+    return true;
+}
+
+void convolveRowHorizontal(const uint8_t *padded, size_t length, size_t step,
+                           const uint16_t *weights, int taps, int shift, uint16_t *out, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::AVX2) return convolveRowHorizontalAVX2(padded, length, step, weights, taps, shift, out);
+    if (level >= SimdLevel::SSE2) return convolveRowHorizontalSSE2(padded, length, step, weights, taps, shift, out);
+#endif
+    convolveRowHorizontalScalar(padded, length, step, weights, taps, shift, out);
+}
+
+void convolveRowsVertical(const uint16_t *const *rows, size_t length, const uint16_t *weights, int taps,
+                          uint32_t bias, int shift, uint8_t *out, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::AVX2) return convolveRowsVerticalAVX2(rows, length, weights, taps, bias, shift, out);
+    if (level >= SimdLevel::SSE2) return convolveRowsVerticalSSE2(rows, 0, length, weights, taps, bias, shift, out);
+#endif
+    convolveRowsVerticalScalar(rows, 0, length, weights, taps, bias, shift, out);
+}
+
+void resampleRowHorizontal(const uint8_t *row, const int *first, const int16_t *weights, int taps, int width,
+                           int16_t *out, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::SSE2) return resampleRowHorizontalSSE2(row, first, weights, taps, width, out);
+#endif
+    resampleRowHorizontalScalar(row, first, weights, taps, 0, width, out);
+}
+
+void resampleRowsVertical(const int16_t *const *rows, const int16_t *weights, int taps, size_t length,
+                          uint8_t *out, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::AVX2) return resampleRowsVerticalAVX2(rows, weights, taps, length, out);
+    if (level >= SimdLevel::SSE2) return resampleRowsVerticalSSE2(rows, weights, taps, 0, length, out);
+#endif
+    resampleRowsVerticalScalar(rows, weights, taps, 0, length, out);
+}
+
+void expandBGR24(const uint8_t *pixels, size_t count, uint8_t *out, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::SSSE3) return expandBGR24SSSE3(pixels, count, out);
+#endif
+    expandBGR24Scalar(pixels, count, out);
+}
+
+void compressBGR24(const uint8_t *pixels, size_t count, uint8_t *out, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::SSSE3) return compressBGR24SSSE3(pixels, count, out);
+#endif
+    compressBGR24Scalar(pixels, count, out);
+}
+
+void splitPixels(const uint8_t *pixels, size_t count, int bytes, uint8_t *const *planes, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::SSSE3) return splitPixelsSSSE3(pixels, count, bytes, planes);
+#endif
+    splitPixelsScalar(pixels, 0, count, bytes, planes);
+}
+
+void mergePixels(const uint8_t *const *planes, size_t count, int bytes, uint8_t *pixels, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::SSSE3) return mergePixelsSSSE3(planes, count, bytes, pixels);
+#endif
+    mergePixelsScalar(planes, 0, count, bytes, pixels);
+}
+
+void averagePlanes(uint8_t *red, uint8_t *green, uint8_t *blue, size_t count, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::AVX2) return averagePlanesAVX2(red, green, blue, count);
+    if (level >= SimdLevel::SSE2) return averagePlanesSSE2(red, green, blue, count);
+#endif
+    averagePlanesScalar(red, green, blue, 0, count);
+}
+
+void premultiplyBGRA(uint8_t *pixels, size_t count, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::AVX2) return premultiplyBGRAAVX2(pixels, count);
+    if (level >= SimdLevel::SSE2) return premultiplyBGRASSE2(pixels, count);
+#endif
+    premultiplyBGRAScalar(pixels, 0, count);
+}
+
+void unpremultiplyBGRA(uint8_t *pixels, size_t count, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::SSE2) return unpremultiplyBGRASSE2(pixels, count);
+#endif
+    unpremultiplyBGRAScalar(pixels, 0, count);
+}
+
+void compositeBGRA(const uint8_t *src, uint8_t *dst, size_t count, SimdLevel level) {
+#if BITMAP_X86
+    if (level >= SimdLevel::AVX2) return compositeBGRAAVX2(src, dst, count);
+    if (level >= SimdLevel::SSE2) return compositeBGRASSE2(src, dst, count);
+#endif
+    compositeBGRAScalar(src, dst, 0, count);
+}
+
+void transposeTile(const TransposeJob &job, int tx, int ty, int tile_width, int tile_height, SimdLevel level) {
+#if BITMAP_X86
+    if (job.bytes == 4 && level >= SimdLevel::SSE2)  return transposeTileSSE2(job, tx, ty, tile_width, tile_height);
+    if (job.bytes == 3 && level >= SimdLevel::SSSE3) return transposeTileSSSE3(job, tx, ty, tile_width, tile_height);
+#endif
+    for (int y = ty; y < ty + tile_height; y++) {
+        for (int x = tx; x < tx + tile_width; x++) {
+            transposePixel(job, x, y);
+        }
+    }
+}
@@ -0,0 +1,151 @@
+// Author:  Charles Lucas
+// CS510
+//
+// SIMD kernels for the point-wise filters, the blur and resampling row
+// passes and the rotation transposes, with the instruction set picked at
+// runtime from the CPU features.  Every kernel has a scalar version that
+// produces exactly the same bytes.
+
+#ifndef BITMAP_SIMD_H
+#define BITMAP_SIMD_H
+
+#include <cstdint>
+#include <cstddef>
+#include "bitmap.h"
+
+/**
+ * Instruction set levels, in increasing order of capability.
+ */
+enum class SimdLevel
+{
+    Scalar = 0,
+    SSE2   = 1,
+    SSSE3  = 2,
+    AVX2   = 3
+};
+
+/**
+ * The best level this CPU supports (detected once).
+ */
+SimdLevel detectSimdLevel();
+
+/**
+ * The level the filters currently use.  Defaults to detectSimdLevel();
+ * setSimdLevel() caps it (to compare against the scalar path, or to work
+ * around a bad CPU), and never raises it above what the CPU supports.
+ */
+SimdLevel getSimdLevel();
+void      setSimdLevel(SimdLevel level);
+const char* simdLevelName(SimdLevel level);
+
+/**
+ * Round every byte to 0, 127 or 255, the way cellShade() does.
+ */
+void cellShadeBytes(uint8_t *data, size_t length, SimdLevel level);
+
+/**
+ * Grayscale a run of 24-bit BGR pixels.
+ */
+void grayscaleBGR24(uint8_t *pixels, size_t count, SimdLevel level);
+
+/**
+ * Grayscale a run of 32-bit pixels whose red, green and blue masks are 8 bits wide.
+ * The alpha bits are kept and any bits outside the masks are cleared.
+ *
+ * @return false (and does nothing) if the format isn't one the SIMD kernels handle.
+ */
+bool grayscaleMasked32(uint8_t *pixels, size_t count, const PixelFormat &format, SimdLevel level);
+
+/**
+ * One horizontal pass of a separable blur over an edge-padded row of channel bytes:
+ *     out[i] = (round + sum of weights[k] * padded[i + k*step]) >> shift   for i < length
+ * where round is half of 1 << shift.  Each result has to fit in 16 bits, so
+ * the weights add up to at most 256 << shift (and at most 1 << 15).  With a
+ * shift of 0 the sums are kept in 16 bits, which is twice as fast.
+ */
+void convolveRowHorizontal(const uint8_t *padded, size_t length, size_t step,
+                           const uint16_t *weights, int taps, int shift, uint16_t *out, SimdLevel level);
+
+/**
+ * One vertical pass of a separable blur over taps rows of horizontal sums:
+ *     out[i] = (bias + sum of weights[k] * rows[k][i]) >> shift   for i < length
+ * The result has to fit in a byte.
+ */
+void convolveRowsVertical(const uint16_t *const *rows, size_t length, const uint16_t *weights, int taps,
+                          uint32_t bias, int shift, uint8_t *out, SimdLevel level);
+
+/**
+ * One horizontal pass of a resize over a row of 4-channel pixels (4 bytes each):
+ *     out[x*4 + c] = (128 + sum of weights[x*taps + k] * row[(first[x] + k)*4 + c]) >> 8   for x < width
+ * saturated to 16 bits.  The weights are 14-bit fixed point, so the output
+ * keeps 6 bits of fraction.  taps has to be even, and every pixel the
+ * windows reach has to be in row.
+ */
+void resampleRowHorizontal(const uint8_t *row, const int *first, const int16_t *weights, int taps, int width,
+                           int16_t *out, SimdLevel level);
+
+/**
+ * One vertical pass of a resize over taps rows of horizontal pass output:
+ *     out[i] = (2^19 + sum of weights[k] * rows[k][i]) >> 20   for i < length
+ * clamped to 0..255.  taps has to be even.
+ */
+void resampleRowsVertical(const int16_t *const *rows, const int16_t *weights, int taps, size_t length,
+                          uint8_t *out, SimdLevel level);
+
+/**
+ * Spread 24-bit BGR pixels out to 4 bytes each (with a 0 fourth byte), and pack them back.
+ */
+void expandBGR24(const uint8_t *pixels, size_t count, uint8_t *out, SimdLevel level);
+void compressBGR24(const uint8_t *pixels, size_t count, uint8_t *out, SimdLevel level);
+
+/**
+ * Split count pixels of bytes (3 or 4) bytes into one plane per byte, and merge them back.
+ */
+void splitPixels(const uint8_t *pixels, size_t count, int bytes, uint8_t *const *planes, SimdLevel level);
+void mergePixels(const uint8_t *const *planes, size_t count, int bytes, uint8_t *pixels, SimdLevel level);
+
+/**
+ * Set each byte of three planes to the average of the three, the way grayscale() does.
+ */
+void averagePlanes(uint8_t *red, uint8_t *green, uint8_t *blue, size_t count, SimdLevel level);
+
+/**
+ * Multiply the blue, green and red of 4-byte BGRA pixels by alpha/255
+ * (rounded), and divide them back out (rounded and clamped to 255; pixels
+ * with 0 alpha come out black).  Alpha is left as it is.
+ */
+void premultiplyBGRA(uint8_t *pixels, size_t count, SimdLevel level);
+void unpremultiplyBGRA(uint8_t *pixels, size_t count, SimdLevel level);
+
+/**
+ * Lay premultiplied BGRA pixels over others ("over"), for every channel alpha included:
+ *     dst = src + dst * (255 - src alpha) / 255   (rounded, clamped to 255)
+ */
+void compositeBGRA(const uint8_t *src, uint8_t *dst, size_t count, SimdLevel level);
+
+/**
+ * TransposeJob - a rotate or diagonal flip, which turns source columns into target rows.
+ * Target pixel (tx, ty) is source pixel
+ *     (flip_x ? width-1-ty : ty,  flip_y ? height-1-tx : tx)
+ * where width and height are the source dimensions (so the target is height x width).
+ * Pixels are copied whole; 32-bit pixels are ANDed with keep.
+ */
+struct TransposeJob
+{
+    const uint8_t *source;
+    uint8_t       *target;
+    int            width;     // Source width in pixels
+    int            height;    // Source height in pixels
+    int            bytes;     // Bytes per pixel (3 or 4)
+    bool           flip_x;
+    bool           flip_y;
+    uint32_t       keep;      // Bits of a 32-bit pixel that belong to a channel
+};
+
+/**
+ * Fill the tile_width x tile_height block of target pixels at (tx, ty).
+ * 4x4 blocks of pixels are transposed in registers where the level allows.
+ */
+void transposeTile(const TransposeJob &job, int tx, int ty, int tile_width, int tile_height, SimdLevel level);
+
+#endif
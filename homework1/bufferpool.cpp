@@ -0,0 +1,99 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include "bufferpool.h"
+
+/**
+ * BufferPool - the free buffers of each size class.
+ */
+struct BufferPool
+{
+    std::mutex                               lock;
+    std::map<size_t, std::vector<void*>>     free;    // Size class -> buffers ready to hand out
+    BufferPoolStats                          stats;
+};
+
+// Never destroyed, so vectors freed during static destruction still have somewhere to go
+static BufferPool& pool() {
+    static BufferPool *instance = new BufferPool;
+    return *instance;
+}
+
+// Powers of two up to a huge page, then whole huge pages
+static size_t sizeClass(size_t bytes) {
+    if (bytes >= HUGE_PAGE_BYTES) {
+        return (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+    }
+    size_t size = BUFFER_ALIGNMENT;
+    while (size < bytes) size *= 2;
+    return size;
+}
+
+void* acquireBuffer(size_t bytes) {
+    BufferPool& p    = pool();
+    size_t      size = sizeClass(bytes);
+
+    {
+        std::lock_guard<std::mutex> guard(p.lock);
+        auto free = p.free.find(size);
+        if (free != p.free.end() && !free->second.empty()) {
+            void *buffer = free->second.back();
+            free->second.pop_back();
+            p.stats.pooled -= size;
+            p.stats.reuses++;
+            return buffer;
+        }
+        p.stats.allocations++;
+    }
+
+    void *buffer = nullptr;
+    if (posix_memalign(&buffer, size >= HUGE_PAGE_BYTES ? HUGE_PAGE_BYTES : BUFFER_ALIGNMENT, size) != 0) {
+        throw std::bad_alloc();
+    }
+    if (size >= HUGE_PAGE_BYTES) {
+        madvise(buffer, size, MADV_HUGEPAGE);   // Fault big buffers in 2 MB at a time
+    }
+    return buffer;
+}
+
+void releaseBuffer(void *buffer, size_t bytes) {
+    BufferPool& p    = pool();
+    size_t      size = sizeClass(bytes);
+
+    if (!buffer) return;
+    {
+        std::lock_guard<std::mutex> guard(p.lock);
+        if (p.stats.pooled + size <= BUFFER_POOL_BYTES) {
+            p.free[size].push_back(buffer);
+            p.stats.pooled += size;
+            return;
+        }
+    }
+    ::free(buffer);
+}
+
+BufferPoolStats getBufferPoolStats() {
+    std::lock_guard<std::mutex> guard(pool().lock);
+    return pool().stats;
+}
+
+void trimBufferPool() {
+    BufferPool&        p = pool();
+    std::vector<void*> buffers;
+
+    {
+        std::lock_guard<std::mutex> guard(p.lock);
+        for (auto& free : p.free) {
+            buffers.insert(buffers.end(), free.second.begin(), free.second.end());
+        }
+        p.free.clear();
+        p.stats.pooled = 0;
+    }
+    for (void *buffer : buffers) {
+        ::free(buffer);
+    }
+}
@@ -0,0 +1,86 @@
+// Author:  Charles Lucas
+// CS510
+//
+// A pool of aligned buffers for pixel data, kept in size classes.  Freed
+// buffers go back to the pool instead of the system, so a batch that keeps
+// loading and filtering images of the same size stops allocating (and
+// faulting in fresh pages) once it has warmed up.
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+#define BUFFER_ALIGNMENT 64                 // Every buffer starts on a cache line
+#define HUGE_PAGE_BYTES  (2 * 1024 * 1024)  // Buffers this big are aligned to, and rounded up to, huge pages
+
+#ifndef BUFFER_POOL_BYTES
+#define BUFFER_POOL_BYTES (1024ull * 1024 * 1024)  // Most the pool holds on to; buffers freed past this go back to the system
+#endif
+
+/**
+ * Get a buffer of at least bytes bytes, aligned to BUFFER_ALIGNMENT, from
+ * the pool if it has one of the right size class.  Its contents are
+ * whatever was left in it.
+ *
+ * @throws bad_alloc if the system is out of memory.
+ */
+void* acquireBuffer(size_t bytes);
+
+/**
+ * Give a buffer back to the pool.  bytes has to be the size it was acquired with.
+ */
+void  releaseBuffer(void *buffer, size_t bytes);
+
+/**
+ * BufferPoolStats - what the pool has done so far.
+ */
+struct BufferPoolStats
+{
+    size_t allocations = 0;   // Buffers that had to come from the system
+    size_t reuses      = 0;   // Buffers handed out again from the pool
+    size_t pooled      = 0;   // Bytes sitting in the pool right now
+};
+
+BufferPoolStats getBufferPoolStats();
+
+/**
+ * Give every pooled buffer back to the system.
+ */
+void trimBufferPool();
+
+/**
+ * PoolAllocator - a std::vector allocator that takes its memory from the pool.
+ * Elements are default-initialized, so resizing a vector of bytes leaves the
+ * new bytes as they are instead of clearing them (everything that resizes
+ * pixel data writes every byte right after).
+ */
+template <typename T>
+struct PoolAllocator
+{
+    typedef T value_type;
+
+    PoolAllocator() = default;
+    template <typename U> PoolAllocator(const PoolAllocator<U>&) {}
+
+    T*   allocate(size_t count)             { return (T*)acquireBuffer(count * sizeof(T)); }
+    void deallocate(T *buffer, size_t count) { releaseBuffer(buffer, count * sizeof(T)); }
+
+    template <typename U, typename... Args>
+    void construct(U *p, Args&&... args) { ::new((void*)p) U(std::forward<Args>(args)...); }
+    template <typename U>
+    void construct(U *p) { ::new((void*)p) U; }
+
+    template <typename U> bool operator==(const PoolAllocator<U>&) const { return true; }
+    template <typename U> bool operator!=(const PoolAllocator<U>&) const { return false; }
+};
+
+template <typename T>
+using PooledVector = std::vector<T, PoolAllocator<T>>;
+
+typedef PooledVector<char> PixelBuffer;   // Pixel data
+
+#endif
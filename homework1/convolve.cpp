@@ -0,0 +1,160 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include "convolve.h"
+#include "pixelformat.h"
+#include "threadpool.h"
+
+// The pixel (or row) i stands for, for i up to a kernel radius past either end of 0..n-1
+static int borderIndex(int i, int n, Border border) {
+    if (border == Border::Clamp) {
+        return std::min(std::max(i, 0), n - 1);
+    }
+    if (n == 1) {
+        return 0;
+    }
+
+    // Reflections repeat every 2(n-1), so kernels wider than the image keep bouncing between the edges
+    int period = 2 * (n - 1);
+    i %= period;
+    if (i < 0) i += period;
+    return i < n ? i : period - i;
+}
+
+/**
+ * Each band keeps the size source rows around the current output row in a
+ * ring, unpacked to channel bytes with radius pixels made up on either side,
+ * so every tap of a row is a plain offset into the ring.  Rows are numbered
+ * as if the image went on past its edges, and rows past the edges are read
+ * from the row borderIndex() picks.  The output goes to scratch, so bands
+ * never see each other's results.
+ */
+void convolveImage(Bitmap& b, int size, Border border, ConvolveRow row, const void *context) {
+    int    radius   = size / 2;
+    int    width    = b.width_in_pixels;
+    int    height   = b.height_in_pixels;
+    int    channels = b.premultiplied ? 4 : 3;          // Premultiplied alpha is convolved along with the colors
+    size_t length   = (size_t)width * channels;         // Channel bytes per row
+    size_t padded   = (size_t)(width + 2*radius) * channels;
+
+    b.scratch.resize(b.data.size());
+
+    withPixelFormat(b, [&](auto format) {
+        typedef decltype(format) Format;
+
+        parallelRows(height, [&](int first, int last) {
+            PooledVector<uint8_t>       ring(size * padded);
+            std::vector<uint8_t>        result(length);
+            std::vector<const uint8_t*> taps((size_t)size * size);
+            auto                        slot = [&](int y) { return ring.data() + ((y % size + size) % size) * padded; };
+
+            for (int next = first - radius, y = first; y < last; y++) {
+                // Bring the ring up to date with every source row the output row needs
+                for (; next <= y + radius; next++) {
+                    uint8_t       *target = slot(next);
+                    const uint8_t *source = (const uint8_t*)b.row(borderIndex(next, height, border));
+
+                    if (channels == 4) unpackPixels(source, width, target + radius*4, format);
+                    else               unpackChannels(source, width, target + radius*3, format);
+                    for (int i = 1; i <= radius; i++) {
+                        memcpy(target + (radius - i)*channels,
+                               target + (radius + borderIndex(-i, width, border))*channels, channels);
+                        memcpy(target + (radius + width - 1 + i)*channels,
+                               target + (radius + borderIndex(width - 1 + i, width, border))*channels, channels);
+                    }
+                }
+
+                // Kernel row ky (from the top) lies over stored row y + radius - ky, since rows are stored bottom up
+                for (int ky = 0; ky < size; ky++) {
+                    for (int kx = 0; kx < size; kx++) {
+                        taps[ky*size + kx] = slot(y + radius - ky) + kx*channels;
+                    }
+                }
+                row(taps.data(), length, result.data(), context);
+
+                uint8_t *target = (uint8_t*)b.scratch.data() + (size_t)y * width * Format::bytes;
+                if (channels == 4) {
+                    packPixels(result.data(), width, target, format);
+                }
+                else {
+                    if (Format::bytes == 4) memcpy(target, b.row(y), (size_t)width * 4);   // Keeps each pixel's alpha
+                    packChannels(result.data(), width, target, format);
+                }
+            }
+        });
+    });
+
+    b.data.swap(b.scratch);
+}
+
+// The generic row loop, for kernels only known at runtime
+static void kernelRow(const uint8_t *const *taps, size_t length, uint8_t *out, const void *context) {
+    const ConvolutionKernel& kernel = *(const ConvolutionKernel*)context;
+    size_t                   count  = (size_t)kernel.size * kernel.size;
+
+    for (size_t i = 0; i < length; i++) {
+        int sum = 0;
+        for (size_t t = 0; t < count; t++) {
+            sum += kernel.weights[t] * taps[t][i];
+        }
+        sum = (sum + kernel.bias * kernel.divisor + kernel.divisor / 2) / kernel.divisor;
+        out[i] = (uint8_t)std::min(std::max(sum, 0), 255);
+    }
+}
+
+void convolve(Bitmap& b, const ConvolutionKernel& kernel, Border border) {
+    if (kernel.size < 1 || kernel.size % 2 == 0 || kernel.size > MAX_KERNEL_SIZE ||
+        kernel.weights.size() != (size_t)kernel.size * kernel.size) {
+        throw(BitmapException("Error - convolution kernels have to be an odd size up to " + std::to_string(MAX_KERNEL_SIZE) +
+                              ", with a weight for every tap", 0));
+    }
+    for (int weight : kernel.weights) {
+        if (weight < -MAX_KERNEL_WEIGHT || weight > MAX_KERNEL_WEIGHT) {
+            throw(BitmapException("Error - convolution weights have to be within " + std::to_string(MAX_KERNEL_WEIGHT) + " of 0", 0));
+        }
+    }
+    if (kernel.divisor < 1 || kernel.divisor > MAX_KERNEL_DIVISOR) {
+        throw(BitmapException("Error - convolution kernels have to have a divisor of 1 to " + std::to_string(MAX_KERNEL_DIVISOR), 0));
+    }
+
+    convolveImage(b, kernel.size, border, kernelRow, &kernel);
+}
+
+void sharpen(Bitmap& b, Border border) {
+    std::cout << "Applying sharpen transform." << std::endl;
+
+    convolve<SharpenKernel>(b, border);
+}
+
+void emboss(Bitmap& b, Border border) {
+    std::cout << "Applying emboss transform." << std::endl;
+
+    convolve<EmbossKernel>(b, border);
+}
+
+void edgeDetect(Bitmap& b, Border border) {
+    std::cout << "Applying edge detection transform." << std::endl;
+
+    convolveGradient<SobelXKernel, SobelYKernel>(b, border);
+}
+
+void boxBlur(Bitmap& b, int size, Border border) {
+    std::cout << "Applying box blur transform (" << size << "x" << size << ")." << std::endl;
+
+    if (size == 3) {
+        convolve<BoxKernel<3>>(b, border);
+    }
+    else if (size == 5) {
+        convolve<BoxKernel<5>>(b, border);
+    }
+    else {
+        size_t taps = (size_t)std::max(size, 0) * std::max(size, 0);
+        if (size > MAX_KERNEL_SIZE) {
+            throw(BitmapException("Error - box blurs go up to " + std::to_string(MAX_KERNEL_SIZE) + "x" + std::to_string(MAX_KERNEL_SIZE), 0));
+        }
+        convolve(b, ConvolutionKernel{size, std::vector<int>(taps, 1), (int)taps, 0}, border);
+    }
+}
@@ -0,0 +1,257 @@
+// Author:  Charles Lucas
+// CS510
+//
+// Square convolution kernels.  A kernel known at compile time is a type
+// with constexpr weights, so each filter gets its own row loop with the
+// weights folded in (zero taps dropped, multiplies by 1 turned into adds)
+// that the compiler vectorizes for each SIMD level.  Kernels read at
+// runtime go through one generic row loop instead.
+
+#ifndef CONVOLVE_H
+#define CONVOLVE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <array>
+#include <type_traits>
+#include "bitmap.h"
+#include "bitmap_simd.h"
+
+#define MAX_KERNEL_SIZE   31     // Widest runtime kernel (box or -kernel:) taken; each output byte costs size * size taps
+#define MAX_KERNEL_WEIGHT 4096   // Largest runtime kernel weight (either sign), so 31 * 31 of them times 255 fit in an int
+#define MAX_KERNEL_DIVISOR (MAX_KERNEL_SIZE * MAX_KERNEL_SIZE * MAX_KERNEL_WEIGHT)
+
+/**
+ * How pixels past the edges of the image are made up.
+ */
+enum class Border
+{
+    Clamp,    // Repeat the edge pixel
+    Mirror    // Reflect about the edge pixel (-1 reads 1, -2 reads 2, ...)
+};
+
+/**
+ * ConvolutionKernel - a size x size kernel given at runtime.
+ * Each channel comes out as
+ *     (sum of weights * pixels) / divisor + bias
+ * rounded and clamped to 0..255, with the weights row by row from the top
+ * left, as the kernel looks laid over the image.
+ */
+struct ConvolutionKernel
+{
+    int              size;       // Odd
+    std::vector<int> weights;    // size * size
+    int              divisor;    // Positive
+    int              bias;
+};
+
+/**
+ * The kernels that ship with the filters.  A compile-time kernel is any type
+ * with the same four members as ConvolutionKernel, static and constexpr.
+ */
+struct SharpenKernel
+{
+    static constexpr int size = 3;
+    static constexpr int weights[9] = { 0, -1,  0,
+                                       -1,  5, -1,
+                                        0, -1,  0};
+    static constexpr int divisor = 1;
+    static constexpr int bias    = 0;
+};
+
+struct EmbossKernel
+{
+    static constexpr int size = 3;
+    static constexpr int weights[9] = {-2, -1,  0,
+                                       -1,  1,  1,
+                                        0,  1,  2};
+    static constexpr int divisor = 1;
+    static constexpr int bias    = 0;
+};
+
+struct SobelXKernel
+{
+    static constexpr int size = 3;
+    static constexpr int weights[9] = {-1,  0,  1,
+                                       -2,  0,  2,
+                                       -1,  0,  1};
+    static constexpr int divisor = 1;
+    static constexpr int bias    = 0;
+};
+
+struct SobelYKernel
+{
+    static constexpr int size = 3;
+    static constexpr int weights[9] = {-1, -2, -1,
+                                        0,  0,  0,
+                                        1,  2,  1};
+    static constexpr int divisor = 1;
+    static constexpr int bias    = 0;
+};
+
+template<int Size>
+struct BoxKernel
+{
+    static constexpr int size = Size;
+    static constexpr std::array<int, Size * Size> weights = [] {
+        std::array<int, Size * Size> ones{};
+        for (int& weight : ones) weight = 1;
+        return ones;
+    }();
+    static constexpr int divisor = Size * Size;
+    static constexpr int bias    = 0;
+};
+
+/**
+ * ConvolveRow - one output row: out[i] for i < length from the size * size
+ * taps, where taps[ky*size + kx] points at the channel byte kernel weight
+ * (kx, ky) multiplies for out[0].  context is the kernel for runtime kernels.
+ */
+typedef void (*ConvolveRow)(const uint8_t *const *taps, size_t length, uint8_t *out, const void *context);
+
+/**
+ * Run a size x size convolution over every color channel of a loaded image,
+ * in bands of rows across the thread pool.  Premultiplied images have their
+ * alpha convolved too.
+ */
+void convolveImage(Bitmap& b, int size, Border border, ConvolveRow row, const void *context);
+
+/**
+ * The largest value |sum of weights * pixels| + |bias * divisor| + divisor
+ * can reach, which picks the width of the sums.
+ */
+template<typename Kernel>
+constexpr int kernelRange() {
+    int total = 0;
+    for (int t = 0; t < Kernel::size * Kernel::size; t++) {
+        total += Kernel::weights[t] < 0 ? -Kernel::weights[t] : Kernel::weights[t];
+    }
+    return total * 255 + (Kernel::bias < 0 ? -Kernel::bias : Kernel::bias) * Kernel::divisor + Kernel::divisor;
+}
+
+// Sums fit in 16 bits for most kernels, which doubles the pixels per vector
+template<typename Kernel>
+using KernelSum = typename std::conditional<(kernelRange<Kernel>() <= 32767), int16_t, int32_t>::type;
+
+template<typename Kernel>
+inline __attribute__((always_inline)) KernelSum<Kernel> kernelSum(const uint8_t *const *taps, size_t i) {
+    KernelSum<Kernel> sum = 0;
+
+#pragma GCC unroll 128
+    for (int t = 0; t < Kernel::size * Kernel::size; t++) {
+        if (Kernel::weights[t] != 0) sum += (KernelSum<Kernel>)(Kernel::weights[t] * taps[t][i]);
+    }
+    return sum;
+}
+
+// Divide by the divisor rounding to nearest, add the bias, and clamp.  Sums too
+// negative for the truncating division to round right come out below 0 either way
+template<typename Kernel>
+inline __attribute__((always_inline)) uint8_t kernelResult(KernelSum<Kernel> sum) {
+    if (Kernel::divisor != 1 || Kernel::bias != 0) {
+        sum = (sum + Kernel::bias * Kernel::divisor + Kernel::divisor / 2) / Kernel::divisor;
+    }
+    return (uint8_t)(sum < 0 ? 0 : sum > 255 ? 255 : sum);
+}
+
+template<typename Kernel>
+inline __attribute__((always_inline)) void filterRowBody(const uint8_t *const *taps, size_t length, uint8_t *__restrict out) {
+    for (size_t i = 0; i < length; i++) {
+        out[i] = kernelResult<Kernel>(kernelSum<Kernel>(taps, i));
+    }
+}
+
+// The gradient magnitude of two kernels, as |x| + |y|
+template<typename KernelX, typename KernelY>
+inline __attribute__((always_inline)) void gradientRowBody(const uint8_t *const *taps, size_t length, uint8_t *__restrict out) {
+    static_assert(KernelX::size == KernelY::size, "gradient kernels have to be the same size");
+
+    for (size_t i = 0; i < length; i++) {
+        int x = kernelSum<KernelX>(taps, i);
+        int y = kernelSum<KernelY>(taps, i);
+        int magnitude = ((x < 0 ? -x : x) + (y < 0 ? -y : y)) / KernelX::divisor;
+        out[i] = (uint8_t)(magnitude > 255 ? 255 : magnitude);
+    }
+}
+
+// Each row loop is compiled three ways: plain, vectorized for SSE2, and vectorized for AVX2.
+// They do the same integer arithmetic, so all three give the same bytes
+template<typename Kernel>
+__attribute__((optimize("no-tree-vectorize")))
+void filterRowScalar(const uint8_t *const *taps, size_t length, uint8_t *out, const void *) {
+    filterRowBody<Kernel>(taps, length, out);
+}
+template<typename Kernel>
+__attribute__((optimize("tree-vectorize", "vect-cost-model=dynamic")))
+void filterRowSSE2(const uint8_t *const *taps, size_t length, uint8_t *out, const void *) {
+    filterRowBody<Kernel>(taps, length, out);
+}
+template<typename Kernel>
+__attribute__((target("avx2"), optimize("tree-vectorize", "vect-cost-model=dynamic")))
+void filterRowAVX2(const uint8_t *const *taps, size_t length, uint8_t *out, const void *) {
+    filterRowBody<Kernel>(taps, length, out);
+}
+
+template<typename KernelX, typename KernelY>
+__attribute__((optimize("no-tree-vectorize")))
+void gradientRowScalar(const uint8_t *const *taps, size_t length, uint8_t *out, const void *) {
+    gradientRowBody<KernelX, KernelY>(taps, length, out);
+}
+template<typename KernelX, typename KernelY>
+__attribute__((optimize("tree-vectorize", "vect-cost-model=dynamic")))
+void gradientRowSSE2(const uint8_t *const *taps, size_t length, uint8_t *out, const void *) {
+    gradientRowBody<KernelX, KernelY>(taps, length, out);
+}
+template<typename KernelX, typename KernelY>
+__attribute__((target("avx2"), optimize("tree-vectorize", "vect-cost-model=dynamic")))
+void gradientRowAVX2(const uint8_t *const *taps, size_t length, uint8_t *out, const void *) {
+    gradientRowBody<KernelX, KernelY>(taps, length, out);
+}
+
+inline ConvolveRow pickRow(ConvolveRow scalar, ConvolveRow sse2, ConvolveRow avx2) {
+    SimdLevel level = getSimdLevel();
+    return level >= SimdLevel::AVX2 ? avx2 : level >= SimdLevel::SSE2 ? sse2 : scalar;
+}
+
+/**
+ * Convolve a loaded image with a compile-time kernel.
+ */
+template<typename Kernel>
+void convolve(Bitmap& b, Border border = Border::Clamp) {
+    static_assert(Kernel::size % 2 == 1 && Kernel::divisor > 0, "kernels have an odd size and a positive divisor");
+
+    convolveImage(b, Kernel::size, border,
+                  pickRow(filterRowScalar<Kernel>, filterRowSSE2<Kernel>, filterRowAVX2<Kernel>), nullptr);
+}
+
+/**
+ * Replace each channel with the gradient magnitude |x| + |y| / divisor of
+ * two compile-time kernels, clamped to 255.
+ */
+template<typename KernelX, typename KernelY>
+void convolveGradient(Bitmap& b, Border border = Border::Clamp) {
+    convolveImage(b, KernelX::size, border,
+                  pickRow(gradientRowScalar<KernelX, KernelY>, gradientRowSSE2<KernelX, KernelY>,
+                          gradientRowAVX2<KernelX, KernelY>), nullptr);
+}
+
+/**
+ * Convolve a loaded image with a kernel given at runtime, through the
+ * generic row loop.
+ *
+ * @throws BitmapException if the kernel's size is even or past
+ *         MAX_KERNEL_SIZE, its weights don't match its size or are past
+ *         MAX_KERNEL_WEIGHT, or its divisor isn't 1..MAX_KERNEL_DIVISOR.
+ */
+void convolve(Bitmap& b, const ConvolutionKernel& kernel, Border border = Border::Clamp);
+
+/**
+ * The filters built on the kernels above.
+ */
+void sharpen(Bitmap& b, Border border = Border::Clamp);
+void emboss(Bitmap& b, Border border = Border::Clamp);
+void edgeDetect(Bitmap& b, Border border = Border::Clamp);   // Sobel
+void boxBlur(Bitmap& b, int size, Border border = Border::Clamp);   // 3 and 5 have their own row loops; odd, up to MAX_KERNEL_SIZE
+
+#endif
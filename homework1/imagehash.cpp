@@ -0,0 +1,180 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
+#include "imagehash.h"
+#include "pixelformat.h"
+
+#define KEY_BITS (64 / HASH_INDEX_KEYS)
+
+/**
+ * Shrink the image to a cols x rows grid of gray cells, top row first.  Each
+ * cell is the average of a box of pixels (a one pixel box where the image is
+ * smaller than the grid), summed over the three colors.
+ * Each band of rows is unpacked a row at a time and added into one total per
+ * column, and the columns are then added up into the band's cells, so every
+ * row is read once.
+ */
+static std::vector<double> grayCells(const Bitmap& b, int cols, int rows) {
+    int                   width  = b.width_in_pixels;
+    int                   height = b.height_in_pixels;
+    std::vector<double>   cells((size_t)cols * rows, 0);
+    std::vector<uint64_t> columns(width);
+    std::vector<uint8_t>  pixels((size_t)width * 4);
+
+    if (width < 1 || height < 1) return cells;
+
+    withPixelFormat(b, [&](auto format) {
+        for (int j = 0; j < rows; j++) {
+            int top    = (int)((int64_t)j * height / rows);
+            int bottom = std::max(top + 1, (int)((int64_t)(j + 1) * height / rows));
+
+            std::fill(columns.begin(), columns.end(), 0);
+            for (int y = top; y < bottom; y++) {
+                const uint8_t *row = (const uint8_t*)b.row(height - 1 - y);
+
+                // 24-bit rows are already just the colors, so they're added up where they are
+                if (std::is_same<decltype(format), BGR24>::value) {
+                    for (int x = 0; x < width; x++) {
+                        columns[x] += row[x*3 + 0] + row[x*3 + 1] + row[x*3 + 2];
+                    }
+                    continue;
+                }
+                unpackPixels(row, width, pixels.data(), format);
+                for (int x = 0; x < width; x++) {
+                    columns[x] += pixels[x*4 + 0] + pixels[x*4 + 1] + pixels[x*4 + 2];
+                }
+            }
+
+            for (int i = 0; i < cols; i++) {
+                int      left  = (int)((int64_t)i * width / cols);
+                int      right = std::max(left + 1, (int)((int64_t)(i + 1) * width / cols));
+                uint64_t total = 0;
+
+                for (int x = left; x < right; x++) total += columns[x];
+                cells[(size_t)j * cols + i] = (double)total / ((double)(right - left) * (bottom - top));
+            }
+        }
+    });
+
+    return cells;
+}
+
+uint64_t differenceHash(const Bitmap& b) {
+    std::vector<double> cells = grayCells(b, 9, 8);
+    uint64_t            hash  = 0;
+
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            if (cells[y * 9 + x + 1] > cells[y * 9 + x]) hash |= 1ull << (y * 8 + x);
+        }
+    }
+    return hash;
+}
+
+uint64_t perceptualHash(const Bitmap& b) {
+    static const std::vector<double> basis = []() {    // basis[u * 32 + x] = cos((2x + 1) u pi / 64)
+        std::vector<double> c(8 * 32);
+        for (int u = 0; u < 8; u++) {
+            for (int x = 0; x < 32; x++) {
+                c[u * 32 + x] = std::cos((2 * x + 1) * u * M_PI / 64);
+            }
+        }
+        return c;
+    }();
+    std::vector<double> cells = grayCells(b, 32, 32);
+    double              across[32][8];   // Each row's low frequencies
+    double              frequencies[64];
+
+    for (int y = 0; y < 32; y++) {
+        for (int u = 0; u < 8; u++) {
+            double sum = 0;
+            for (int x = 0; x < 32; x++) sum += cells[y * 32 + x] * basis[u * 32 + x];
+            across[y][u] = sum;
+        }
+    }
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            double sum = 0;
+            for (int y = 0; y < 32; y++) sum += across[y][u] * basis[v * 32 + y];
+            frequencies[v * 8 + u] = sum;
+        }
+    }
+
+    // The median leaves out the average brightness (0, 0), which dwarfs everything else
+    double rest[63];
+    std::copy(frequencies + 1, frequencies + 64, rest);
+    std::nth_element(rest, rest + 31, rest + 63);
+    double median = rest[31];
+
+    uint64_t hash = 0;
+    for (int i = 0; i < 64; i++) {
+        if (frequencies[i] > median) hash |= 1ull << i;
+    }
+    return hash;
+}
+
+// Part k of a hash, which is its key in table k
+static uint32_t hashKey(uint64_t hash, int k) {
+    return (uint32_t)(hash >> (k * KEY_BITS)) & ((1u << KEY_BITS) - 1);
+}
+
+// Call visit on key and every key that differs from it in at most flips of the bits from first_bit up
+template<typename Visit>
+static void nearbyKeys(uint32_t key, int first_bit, int flips, const Visit& visit) {
+    visit(key);
+    if (flips == 0) return;
+    for (int bit = first_bit; bit < KEY_BITS; bit++) {
+        nearbyKeys(key ^ (1u << bit), bit + 1, flips - 1, visit);
+    }
+}
+
+HashIndex::HashIndex() {
+    for (auto& table : buckets) {
+        table.resize(1u << KEY_BITS);
+    }
+}
+
+uint32_t HashIndex::insert(uint64_t hash) {
+    uint32_t id = hashes.size();
+
+    hashes.push_back(hash);
+    for (int k = 0; k < HASH_INDEX_KEYS; k++) {
+        buckets[k][hashKey(hash, k)].push_back(id);
+    }
+    return id;
+}
+
+/**
+ * A hash can turn up in the buckets of more than one part.  It's only taken
+ * from the first part that's close enough to have found it, so each hash is
+ * checked once without keeping a set of the ones seen.
+ */
+std::vector<std::pair<uint32_t, int>> HashIndex::find(uint64_t hash, int distance) const {
+    std::vector<std::pair<uint32_t, int>> found;
+    int                                   flips = std::min(distance / HASH_INDEX_KEYS, KEY_BITS);
+
+    if (distance < 0) return found;
+
+    for (int k = 0; k < HASH_INDEX_KEYS; k++) {
+        nearbyKeys(hashKey(hash, k), 0, flips, [&](uint32_t key) {
+            for (uint32_t id : buckets[k][key]) {
+                uint64_t other   = hashes[id];
+                bool     earlier = false;
+
+                for (int j = 0; j < k && !earlier; j++) {
+                    earlier = __builtin_popcount(hashKey(other, j) ^ hashKey(hash, j)) <= flips;
+                }
+                int d = hammingDistance(hash, other);
+                if (!earlier && d <= distance) found.push_back({id, d});
+            }
+        });
+    }
+
+    std::sort(found.begin(), found.end(), [](const std::pair<uint32_t, int>& a, const std::pair<uint32_t, int>& b) {
+        return a.second != b.second ? a.second < b.second : a.first < b.first;
+    });
+    return found;
+}
@@ -0,0 +1,86 @@
+// Author:  Charles Lucas
+// CS510
+//
+// Perceptual hashes: 64-bit fingerprints that stay close when an image is
+// resized, blurred, recompressed or color corrected a little, so near
+// duplicates can be found by Hamming distance, and an index that finds every
+// fingerprint within a distance of another without comparing against all of
+// them.
+
+#ifndef IMAGEHASH_H
+#define IMAGEHASH_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "bitmap.h"
+
+#define DUPLICATE_DISTANCE 6   // Bits two perceptual hashes of near-duplicate images differ in at most
+#define HASH_INDEX_KEYS    4   // Parts each hash is split into for the index (16 bits each)
+
+/**
+ * The difference hash (dHash): the image shrunk to 9x8 gray cells, one bit
+ * per pair of neighboring cells in a row, set when the right one is
+ * brighter.  Cheap, and good at exact and resized copies.
+ *
+ * Both hashes shrink the image by averaging boxes of pixels, with gray the
+ * average of the three colors as in grayscale(), in one pass over the rows on
+ * the calling thread (without the thread pool, so an I/O thread can hash
+ * what it reads).  The image can be loaded or mapped.
+ */
+uint64_t differenceHash(const Bitmap& b);
+
+/**
+ * The perceptual hash (pHash): the image shrunk to 32x32 gray cells, and
+ * the lowest 8x8 frequencies of their discrete cosine transform, one bit per
+ * frequency, set when it's above the median.  Holds up better than dHash to
+ * blurs, noise and changes of contrast.
+ */
+uint64_t perceptualHash(const Bitmap& b);
+
+/**
+ * The number of bits a and b differ in.
+ */
+inline int hammingDistance(uint64_t a, uint64_t b) {
+    return __builtin_popcountll(a ^ b);
+}
+
+/**
+ * HashIndex - hashes to search by Hamming distance (multi-index hashing).
+ *
+ * Each hash is split into HASH_INDEX_KEYS parts, and each part has a table
+ * of the hashes with each value of it.  Two hashes within distance d of each
+ * other have at least one part within d / HASH_INDEX_KEYS bits, so a search
+ * only looks in the buckets within that many bits of each part, and checks
+ * the hashes it finds there.  For the small distances near duplicates are
+ * found at, that's a few dozen buckets no matter how many hashes there are.
+ */
+class HashIndex
+{
+public:
+    HashIndex();
+
+    /**
+     * Add a hash.
+     *
+     * @return its id (ids count up from 0).
+     */
+    uint32_t insert(uint64_t hash);
+
+    /**
+     * Every hash within distance bits of hash.
+     *
+     * @return (id, distance) pairs, nearest first (and lowest id first at
+     *         the same distance).
+     */
+    std::vector<std::pair<uint32_t, int>> find(uint64_t hash, int distance) const;
+
+    size_t   size() const              { return hashes.size(); }
+    uint64_t operator[](uint32_t id) const { return hashes[id]; }
+
+private:
+    std::vector<uint64_t>              hashes;                       // By id
+    std::vector<std::vector<uint32_t>> buckets[HASH_INDEX_KEYS];     // For each part, the ids with each value of it
+};
+
+#endif
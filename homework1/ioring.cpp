@@ -0,0 +1,197 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "ioring.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && !defined(NO_IO_URING)
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+// Move the transfer past moved bytes, dropping the parts that are done
+static void advance(IoTransfer& transfer, size_t moved) {
+    size_t done = 0;
+
+    transfer.offset += moved;
+    for (; done < transfer.parts.size() && moved >= transfer.parts[done].iov_len; done++) {
+        moved -= transfer.parts[done].iov_len;
+    }
+    if (moved > 0) {
+        transfer.parts[done].iov_base = (char*)transfer.parts[done].iov_base + moved;
+        transfer.parts[done].iov_len -= moved;
+    }
+    transfer.parts.erase(transfer.parts.begin(), transfer.parts.begin() + done);
+}
+
+bool transferNow(IoTransfer& transfer) {
+    while (!transfer.parts.empty()) {
+        int     count = std::min<size_t>(transfer.parts.size(), IOV_MAX);
+        ssize_t moved = transfer.write ? pwritev(transfer.fd, transfer.parts.data(), count, transfer.offset)
+                                       : preadv(transfer.fd, transfer.parts.data(), count, transfer.offset);
+        if (moved < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (moved == 0) return false;
+        advance(transfer, moved);
+    }
+    return true;
+}
+
+IoRing::IoRing(unsigned depth) {
+#if HAVE_IO_URING
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0) return;    // No io_uring (or a depth of 0) - run() falls back to preadv()/pwritev()
+
+    // Kernels old enough to map the two rings separately get the fallback too
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        return;
+    }
+
+    rings_size = std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                  params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    sqes_size  = params.sq_entries * sizeof(io_uring_sqe);
+    rings = mmap(nullptr, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    sqes  = mmap(nullptr, sqes_size,  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+        if (rings != MAP_FAILED) munmap(rings, rings_size);
+        if (sqes  != MAP_FAILED) munmap(sqes, sqes_size);
+        rings = sqes = nullptr;
+        close(fd);
+        return;
+    }
+
+    char *base = (char*)rings;
+    sq_tail  = (unsigned*)(base + params.sq_off.tail);
+    sq_mask  = (unsigned*)(base + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(base + params.sq_off.array);
+    cq_head  = (unsigned*)(base + params.cq_off.head);
+    cq_tail  = (unsigned*)(base + params.cq_off.tail);
+    cq_mask  = (unsigned*)(base + params.cq_off.ring_mask);
+    cqes     = base + params.cq_off.cqes;
+    entries  = params.sq_entries;
+    ring     = fd;
+#else
+    (void)depth;
+#endif
+}
+
+IoRing::~IoRing() {
+    if (ring < 0) return;
+
+    munmap(rings, rings_size);
+    munmap(sqes, sqes_size);
+    close(ring);
+}
+
+bool IoRing::usesUring() const {
+    return ring >= 0;
+}
+
+void IoRing::submit(IoTransfer& transfer, uint64_t tag) {
+#if HAVE_IO_URING
+    unsigned      tail  = *sq_tail;    // Only this thread moves the tail
+    unsigned      index = tail & *sq_mask;
+    io_uring_sqe *sqe   = (io_uring_sqe*)sqes + index;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = transfer.write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd        = transfer.fd;
+    sqe->addr      = (uint64_t)(uintptr_t)transfer.parts.data();
+    sqe->len       = std::min<size_t>(transfer.parts.size(), IOV_MAX);
+    sqe->off       = transfer.offset;
+    sqe->user_data = tag;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+#else
+    (void)transfer;
+    (void)tag;
+#endif
+}
+
+/**
+ * Keep up to entries transfers in the ring.  Each completion either finishes
+ * its transfer or, after a short one, sends the rest of it back around.
+ * After a failure nothing new goes in, but everything already in the ring is
+ * waited for, since the kernel may still be using its parts (unless
+ * io_uring_enter() itself fails).
+ */
+bool IoRing::run(std::vector<IoTransfer>& transfers) {
+    bool ok = true;
+
+    if (ring < 0) {
+        for (IoTransfer& transfer : transfers) {
+            ok = transferNow(transfer) && ok;
+        }
+        return ok;
+    }
+
+#if HAVE_IO_URING
+    std::vector<size_t> again;           // Transfers that came back short
+    size_t              next = 0;
+    unsigned            in_flight = 0;   // In the ring, submitted or not
+    unsigned            unsubmitted = 0;
+
+    while (in_flight > 0 || (ok && (next < transfers.size() || !again.empty()))) {
+        while (ok && in_flight < entries && (next < transfers.size() || !again.empty())) {
+            size_t i;
+            if (!again.empty()) {
+                i = again.back();
+                again.pop_back();
+            }
+            else {
+                i = next++;
+            }
+            if (transfers[i].parts.empty()) continue;
+            submit(transfers[i], i);
+            in_flight++;
+            unsubmitted++;
+        }
+        if (in_flight == 0) break;
+
+        int submitted = syscall(__NR_io_uring_enter, ring, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            return false;
+        }
+        unsubmitted -= std::min<unsigned>(submitted, unsubmitted);
+
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = ((const io_uring_cqe*)cqes)[head & *cq_mask];
+            IoTransfer&         transfer = transfers[cqe.user_data];
+
+            in_flight--;
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+                again.push_back(cqe.user_data);
+            }
+            else if (cqe.res <= 0) {
+                ok = false;    // An error, or the end of the file
+            }
+            else {
+                advance(transfer, cqe.res);
+                if (!transfer.parts.empty()) again.push_back(cqe.user_data);
+            }
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+#endif
+    return ok;
+}
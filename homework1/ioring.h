@@ -0,0 +1,75 @@
+// Author:  Charles Lucas
+// CS510
+//
+// Batches of file reads and writes kept in flight together.  On Linux the
+// batch goes through io_uring (straight through the system calls, so there
+// is no library to link); where the kernel doesn't have it, or turns it off,
+// the transfers run one after another with preadv()/pwritev().  Either way
+// the thread calling run() doesn't touch the thread pool, so an I/O thread
+// can run it while the filters have the pool.
+
+#ifndef IORING_H
+#define IORING_H
+
+#include <cstdint>
+#include <vector>
+#include <sys/uio.h>
+
+#define IORING_DEPTH 32   // Transfers in flight at once
+
+/**
+ * IoTransfer - one preadv() or pwritev() of a list of parts at an offset.
+ * The parts are advanced as they are transferred.
+ */
+struct IoTransfer
+{
+    int                fd;
+    std::vector<iovec> parts;     // At most IOV_MAX
+    uint64_t           offset;
+    bool               write;
+};
+
+class IoRing
+{
+public:
+    /**
+     * Set up a ring with room for depth transfers in flight, or the
+     * fallback if io_uring isn't there.
+     */
+    explicit IoRing(unsigned depth = IORING_DEPTH);
+    ~IoRing();
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    bool usesUring() const;
+
+    /**
+     * Do every transfer, picking up after short ones, and wait for all of
+     * them.  Reads fail if the file ends first.
+     *
+     * @return false if any transfer failed.
+     */
+    bool run(std::vector<IoTransfer>& transfers);
+
+private:
+    void submit(IoTransfer& transfer, uint64_t tag);
+
+    int       ring = -1;              // The io_uring, or -1 for the fallback
+    unsigned  entries = 0;
+    void     *rings = nullptr;        // Submission and completion rings, mapped together
+    size_t    rings_size = 0;
+    void     *sqes = nullptr;         // Submission queue entries
+    size_t    sqes_size = 0;
+
+    unsigned *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+    void     *cqes = nullptr;
+};
+
+/**
+ * preadv() or pwritev() all of transfer's parts on the calling thread,
+ * picking up after short transfers.  Reads fail if the file ends first.
+ */
+bool transferNow(IoTransfer& transfer);
+
+#endif
@@ -1,22 +1,173 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cstdlib>
+#include <vector>
+#include <memory>
 #include "bitmap.h"
+#include "threadpool.h"
+#include "pipeline.h"
+#include "batch.h"
+#include "stream.h"
+#include "stats.h"
+#include "convolve.h"
+#include "imagehash.h"
+#include "resultcache.h"
 
 using namespace std;
 
 int main(int argc, char** argv)
 {
-    if(argc != 4)
+    // Optional leading -j<threads> sets how many threads the filters use, and --cache:<directory> keeps
+    // results in a result cache there (BITMAP_CACHE sets a cache for every run)
+    unique_ptr<ResultCache> cache;
+    if(getenv("BITMAP_CACHE") && *getenv("BITMAP_CACHE"))
+    {
+        cache.reset(new ResultCache(getenv("BITMAP_CACHE")));
+    }
+    while(argc > 1 && (string(argv[1]).compare(0, 2, "-j"s) == 0 || string(argv[1]).compare(0, 8, "--cache:"s) == 0))
+    {
+        if(argv[1][1] == 'j') setThreadCount(atoi(argv[1] + 2));
+        else                  cache.reset(new ResultCache(argv[1] + 8));
+        argc--;
+        argv++;
+    }
+
+    if((argc == 3 || argc == 4) && argv[1] == "--batch"s)
+    {
+        // --dedupe skips jobs on near duplicates of inputs already run, --dedupe<bits> sets how near
+        int dedupe = -1;
+        if(argc == 4)
+        {
+            string option(argv[2]);
+            if(option.compare(0, 8, "--dedupe") != 0)
+            {
+                cout << "Error - unknown batch option " << option << endl;
+                return 1;
+            }
+            dedupe = option.size() > 8 ? atoi(option.c_str() + 8) : DUPLICATE_DISTANCE;
+        }
+
+        vector<BatchJob> jobs;
+        try
+        {
+            jobs = readManifest(argv[argc - 1]);
+        }
+        catch(BitmapException& e)
+        {
+            e.print_exception();
+            return 1;
+        }
+
+        // Every filter prints a line as it runs, which is just noise with jobs running
+        // side by side, so only the batch report goes to the console
+        streambuf* console = cout.rdbuf();
+        ostream    report(console);
+        cout.rdbuf(nullptr);
+        int failed = runBatch(jobs, report, dedupe, cache.get());
+        cout.rdbuf(console);
+
+        return failed ? 1 : 0;
+    }
+
+    if(argc >= 3 && argv[1] == "--stats"s)
+    {
+        // One JSON line per image, so the loading messages are silenced.  The images are
+        // only mapped, never decoded into memory
+        streambuf* console = cout.rdbuf();
+        ostream    report(console);
+        int        failed = 0;
+
+        cout.rdbuf(nullptr);
+        for(int i = 2; i < argc; i++)
+        {
+            string name;
+            for(const char* c = argv[i]; *c; c++)
+            {
+                if(*c == '"' || *c == '\\') name += '\\';
+                name += *c;
+            }
+
+            report << "{\"file\": \"" << name << "\", ";
+            try
+            {
+                Bitmap image;
+                image.open_mapped(argv[i]);
+                ImageStats stats = imageStats(image);
+                report << "\"stats\": ";
+                writeStats(report, stats);
+            }
+            catch(BitmapException& e)
+            {
+                report << "\"error\": \"" << e.what() << "\"";
+                failed++;
+            }
+            report << "}" << endl;
+        }
+        cout.rdbuf(console);
+
+        return failed ? 1 : 0;
+    }
+
+    if(argc >= 5 && argv[1] == "--stream"s)
+    {
+        vector<string> options(argv + 2, argv + argc - 2);
+        string         infile(argv[argc - 2]);
+        string         outfile(argv[argc - 1]);
+
+        for(const string& option : options)
+        {
+            if(!canStream(option))
+            {
+                cout << "Error - option " << option << " can't be streamed" << endl;
+                return 1;
+            }
+        }
+
+        // The filters print a line for every band, so they're silenced while the image streams
+        streambuf* console = cout.rdbuf();
+        cout.rdbuf(nullptr);
+        try
+        {
+            streamImage(infile, outfile, options);
+        }
+        catch(BitmapException& e)
+        {
+            cout.rdbuf(console);
+            e.print_exception();
+            return 1;
+        }
+        cout.rdbuf(console);
+
+        cout << "Bitmap streamed successfully - " << outfile << endl;
+        return 0;
+    }
+
+    if(argc < 4)
     {
         cout << "usage:\n"
-             << "bitmap option inputfile.bmp outputfile.bmp\n"
+             << "bitmap [-j<threads>] [--cache:<directory>] option [option ...] inputfile.bmp outputfile.bmp\n"
+             << "  options are applied in order, e.g. -g -b -r90\n"
+             << "bitmap [-j<threads>] [--cache:<directory>] --batch [--dedupe[<bits>]] manifest\n"
+             << "  runs every line of the manifest, each written as: inputfile.bmp [option ...] outputfile.bmp\n"
+             << "  --dedupe skips jobs whose input's perceptual hash is within <bits> (default " << DUPLICATE_DISTANCE << ") of an\n"
+             << "  input already run with the same options\n"
+             << "bitmap [-j<threads>] --stream option [option ...] inputfile.bmp outputfile.bmp\n"
+             << "  filters a band of rows at a time, for images too big for memory (-n -c -g -p -p<size> -b -b<sigma> -h -shrink)\n"
+             << "bitmap [-j<threads>] --stats inputfile.bmp [inputfile.bmp ...]\n"
+             << "  prints each image's per-channel histograms, min, max, mean and standard deviation as a JSON line\n"
+             << "  -j<threads> number of threads to use (default: one per core)\n"
+             << "  --cache:<directory> keep results in a cache in directory, keyed by the input file and the options,\n"
+             << "   and hand out the cached result when the same options are run on the same file again\n"
+             << "   (the BITMAP_CACHE environment variable sets a cache directory for every run)\n"
              << "options:\n"
              << "  -n no transform\n"
              << "  -c cell shade\n"
              << "  -g gray scale\n"
              << "  -p pixelate\n"
+             << "  -p<size> or -p<width>x<height> pixelate with the given block size (e.g. -p8, -p32x8)\n"
              << "  -b blur\n"
+             << "  -b<sigma> blur with the given sigma, up to " << MAX_BLUR_SIGMA << " (e.g. -b3.5)\n"
              << "  -r90 rotate 90\n"
              << "  -r180 rotate 180\n"
              << "  -r270 rotate 270\n"
@@ -25,89 +176,88 @@ int main(int argc, char** argv)
              << "  -d1 flip diagonally 1\n"
              << "  -d2 flip diagonally 2\n"
              << "  -grow scale the image by 2\n"
-             << "  -shrink scale the image by .5" << endl;
+             << "  -shrink scale the image by .5, averaging each 2x2 block\n"
+             << "  -resize<width>x<height>[:filter] resize to any size with the filter nearest, box,\n"
+             << "   bilinear, bicubic (default) or lanczos (e.g. -resize640x480, -resize160x120:box)\n"
+             << "  -sharpen sharpen\n"
+             << "  -emboss emboss\n"
+             << "  -edges detect edges (Sobel)\n"
+             << "  -box or -box<size> box blur over size x size pixels (default 3, odd, up to " << MAX_KERNEL_SIZE << ")\n"
+             << "  -kernel:<weight>,...[/<divisor>] convolve with a square kernel given row by row from the top,\n"
+             << "   up to " << MAX_KERNEL_SIZE << "x" << MAX_KERNEL_SIZE << " with weights within " << MAX_KERNEL_WEIGHT << " of 0\n"
+             << "   (e.g. -kernel:1,2,1,2,4,2,1,2,1/16)\n"
+             << "   the convolutions take :mirror to reflect at the borders instead of repeating the edge (e.g. -box5:mirror)\n"
+             << "  -invert invert the colors\n"
+             << "  -posterize or -posterize<levels> round each channel to levels values (default 4)\n"
+             << "  -levels or -levels<percent> stretch each channel to cover 0..255, letting percent of the\n"
+             << "   pixels saturate at each end (e.g. -levels0.5)\n"
+             << "  -equalize equalize the histogram of each channel\n"
+             << "  -gamma<gamma> gamma correct, brightening for gamma above 1 (e.g. -gamma2.2)\n"
+             << "  -stats:<file> write the image's statistics at this point to file as JSON\n"
+             << "  -overlay:<file>[@<x>,<y>] lay the image in file over this one, blended by its alpha,\n"
+             << "   with its top left corner at x,y from the top left (e.g. -overlay:logo.bmp@20,20)\n"
+             << "  -alpha filter images with alpha in premultiplied form, so blur, pixelate and the\n"
+             << "   resizes don't bleed the color of transparent pixels into the rest" << endl;
 
         return 0;
     }
 
-    string flag(argv[1]);
-    string infile(argv[2]);
-    string outfile(argv[3]);
+    string infile(argv[argc - 2]);
+    string outfile(argv[argc - 1]);
 
-    ifstream in;
     Bitmap image;
-    ofstream out;
+    Pipeline pipeline;
+    string options;
 
-    try
-    {
-        in.open(infile, ios::binary);
-        in >> image;
-        in.close();
-    }
-    catch(BitmapException& e)
+    for(int i = 1; i < argc - 2; i++)
     {
-        e.print_exception();
-        return 0;
+        if(!pipeline.add(argv[i]))
+        {
+            cout << "Error - unknown option " << argv[i] << endl;
+            return 0;
+        }
+        if(!canCache(argv[i])) cache.reset();
+        options += (options.empty() ? "" : " ") + string(argv[i]);
     }
 
-    if(flag == "-n"s) {}
-    if(flag == "-c"s)
-    {
-        cellShade(image);
-    }
-    if(flag == "-g"s)
-    {
-        grayscale(image);
-    }
-    if(flag == "-p"s)
-    {
-        pixelate(image);
-    }
-    if(flag == "-b"s)
-    {
-        blur(image);
-    }
-    if(flag == "-r90"s)
-    {
-        rot90(image);
-    }
-    if(flag == "-r180"s)
-    {
-        rot180(image);
-    }
-    if(flag == "-r270"s)
+    // The cache is checked before the input is decoded, so a hit only costs a pass over the file to hash it
+    string key;
+    if(cache)
     {
-        rot270(image);
+        string file_hash = cache->hashFile(infile);
+        if(!file_hash.empty())
+        {
+            key = cache->key(file_hash, options);
+            CacheHit hit = cache->fetch(key, outfile);
+            if(hit != CacheHit::Miss)
+            {
+                cout << "Bitmap served from the result cache (" << cacheHitName(hit) << ") - " << outfile << endl;
+                return 0;
+            }
+        }
     }
-    if(flag == "-v"s)
-    {
-        flipv(image);
-    }
-    if(flag == "-h"s)
-    {
-        fliph(image);
-    }
-    if(flag == "-d1"s)
+
+    try
     {
-        flipd1(image);
+        image.load(infile);
     }
-    if(flag == "-d2"s)
+    catch(BitmapException& e)
     {
-        flipd2(image);
+        e.print_exception();
+        return 0;
     }
-    if(flag == "-grow"s)
+
+    try
     {
-        scaleUp(image);
+        pipeline.run(image);
+        image.save(outfile);
+        if(!key.empty()) cache->store(key, outfile);
     }
-    if(flag == "-shrink"s)
+    catch(BitmapException& e)
     {
-        scaleDown(image);
+        e.print_exception();
     }
 
-    out.open(outfile, ios::binary);
-    out << image;
-    out.close();
-
     return 0;
 }
 
@@ -0,0 +1,481 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <tuple>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include "pipeline.h"
+#include "planar.h"
+#include "tiled.h"
+#include "stats.h"
+#include "convolve.h"
+#include "pointop.h"
+#include "threadpool.h"
+
+#define FUSED_BYTES (256 * 1024)   // Rows a fused run of point-wise filters works on at once (about one L2)
+
+bool parseSigma(const std::string& option, double& sigma) {
+    size_t used;
+
+    if (option.compare(0, 2, "-b") != 0 || option.size() == 2) {
+        return false;
+    }
+    try {
+        sigma = std::stod(option.substr(2), &used);
+    }
+    catch (std::exception&) {
+        return false;
+    }
+    return used == option.size() - 2 && std::isfinite(sigma) && sigma > 0 && sigma <= MAX_BLUR_SIGMA;
+}
+
+// Read the number after prefix, which has to be the rest of the option
+static bool parseNumber(const std::string& option, const std::string& prefix, double& value) {
+    size_t used;
+
+    if (option.compare(0, prefix.size(), prefix) != 0 || option.size() == prefix.size()) {
+        return false;
+    }
+    try {
+        value = std::stod(option.substr(prefix.size()), &used);
+    }
+    catch (std::exception&) {
+        return false;
+    }
+    return used == option.size() - prefix.size();
+}
+
+bool parseLevels(const std::string& option, double& clip) {
+    if (option == "-levels") {
+        clip = 0;
+        return true;
+    }
+    if (!parseNumber(option, "-levels", clip) || !(clip >= 0 && clip <= 50)) {
+        return false;
+    }
+    clip /= 100;
+    return true;
+}
+
+bool parseGamma(const std::string& option, double& gamma) {
+    return parseNumber(option, "-gamma", gamma) && gamma > 0 && gamma < 1e6;
+}
+
+bool parseBlockSize(const std::string& option, int& width, int& height) {
+    int  used = 0;
+    char separator;
+
+    if (option.compare(0, 2, "-p") != 0 || option.size() == 2) {
+        return false;
+    }
+    if (sscanf(option.c_str() + 2, "%d%n", &width, &used) != 1) {
+        return false;
+    }
+    height = width;
+    if (option[2 + used] == 'x') {
+        int more = 0;
+        if (sscanf(option.c_str() + 2 + used, "%c%d%n", &separator, &height, &more) != 2) {
+            return false;
+        }
+        used += more;
+    }
+    return (size_t)(2 + used) == option.size() && width > 0 && height > 0;
+}
+
+bool parseResize(const std::string& option, int& width, int& height, ResampleFilter& filter) {
+    static const std::vector<std::pair<std::string, ResampleFilter>> filters = {
+        {"nearest",  ResampleFilter::Nearest},
+        {"box",      ResampleFilter::Box},
+        {"bilinear", ResampleFilter::Bilinear},
+        {"bicubic",  ResampleFilter::Bicubic},
+        {"lanczos",  ResampleFilter::Lanczos},
+    };
+    int used = 0;
+
+    if (option.compare(0, 7, "-resize") != 0) {
+        return false;
+    }
+    if (sscanf(option.c_str() + 7, "%dx%d%n", &width, &height, &used) != 2 || width < 1 || height < 1) {
+        return false;
+    }
+
+    std::string rest = option.substr(7 + used);
+    filter = ResampleFilter::Bicubic;
+    if (rest.empty()) {
+        return true;
+    }
+    for (const auto& name : filters) {
+        if (rest == ":" + name.first) {
+            filter = name.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parseOverlay(const std::string& option, std::string& path, int& x, int& y) {
+    int used = 0;
+
+    if (option.compare(0, 9, "-overlay:") != 0 || option.size() == 9) {
+        return false;
+    }
+    path = option.substr(9);
+    x = y = 0;
+
+    size_t at = path.rfind('@');
+    if (at != std::string::npos && at > 0 &&
+        sscanf(path.c_str() + at + 1, "%d,%d%n", &x, &y, &used) == 2 && at + 1 + used == path.size()) {
+        path.resize(at);
+    }
+    return true;
+}
+
+bool parsePosterize(const std::string& option, int& levels) {
+    int used = 0;
+
+    if (option == "-posterize") {
+        levels = 4;
+        return true;
+    }
+    if (option.compare(0, 10, "-posterize") != 0 || sscanf(option.c_str() + 10, "%d%n", &levels, &used) != 1) {
+        return false;
+    }
+    return (size_t)(10 + used) == option.size() && levels >= 2 && levels <= 256;
+}
+
+bool parseBoxSize(const std::string& option, int& size) {
+    int used = 0;
+
+    if (option == "-box") {
+        size = 3;
+        return true;
+    }
+    if (option.compare(0, 4, "-box") != 0 || sscanf(option.c_str() + 4, "%d%n", &size, &used) != 1) {
+        return false;
+    }
+    return (size_t)(4 + used) == option.size() && size > 0 && size % 2 == 1 && size <= MAX_KERNEL_SIZE;
+}
+
+bool parseKernel(const std::string& option, ConvolutionKernel& kernel) {
+    const char *text = option.c_str() + 8;
+    int         weight, used = 0;
+
+    if (option.compare(0, 8, "-kernel:") != 0) {
+        return false;
+    }
+    kernel.weights.clear();
+    kernel.divisor = 1;
+    kernel.bias    = 0;
+    do {
+        if (sscanf(text, "%d%n", &weight, &used) != 1 || weight < -MAX_KERNEL_WEIGHT || weight > MAX_KERNEL_WEIGHT) {
+            return false;
+        }
+        kernel.weights.push_back(weight);
+        text += used;
+    } while (*text == ',' && ++text);
+    if (*text == '/' && (sscanf(text + 1, "%d%n", &kernel.divisor, &used) != 1 ||
+                         (text += 1 + used, kernel.divisor < 1 || kernel.divisor > MAX_KERNEL_DIVISOR))) {
+        return false;
+    }
+
+    kernel.size = 1;
+    while ((size_t)kernel.size * kernel.size < kernel.weights.size()) kernel.size += 2;
+    return *text == 0 && (size_t)kernel.size * kernel.size == kernel.weights.size() && kernel.size <= MAX_KERNEL_SIZE;
+}
+
+// Take a :mirror or :clamp off the end of a convolution option
+static Border parseBorder(std::string& option) {
+    for (const auto& suffix : {std::make_pair(":mirror", Border::Mirror), std::make_pair(":clamp", Border::Clamp)}) {
+        size_t length = strlen(suffix.first);
+        if (option.size() > length && option.compare(option.size() - length, length, suffix.first) == 0) {
+            option.resize(option.size() - length);
+            return suffix.second;
+        }
+    }
+    return Border::Clamp;
+}
+
+// Write the image's statistics to path as JSON
+static void saveStats(const Bitmap& b, const std::string& path) {
+    std::ofstream out(path);
+
+    writeStats(out, imageStats(b));
+    out << std::endl;
+    if (!out) {
+        throw(BitmapException("Error - could not write statistics to " + path, 0));
+    }
+}
+
+// Each overlay file is read once and shared, so a batch that watermarks many images reads the watermark once
+static std::shared_ptr<const Bitmap> loadOverlay(const std::string& path) {
+    static std::mutex                                           lock;
+    static std::map<std::string, std::shared_ptr<const Bitmap>> loaded;
+
+    std::lock_guard<std::mutex>    guard(lock);
+    std::shared_ptr<const Bitmap>& overlay = loaded[path];
+    if (!overlay) {
+        std::shared_ptr<Bitmap> b(new Bitmap);
+        b->open_mapped(path);   // The rows stay in the mapping, composite() only reads them
+        overlay = b;
+    }
+    return overlay;
+}
+
+Pipeline::Stage::Stage(std::function<void(Bitmap&)> image, Alpha alpha, std::function<void(PlanarImage&)> planar,
+                       bool prefers_planes)
+    : image(image), planar(planar), prefers_planes(prefers_planes), alpha(alpha) {}
+
+// Point-wise filters work on straight colors
+Pipeline::Stage::Stage(const std::string& name, std::function<void(Bitmap&, int, int)> rows,
+                       std::function<void(PlanarImage&)> planar, std::shared_ptr<const PointOp> lookup)
+    : name(name), rows(rows), planar(planar), alpha(Alpha::Straight), lookup(lookup) {}
+
+bool Pipeline::add(const std::string& option) {
+    // With the imageTransform() mode of the transforms that can be done on tiles, and whether they are slow on rows
+    static const std::vector<std::tuple<std::string, void (*)(Bitmap&), int, bool>> filters = {
+        {"-r90",    rot90,   0,  true},
+        {"-r180",   rot180,  1,  true},
+        {"-r270",   rot270,  2,  true},
+        {"-v",      flipv,   3,  false},
+        {"-h",      fliph,   4,  false},
+        {"-d1",     flipd1,  5,  true},
+        {"-d2",     flipd2,  6,  true},
+        {"-grow",   scaleUp, -1, false},
+    };
+
+    if (option == "-n") {
+        return true;
+    }
+    if (option == "-alpha") {
+        alpha_correct = true;
+        return true;
+    }
+    if (option == "-c") {
+        stages.emplace_back("Applying cell shading transform.", cellShadeRows, [](PlanarImage& p) { cellShade(p); },
+                            std::make_shared<PointOp>(cellShadeOp()));
+        return true;
+    }
+    if (option == "-invert") {
+        addPointOp("Applying invert transform.", invertOp());
+        return true;
+    }
+    if (option == "-g") {
+        stages.emplace_back("Applying grayscale transform.", grayscaleRows, [](PlanarImage& p) { grayscale(p); });
+        return true;
+    }
+    if (option == "-p") {
+        stages.emplace_back([](Bitmap& b) { pixelate(b); }, Alpha::Premultiplied, [](PlanarImage& p) { pixelate(p); }, true);
+        return true;
+    }
+    if (option == "-b") {
+        stages.emplace_back([](Bitmap& b) { blur(b); }, Alpha::Premultiplied, [](PlanarImage& p) { blur(p); });
+        return true;
+    }
+    if (option == "-shrink") {
+        stages.emplace_back(scaleDown, Alpha::Premultiplied);
+        return true;
+    }
+    if (option == "-equalize") {
+        stages.emplace_back([](Bitmap& b) { equalize(b); }, Alpha::Straight);
+        return true;
+    }
+    for (const auto& filter : filters) {
+        if (option == std::get<0>(filter)) {
+            Stage stage(std::get<1>(filter), Alpha::Either);
+            int   mode = std::get<2>(filter);
+            if (mode >= 0) stage.tiled = [mode](TiledImage& t) { t.transform(mode); };
+            stage.prefers_tiles = std::get<3>(filter);
+            stages.push_back(stage);
+            return true;
+        }
+    }
+
+    double sigma;
+    if (parseSigma(option, sigma)) {
+        stages.emplace_back([sigma](Bitmap& b) { blur(b, sigma); }, Alpha::Premultiplied, [sigma](PlanarImage& p) { blur(p, sigma); });
+        return true;
+    }
+
+    int width, height;
+    if (parseBlockSize(option, width, height)) {
+        stages.emplace_back([width, height](Bitmap& b) { pixelate(b, width, height); }, Alpha::Premultiplied,
+                            [width, height](PlanarImage& p) { pixelate(p, width, height); }, true);
+        return true;
+    }
+
+    ResampleFilter filter;
+    if (parseResize(option, width, height, filter)) {
+        stages.emplace_back([width, height, filter](Bitmap& b) { resize(b, width, height, filter); }, Alpha::Premultiplied);
+        return true;
+    }
+
+    double clip;
+    if (parseLevels(option, clip)) {
+        stages.emplace_back([clip](Bitmap& b) { autoLevels(b, clip); }, Alpha::Straight);
+        return true;
+    }
+
+    // The point operations' tables are built once here
+    double value;
+    if (parseGamma(option, value)) {
+        addPointOp("Applying gamma transform.", gammaOp(value));
+        return true;
+    }
+    int levels;
+    if (parsePosterize(option, levels)) {
+        addPointOp("Applying posterize transform (" + std::to_string(levels) + " levels).", posterizeOp(levels));
+        return true;
+    }
+
+    if (option.compare(0, 7, "-stats:") == 0 && option.size() > 7) {
+        std::string path = option.substr(7);
+        stages.emplace_back([path](const Bitmap& b) { saveStats(b, path); }, Alpha::Straight);
+        return true;
+    }
+
+    // Convolutions.  Kernels that keep flat areas as they are (weights adding up to the divisor) mix
+    // pixels like a blur, so they want premultiplied alpha; the others (edges) work on straight colors
+    std::string       name   = option;
+    Border            border = parseBorder(name);
+    ConvolutionKernel kernel;
+    if (name == "-sharpen") {
+        stages.emplace_back([border](Bitmap& b) { sharpen(b, border); }, Alpha::Premultiplied);
+        return true;
+    }
+    if (name == "-emboss") {
+        stages.emplace_back([border](Bitmap& b) { emboss(b, border); }, Alpha::Premultiplied);
+        return true;
+    }
+    if (name == "-edges") {
+        stages.emplace_back([border](Bitmap& b) { edgeDetect(b, border); }, Alpha::Straight);
+        return true;
+    }
+    int size;
+    if (parseBoxSize(name, size)) {
+        stages.emplace_back([size, border](Bitmap& b) { boxBlur(b, size, border); }, Alpha::Premultiplied);
+        return true;
+    }
+    if (parseKernel(name, kernel)) {
+        int total = 0;
+        for (int weight : kernel.weights) total += weight;
+        stages.emplace_back([kernel, border](Bitmap& b) {
+                                std::cout << "Applying " << kernel.size << "x" << kernel.size << " convolution transform." << std::endl;
+                                convolve(b, kernel, border);
+                            }, total == kernel.divisor ? Alpha::Premultiplied : Alpha::Straight);
+        return true;
+    }
+
+    std::string path;
+    int         x, y;
+    if (parseOverlay(option, path, x, y)) {
+        stages.emplace_back([path, x, y](Bitmap& b) { composite(b, *loadOverlay(path), x, y); }, Alpha::Either);
+        return true;
+    }
+
+    return false;
+}
+
+void Pipeline::addPointOp(const std::string& name, const PointOp& op) {
+    std::shared_ptr<const PointOp> tables = std::make_shared<PointOp>(op);
+
+    stages.emplace_back(name, [tables](Bitmap& b, int first, int last) { applyPointOpRows(b, *tables, first, last); }, nullptr,
+                        tables);
+}
+
+void Pipeline::run(Bitmap& b) const {
+    for (size_t i = 0; i < stages.size(); ) {
+        // Put the image in the form of alpha the next filter needs
+        if (alpha_correct && stages[i].alpha == Alpha::Premultiplied) premultiply(b);
+        if (alpha_correct && stages[i].alpha == Alpha::Straight)      unpremultiply(b);
+
+        // Gather the run of rotations and flips starting here, and use tiles if one of them is slow on rows
+        size_t end = i;
+        bool   pays = false;
+        while (end < stages.size() && stages[end].tiled) {
+            pays = pays || stages[end].prefers_tiles;
+            end++;
+        }
+        if (pays) {
+            TiledImage tiles(b);
+            for (size_t stage = i; stage < end; stage++) {
+                stages[stage].tiled(tiles);
+            }
+            tiles.merge(b);
+            i = end;
+            continue;
+        }
+
+        // Gather the run of filters with planar versions starting here, and use planes if one of them gains enough
+        end  = i;
+        pays = false;
+        while (end < stages.size() && stages[end].planar && (!alpha_correct || stages[end].alpha == stages[i].alpha)) {
+            pays = pays || stages[end].prefers_planes;
+            end++;
+        }
+        if (pays && PlanarImage::canSplit(b)) {
+            PlanarImage planes(b);
+            for (size_t stage = i; stage < end; stage++) {
+                stages[stage].planar(planes);
+            }
+            planes.merge(b);
+            i = end;
+            continue;
+        }
+
+        if (!stages[i].rows) {
+            stages[i].image(b);
+            i++;
+            continue;
+        }
+
+        // Gather the run of point-wise filters starting here.  Two or more tables in a row become one, when
+        // the image's channels are whole bytes (cell shade works on the bytes, so it only composes then)
+        std::vector<std::function<void(Bitmap&, int, int)>> passes;
+        end = i;
+        while (end < stages.size() && stages[end].rows) {
+            size_t next = end + 1;
+            while (next < stages.size() && stages[next].rows && stages[next].lookup && stages[end].lookup) next++;
+
+            if (next - end > 1 && PlanarImage::canSplit(b)) {
+                std::shared_ptr<PointOp> op = std::make_shared<PointOp>(*stages[end].lookup);
+                for (size_t stage = end; stage < next; stage++) {
+                    std::cout << stages[stage].name << std::endl;
+                    if (stage > end) *op = op->then(*stages[stage].lookup);
+                }
+                passes.push_back([op](Bitmap& b, int first, int last) { applyPointOpRows(b, *op, first, last); });
+            }
+            else {
+                for (size_t stage = end; stage < next; stage++) {
+                    std::cout << stages[stage].name << std::endl;
+                    passes.push_back(stages[stage].rows);
+                }
+            }
+            end = next;
+        }
+
+        int chunk = std::max(1, FUSED_BYTES / std::max(1, b.width_in_pixels * (b.color_depth / 8)));
+
+        parallelRows(b.height_in_pixels, [&](int first, int last) {
+            for (int y = first; y < last; y += chunk) {
+                for (const auto& pass : passes) {
+                    pass(b, y, std::min(y + chunk, last));
+                }
+            }
+        });
+        i = end;
+    }
+
+    if (alpha_correct) unpremultiply(b);
+}
+
+size_t Pipeline::size() const {
+    return stages.size();
+}
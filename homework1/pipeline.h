@@ -0,0 +1,170 @@
+// Author:  Charles Lucas
+// CS510
+//
+// An ordered list of filters run on one image, so a chain of transforms
+// costs one load and one store instead of a round trip through disk per
+// filter.
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include "bitmap.h"
+
+class PlanarImage;
+class TiledImage;
+struct PointOp;
+struct ConvolutionKernel;
+
+class Pipeline
+{
+public:
+    /**
+     * Append the filter for a command line option (-c, -g, -b3.5, -r90, ...).
+     * -n adds nothing, -alpha makes the whole pipeline alpha-correct, and
+     * -stats:<file> writes the statistics of the image at that point to file.
+     * Convolutions (-sharpen, -emboss, -edges, -box, -kernel:...) take a
+     * :mirror or :clamp suffix for their borders (clamp if not given).
+     *
+     * @return false if the option isn't a filter.
+     */
+    bool add(const std::string& option);
+
+    /**
+     * Run every filter in order.
+     * Runs of point-wise filters (cell shade, grayscale, gamma, ...) are fused:
+     * each band of rows goes through all of them while it is still in cache,
+     * so the whole run costs one sweep over the image.  Neighbouring filters
+     * that are per-channel tables are composed into one table first, so they
+     * cost one lookup per byte between them.
+     * Runs of filters that have planar versions are done on a PlanarImage
+     * when the run includes one that is much faster on planes (pixelate),
+     * since that pays for splitting the image and merging it back.  Runs of
+     * rotations and flips are done on a TiledImage the same way, when the run
+     * has one that is slow on rows (anything but -v and -h).
+     * With -alpha, an image with alpha is premultiplied for the filters that
+     * average pixels and goes back to straight alpha for the point-wise ones
+     * and at the end.
+     *
+     * @throws BitmapException if an overlay can't be read or statistics can't be written.
+     */
+    void run(Bitmap& b) const;
+
+    size_t size() const;
+
+private:
+    /**
+     * The form of alpha a filter needs when filtering alpha-correctly.
+     */
+    enum class Alpha
+    {
+        Either,          // Moves whole pixels (rotations, flips, grow, overlays)
+        Straight,        // Point-wise (cell shade, grayscale, levels, gamma, invert, posterize) and statistics
+        Premultiplied    // Averages pixels (blur, pixelate, shrink, resize)
+    };
+
+    struct Stage
+    {
+        std::string                            name;    // What run() prints for a point-wise filter
+        std::function<void(Bitmap&)>           image;   // The filter on the whole image (unset for point-wise filters)
+        std::function<void(Bitmap&, int, int)> rows;    // Point-wise filters only: the filter on rows first..last-1
+        std::function<void(PlanarImage&)>      planar;  // The filter on planes, if it has a planar version
+        bool                                   prefers_planes = false;  // Fast enough on planes to be worth splitting the image for
+        Alpha                                  alpha          = Alpha::Either;
+        std::shared_ptr<const PointOp>         lookup;  // Point-wise filters that map each channel on its own: their tables
+        std::function<void(TiledImage&)>       tiled;   // Rotations and flips: the filter on tiles
+        bool                                   prefers_tiles  = false;  // Slow enough on rows to be worth tiling the image for
+
+        // A filter on the whole image, and its version on planes if it has one
+        Stage(std::function<void(Bitmap&)> image, Alpha alpha, std::function<void(PlanarImage&)> planar = nullptr,
+              bool prefers_planes = false);
+
+        // A point-wise filter, which prints name when it runs
+        Stage(const std::string& name, std::function<void(Bitmap&, int, int)> rows, std::function<void(PlanarImage&)> planar,
+              std::shared_ptr<const PointOp> lookup = nullptr);
+    };
+
+    /**
+     * Append a point-wise filter that is a table per channel.
+     */
+    void addPointOp(const std::string& name, const PointOp& op);
+
+    std::vector<Stage> stages;
+    bool               alpha_correct = false;   // Set by -alpha
+};
+
+/**
+ * Read the sigma out of a -b<sigma> option.
+ *
+ * @return false if the option isn't one, or its sigma isn't more than 0 and
+ *         at most MAX_BLUR_SIGMA.
+ */
+bool parseSigma(const std::string& option, double& sigma);
+
+/**
+ * Read the clip percentage out of a -levels or -levels<percent> option
+ * (0 to 50, 0 if not given), as a fraction.
+ *
+ * @return false if the option isn't one.
+ */
+bool parseLevels(const std::string& option, double& clip);
+
+/**
+ * Read the gamma out of a -gamma<gamma> option.
+ *
+ * @return false if the option isn't one, or the gamma isn't positive.
+ */
+bool parseGamma(const std::string& option, double& gamma);
+
+/**
+ * Read the block size out of a -p<size> or -p<width>x<height> option.
+ *
+ * @return false if the option isn't one.
+ */
+bool parseBlockSize(const std::string& option, int& width, int& height);
+
+/**
+ * Read the size and filter out of a -resize<width>x<height>[:filter] option,
+ * where the filter is nearest, box, bilinear, bicubic (the default) or lanczos.
+ *
+ * @return false if the option isn't one.
+ */
+bool parseResize(const std::string& option, int& width, int& height, ResampleFilter& filter);
+
+/**
+ * Read the number of levels out of a -posterize or -posterize<levels> option
+ * (4 if not given, 2 to 256).
+ *
+ * @return false if the option isn't one.
+ */
+bool parsePosterize(const std::string& option, int& levels);
+
+/**
+ * Read the size out of a -box or -box<size> option (3 if not given, and odd).
+ *
+ * @return false if the option isn't one, or its size is past MAX_KERNEL_SIZE.
+ */
+bool parseBoxSize(const std::string& option, int& size);
+
+/**
+ * Read the kernel out of a -kernel:<weight>,<weight>,...[/<divisor>] option,
+ * with the weights of a square kernel of odd size row by row from the top.
+ *
+ * @return false if the option isn't one, or it's past MAX_KERNEL_SIZE,
+ *         MAX_KERNEL_WEIGHT or MAX_KERNEL_DIVISOR.
+ */
+bool parseKernel(const std::string& option, ConvolutionKernel& kernel);
+
+/**
+ * Read the file and position out of a -overlay:<file>[@<x>,<y>] option,
+ * which composites the file over the image with its top left corner at
+ * (x, y) from the image's top left (0,0 if no position is given).
+ *
+ * @return false if the option isn't one.
+ */
+bool parseOverlay(const std::string& option, std::string& path, int& x, int& y);
+
+#endif
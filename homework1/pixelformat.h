@@ -0,0 +1,242 @@
+// Author:  Charles Lucas
+// CS510
+//
+// Pixel formats and row spans used to write the filters as row kernels.
+//
+// Each format knows how to load and store one pixel at compile time, so a
+// kernel written once as a template over the format gets instantiated with
+// the depth and channel layout baked in.  withPixelFormat() picks the right
+// instantiation for an image once, outside the pixel loops.
+
+#ifndef PIXELFORMAT_H
+#define PIXELFORMAT_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include "bitmap.h"
+#include "bitmap_simd.h"
+
+/**
+ * Color - the 8-bit channel values of one pixel
+ */
+struct Color
+{
+    uint red;
+    uint green;
+    uint blue;
+    uint alpha;
+};
+
+/**
+ * BGR24 - 24-bit pixels, stored as blue, green, red bytes
+ */
+struct BGR24
+{
+    static const int bytes = 3;
+
+    void load(const uint8_t *p, Color &c) const {
+        c.blue  = p[0];
+        c.green = p[1];
+        c.red   = p[2];
+        c.alpha = 0;
+    }
+    void store(uint8_t *p, const Color &c) const {
+        p[0] = (uint8_t)c.blue;
+        p[1] = (uint8_t)c.green;
+        p[2] = (uint8_t)c.red;
+    }
+};
+
+/**
+ * Masked32 - 32-bit pixels whose 8-bit channel masks are known at compile time.
+ * Bits outside the masks are written as 0, the same as Bitmap::writePixel.
+ */
+template<uint32_t RedMask, uint32_t GreenMask, uint32_t BlueMask, uint32_t AlphaMask>
+struct Masked32
+{
+    static const int bytes = 4;
+
+    static constexpr uint32_t shift(uint32_t mask) { return (mask != 0) ? __builtin_ctz(mask) : 0; }
+
+    void load(const uint8_t *p, Color &c) const {
+        uint32_t value;
+        memcpy(&value, p, 4);
+        c.red   = (value & RedMask)   >> shift(RedMask);
+        c.green = (value & GreenMask) >> shift(GreenMask);
+        c.blue  = (value & BlueMask)  >> shift(BlueMask);
+        c.alpha = (value & AlphaMask) >> shift(AlphaMask);
+    }
+    void store(uint8_t *p, const Color &c) const {
+        uint32_t value = ((c.red   << shift(RedMask))   & RedMask)
+                       | ((c.green << shift(GreenMask)) & GreenMask)
+                       | ((c.blue  << shift(BlueMask))  & BlueMask)
+                       | ((c.alpha << shift(AlphaMask)) & AlphaMask);
+        memcpy(p, &value, 4);
+    }
+};
+
+// Bytes in memory:  blue, green, red, alpha
+typedef Masked32<0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000> BGRA32;
+
+// Bytes in memory:  unused, blue, green, red (what our 32-bit examples use)
+typedef Masked32<0xFF000000, 0x00FF0000, 0x0000FF00, 0x00000000> XBGR32;
+
+/**
+ * AnyMasked32 - 32-bit pixels with any other masks, decoded through the image's PixelFormat
+ */
+struct AnyMasked32
+{
+    static const int bytes = 4;
+    PixelFormat format;
+
+    AnyMasked32() {}
+    explicit AnyMasked32(const PixelFormat &f) : format(f) {}
+
+    void load(const uint8_t *p, Color &c) const {
+        uint32_t value;
+        memcpy(&value, p, 4);
+        c.red   = format.red  .read(value);
+        c.green = format.green.read(value);
+        c.blue  = format.blue .read(value);
+        c.alpha = format.alpha.read(value);
+    }
+    void store(uint8_t *p, const Color &c) const {
+        uint32_t value = format.red  .write(c.red)
+                       | format.green.write(c.green)
+                       | format.blue .write(c.blue)
+                       | format.alpha.write(c.alpha);
+        memcpy(p, &value, 4);
+    }
+};
+
+/**
+ * RowSpan - one row of pixels in a given format
+ */
+template<typename Format>
+struct RowSpan
+{
+    uint8_t *pixels;
+    int      width;
+    Format   format;
+
+    void load (int x, Color &c) const       { format.load (pixels + (ptrdiff_t)x * Format::bytes, c); }
+    void store(int x, const Color &c) const { format.store(pixels + (ptrdiff_t)x * Format::bytes, c); }
+};
+
+template<typename Format>
+RowSpan<Format> rowSpan(Bitmap &b, int y, const Format &format) {
+    return RowSpan<Format>{(uint8_t*)b.row(y), b.width_in_pixels, format};
+}
+
+// A row of a const image (mapped or in data) - only load from it
+template<typename Format>
+RowSpan<Format> rowSpan(const Bitmap &b, int y, const Format &format) {
+    return RowSpan<Format>{(uint8_t*)b.row(y), b.width_in_pixels, format};
+}
+
+/**
+ * Call kernel(format) with the pixel format matching the image.
+ * kernel is a generic lambda (or functor), so each format gets its own instantiation.
+ */
+template<typename Kernel>
+void withPixelFormat(const Bitmap &b, Kernel &&kernel) {
+    if (b.color_depth == 24) {
+        kernel(BGR24());
+    }
+    else if (b.red_mask == 0x00FF0000 && b.green_mask == 0x0000FF00 && b.blue_mask == 0x000000FF && b.alpha_mask == 0xFF000000) {
+        kernel(BGRA32());
+    }
+    else if (b.red_mask == 0xFF000000 && b.green_mask == 0x00FF0000 && b.blue_mask == 0x0000FF00 && b.alpha_mask == 0x00000000) {
+        kernel(XBGR32());
+    }
+    else {
+        kernel(AnyMasked32(b.format));
+    }
+}
+
+// Spread a row out to blue, green, red, alpha bytes, and put them back
+template<typename Format>
+inline void unpackPixels(const uint8_t *row, int width, uint8_t *pixels, const Format& format) {
+    Color c;
+    for (int x = 0; x < width; x++) {
+        format.load(row + x * Format::bytes, c);
+        pixels[x*4 + 0] = c.blue;
+        pixels[x*4 + 1] = c.green;
+        pixels[x*4 + 2] = c.red;
+        pixels[x*4 + 3] = c.alpha;
+    }
+}
+template<typename Format>
+inline void packPixels(const uint8_t *pixels, int width, uint8_t *row, const Format& format) {
+    for (int x = 0; x < width; x++) {
+        format.store(row + x * Format::bytes, Color{pixels[x*4 + 2], pixels[x*4 + 1], pixels[x*4 + 0], pixels[x*4 + 3]});
+    }
+}
+inline void unpackPixels(const uint8_t *row, int width, uint8_t *pixels, const BGR24&) {
+    expandBGR24(row, width, pixels, getSimdLevel());
+}
+inline void packPixels(const uint8_t *pixels, int width, uint8_t *row, const BGR24&) {
+    compressBGR24(pixels, width, row, getSimdLevel());
+}
+inline void unpackPixels(const uint8_t *row, int width, uint8_t *pixels, const BGRA32&) {
+    memcpy(pixels, row, (size_t)width * 4);
+}
+inline void packPixels(const uint8_t *pixels, int width, uint8_t *row, const BGRA32&) {
+    memcpy(row, pixels, (size_t)width * 4);
+}
+
+// Split a row into blue/green/red channel bytes, and put them back keeping each pixel's alpha
+template<typename Format>
+inline void unpackChannels(const uint8_t *row, int width, uint8_t *channels, const Format& format) {
+    Color c;
+    for (int x = 0; x < width; x++) {
+        format.load(row + x * Format::bytes, c);
+        channels[x*3 + 0] = c.blue;
+        channels[x*3 + 1] = c.green;
+        channels[x*3 + 2] = c.red;
+    }
+}
+template<typename Format>
+inline void packChannels(const uint8_t *channels, int width, uint8_t *row, const Format& format) {
+    Color c;
+    for (int x = 0; x < width; x++) {
+        format.load(row + x * Format::bytes, c);
+        c.blue  = channels[x*3 + 0];
+        c.green = channels[x*3 + 1];
+        c.red   = channels[x*3 + 2];
+        format.store(row + x * Format::bytes, c);
+    }
+}
+inline void unpackChannels(const uint8_t *row, int width, uint8_t *channels, const BGR24&) {
+    memcpy(channels, row, width * 3);
+}
+inline void packChannels(const uint8_t *channels, int width, uint8_t *row, const BGR24&) {
+    memcpy(row, channels, width * 3);
+}
+
+// Reverse the order of count pixels in place
+inline void reversePixels(uint8_t *pixels, size_t count, int bytes) {
+    uint8_t *left  = pixels;
+    uint8_t *right = pixels + (count - 1) * bytes;
+    uint8_t  temp[4];
+
+    for (; left < right; left += bytes, right -= bytes) {
+        memcpy(temp,  left,  bytes);
+        memcpy(left,  right, bytes);
+        memcpy(right, temp,  bytes);
+    }
+}
+
+// Clear the bits of every 32-bit pixel that aren't in any channel mask
+// (writePixel never sets them, so a transformed image doesn't either)
+inline void clearUnusedBits(uint8_t *pixels, size_t count, uint32_t keep) {
+    for (size_t i = 0; i < count; i++, pixels += 4) {
+        uint32_t value;
+        memcpy(&value, pixels, 4);
+        value &= keep;
+        memcpy(pixels, &value, 4);
+    }
+}
+
+#endif
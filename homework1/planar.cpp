@@ -0,0 +1,98 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "planar.h"
+#include "bitmap_simd.h"
+#include "threadpool.h"
+
+// The plane holding a channel, or -1 if the mask isn't exactly one byte
+static int bytePlane(uint32_t mask) {
+    for (int k = 0; k < 4; k++) {
+        if (mask == 0xFFu << (8 * k)) return k;
+    }
+    return -1;
+}
+
+bool PlanarImage::canSplit(const Bitmap& b) {
+    if (b.color_depth == 24) {
+        return true;
+    }
+
+    int red   = bytePlane(b.red_mask);
+    int green = bytePlane(b.green_mask);
+    int blue  = bytePlane(b.blue_mask);
+    int alpha = b.alpha_mask ? bytePlane(b.alpha_mask) : -2;
+
+    return red >= 0 && green >= 0 && blue >= 0 && alpha != -1 &&
+           red != green && red != blue && green != blue && alpha != red && alpha != green && alpha != blue;
+}
+
+PlanarImage::PlanarImage(const Bitmap& b) {
+    if (!canSplit(b)) {
+        throw(BitmapException("Error - only images with 8-bit channels can be split into planes", 0));
+    }
+
+    width  = b.width_in_pixels;
+    height = b.height_in_pixels;
+    count  = b.color_depth / 8;
+    premultiplied = b.premultiplied;
+    pitch  = ((size_t)width + PLANE_ALIGNMENT - 1) / PLANE_ALIGNMENT * PLANE_ALIGNMENT;
+
+    if (count == 3) {
+        blue  = 0;
+        green = 1;
+        red   = 2;
+    }
+    else {
+        red   = bytePlane(b.red_mask);
+        green = bytePlane(b.green_mask);
+        blue  = bytePlane(b.blue_mask);
+        alpha = b.alpha_mask ? bytePlane(b.alpha_mask) : -1;
+        if (alpha < 0) unused = 6 - red - green - blue;   // The one byte left over
+    }
+
+    header.copyHeader(b);
+
+    // Every plane and the spare in one pooled block, each plane starting on a cache line
+    size_t plane_size = pitch * height;
+    memory.resize(plane_size * (count + 1) + 1);
+    for (int k = 0; k < count; k++) {
+        planes[k] = memory.data() + k * plane_size;
+    }
+    spare = memory.data() + count * plane_size;
+
+    parallelRows(height, [&](int first, int last) {
+        for (int y = first; y < last; y++) {
+            uint8_t *targets[4];
+            for (int k = 0; k < count; k++) targets[k] = row(k, y);
+            splitPixels((const uint8_t*)b.row(y), width, count, targets, getSimdLevel());
+        }
+    });
+}
+
+void PlanarImage::merge(Bitmap& b) const {
+    b.copyHeaderForPixels(header);
+
+    parallelRows(height, [&](int first, int last) {
+        for (int y = first; y < last; y++) {
+            const uint8_t *sources[4];
+            for (int k = 0; k < count; k++) sources[k] = row(k, y);
+            mergePixels(sources, width, count, (uint8_t*)b.row(y), getSimdLevel());
+        }
+    });
+}
+
+void PlanarImage::swapSpare(int plane) {
+    std::swap(planes[plane], spare);
+}
+
+void applyFilter(PlanarImage& p, const std::function<void(Bitmap&)>& filter) {
+    Bitmap b;
+
+    p.merge(b);
+    filter(b);
+    p = PlanarImage(b);   // The filter may have changed the size, but not the channels
+}
@@ -0,0 +1,96 @@
+// Author:  Charles Lucas
+// CS510
+//
+// Planar images: each byte of a pixel in its own plane, so channel-wise
+// filters run straight down contiguous bytes with no shuffling.  Images are
+// split into planes once, run through any number of filters, and merged back.
+
+#ifndef PLANAR_H
+#define PLANAR_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include "bitmap.h"
+#include "bufferpool.h"
+
+#define PLANE_ALIGNMENT 64   // Planes start on a cache line, and rows are padded to a whole number of AVX2 vectors
+
+/**
+ * PlanarImage - an image with every byte of its pixels split out into planes.
+ *
+ * Plane k holds byte k of each pixel as it is in memory, so a 24-bit image
+ * has blue, green and red planes and a 32-bit image has four.  Splitting
+ * and merging move whole bytes, so a round trip gives back exactly the
+ * pixels it started with, bits outside the channel masks included.
+ * Only images whose channels are whole bytes can be split (canSplit()).
+ */
+class PlanarImage
+{
+public:
+    /**
+     * Split a loaded or mapped image into planes.
+     *
+     * @throws BitmapException if the channels aren't whole bytes.
+     */
+    explicit PlanarImage(const Bitmap& b);
+
+    PlanarImage(const PlanarImage&) = delete;
+    PlanarImage& operator=(const PlanarImage&) = delete;
+    PlanarImage(PlanarImage&&) = default;
+    PlanarImage& operator=(PlanarImage&&) = default;
+
+    /**
+     * Whether every channel of the image is a whole byte of the pixel.
+     */
+    static bool canSplit(const Bitmap& b);
+
+    /**
+     * Merge the planes back into pixels in b, which gets this image's header.
+     */
+    void merge(Bitmap& b) const;
+
+    uint8_t*       row(int plane, int y)       { return planes[plane] + (size_t)y * pitch; }
+    const uint8_t* row(int plane, int y) const { return planes[plane] + (size_t)y * pitch; }
+
+    /**
+     * The spare plane: filters that can't work in place write a plane here
+     * and swap it in with swapSpare().
+     */
+    uint8_t* spareRow(int y) { return spare + (size_t)y * pitch; }
+    void     swapSpare(int plane);
+
+    int    width;
+    int    height;
+    size_t pitch;           // Bytes between rows of a plane (width rounded up to PLANE_ALIGNMENT)
+    int    count;           // Number of planes (bytes per pixel)
+    int    red, green, blue;
+    int    alpha  = -1;     // Plane holding alpha, or -1
+    int    unused = -1;     // Plane no channel uses (32-bit images without alpha), or -1
+    bool   premultiplied;   // The colors are multiplied by alpha, so the filters that average pixels average alpha too
+
+private:
+    Bitmap                                  header;   // The source image without its pixels
+    PooledVector<uint8_t>                   memory;   // Every plane, then the spare
+    uint8_t                                *planes[4];
+    uint8_t                                *spare;
+};
+
+/**
+ * The filters that work on planes.  Each one gives exactly the bytes the
+ * Bitmap version would.
+ */
+void cellShade(PlanarImage& p);
+void grayscale(PlanarImage& p);
+void blur(PlanarImage& p);
+void blur(PlanarImage& p, double sigma);
+void pixelate(PlanarImage& p);
+void pixelate(PlanarImage& p, int block_width, int block_height);
+
+/**
+ * Run any Bitmap filter on a planar image, by merging it, filtering and
+ * splitting it again.
+ */
+void applyFilter(PlanarImage& p, const std::function<void(Bitmap&)>& filter);
+
+#endif
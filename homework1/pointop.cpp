@@ -0,0 +1,176 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <iostream>
+#include <cmath>
+#include <cstring>
+#include "pointop.h"
+#include "pixelformat.h"
+#include "threadpool.h"
+
+static constexpr ByteTable identity_table  = makeTable([](int v) { return v; });
+static constexpr ByteTable zero_table      = makeTable([](int) { return 0; });
+static constexpr ByteTable cell_table      = makeTable([](int v) { return v <= 64 ? 0 : v < 192 ? 127 : 255; });
+static constexpr ByteTable inverse_table   = makeTable([](int v) { return 255 - v; });
+
+PointOp::PointOp()
+    : red(identity_table), green(identity_table), blue(identity_table), alpha(identity_table), other(zero_table) {
+}
+
+PointOp::PointOp(const ByteTable& colors)
+    : red(colors), green(colors), blue(colors), alpha(identity_table), other(zero_table) {
+}
+
+PointOp PointOp::then(const PointOp& next) const {
+    PointOp composed;
+
+    for (int v = 0; v < 256; v++) {
+        composed.red[v]   = next.red[red[v]];
+        composed.green[v] = next.green[green[v]];
+        composed.blue[v]  = next.blue[blue[v]];
+        composed.alpha[v] = next.alpha[alpha[v]];
+        composed.other[v] = next.other[other[v]];
+    }
+    return composed;
+}
+
+PointOp cellShadeOp() {
+    PointOp op(cell_table);
+
+    op.alpha = op.other = cell_table;
+    return op;
+}
+
+PointOp invertOp() {
+    return PointOp(inverse_table);
+}
+
+PointOp posterizeOp(int levels) {
+    if (levels < 2 || levels > 256) {
+        throw(BitmapException("Error - posterize levels have to be 2 to 256", 0));
+    }
+
+    int steps = levels - 1;
+    return PointOp(makeTable([steps](int v) { return ((v * steps + 127) / 255 * 255 + steps / 2) / steps; }));
+}
+
+PointOp gammaOp(double gamma) {
+    if (!(gamma > 0)) {
+        throw(BitmapException("Error - gamma has to be positive", 0));
+    }
+    return PointOp(makeTable([gamma](int v) { return (int)std::lround(255.0 * std::pow(v / 255.0, 1.0 / gamma)); }));
+}
+
+// Point each byte of a pixel at the table for the channel it holds.
+// Fails if a channel isn't a whole byte
+static bool byteLanes(const Bitmap& b, const PointOp& op, const uint8_t **lanes) {
+    if (b.color_depth == 24) {
+        lanes[0] = op.blue.data();
+        lanes[1] = op.green.data();
+        lanes[2] = op.red.data();
+        return true;
+    }
+
+    const std::pair<uint32_t, const ByteTable*> channels[4] = {
+        {b.red_mask, &op.red}, {b.green_mask, &op.green}, {b.blue_mask, &op.blue}, {b.alpha_mask, &op.alpha}
+    };
+    for (int k = 0; k < 4; k++) lanes[k] = op.other.data();
+    for (const auto& channel : channels) {
+        if (channel.first == 0) continue;   // No alpha
+
+        int k = 0;
+        while (k < 4 && channel.first != 0xFFu << (8 * k)) k++;
+        if (k == 4) return false;
+        lanes[k] = channel.second->data();
+    }
+    return true;
+}
+
+// Look up byte k of each of count pixels in lanes[k].  Each lookup depends on the load before
+// it, so the loops are unrolled to keep several in flight
+static void lookupPixels(uint8_t *pixels, size_t count, int bytes, const uint8_t *const *lanes) {
+    bool same = true;
+    for (int k = 1; k < bytes; k++) {
+        same = same && memcmp(lanes[k], lanes[0], 256) == 0;
+    }
+
+    if (same) {
+        const uint8_t *table  = lanes[0];
+        size_t         length = count * bytes;
+        size_t         i = 0;
+
+        for (; i + 8 <= length; i += 8) {
+            uint8_t v0 = table[pixels[i + 0]], v1 = table[pixels[i + 1]], v2 = table[pixels[i + 2]], v3 = table[pixels[i + 3]];
+            uint8_t v4 = table[pixels[i + 4]], v5 = table[pixels[i + 5]], v6 = table[pixels[i + 6]], v7 = table[pixels[i + 7]];
+            pixels[i + 0] = v0;  pixels[i + 1] = v1;  pixels[i + 2] = v2;  pixels[i + 3] = v3;
+            pixels[i + 4] = v4;  pixels[i + 5] = v5;  pixels[i + 6] = v6;  pixels[i + 7] = v7;
+        }
+        for (; i < length; i++) {
+            pixels[i] = table[pixels[i]];
+        }
+        return;
+    }
+
+    if (bytes == 3) {
+        for (size_t i = 0; i < count; i++, pixels += 3) {
+            uint8_t v0 = lanes[0][pixels[0]], v1 = lanes[1][pixels[1]], v2 = lanes[2][pixels[2]];
+            pixels[0] = v0;  pixels[1] = v1;  pixels[2] = v2;
+        }
+    }
+    else {
+        for (size_t i = 0; i < count; i++, pixels += 4) {
+            uint8_t v0 = lanes[0][pixels[0]], v1 = lanes[1][pixels[1]], v2 = lanes[2][pixels[2]], v3 = lanes[3][pixels[3]];
+            pixels[0] = v0;  pixels[1] = v1;  pixels[2] = v2;  pixels[3] = v3;
+        }
+    }
+}
+
+void applyPointOp(Bitmap& b, const PointOp& op) {
+    parallelRows(b.height_in_pixels, [&](int first, int last) {
+        applyPointOpRows(b, op, first, last);
+    });
+}
+
+void applyPointOpRows(Bitmap& b, const PointOp& op, int first, int last) {
+    const uint8_t *lanes[4];
+
+    // The rows are stored back to back, so the band is one run of pixels
+    if (byteLanes(b, op, lanes)) {
+        lookupPixels((uint8_t*)b.row(first), (size_t)(last - first) * b.width_in_pixels, b.color_depth / 8, lanes);
+        return;
+    }
+
+    withPixelFormat(b, [&](auto format) {
+        Color c;
+
+        for (int y = first; y < last; y++) {
+            auto row = rowSpan(b, y, format);
+            for (int x = 0; x < b.width_in_pixels; x++) {
+                row.load(x, c);
+                c.red   = op.red[c.red];
+                c.green = op.green[c.green];
+                c.blue  = op.blue[c.blue];
+                c.alpha = op.alpha[c.alpha];
+                row.store(x, c);
+            }
+        }
+    });
+}
+
+void invert(Bitmap& b) {
+    std::cout << "Applying invert transform." << std::endl;
+
+    applyPointOp(b, invertOp());
+}
+
+void posterize(Bitmap& b, int levels) {
+    std::cout << "Applying posterize transform (" << levels << " levels)." << std::endl;
+
+    applyPointOp(b, posterizeOp(levels));
+}
+
+void gammaCorrect(Bitmap& b, double gamma) {
+    std::cout << "Applying gamma transform." << std::endl;
+
+    applyPointOp(b, gammaOp(gamma));
+}
@@ -0,0 +1,97 @@
+// Author:  Charles Lucas
+// CS510
+//
+// Point operations: filters that map each channel value on its own, kept as
+// a 256-entry table per channel.  Tables compose, so any chain of point
+// operations costs one table lookup per byte.
+
+#ifndef POINTOP_H
+#define POINTOP_H
+
+#include <cstdint>
+#include <array>
+#include "bitmap.h"
+
+typedef std::array<uint8_t, 256> ByteTable;
+
+/**
+ * The table of f(0) .. f(255), clamped to 0..255.  f can be a constexpr
+ * lambda, to build the table at compile time.
+ */
+template<typename Function>
+constexpr ByteTable makeTable(Function f) {
+    ByteTable table{};
+    for (int v = 0; v < 256; v++) {
+        int value = f(v);
+        table[v] = (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+    }
+    return table;
+}
+
+/**
+ * PointOp - a table for each channel of a pixel.
+ */
+struct PointOp
+{
+    ByteTable red;
+    ByteTable green;
+    ByteTable blue;
+    ByteTable alpha;
+    ByteTable other;   // Bytes of 32-bit pixels that aren't in any channel
+
+    /**
+     * The op that leaves every channel as it is and clears the bits outside
+     * the channels, the way writePixel does.
+     */
+    PointOp();
+
+    /**
+     * The op with the same table for red, green and blue.
+     */
+    explicit PointOp(const ByteTable& colors);
+
+    /**
+     * The op that does this one and then next.
+     */
+    PointOp then(const PointOp& next) const;
+};
+
+/**
+ * The ops behind the point-wise filters.  cellShadeOp() maps every byte of
+ * the pixels, alpha included, the same as cellShade() does.
+ */
+PointOp cellShadeOp();
+PointOp invertOp();
+
+/**
+ * Round each color channel to the nearest of levels evenly spaced values
+ * from 0 to 255.
+ *
+ * @throws BitmapException if levels isn't 2 to 256.
+ */
+PointOp posterizeOp(int levels);
+
+/**
+ * A gamma correction: out = 255 * (in / 255)^(1 / gamma), rounded, so a
+ * gamma above 1 brightens.
+ *
+ * @throws BitmapException if gamma isn't positive.
+ */
+PointOp gammaOp(double gamma);
+
+/**
+ * Run every pixel through the op.  Images whose channels are whole bytes are
+ * looked up a byte at a time, straight over the rows; others go through
+ * their pixel format.
+ */
+void applyPointOp(Bitmap& b, const PointOp& op);
+void applyPointOpRows(Bitmap& b, const PointOp& op, int first, int last);
+
+/**
+ * The filters built on the ops above.
+ */
+void invert(Bitmap& b);
+void posterize(Bitmap& b, int levels);
+void gammaCorrect(Bitmap& b, double gamma);
+
+#endif
@@ -0,0 +1,251 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "resultcache.h"
+
+#if defined(__linux__) && __has_include(<linux/fs.h>)
+#include <linux/fs.h>
+#endif
+
+static const uint64_t PRIME1 = 11400714785074694791ull;
+static const uint64_t PRIME2 = 14029467366897019727ull;
+static const uint64_t PRIME3 = 1609587929392839161ull;
+static const uint64_t PRIME4 = 9650029242287828579ull;
+static const uint64_t PRIME5 = 2870177450012600261ull;
+
+static inline uint64_t rotateLeft(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hashRound(uint64_t lane, uint64_t input) {
+    return rotateLeft(lane + input * PRIME2, 31) * PRIME1;
+}
+
+static inline uint64_t mergeRound(uint64_t hash, uint64_t lane) {
+    return (hash ^ hashRound(0, lane)) * PRIME1 + PRIME4;
+}
+
+/**
+ * XXH64 with several seeds in one sweep over the bytes.  Four lanes per seed
+ * take 8 bytes each from every 32 byte stripe, so the multiplies of one lane
+ * don't wait on another's, and are folded together at the end with whatever
+ * is left over.  Each stripe is read once for all the seeds.
+ */
+template<int Seeds>
+static void hashSeeds(const void *data, size_t size, const uint64_t (&seeds)[Seeds], uint64_t (&hashes)[Seeds]) {
+    const uint8_t *start = (const uint8_t*)data;
+    const uint8_t *end   = start + size;
+    const uint8_t *p     = start;
+
+    if (size >= 32) {
+        uint64_t lanes[Seeds][4];
+        for (int s = 0; s < Seeds; s++) {
+            lanes[s][0] = seeds[s] + PRIME1 + PRIME2;
+            lanes[s][1] = seeds[s] + PRIME2;
+            lanes[s][2] = seeds[s];
+            lanes[s][3] = seeds[s] - PRIME1;
+        }
+
+        for (; p + 32 <= end; p += 32) {
+            uint64_t words[4] = {read64(p), read64(p + 8), read64(p + 16), read64(p + 24)};
+            for (int s = 0; s < Seeds; s++) {
+                for (int k = 0; k < 4; k++) lanes[s][k] = hashRound(lanes[s][k], words[k]);
+            }
+        }
+        for (int s = 0; s < Seeds; s++) {
+            hashes[s] = rotateLeft(lanes[s][0], 1) + rotateLeft(lanes[s][1], 7) + rotateLeft(lanes[s][2], 12) + rotateLeft(lanes[s][3], 18);
+            for (uint64_t lane : lanes[s]) hashes[s] = mergeRound(hashes[s], lane);
+        }
+    }
+    else {
+        for (int s = 0; s < Seeds; s++) hashes[s] = seeds[s] + PRIME5;
+    }
+
+    for (int s = 0; s < Seeds; s++) {
+        uint64_t hash = hashes[s] + size;
+
+        for (p = start + size / 32 * 32; p + 8 <= end; p += 8) {
+            hash = rotateLeft(hash ^ hashRound(0, read64(p)), 27) * PRIME1 + PRIME4;
+        }
+        if (p + 4 <= end) {
+            hash = rotateLeft(hash ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+            p += 4;
+        }
+        for (; p < end; p++) {
+            hash = rotateLeft(hash ^ (*p * PRIME5), 11) * PRIME1;
+        }
+
+        hash ^= hash >> 33;
+        hash *= PRIME2;
+        hash ^= hash >> 29;
+        hash *= PRIME3;
+        hash ^= hash >> 32;
+        hashes[s] = hash;
+    }
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed) {
+    uint64_t seeds[1] = {seed};
+    uint64_t hashes[1];
+
+    hashSeeds(data, size, seeds, hashes);
+    return hashes[0];
+}
+
+bool canCache(const std::string& option) {
+    return option.compare(0, 7, "-stats:") != 0 && option.compare(0, 9, "-overlay:") != 0;
+}
+
+const char* cacheHitName(CacheHit hit) {
+    switch (hit) {
+        case CacheHit::Reflink:  return "reflink";
+        case CacheHit::Copy:     return "copy";
+        default:                 return "miss";
+    }
+}
+
+// Two hashes with different seeds, taken in one sweep, as 32 hex digits
+static std::string hashHex(const void *data, size_t size) {
+    const uint64_t seeds[2] = {0, PRIME5};
+    uint64_t       hashes[2];
+    char           text[33];
+
+    hashSeeds(data, size, seeds, hashes);
+    snprintf(text, sizeof(text), "%016llx%016llx", (unsigned long long)hashes[0], (unsigned long long)hashes[1]);
+    return text;
+}
+
+// A name next to path that no other thread or process is using
+static std::string temporaryName(const std::string& path) {
+    static std::atomic<unsigned> count(0);
+    return path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(count++);
+}
+
+// Copy the file at source to a new file at target through a mapping of it
+static bool copyMapped(int in, const std::string& target) {
+    struct stat file_stat;
+    if (fstat(in, &file_stat) != 0) return false;
+
+    int out = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out < 0) return false;
+
+    bool   ok   = true;
+    size_t size = file_stat.st_size;
+    if (size > 0) {
+        void *base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, in, 0);
+        ok = base != MAP_FAILED;
+        if (ok) {
+            madvise(base, size, MADV_SEQUENTIAL);
+            for (size_t done = 0; ok && done < size; ) {
+                ssize_t written = write(out, (const char*)base + done, size - done);
+                if (written < 0 && errno == EINTR) continue;
+                ok = written > 0;
+                if (ok) done += written;
+            }
+            munmap(base, size);
+        }
+    }
+    if (close(out) != 0) ok = false;
+    if (!ok) unlink(target.c_str());
+    return ok;
+}
+
+/**
+ * Put a copy of the file at source at target: a reflink where the filesystem
+ * has them, and a copy otherwise.  Never a hard link, since then writing
+ * into one would change the other.  The file goes to a temporary name first
+ * and is renamed over target, so target is never half written.
+ */
+static CacheHit placeFile(const std::string& source, const std::string& target) {
+    int in = open(source.c_str(), O_RDONLY);
+    if (in < 0) return CacheHit::Miss;
+
+    std::string temp = temporaryName(target);
+    CacheHit    how  = CacheHit::Miss;
+
+#ifdef FICLONE
+    int out = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out >= 0) {
+        if (ioctl(out, FICLONE, in) == 0) how = CacheHit::Reflink;
+        if (close(out) != 0) how = CacheHit::Miss;
+        if (how == CacheHit::Miss) unlink(temp.c_str());
+    }
+#endif
+    if (how == CacheHit::Miss && copyMapped(in, temp)) how = CacheHit::Copy;
+    close(in);
+
+    if (how != CacheHit::Miss && rename(temp.c_str(), target.c_str()) != 0) {
+        unlink(temp.c_str());
+        how = CacheHit::Miss;
+    }
+    return how;
+}
+
+ResultCache::ResultCache(const std::string& directory) : directory(directory) {}
+
+std::string ResultCache::hashFile(const std::string& input) const {
+    struct stat file_stat;
+    int         fd = open(input.c_str(), O_RDONLY);
+
+    if (fd < 0) return "";
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        close(fd);
+        return "";
+    }
+    if (file_stat.st_size == 0) {
+        close(fd);
+        return hashHex("", 0);
+    }
+
+    void *base = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return "";
+    madvise(base, file_stat.st_size, MADV_SEQUENTIAL);
+
+    std::string hash = hashHex(base, file_stat.st_size);
+    munmap(base, file_stat.st_size);
+    return hash;
+}
+
+std::string ResultCache::key(const std::string& file_hash, const std::string& options) const {
+    std::string text = std::to_string(RESULT_CACHE_VERSION) + " " + file_hash + " " + options;
+    return hashHex(text.data(), text.size());
+}
+
+// Entries are spread over 256 directories by the first two digits of their key
+std::string ResultCache::entry(const std::string& key) const {
+    return directory + "/" + key.substr(0, 2) + "/" + key.substr(2) + ".bmp";
+}
+
+CacheHit ResultCache::fetch(const std::string& key, const std::string& output) const {
+    return placeFile(entry(key), output);
+}
+
+void ResultCache::store(const std::string& key, const std::string& output) const {
+    std::string path = entry(key);
+
+    mkdir(directory.c_str(), 0755);
+    mkdir(path.substr(0, path.rfind('/')).c_str(), 0755);
+    placeFile(output, path);
+}
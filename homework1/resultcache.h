@@ -0,0 +1,92 @@
+// Author:  Charles Lucas
+// CS510
+//
+// The result cache: outputs kept on disk under a key made from the bytes of
+// the input file and the options run on it, so running the same options on
+// an unchanged input again costs one hash of the file instead of decoding,
+// filtering and writing it.  Each entry is a finished output file, named by
+// its key, and hits are handed out as a reflink or a copy of it.
+
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#define RESULT_CACHE_VERSION 2   // Part of every key: bump it when a filter's output changes, so old results aren't served
+
+/**
+ * The 64-bit xxHash (XXH64) of size bytes.
+ */
+uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0);
+
+/**
+ * Whether a pipeline with this option can have its result cached.  -stats
+ * writes a file of its own and -overlay reads another image, so neither
+ * depends only on the input and the options.
+ */
+bool canCache(const std::string& option);
+
+/**
+ * How a cached result got to the output.
+ */
+enum class CacheHit
+{
+    Miss,
+    Reflink,    // Shares the entry's blocks, copy-on-write
+    Copy,       // Copied out of a mapping of the entry
+};
+
+const char* cacheHitName(CacheHit hit);
+
+/**
+ * ResultCache - the entries in one directory.
+ *
+ * Entries are written to a temporary name and renamed into place, and so are
+ * outputs, so two processes sharing a cache never see half a file.  Entries
+ * and outputs never share a file (a reflink only shares blocks until one of
+ * them is written), so writing into an output can't change the entry it came
+ * from.  Nothing is ever evicted.
+ */
+class ResultCache
+{
+public:
+    /**
+     * A cache in directory, which is made when the first entry is stored.
+     */
+    explicit ResultCache(const std::string& directory);
+
+    /**
+     * The 128-bit hash of the bytes of the file at input (two seeds of XXH64,
+     * taken in one pass over a mapping of it), or "" if it can't be read.
+     */
+    std::string hashFile(const std::string& input) const;
+
+    /**
+     * The key of running options (as written on the command line) on a file
+     * with hash file_hash.
+     */
+    std::string key(const std::string& file_hash, const std::string& options) const;
+
+    /**
+     * Put the entry for key at output, replacing whatever is there.
+     *
+     * @return how it got there, or CacheHit::Miss if there is no entry (or
+     *         it couldn't be put at output, which is left as it was).
+     */
+    CacheHit fetch(const std::string& key, const std::string& output) const;
+
+    /**
+     * Keep the file at output as the entry for key.  A cache that can't be
+     * written to is quietly skipped.
+     */
+    void store(const std::string& key, const std::string& output) const;
+
+private:
+    std::string entry(const std::string& key) const;
+
+    std::string directory;
+};
+
+#endif
@@ -0,0 +1,194 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <iostream>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include "stats.h"
+#include "pointop.h"
+#include "pixelformat.h"
+#include "threadpool.h"
+
+// Per-band counts.  Even and odd pixels go into separate tables, so runs of
+// the same value (flat areas, which most images are full of) don't make
+// each increment wait for the one before it.
+struct BandCounts
+{
+    uint64_t counts[2][4][256];
+};
+
+template<bool Alpha, typename Format>
+static void countRows(const Bitmap& b, const Format& format, BandCounts& band, int first, int last) {
+    Color c0, c1;
+    int   width = b.width_in_pixels;
+
+    for (int y = first; y < last; y++) {
+        auto source = rowSpan(b, y, format);
+        int  x = 0;
+
+        for (; x + 1 < width; x += 2) {
+            source.load(x, c0);
+            source.load(x + 1, c1);
+            band.counts[0][0][c0.red]++;
+            band.counts[0][1][c0.green]++;
+            band.counts[0][2][c0.blue]++;
+            band.counts[1][0][c1.red]++;
+            band.counts[1][1][c1.green]++;
+            band.counts[1][2][c1.blue]++;
+            if (Alpha) {
+                band.counts[0][3][c0.alpha]++;
+                band.counts[1][3][c1.alpha]++;
+            }
+        }
+        if (x < width) {
+            source.load(x, c0);
+            band.counts[0][0][c0.red]++;
+            band.counts[0][1][c0.green]++;
+            band.counts[0][2][c0.blue]++;
+            if (Alpha) band.counts[0][3][c0.alpha]++;
+        }
+    }
+}
+
+// Work out the moments of a channel from its histogram
+static void finishChannel(ChannelStats& channel, uint64_t pixels) {
+    double sum = 0, squares = 0;
+
+    channel.min = channel.max = 0;
+    channel.mean = channel.stddev = 0;
+    if (pixels == 0) return;
+
+    channel.min = 0;
+    while (channel.histogram[channel.min] == 0) channel.min++;
+    channel.max = 255;
+    while (channel.histogram[channel.max] == 0) channel.max--;
+
+    for (int v = 0; v < 256; v++) {
+        sum     += (double)v * channel.histogram[v];
+        squares += (double)v * v * channel.histogram[v];
+    }
+    channel.mean   = sum / pixels;
+    channel.stddev = std::sqrt(std::max(0.0, squares / pixels - channel.mean * channel.mean));
+}
+
+ImageStats imageStats(const Bitmap& b) {
+    ImageStats stats;
+    std::mutex lock;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.pixels    = (uint64_t)b.width_in_pixels * b.height_in_pixels;
+    stats.has_alpha = b.color_depth == 32 && b.alpha_mask != 0;
+
+    ChannelStats *channels[4] = {&stats.red, &stats.green, &stats.blue, &stats.alpha};
+
+    withPixelFormat(b, [&](auto format) {
+        parallelRows(b.height_in_pixels, [&](int first, int last) {
+            std::unique_ptr<BandCounts> band(new BandCounts());
+
+            if (stats.has_alpha) countRows<true>(b, format, *band, first, last);
+            else                 countRows<false>(b, format, *band, first, last);
+
+            // Add this band's counts into the totals
+            std::lock_guard<std::mutex> guard(lock);
+            for (int k = 0; k < 4; k++) {
+                for (int v = 0; v < 256; v++) {
+                    channels[k]->histogram[v] += band->counts[0][k][v] + band->counts[1][k][v];
+                }
+            }
+        });
+    });
+
+    for (int k = 0; k < (stats.has_alpha ? 4 : 3); k++) {
+        finishChannel(*channels[k], stats.pixels);
+    }
+    return stats;
+}
+
+static void writeChannel(std::ostream& out, const char *name, const ChannelStats& channel) {
+    out << "\"" << name << "\": {\"min\": " << channel.min << ", \"max\": " << channel.max
+        << ", \"mean\": " << channel.mean << ", \"stddev\": " << channel.stddev << ", \"histogram\": [";
+    for (int v = 0; v < 256; v++) {
+        out << (v ? ", " : "") << channel.histogram[v];
+    }
+    out << "]}";
+}
+
+void writeStats(std::ostream& out, const ImageStats& stats) {
+    out << "{\"pixels\": " << stats.pixels << ", ";
+    writeChannel(out, "red", stats.red);
+    out << ", ";
+    writeChannel(out, "green", stats.green);
+    out << ", ";
+    writeChannel(out, "blue", stats.blue);
+    if (stats.has_alpha) {
+        out << ", ";
+        writeChannel(out, "alpha", stats.alpha);
+    }
+    out << "}";
+}
+
+// Stretch low..high out to 0..255
+static void stretchTable(ByteTable& table, uint low, uint high) {
+    for (uint v = 0; v < 256; v++) {
+        if (high <= low)  table[v] = (uint8_t)v;
+        else if (v <= low)  table[v] = 0;
+        else if (v >= high) table[v] = 255;
+        else table[v] = (uint8_t)(((v - low) * 255 + (high - low) / 2) / (high - low));
+    }
+}
+
+// The values below which, and above which, no more than clipped pixels lie
+static void clippedRange(const ChannelStats& channel, uint64_t clipped, uint& low, uint& high) {
+    uint64_t below = 0, above = 0;
+
+    low = channel.min;
+    while (low < channel.max && below + channel.histogram[low] <= clipped) below += channel.histogram[low++];
+    high = channel.max;
+    while (high > low && above + channel.histogram[high] <= clipped) above += channel.histogram[high--];
+}
+
+void autoLevels(Bitmap& b, double clip) {
+    std::cout << "Applying auto levels transform." << std::endl;
+
+    ImageStats    stats   = imageStats(b);
+    uint64_t      clipped = (uint64_t)(std::min(std::max(clip, 0.0), 0.5) * stats.pixels);
+    PointOp       op;
+    uint          low, high;
+
+    clippedRange(stats.red, clipped, low, high);
+    stretchTable(op.red, low, high);
+    clippedRange(stats.green, clipped, low, high);
+    stretchTable(op.green, low, high);
+    clippedRange(stats.blue, clipped, low, high);
+    stretchTable(op.blue, low, high);
+    applyPointOp(b, op);
+}
+
+// Map each value to where its cumulative count falls between the first value present and all the pixels
+static void equalizeTable(ByteTable& table, const ChannelStats& channel, uint64_t pixels) {
+    uint64_t start = channel.histogram[channel.min];
+    uint64_t range = pixels - start;
+    uint64_t total = 0;
+
+    for (int v = 0; v < 256; v++) {
+        total += channel.histogram[v];
+        if (range == 0)          table[v] = (uint8_t)v;
+        else if (total < start)  table[v] = 0;
+        else table[v] = (uint8_t)(((total - start) * 255 + range / 2) / range);
+    }
+}
+
+void equalize(Bitmap& b) {
+    std::cout << "Applying histogram equalization transform." << std::endl;
+
+    ImageStats    stats = imageStats(b);
+    PointOp       op;
+
+    equalizeTable(op.red,   stats.red,   stats.pixels);
+    equalizeTable(op.green, stats.green, stats.pixels);
+    equalizeTable(op.blue,  stats.blue,  stats.pixels);
+    applyPointOp(b, op);
+}
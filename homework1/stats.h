@@ -0,0 +1,70 @@
+// Author:  Charles Lucas
+// CS510
+//
+// Image statistics: per-channel histograms and the moments that come out of
+// them, gathered in one pass over a loaded or mapped image, and the
+// histogram-driven filters built on them (auto levels, equalization), which
+// are applied as point operations.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+#include <ostream>
+#include "bitmap.h"
+
+/**
+ * ChannelStats - the histogram of one 8-bit channel and what follows from it.
+ * min, max, mean and stddev are all 0 for an empty image.
+ */
+struct ChannelStats
+{
+    uint64_t histogram[256];   // Pixels with each value
+    uint     min;              // Smallest value present
+    uint     max;              // Largest value present
+    double   mean;
+    double   stddev;           // Population standard deviation
+};
+
+/**
+ * ImageStats - the statistics of every channel of an image.
+ * alpha is only filled in for images with an alpha mask.
+ */
+struct ImageStats
+{
+    uint64_t     pixels;
+    bool         has_alpha;
+    ChannelStats red;
+    ChannelStats green;
+    ChannelStats blue;
+    ChannelStats alpha;
+};
+
+/**
+ * Gather the statistics of a loaded or mapped image.  Bands of rows are
+ * counted in parallel into their own histograms, which are added up at the
+ * end; the moments are worked out from the histograms, so the pixels are
+ * read once.
+ */
+ImageStats imageStats(const Bitmap& b);
+
+/**
+ * Write the statistics as one JSON object (the histograms included).
+ */
+void writeStats(std::ostream& out, const ImageStats& stats);
+
+/**
+ * Stretch each color channel so its values cover 0..255.  clip is the
+ * fraction of pixels (0 to 0.5) allowed to saturate at each end, so a few
+ * stray pixels don't hold the stretch back.  Channels with a single value
+ * are left as they are.
+ */
+void autoLevels(Bitmap& b, double clip = 0);
+
+/**
+ * Equalize the histogram of each color channel, spreading its values out
+ * so their cumulative counts rise evenly from 0 to 255.
+ */
+void equalize(Bitmap& b);
+
+#endif
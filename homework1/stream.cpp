@@ -0,0 +1,220 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "bitmap.h"
+#include "pipeline.h"
+#include "stream.h"
+
+#ifndef STREAM_BAND_BYTES
+#define STREAM_BAND_BYTES (1024 * 1024)   // Rows of input each filter works on at once (make test shrinks it to cross more bands)
+#endif
+#define STREAM_WRITE_BYTES (256 * 1024)   // Padded output rows gathered into each write
+
+typedef std::function<void(const char*, int)> RowSink;  // Takes count rows, back to back with no padding
+
+/**
+ * StreamFilter - a filter and how it has to be fed.
+ */
+struct StreamFilter
+{
+    std::function<void(Bitmap&)> filter;
+    int                          halo = 0;         // Rows above and below an output row that the filter reads
+    int                          granularity = 1;  // Bands have to start on a multiple of this many rows
+    bool                         halves = false;   // The output is half the width and height (scaleDown)
+};
+
+static bool streamFilter(const std::string& option, StreamFilter& f) {
+    double sigma;
+    int    width, height;
+
+    if      (option == "-c")     { f.filter = cellShade; }
+    else if (option == "-g")     { f.filter = grayscale; }
+    else if (option == "-h")     { f.filter = fliph; }
+    else if (option == "-p")     { f.filter = [](Bitmap& b) { pixelate(b); };  f.granularity = 16; }  // Bands of whole blocks
+    else if (option == "-shrink"){ f.filter = scaleDown; f.granularity = 2;  f.halves = true; }
+    else if (option == "-b")     { f.filter = [](Bitmap& b) { blur(b); };  f.halo = 2; }  // The 5x5 kernel
+    else if (parseSigma(option, sigma)) {
+        f.filter = [sigma](Bitmap& b) { blur(b, sigma); };
+        f.halo   = blurRadius(sigma);
+    }
+    else if (parseBlockSize(option, width, height)) {
+        f.filter      = [width, height](Bitmap& b) { pixelate(b, width, height); };
+        f.granularity = height;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+bool canStream(const std::string& option) {
+    StreamFilter f;
+    return option == "-n" || streamFilter(option, f);
+}
+
+/**
+ * StreamStage - one filter of a stream.
+ * Collects incoming rows until a whole band (plus its halo) is there, runs
+ * the filter on a small image holding just those rows, passes the band's
+ * rows on, and forgets the rows no later band needs.
+ */
+class StreamStage
+{
+public:
+    StreamStage(const Bitmap& header, const StreamFilter& filter, RowSink sink) : filter(filter), sink(sink) {
+        work = header;
+        work.data.clear();
+        work.mapping.reset();
+        work.mapped_pixels = nullptr;
+        work.mapped_stride = 0;
+
+        width  = header.width_in_pixels;
+        height = header.height_in_pixels;
+        stride = (size_t)width * (header.color_depth / 8);
+
+        band = std::max<int>({(int)(STREAM_BAND_BYTES / stride), 4 * filter.halo, 1});
+        band = (band + filter.granularity - 1) / filter.granularity * filter.granularity;
+    }
+
+    void push(const char *rows, int count) {
+        window.insert(window.end(), rows, rows + count * stride);
+        received += count;
+
+        while (next_band < height) {
+            int first = next_band;
+            int last  = std::min(first + band, height);
+            int lo    = std::max(first - filter.halo, 0);        // Rows the filter sees
+            int hi    = std::min(last + filter.halo, height);
+            if (received < hi) break;
+
+            work.setDimensions(width, hi - lo);
+            work.data.assign(window.begin() + (lo - window_first) * stride, window.begin() + (hi - window_first) * stride);
+            filter.filter(work);
+
+            if (filter.halves) sink(work.data.data(), work.height_in_pixels);
+            else               sink(work.row(first - lo), last - first);
+
+            // Keep only the rows the next band's halo reaches back to
+            next_band = last;
+            int keep  = std::max(next_band - filter.halo, 0);
+            window.erase(window.begin(), window.begin() + (keep - window_first) * stride);
+            window_first = keep;
+        }
+    }
+
+private:
+    Bitmap            work;              // The input header, with the rows of one band as data
+    StreamFilter      filter;
+    RowSink           sink;
+    int               width, height;     // Input dimensions
+    size_t            stride;            // Bytes per input row
+    int               band;              // Rows per band
+    std::vector<char> window;            // Input rows window_first..received-1
+    int               window_first = 0;
+    int               received = 0;
+    int               next_band = 0;     // First row of the next band to filter
+};
+
+void streamImage(const std::string& infile, const std::string& outfile, const std::vector<std::string>& options) {
+    std::vector<StreamFilter>                 filters;
+    std::vector<std::unique_ptr<StreamStage>> stages;
+    std::vector<Bitmap>                       headers;   // Header of each stage's input, then of the output
+    Bitmap                                    source;
+
+    for (const std::string& option : options) {
+        StreamFilter f;
+        if (option == "-n") continue;
+        if (!streamFilter(option, f)) {
+            throw(BitmapException("Option " + option + " can't be streamed", 0));
+        }
+        filters.push_back(f);
+    }
+
+    source.open_mapped(infile);
+
+    headers.push_back(source);
+    headers.back().mapping.reset();
+    headers.back().mapped_pixels = nullptr;
+    for (const StreamFilter& f : filters) {
+        Bitmap next = headers.back();
+        if (f.halves) next.setDimensions(next.width_in_pixels / 2, next.height_in_pixels / 2);
+        headers.push_back(next);
+    }
+
+    // The last stage hands its rows to the output file.  24-bit rows are padded out to 4 bytes in whole
+    // chunks of rows, so the file sees a few large writes
+    const Bitmap&     output     = headers.back();
+    size_t            row        = (size_t)output.width_in_pixels * (output.color_depth / 8);
+    uint32_t          padding    = output.getRowPaddingSize();
+    size_t            chunk_rows = std::max<size_t>(1, STREAM_WRITE_BYTES / (row + padding));
+    std::vector<char> padded(padding ? chunk_rows * (row + padding) : 0, 0);
+    std::ofstream     out(outfile, std::ios::binary);
+    uint64_t          written    = output.writeHeader(out);
+
+    RowSink write = [&](const char *rows, int count) {
+        if (padding == 0) {
+            out.write(rows, count * row);
+            written += count * row;
+            return;
+        }
+        for (int y = 0; y < count; ) {
+            char *p = padded.data();
+            for (size_t i = 0; i < chunk_rows && y < count; i++, y++) {
+                memcpy(p, rows + y * row, row);
+                p += row + padding;                // The padding bytes stay 0
+            }
+            out.write(padded.data(), p - padded.data());
+            written += p - padded.data();
+        }
+    };
+
+    // Each stage hands its rows to the next one
+    for (size_t i = 0; i < filters.size(); i++) {
+        RowSink sink = write;
+        if (i + 1 < filters.size()) {
+            sink = [&stages, i](const char *rows, int count) { stages[i + 1]->push(rows, count); };
+        }
+        stages.push_back(std::unique_ptr<StreamStage>(new StreamStage(headers[i], filters[i], sink)));
+    }
+    RowSink input = write;
+    if (!stages.empty()) {
+        input = [&stages](const char *rows, int count) { stages.front()->push(rows, count); };
+    }
+
+    // Read the input a band at a time, letting the kernel drop each band from memory once it's passed on
+    const Bitmap& mapped = source;   // Its rows are in the mapping, not in data
+    size_t        stride = (size_t)source.width_in_pixels * (source.color_depth / 8);
+    int           chunk  = std::max<int>(1, STREAM_BAND_BYTES / stride);
+    for (int y = 0; y < source.height_in_pixels; y += chunk) {
+        int last = std::min(y + chunk, source.height_in_pixels);
+
+        if (source.getRowStride() == stride) {
+            input(mapped.row(y), last - y);
+        }
+        else {
+            for (int r = y; r < last; r++) input(mapped.row(r), 1);
+        }
+        source.releaseMappedRows(y, last);
+    }
+
+    // Then the bytes the source had after its rows, which the output's length still counts
+    std::vector<char> trailing(source.trailingLength());
+    source.copyTrailing(0, trailing.size(), trailing.data());
+    out.write(trailing.data(), trailing.size());
+    written += trailing.size();
+
+    out.close();
+    if (!out) {
+        throw(BitmapException("Error writing " + outfile, 0));
+    }
+    if (written != output.length) {
+        throw(BitmapException("Error - wrote " + std::to_string(written) + " bytes of " + outfile + ", but its header says " +
+                              std::to_string(output.length), 0));
+    }
+}
@@ -0,0 +1,31 @@
+// Author:  Charles Lucas
+// CS510
+//
+// Streaming mode: runs filters over an image a band of rows at a time, so
+// images much larger than memory can be filtered.  Rows are read from the
+// mapped input bottom-up, passed through each filter in bands, and written
+// to the output as soon as the last filter has finished with them.
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <string>
+#include <vector>
+
+/**
+ * Whether an option can be streamed: -n, -c, -g, -p, -p<size>, -b, -b<sigma>, -h and -shrink.
+ * The others need the whole image at once.
+ */
+bool canStream(const std::string& option);
+
+/**
+ * Filter infile into outfile with the options, in order, a band of rows at a time.
+ * The output is the same as loading the whole image and running the options on it,
+ * but only a few bands of each filter's rows are in memory at once.
+ *
+ * @throws BitmapException if the input is an invalid bitmap, an option
+ *         can't be streamed, or the output can't be written.
+ */
+void streamImage(const std::string& infile, const std::string& outfile, const std::vector<std::string>& options);
+
+#endif
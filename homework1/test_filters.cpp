@@ -0,0 +1,1977 @@
+// Author:  Charles Lucas
+// CS510
+//
+// Checks the filters against the reference images in examples/, and the
+// SIMD kernels against the scalar kernels at every level this CPU supports,
+// the multithreaded filters against a single thread, premultiplied alpha and
+// compositing, statistics, image hashes, point operations, convolutions, and
+// planar and tiled images, pipelines, batches and streams against the filters
+// run one at a time, and the result cache.
+// Run from the homework1 directory (make test).
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <tuple>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bitmap.h"
+#include "bitmap_simd.h"
+#include "planar.h"
+#include "tiled.h"
+#include "threadpool.h"
+#include "bufferpool.h"
+#include "stats.h"
+#include "imagehash.h"
+#include "pointop.h"
+#include "convolve.h"
+#include "pipeline.h"
+#include "batch.h"
+#include "stream.h"
+#include "ioring.h"
+#include "resultcache.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool passed, const string& what)
+{
+    cout << (passed ? "  pass  " : "  FAIL  ") << what << endl;
+    if(!passed) failures++;
+}
+
+static Bitmap load(const string& path)
+{
+    Bitmap b;
+    b.open_mapped(path);
+    b.loadMapped();
+    return b;
+}
+
+static string readFile(const string& path)
+{
+    ifstream      in(path, ios::binary);
+    ostringstream bytes;
+    bytes << in.rdbuf();
+    return bytes.str();
+}
+
+static vector<SimdLevel> supportedLevels()
+{
+    vector<SimdLevel> levels;
+    for(int level = 0; level <= (int)detectSimdLevel(); level++)
+    {
+        levels.push_back((SimdLevel)level);
+    }
+    return levels;
+}
+
+// Every SIMD level has to produce the reference output for the example images
+static void testExamples()
+{
+    const vector<string> names = {"bear1_24", "bear2_24", "bear3_24", "pikachu24", "sonic24",
+                                  "bear1_32", "bear2_32", "bear3_32", "pikachu32"};
+
+    cout << "example images:" << endl;
+    for(const string& name : names)
+    {
+        Bitmap source = load("examples/" + name + ".bmp");
+        Bitmap grey   = load("examples/" + name + "_grey.bmp");
+        Bitmap cell   = load("examples/" + name + "_cell.bmp");
+
+        for(SimdLevel level : supportedLevels())
+        {
+            setSimdLevel(level);
+
+            Bitmap b = source;
+            grayscale(b);
+            check(b.data == grey.data, name + " grayscale " + simdLevelName(level));
+
+            b = source;
+            cellShade(b);
+            check(b.data == cell.data, name + " cell shade " + simdLevelName(level));
+        }
+    }
+    setSimdLevel(detectSimdLevel());
+}
+
+// Random pixels at every length up to a few vectors, so the SIMD tails get exercised
+static void testKernels()
+{
+    PixelFormat bgra;
+    bgra.red  .decode(0x00FF0000);
+    bgra.green.decode(0x0000FF00);
+    bgra.blue .decode(0x000000FF);
+    bgra.alpha.decode(0xFF000000);
+
+    cout << "kernels against scalar:" << endl;
+    srand(510);
+    for(SimdLevel level : supportedLevels())
+    {
+        bool cell_ok = true;
+        bool grey24_ok = true;
+        bool grey32_ok = true;
+
+        for(size_t count = 0; count < 100; count++)
+        {
+            vector<uint8_t> pixels(count * 4);
+            for(uint8_t& byte : pixels) byte = rand();
+
+            vector<uint8_t> expected = pixels;
+            vector<uint8_t> actual   = pixels;
+            cellShadeBytes(expected.data(), expected.size(), SimdLevel::Scalar);
+            cellShadeBytes(actual.data(), actual.size(), level);
+            cell_ok = cell_ok && expected == actual;
+
+            expected = actual = pixels;
+            grayscaleBGR24(expected.data(), count, SimdLevel::Scalar);
+            grayscaleBGR24(actual.data(), count, level);
+            grey24_ok = grey24_ok && expected == actual;
+
+            expected = actual = pixels;
+            grayscaleMasked32(expected.data(), count, bgra, SimdLevel::Scalar);
+            grayscaleMasked32(actual.data(), count, bgra, level);
+            grey32_ok = grey32_ok && expected == actual;
+        }
+
+        check(cell_ok,   string("cell shade ") + simdLevelName(level));
+        check(grey24_ok, string("grayscale 24-bit ") + simdLevelName(level));
+        check(grey32_ok, string("grayscale 32-bit ") + simdLevelName(level));
+
+        // Resampling, with negative weights and horizontal sums outside 0..255 like bicubic makes
+        bool across_ok = true;
+        bool down_ok = true;
+        for(int taps = 2; taps <= 8; taps += 2)
+        {
+            for(int width = 0; width < 40; width++)
+            {
+                vector<uint8_t> row((width + taps) * 4);
+                vector<int>     first(width);
+                vector<int16_t> weights(width * taps);
+                for(uint8_t& byte : row) byte = rand();
+                for(int& f : first) f = rand() % (width + 1);
+                for(int16_t& w : weights) w = rand() % 12288 - 4096;
+
+                vector<int16_t> expected(width * 4), actual(width * 4);
+                resampleRowHorizontal(row.data(), first.data(), weights.data(), taps, width, expected.data(), SimdLevel::Scalar);
+                resampleRowHorizontal(row.data(), first.data(), weights.data(), taps, width, actual.data(), level);
+                across_ok = across_ok && expected == actual;
+
+                vector<vector<int16_t>> sums(taps, vector<int16_t>(width * 4));
+                vector<const int16_t*>  rows;
+                for(vector<int16_t>& sum : sums)
+                {
+                    for(int16_t& value : sum) value = rand() % 20000 - 2000;
+                    rows.push_back(sum.data());
+                }
+                vector<uint8_t> expected_bytes(width * 4), actual_bytes(width * 4);
+                resampleRowsVertical(rows.data(), weights.data(), taps, width * 4, expected_bytes.data(), SimdLevel::Scalar);
+                resampleRowsVertical(rows.data(), weights.data(), taps, width * 4, actual_bytes.data(), level);
+                down_ok = down_ok && expected_bytes == actual_bytes;
+            }
+        }
+        // Blur rows, with 16-bit sums and with 32-bit sums rounded down to 16 bits, up to the largest they can be
+        bool blur_ok = true;
+        for(int shift : {0, 7})
+        {
+            for(int taps = 1; taps <= 9; taps += 2)
+            {
+                for(size_t length = 0; length < 70; length++)
+                {
+                    vector<uint8_t>  padded(length + taps - 1);
+                    vector<uint16_t> weights(taps, 0);
+                    for(uint8_t& byte : padded) byte = length % 3 == 0 ? 255 : rand();
+                    for(int left = 256 << shift, k = 0; left > 0; k = (k + 1) % taps)
+                    {
+                        int w = min(left, rand() % (left + 1) + 1);
+                        weights[k] += w;
+                        left -= w;
+                    }
+
+                    vector<uint16_t> expected(length), actual(length);
+                    convolveRowHorizontal(padded.data(), length, 1, weights.data(), taps, shift, expected.data(), SimdLevel::Scalar);
+                    convolveRowHorizontal(padded.data(), length, 1, weights.data(), taps, shift, actual.data(), level);
+                    blur_ok = blur_ok && expected == actual;
+                }
+            }
+        }
+        check(blur_ok, string("blur rows ") + simdLevelName(level));
+
+        bool expand_ok = true;
+        for(size_t count = 0; count < 40; count++)
+        {
+            vector<uint8_t> pixels(count * 3);
+            for(uint8_t& byte : pixels) byte = rand();
+
+            vector<uint8_t> expanded(count * 4), packed(count * 3);
+            expandBGR24(pixels.data(), count, expanded.data(), level);
+            compressBGR24(expanded.data(), count, packed.data(), level);
+            for(size_t i = 0; i < count; i++) expand_ok = expand_ok && expanded[i*4 + 3] == 0;
+            expand_ok = expand_ok && packed == pixels;
+        }
+
+        // Planes, from pixels of 3 and 4 bytes
+        bool planes_ok = true;
+        bool average_ok = true;
+        for(int bytes = 3; bytes <= 4; bytes++)
+        {
+            for(size_t count = 0; count < 70; count++)
+            {
+                vector<uint8_t> pixels(count * bytes);
+                for(uint8_t& byte : pixels) byte = rand();
+
+                vector<vector<uint8_t>> expected(4, vector<uint8_t>(count)), actual(4, vector<uint8_t>(count));
+                uint8_t *expected_planes[4], *actual_planes[4];
+                for(int k = 0; k < 4; k++)
+                {
+                    expected_planes[k] = expected[k].data();
+                    actual_planes[k]   = actual[k].data();
+                }
+                splitPixels(pixels.data(), count, bytes, expected_planes, SimdLevel::Scalar);
+                splitPixels(pixels.data(), count, bytes, actual_planes, level);
+                planes_ok = planes_ok && expected == actual;
+
+                vector<uint8_t> merged(count * bytes);
+                mergePixels(actual_planes, count, bytes, merged.data(), level);
+                planes_ok = planes_ok && merged == pixels;
+
+                averagePlanes(expected_planes[0], expected_planes[1], expected_planes[2], count, SimdLevel::Scalar);
+                averagePlanes(actual_planes[0], actual_planes[1], actual_planes[2], count, level);
+                average_ok = average_ok && expected == actual;
+            }
+        }
+
+        check(across_ok, string("resample across ") + simdLevelName(level));
+        check(down_ok,   string("resample down ") + simdLevelName(level));
+        check(expand_ok, string("expand and compress 24-bit ") + simdLevelName(level));
+        check(planes_ok, string("split and merge planes ") + simdLevelName(level));
+
+        bool alpha_ok = true;
+        bool over_ok = true;
+        for(size_t count = 0; count < 40; count++)
+        {
+            vector<uint8_t> pixels(count * 4), under(count * 4);
+            for(uint8_t& byte : pixels) byte = rand();
+            for(uint8_t& byte : under) byte = rand();
+            for(size_t i = 0; i < count; i += 5) pixels[i*4 + 3] = (i % 10) ? 255 : 0;   // Some opaque and transparent pixels
+
+            vector<uint8_t> expected = pixels;
+            vector<uint8_t> actual   = pixels;
+            premultiplyBGRA(expected.data(), count, SimdLevel::Scalar);
+            premultiplyBGRA(actual.data(), count, level);
+            alpha_ok = alpha_ok && expected == actual;
+
+            vector<uint8_t> expected_under = under;
+            vector<uint8_t> actual_under   = under;
+            compositeBGRA(expected.data(), expected_under.data(), count, SimdLevel::Scalar);
+            compositeBGRA(actual.data(), actual_under.data(), count, level);
+            over_ok = over_ok && expected_under == actual_under;
+
+            // Colors above their alpha too, like a bicubic overshoot makes
+            expected = actual = pixels;
+            unpremultiplyBGRA(expected.data(), count, SimdLevel::Scalar);
+            unpremultiplyBGRA(actual.data(), count, level);
+            alpha_ok = alpha_ok && expected == actual;
+        }
+        check(alpha_ok, string("premultiply and unpremultiply ") + simdLevelName(level));
+        check(over_ok,  string("composite ") + simdLevelName(level));
+        check(average_ok, string("average planes ") + simdLevelName(level));
+    }
+}
+
+// Filters with SIMD paths have to come out the same at every level
+static void testAgainstScalar()
+{
+    const vector<pair<string, function<void(Bitmap&)>>> filters = {
+        {"blur",             [](Bitmap& b) { blur(b); }},
+        {"blur sigma 3.5",   [](Bitmap& b) { blur(b, 3.5); }},
+        {"rot90",            rot90},
+        {"rot180",           rot180},
+        {"rot270",           rot270},
+        {"flipv",            flipv},
+        {"fliph",            fliph},
+        {"flipd1",           flipd1},
+        {"flipd2",           flipd2},
+        {"shrink",           scaleDown},
+        {"resize box",       [](Bitmap& b) { resize(b, 97, 203, ResampleFilter::Box); }},
+        {"resize bilinear",  [](Bitmap& b) { resize(b, 500, 301, ResampleFilter::Bilinear); }},
+        {"resize bicubic",   [](Bitmap& b) { resize(b, 333, 1500, ResampleFilter::Bicubic); }},
+        {"resize lanczos",   [](Bitmap& b) { resize(b, 1000, 151, ResampleFilter::Lanczos); }},
+        {"auto levels",      [](Bitmap& b) { autoLevels(b, 0.01); }},
+        {"equalize",         equalize},
+        {"gamma",            [](Bitmap& b) { gammaCorrect(b, 0.6); }},
+        {"invert",           invert},
+        {"posterize",        [](Bitmap& b) { posterize(b, 6); }},
+        {"sharpen",          [](Bitmap& b) { sharpen(b); }},
+        {"edges mirrored",   [](Bitmap& b) { edgeDetect(b, Border::Mirror); }},
+        {"box 5",            [](Bitmap& b) { boxBlur(b, 5); }},
+    };
+
+    cout << "filters against scalar:" << endl;
+    for(const char *name : {"bear2_24", "bear3_32"})
+    {
+        Bitmap source = load("examples/" + string(name) + ".bmp");
+
+        for(const auto& filter : filters)
+        {
+            setSimdLevel(SimdLevel::Scalar);
+            Bitmap expected = source;
+            filter.second(expected);
+
+            for(SimdLevel level : supportedLevels())
+            {
+                setSimdLevel(level);
+                Bitmap b = source;
+                filter.second(b);
+                check(b.data == expected.data && b.width_in_pixels == expected.width_in_pixels,
+                      string(name) + " " + filter.first + " " + simdLevelName(level));
+            }
+        }
+    }
+    setSimdLevel(detectSimdLevel());
+}
+
+// Splitting a filter into bands across threads must not change a single byte
+static void testThreads()
+{
+    const vector<pair<string, function<void(Bitmap&)>>> filters = {
+        {"cell shade",       [](Bitmap& b) { cellShade(b); }},
+        {"grayscale",        [](Bitmap& b) { grayscale(b); }},
+        {"pixelate",         [](Bitmap& b) { pixelate(b); }},
+        {"pixelate 7x5",     [](Bitmap& b) { pixelate(b, 7, 5); }},
+        {"blur",             [](Bitmap& b) { blur(b); }},
+        {"blur sigma 3.5",   [](Bitmap& b) { blur(b, 3.5); }},
+        {"rot90",            rot90},
+        {"rot180",           rot180},
+        {"rot270",           rot270},
+        {"flipv",            flipv},
+        {"fliph",            fliph},
+        {"flipd1",           flipd1},
+        {"flipd2",           flipd2},
+        {"grow",             scaleUp},
+        {"shrink",           scaleDown},
+        {"resize box",       [](Bitmap& b) { resize(b, 97, 203, ResampleFilter::Box); }},
+        {"resize lanczos",   [](Bitmap& b) { resize(b, 1000, 151, ResampleFilter::Lanczos); }},
+        {"auto levels",      [](Bitmap& b) { autoLevels(b, 0.01); }},
+        {"equalize",         equalize},
+        {"gamma",            [](Bitmap& b) { gammaCorrect(b, 0.6); }},
+        {"invert",           invert},
+        {"posterize",        [](Bitmap& b) { posterize(b, 6); }},
+        {"sharpen",          [](Bitmap& b) { sharpen(b); }},
+        {"edges mirrored",   [](Bitmap& b) { edgeDetect(b, Border::Mirror); }},
+        {"box 5",            [](Bitmap& b) { boxBlur(b, 5); }},
+    };
+
+    cout << "filters against one thread:" << endl;
+    for(const char *name : {"bear2_24", "bear3_32"})
+    {
+        Bitmap source = load("examples/" + string(name) + ".bmp");
+
+        for(const auto& filter : filters)
+        {
+            setThreadCount(1);
+            Bitmap expected = source;
+            filter.second(expected);
+
+            for(int threads : {2, 3, 8})
+            {
+                setThreadCount(threads);
+                Bitmap b = source;
+                filter.second(b);
+                check(b.data == expected.data && b.width_in_pixels == expected.width_in_pixels,
+                      string(name) + " " + filter.first + " " + to_string(threads) + " threads");
+            }
+        }
+    }
+
+    // Threads outside the pool running filters at the same time, while the pool is resized under them
+    Bitmap source = load("examples/bear2_24.bmp");
+    Bitmap expected = source;
+    blur(expected);
+    vector<thread> callers;
+    atomic<int>    wrong(0);
+    for(int caller = 0; caller < 4; caller++)
+    {
+        callers.emplace_back([&, caller]() {
+            for(int round = 0; round < 10; round++)
+            {
+                if(caller == 0) setThreadCount(2 + round % 3);
+                Bitmap b = source;
+                blur(b);
+                if(b.data != expected.data) wrong++;
+            }
+        });
+    }
+    for(thread& caller : callers) caller.join();
+    check(wrong == 0, "filters run from several threads at once");
+    setThreadCount(0);
+}
+
+// Planar filters have to give the same bytes as the Bitmap filters, and splitting and merging loses nothing
+static void testPlanar()
+{
+    const vector<pair<string, pair<function<void(Bitmap&)>, function<void(PlanarImage&)>>>> filters = {
+        {"cell shade",     {[](Bitmap& b) { cellShade(b); },     [](PlanarImage& p) { cellShade(p); }}},
+        {"grayscale",      {[](Bitmap& b) { grayscale(b); },     [](PlanarImage& p) { grayscale(p); }}},
+        {"pixelate",       {[](Bitmap& b) { pixelate(b); },      [](PlanarImage& p) { pixelate(p); }}},
+        {"pixelate 7x5",   {[](Bitmap& b) { pixelate(b, 7, 5); }, [](PlanarImage& p) { pixelate(p, 7, 5); }}},
+        {"blur",           {[](Bitmap& b) { blur(b); },          [](PlanarImage& p) { blur(p); }}},
+        {"blur sigma 3.5", {[](Bitmap& b) { blur(b, 3.5); },     [](PlanarImage& p) { blur(p, 3.5); }}},
+        {"rot90",          {rot90, [](PlanarImage& p) { applyFilter(p, rot90); }}},
+        {"resize",         {[](Bitmap& b) { resize(b, 123, 77, ResampleFilter::Lanczos); },
+                            [](PlanarImage& p) { applyFilter(p, [](Bitmap& b) { resize(b, 123, 77, ResampleFilter::Lanczos); }); }}},
+    };
+
+    cout << "planar against bitmap filters:" << endl;
+
+    // A 32-bit image with no alpha, so one plane is unused, cropped to an odd width
+    Bitmap xrgb = load("examples/bear3_32.bmp");
+    resize(xrgb, 301, 199, ResampleFilter::Box);
+    xrgb.alpha_mask = 0;
+    xrgb.decodeMasks();
+
+    const vector<pair<string, Bitmap>> sources = {
+        {"bear2_24", load("examples/bear2_24.bmp")},
+        {"bear3_32", load("examples/bear3_32.bmp")},
+        {"xrgb 301x199", xrgb},
+    };
+    for(const auto& source : sources)
+    {
+        PlanarImage planes(source.second);
+        Bitmap      merged;
+        planes.merge(merged);
+        check(merged.data == source.second.data && merged.width_in_pixels == source.second.width_in_pixels,
+              source.first + " split and merged");
+
+        for(const auto& filter : filters)
+        {
+            Bitmap expected = source.second;
+            filter.second.first(expected);
+
+            for(SimdLevel level : supportedLevels())
+            {
+                for(int threads : {1, 3})
+                {
+                    setSimdLevel(level);
+                    setThreadCount(threads);
+                    PlanarImage p(source.second);
+                    Bitmap      b;
+                    filter.second.second(p);
+                    p.merge(b);
+                    check(b.data == expected.data && b.width_in_pixels == expected.width_in_pixels,
+                          source.first + " " + filter.first + " " + simdLevelName(level) + " " + to_string(threads) + " threads");
+                }
+            }
+        }
+    }
+    setSimdLevel(detectSimdLevel());
+    setThreadCount(0);
+
+    Bitmap narrow = xrgb;
+    narrow.red_mask = 0x00FFF000;
+    check(!PlanarImage::canSplit(narrow), "channels that aren't whole bytes can't be split");
+}
+
+// Every transform, and every pair of them, on tiles against the same transforms on rows
+static void testTiled()
+{
+    const vector<pair<string, function<void(Bitmap&)>>> transforms = {
+        {"rot90",  [](Bitmap& b) { rot90(b); }},
+        {"rot180", [](Bitmap& b) { rot180(b); }},
+        {"rot270", [](Bitmap& b) { rot270(b); }},
+        {"flipv",  [](Bitmap& b) { flipv(b); }},
+        {"fliph",  [](Bitmap& b) { fliph(b); }},
+        {"flipd1", [](Bitmap& b) { flipd1(b); }},
+        {"flipd2", [](Bitmap& b) { flipd2(b); }},
+    };
+
+    cout << "tiled against bitmap transforms:" << endl;
+
+    // Sizes on both sides of a tile edge, and a 32-bit image with unused bits
+    Bitmap xrgb = load("examples/bear3_32.bmp");
+    resize(xrgb, 130, 65, ResampleFilter::Box);
+    xrgb.alpha_mask = 0;
+    xrgb.decodeMasks();
+
+    vector<pair<string, Bitmap>> sources = {
+        {"xrgb 130x65", xrgb},
+    };
+    for(const char *name : {"bear2_24", "bear3_32"})
+    {
+        for(const auto& size : vector<pair<int, int>>{{1, 1}, {64, 64}, {77, 1}, {200, 63}})
+        {
+            Bitmap b = load("examples/" + string(name) + ".bmp");
+            resize(b, size.first, size.second, ResampleFilter::Box);
+            sources.push_back({string(name) + " " + to_string(size.first) + "x" + to_string(size.second), b});
+        }
+    }
+
+    for(const auto& source : sources)
+    {
+        TiledImage tiles(source.second);
+        Bitmap     merged;
+        tiles.merge(merged);
+        check(merged.data == source.second.data && merged.width_in_pixels == source.second.width_in_pixels,
+              source.first + " tiled and merged");
+
+        for(uint first = 0; first < transforms.size(); first++)
+        {
+            for(uint second = 0; second < transforms.size(); second++)
+            {
+                Bitmap expected = source.second;
+                transforms[first].second(expected);
+                transforms[second].second(expected);
+
+                TiledImage t(source.second);
+                Bitmap     b;
+                t.transform(first);
+                t.transform(second);
+                t.merge(b);
+                check(b.data == expected.data && b.width_in_pixels == expected.width_in_pixels &&
+                      b.height_in_pixels == expected.height_in_pixels,
+                      source.first + " " + transforms[first].first + " " + transforms[second].first);
+            }
+        }
+    }
+
+    check(mortonCode(0, 0) == 0 && mortonCode(1, 0) == 1 && mortonCode(0, 1) == 2 && mortonCode(3, 3) == 15 &&
+          mortonCode(4, 0) == 16, "Z-order codes");
+}
+
+// Pixel (x, y) of an image, counting y down from the top
+static uint8_t* pixelAt(Bitmap& b, int x, int y)
+{
+    return (uint8_t*)b.row(b.height_in_pixels - 1 - y) + x * (b.color_depth / 8);
+}
+
+// bear3_32's pixels as BGRA, with alpha running from transparent on the left to opaque on the right
+static Bitmap makeTranslucent(int width, int height)
+{
+    Bitmap b = load("examples/bear3_32.bmp");
+    resize(b, width, height, ResampleFilter::Box);
+    b.red_mask   = 0x00FF0000;
+    b.green_mask = 0x0000FF00;
+    b.blue_mask  = 0x000000FF;
+    b.alpha_mask = 0xFF000000;
+    b.decodeMasks();
+    for(int y = 0; y < height; y++)
+    {
+        for(int x = 0; x < width; x++) pixelAt(b, x, y)[3] = x * 255 / (width - 1);
+    }
+    return b;
+}
+
+// Rounded x/255
+static uint divide255(uint x)
+{
+    return (x + 127) / 255;
+}
+
+// Premultiplied filters, and compositing
+static void testAlpha()
+{
+    cout << "alpha:" << endl;
+
+    // Transparent red on the left, opaque blue on the right: filtering alpha-correctly, no red shows
+    Bitmap halves = makeTranslucent(64, 48);
+    for(int y = 0; y < 48; y++)
+    {
+        for(int x = 0; x < 64; x++)
+        {
+            uint8_t *p = pixelAt(halves, x, y);
+            p[0] = x < 32 ? 0 : 255;
+            p[1] = 0;
+            p[2] = x < 32 ? 255 : 0;
+            p[3] = x < 32 ? 0 : 255;
+        }
+    }
+    for(const vector<string>& chain : vector<vector<string>>{{"-b3"}, {"-p7x5"}, {"-resize100x30:bicubic"}, {"-r90", "-b", "-shrink"}})
+    {
+        string what = "no red bleeds through";
+        bool   bled[2] = {false, false};
+        for(const string& option : chain) what += " " + option;
+
+        for(bool correct : {false, true})
+        {
+            Pipeline pipeline;
+            if(correct) pipeline.add("-alpha");
+            for(const string& option : chain) pipeline.add(option);
+
+            Bitmap b = halves;
+            pipeline.run(b);
+            for(int y = 0; y < b.height_in_pixels; y++)
+            {
+                for(int x = 0; x < b.width_in_pixels; x++)
+                {
+                    uint8_t *p = pixelAt(b, x, y);
+                    if(p[3] > 0 && p[2] > 0) bled[correct] = true;
+                }
+            }
+            if(correct) check(!b.premultiplied, what + " ends straight");
+        }
+        check(bled[0] && !bled[1], what);
+    }
+
+    // Opaque pixels and alpha come back exactly
+    Bitmap source = makeTranslucent(101, 77);
+    Bitmap b      = source;
+    premultiply(b);
+    unpremultiply(b);
+    bool exact = true;
+    for(int y = 0; y < 77; y++)
+    {
+        exact = exact && pixelAt(b, 100, y)[3] == 255 && memcmp(pixelAt(b, 100, y), pixelAt(source, 100, y), 4) == 0;
+        for(int x = 0; x < 101; x++) exact = exact && pixelAt(b, x, y)[3] == pixelAt(source, x, y)[3];
+    }
+    check(exact, "premultiply and back keeps alpha and opaque pixels");
+
+    // Planar filters on premultiplied planes match the Bitmap filters
+    const vector<pair<string, pair<function<void(Bitmap&)>, function<void(PlanarImage&)>>>> filters = {
+        {"blur sigma 2", {[](Bitmap& b) { blur(b, 2); },          [](PlanarImage& p) { blur(p, 2); }}},
+        {"pixelate 7x5", {[](Bitmap& b) { pixelate(b, 7, 5); },   [](PlanarImage& p) { pixelate(p, 7, 5); }}},
+    };
+    premultiply(source);
+    for(const auto& filter : filters)
+    {
+        for(SimdLevel level : supportedLevels())
+        {
+            setSimdLevel(level);
+            Bitmap expected = source;
+            filter.second.first(expected);
+            PlanarImage planes(source);
+            filter.second.second(planes);
+            Bitmap actual;
+            planes.merge(actual);
+            check(actual.data == expected.data && actual.premultiplied, "premultiplied planar " + filter.first + " " + simdLevelName(level));
+        }
+    }
+    setSimdLevel(detectSimdLevel());
+
+    // Compositing over a 24-bit image, partly off its edges
+    Bitmap overlay = makeTranslucent(50, 40);
+    Bitmap photo   = load("examples/bear2_24.bmp");
+    for(pair<int, int> at : vector<pair<int, int>>{{30, 20}, {-10, -15}, {photo.width_in_pixels - 20, photo.height_in_pixels - 5}, {-60, 0}})
+    {
+        Bitmap expected = photo;
+        for(int y = 0; y < 40; y++)
+        {
+            for(int x = 0; x < 50; x++)
+            {
+                int px = at.first + x, py = at.second + y;
+                if(px < 0 || py < 0 || px >= photo.width_in_pixels || py >= photo.height_in_pixels) continue;
+
+                uint8_t *over  = pixelAt(overlay, x, y);
+                uint8_t *under = pixelAt(expected, px, py);
+                for(int k = 0; k < 3; k++) under[k] = min(255u, divide255(over[k] * over[3]) + divide255(under[k] * (255 - over[3])));
+            }
+        }
+
+        string where = to_string(at.first) + "," + to_string(at.second);
+        for(SimdLevel level : supportedLevels())
+        {
+            setSimdLevel(level);
+            Bitmap b = photo;
+            composite(b, overlay, at.first, at.second);
+            check(b.data == expected.data, "composite at " + where + " " + simdLevelName(level));
+        }
+    }
+    setSimdLevel(detectSimdLevel());
+
+    // An opaque overlay is copied over, and a translucent one over a translucent image keeps it translucent
+    Bitmap patch = load("examples/bear2_24.bmp");
+    resize(patch, 20, 10, ResampleFilter::Box);
+    b = photo;
+    composite(b, patch, 5, 7);
+    bool copied = true;
+    for(int y = 0; y < 10; y++) copied = copied && memcmp(pixelAt(b, 5, 7 + y), pixelAt(patch, 0, y), 20 * 3) == 0;
+    check(copied, "composite an opaque image copies it");
+
+    b = makeTranslucent(60, 60);
+    composite(b, overlay, 0, 0);
+    check(pixelAt(b, 0, 0)[3] == 0 && pixelAt(b, 59, 0)[3] == 255 && pixelAt(b, 25, 0)[3] > pixelAt(overlay, 25, 0)[3],
+          "composite over translucent pixels adds up their alpha");
+
+    // The same through a pipeline option
+    const string path = "/tmp/test_filters_overlay.bmp";
+    overlay.save(path);
+    Pipeline pipeline;
+    check(pipeline.add("-overlay:" + path + "@30,20") && !pipeline.add("-overlay:"), "overlay options");
+    Bitmap expected = photo;
+    composite(expected, overlay, 30, 20);
+    b = photo;
+    pipeline.run(b);
+    check(b.data == expected.data, "pipeline overlay");
+}
+
+// Point operations have to match their formulas, and composed tables the ops run one after another
+static void testPointOps()
+{
+    cout << "point operations:" << endl;
+
+    // The cell shade table gives the reference images, alpha and unused bytes included
+    for(const char *name : {"bear1_24", "bear3_32", "pikachu32"})
+    {
+        Bitmap b    = load("examples/" + string(name) + ".bmp");
+        Bitmap cell = load("examples/" + string(name) + "_cell.bmp");
+        applyPointOp(b, cellShadeOp());
+        check(b.data == cell.data, string(name) + " cell shade table");
+    }
+
+    bool rejected = true;
+    for(int levels : {1, 257})
+    {
+        try
+        {
+            posterizeOp(levels);
+            rejected = false;
+        }
+        catch(BitmapException&) {}
+    }
+    check(rejected, "posterize levels rejected");
+
+    for(const char *name : {"bear2_24", "bear3_32", "translucent", "odd masks"})
+    {
+        Bitmap source = name == "translucent"s ? makeTranslucent(97, 61) : load("examples/" + string(name == "odd masks"s ? "bear3_32" : name) + ".bmp");
+        if(name == "odd masks"s)
+        {
+            // Channels that aren't whole bytes go through the pixel format
+            source.red_mask   = 0x0FF00000;
+            source.green_mask = 0x000FF000;
+            source.blue_mask  = 0x00000FF0;
+            source.alpha_mask = 0xF0000000;
+            source.decodeMasks();
+        }
+
+        Bitmap inverted = source, posterized = source;
+        invert(inverted);
+        posterize(posterized, 3);
+        bool formula = true;
+        uint c[4] = {}, d[4] = {}, e[4] = {};
+        for(int y = 0; y < source.height_in_pixels; y++)
+        {
+            for(int x = 0; x < source.width_in_pixels; x++)
+            {
+                source.readPixel(x, y, c[0], c[1], c[2], c[3]);
+                inverted.readPixel(x, y, d[0], d[1], d[2], d[3]);
+                posterized.readPixel(x, y, e[0], e[1], e[2], e[3]);
+                for(int k = 0; k < 3; k++)
+                {
+                    formula = formula && d[k] == 255 - c[k] && e[k] == (c[k] < 64 ? 0u : c[k] < 192 ? 128u : 255u);
+                }
+                formula = formula && d[3] == c[3] && e[3] == c[3];
+            }
+        }
+        check(formula, string(name) + " invert and posterize 3");
+
+        Bitmap twice = inverted;
+        invert(twice);
+        Bitmap cleared = source;
+        applyPointOp(cleared, PointOp());
+        check(twice.data == cleared.data, string(name) + " inverted twice");
+
+        // Composing and then applying gives the same bytes as applying one after another
+        const vector<PointOp> ops = {gammaOp(2.2), invertOp(), posterizeOp(5), gammaOp(0.45)};
+        PointOp composed = ops[0];
+        Bitmap  expected = source;
+        for(size_t k = 0; k < ops.size(); k++)
+        {
+            if(k) composed = composed.then(ops[k]);
+            applyPointOp(expected, ops[k]);
+        }
+        Bitmap b = source;
+        applyPointOp(b, composed);
+        check(b.data == expected.data, string(name) + " composed tables");
+    }
+
+    // Composed runs in a pipeline give the same bytes as the filters one by one, on every format
+    for(const char *name : {"bear2_24", "bear3_32", "translucent"})
+    {
+        Bitmap source = name == "translucent"s ? makeTranslucent(97, 61) : load("examples/" + string(name) + ".bmp");
+        for(const vector<string>& chain : vector<vector<string>>{{"-c", "-gamma2.2", "-invert"}, {"-invert", "-c"},
+                                                                   {"-posterize3", "-g", "-invert", "-gamma0.5", "-c"}})
+        {
+            Pipeline pipeline;
+            Bitmap   expected = source;
+            string   what = name;
+            for(const string& option : chain)
+            {
+                pipeline.add(option);
+                what += " " + option;
+                if(option == "-c")              cellShade(expected);
+                else if(option == "-g")         grayscale(expected);
+                else if(option == "-invert")    invert(expected);
+                else if(option == "-posterize3") posterize(expected, 3);
+                else gammaCorrect(expected, option == "-gamma2.2" ? 2.2 : 0.5);
+            }
+            Bitmap b = source;
+            pipeline.run(b);
+            check(b.data == expected.data, what);
+        }
+    }
+}
+
+// Statistics have to match a readPixel loop, and the filters built on them have to do what they say
+static void testStats()
+{
+    cout << "statistics:" << endl;
+    for(const char *name : {"bear2_24", "bear3_32", "translucent"})
+    {
+        Bitmap source = name == "translucent"s ? makeTranslucent(301, 77) : load("examples/" + string(name) + ".bmp");
+
+        // Count every channel by hand
+        uint64_t counts[4][256] = {};
+        uint     c[4] = {};
+        for(int y = 0; y < source.height_in_pixels; y++)
+        {
+            for(int x = 0; x < source.width_in_pixels; x++)
+            {
+                source.readPixel(x, y, c[0], c[1], c[2], c[3]);
+                for(int k = 0; k < 4; k++) counts[k][c[k]]++;
+            }
+        }
+
+        ImageStats          stats = imageStats(source);
+        const ChannelStats* channels[4] = {&stats.red, &stats.green, &stats.blue, &stats.alpha};
+        bool                same = stats.pixels == (uint64_t)source.width_in_pixels * source.height_in_pixels;
+        bool                moments = true;
+        for(int k = 0; k < (stats.has_alpha ? 4 : 3); k++)
+        {
+            double sum = 0, squares = 0;
+            uint   low = 255, high = 0;
+            for(int v = 0; v < 256; v++)
+            {
+                same = same && channels[k]->histogram[v] == counts[k][v];
+                sum += (double)v * counts[k][v];
+                squares += (double)v * v * counts[k][v];
+                if(counts[k][v])
+                {
+                    low  = min(low, (uint)v);
+                    high = max(high, (uint)v);
+                }
+            }
+            double mean = sum / stats.pixels;
+            moments = moments && channels[k]->min == low && channels[k]->max == high && fabs(channels[k]->mean - mean) < 1e-9 &&
+                      fabs(channels[k]->stddev - sqrt(squares / stats.pixels - mean * mean)) < 1e-6;
+        }
+        check(same, string(name) + " histograms");
+        check(moments, string(name) + " min, max, mean and standard deviation");
+        check(stats.has_alpha == (name == "translucent"s), string(name) + " alpha counted only when there is alpha");
+
+        // The bands counted on different threads have to add up the same
+        bool threaded = true;
+        for(int threads : {2, 3, 8})
+        {
+            setThreadCount(threads);
+            ImageStats other = imageStats(source);
+            threaded = threaded && memcmp(&other, &stats, sizeof(stats)) == 0;
+        }
+        setThreadCount(0);
+        check(threaded, string(name) + " statistics on 2, 3 and 8 threads");
+
+        // Squeeze the colors into 60..187, so there is something to stretch
+        Bitmap dull = source;
+        for(int y = 0; y < dull.height_in_pixels; y++)
+        {
+            for(int x = 0; x < dull.width_in_pixels; x++)
+            {
+                dull.readPixel(x, y, c[0], c[1], c[2], c[3]);
+                for(int k = 0; k < 3; k++) c[k] = 60 + c[k] / 2;
+                dull.writePixel(x, y, c[0], c[1], c[2], c[3]);
+            }
+        }
+
+        // Auto levels stretches every channel out to 0..255, and clipping saturates about as many pixels as allowed.
+        // Channels with one value (the translucent image's blue, from an unused byte) stay as they are
+        ImageStats before = imageStats(dull);
+        Bitmap     b = dull;
+        autoLevels(b);
+        ImageStats after = imageStats(b);
+        const ChannelStats* was[3] = {&before.red, &before.green, &before.blue};
+        const ChannelStats* now[3] = {&after.red, &after.green, &after.blue};
+        bool covers = true;
+        for(int k = 0; k < 3; k++)
+        {
+            covers = covers && (was[k]->min == was[k]->max ? now[k]->min == was[k]->min && now[k]->max == was[k]->max
+                                                           : now[k]->min == 0 && now[k]->max == 255);
+        }
+        check(covers, string(name) + " auto levels covers 0..255");
+
+        b = dull;
+        autoLevels(b, 0.05);
+        after = imageStats(b);
+        bool clipped = true;
+        for(int k = 0; k < 3; k++)
+        {
+            double low = (double)now[k]->histogram[0] / after.pixels, high = (double)now[k]->histogram[255] / after.pixels;
+            if(was[k]->min == was[k]->max) continue;
+            clipped = clipped && low > 0 && low < 0.1 && high > 0 && high < 0.1;
+        }
+        check(clipped, string(name) + " auto levels clipping 5%");
+
+        // Equalizing gives a cumulative histogram close to a straight line
+        b = dull;
+        equalize(b);
+        after = imageStats(b);
+        bool even = true;
+        for(int k = 0; k < 3; k++)
+        {
+            const ChannelStats* channel = now[k];
+            uint64_t            total = 0;
+            if(was[k]->min == was[k]->max)
+            {
+                even = even && channel->min == was[k]->min;
+                continue;
+            }
+            for(int v = 0; v < 256; v++)
+            {
+                total += channel->histogram[v];
+                if(channel->histogram[v] && fabs((double)total / after.pixels - v / 255.0) > 0.05) even = false;
+            }
+        }
+        check(even, string(name) + " equalized");
+
+        // Gamma matches the formula, and leaves alpha alone
+        b = source;
+        gammaCorrect(b, 2.2);
+        bool formula = true;
+        uint d[4] = {};
+        for(int y = 0; y < source.height_in_pixels; y++)
+        {
+            for(int x = 0; x < source.width_in_pixels; x++)
+            {
+                source.readPixel(x, y, c[0], c[1], c[2], c[3]);
+                b.readPixel(x, y, d[0], d[1], d[2], d[3]);
+                for(int k = 0; k < 3; k++) formula = formula && d[k] == (uint)lround(255 * pow(c[k] / 255.0, 1 / 2.2));
+                formula = formula && d[3] == c[3];
+            }
+        }
+        check(formula, string(name) + " gamma 2.2");
+
+        b = source;
+        gammaCorrect(b, 1);
+        check(b.data == source.data, string(name) + " gamma 1 changes nothing");
+    }
+
+    bool thrown = false;
+    try
+    {
+        gammaOp(0);
+    }
+    catch(BitmapException&)
+    {
+        thrown = true;
+    }
+    check(thrown, "gamma 0 rejected");
+
+    // -stats writes the statistics of the image at that point in the pipeline
+    Bitmap   source = load("examples/bear2_24.bmp");
+    Pipeline pipeline;
+    check(pipeline.add("-g") && pipeline.add("-stats:/tmp/test_filters_stats.json") && pipeline.add("-r90") &&
+          !pipeline.add("-stats:"), "stats options");
+    Bitmap b = source;
+    pipeline.run(b);
+    grayscale(source);
+    ostringstream expected;
+    writeStats(expected, imageStats(source));
+    ifstream written("/tmp/test_filters_stats.json");
+    string   line;
+    getline(written, line);
+    check(line == expected.str(), "pipeline -stats");
+    remove("/tmp/test_filters_stats.json");
+}
+
+// Near duplicates hash close together and different images don't, and the index finds exactly what comparing
+// against every hash finds
+static void testImageHash()
+{
+    cout << "image hashes:" << endl;
+
+    for(const char *name : {"bear2_24", "bear3_32"})
+    {
+        Bitmap source = load("examples/" + string(name) + ".bmp");
+        Bitmap mapped;
+        mapped.open_mapped("examples/" + string(name) + ".bmp");
+        check(differenceHash(mapped) == differenceHash(source) && perceptualHash(mapped) == perceptualHash(source),
+              string(name) + " mapped hashes the same");
+
+        const vector<pair<string, function<void(Bitmap&)>>> near = {
+            {"blur",    [](Bitmap& b) { blur(b); }},
+            {"resize",  [](Bitmap& b) { resize(b, b.width_in_pixels * 2 / 3, b.height_in_pixels * 2 / 3, ResampleFilter::Bilinear); }},
+            {"gamma",   [](Bitmap& b) { gammaCorrect(b, 1.3); }},
+            {"gray",    [](Bitmap& b) { grayscale(b); }},
+        };
+        for(const auto& edit : near)
+        {
+            Bitmap b = source;
+            edit.second(b);
+            check(hammingDistance(perceptualHash(b), perceptualHash(source)) <= DUPLICATE_DISTANCE &&
+                  hammingDistance(differenceHash(b), differenceHash(source)) <= DUPLICATE_DISTANCE,
+                  string(name) + " " + edit.first + " is a near duplicate");
+        }
+
+        const vector<pair<string, function<void(Bitmap&)>>> far = {
+            {"invert", invert},
+            {"rot90",  [](Bitmap& b) { rot90(b); }},
+        };
+        for(const auto& edit : far)
+        {
+            Bitmap b = source;
+            edit.second(b);
+            check(hammingDistance(perceptualHash(b), perceptualHash(source)) > 4 * DUPLICATE_DISTANCE &&
+                  hammingDistance(differenceHash(b), differenceHash(source)) > 4 * DUPLICATE_DISTANCE,
+                  string(name) + " " + edit.first + " is a different image");
+        }
+    }
+    Bitmap tiny = load("examples/bear2_24.bmp");
+    resize(tiny, 3, 2, ResampleFilter::Box);
+    differenceHash(tiny);
+    perceptualHash(tiny);
+
+    // Random hashes with some planted close to others, searched at every distance up to 3 bits per part
+    HashIndex        index;
+    vector<uint64_t> hashes;
+    uint64_t         state = 1;
+    auto             random = [&]() { state ^= state << 13; state ^= state >> 7; state ^= state << 17; return state; };
+    bool             ids = true;
+    for(int i = 0; i < 20000; i++)
+    {
+        uint64_t hash = random();
+        if(i % 4 == 3) hash = hashes[random() % hashes.size()] ^ (random() & random() & random());
+        hashes.push_back(hash);
+        ids = ids && index.insert(hash) == (uint32_t)i && index[i] == hash;
+    }
+    check(ids, "hash index ids count up");
+
+    bool same = true;
+    for(int query = 0; query < 100; query++)
+    {
+        uint64_t hash     = query % 2 ? random() : hashes[random() % hashes.size()] ^ (random() & random());
+        int      distance = query % 16;
+
+        vector<pair<uint32_t, int>> expected;
+        for(uint32_t id = 0; id < hashes.size(); id++)
+        {
+            if(hammingDistance(hash, hashes[id]) <= distance) expected.push_back({id, hammingDistance(hash, hashes[id])});
+        }
+        stable_sort(expected.begin(), expected.end(), [](const pair<uint32_t, int>& a, const pair<uint32_t, int>& b) {
+            return a.second < b.second;
+        });
+        same = same && index.find(hash, distance) == expected;
+    }
+    check(same && index.size() == hashes.size(), "hash index finds every hash within the distance");
+    check(index.find(hashes[0], -1).empty(), "hash index with a negative distance finds nothing");
+}
+
+// Reflect or clamp i into 0..n-1, the way the convolution borders are defined
+static int borderPixel(int i, int n, Border border)
+{
+    if(border == Border::Clamp) return min(max(i, 0), n - 1);
+    while(i < 0 || i >= n)
+    {
+        if(n == 1) return 0;
+        i = i < 0 ? -i : 2*(n - 1) - i;
+    }
+    return i;
+}
+
+// Convolve by hand with readPixel, in top-down coordinates: tap (kx, ky) reads pixel (x - r + kx, y - r + ky).
+// With gradient, the kernel is Sobel and each channel is |x| + |y|
+static Bitmap convolveByHand(Bitmap source, const ConvolutionKernel& kernel, Border border, bool gradient = false)
+{
+    const int sobel_x[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1}, sobel_y[9] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
+    int       width = source.width_in_pixels, height = source.height_in_pixels, radius = kernel.size / 2;
+    int       channels = source.premultiplied ? 4 : 3;
+    Bitmap    b = source;
+    uint      c[4];
+
+    for(int y = 0; y < height; y++)
+    {
+        for(int x = 0; x < width; x++)
+        {
+            int sums[2][4] = {};
+            for(int ky = 0; ky < kernel.size; ky++)
+            {
+                for(int kx = 0; kx < kernel.size; kx++)
+                {
+                    int sx = borderPixel(x - radius + kx, width, border);
+                    int sy = borderPixel(y - radius + ky, height, border);
+                    source.readPixel(sx, height - 1 - sy, c[0], c[1], c[2], c[3]);
+                    for(int k = 0; k < channels; k++)
+                    {
+                        int t = ky*kernel.size + kx;
+                        sums[0][k] += (gradient ? sobel_x[t] : kernel.weights[t]) * (int)c[k];
+                        if(gradient) sums[1][k] += sobel_y[t] * (int)c[k];
+                    }
+                }
+            }
+            source.readPixel(x, height - 1 - y, c[0], c[1], c[2], c[3]);
+            for(int k = 0; k < channels; k++)
+            {
+                int value;
+                if(gradient) value = abs(sums[0][k]) + abs(sums[1][k]);
+                else
+                {
+                    double exact = (double)sums[0][k] / kernel.divisor + kernel.bias;
+                    value = (int)floor(exact + 0.5);
+                }
+                c[k] = min(max(value, 0), 255);
+            }
+            b.writePixel(x, height - 1 - y, c[0], c[1], c[2], c[3]);
+        }
+    }
+    return b;
+}
+
+// Convolutions have to match a readPixel loop at every SIMD level, for both borders and any kernel size
+static void testConvolve()
+{
+    const ConvolutionKernel sharpen_kernel = {3, {0, -1, 0, -1, 5, -1, 0, -1, 0}, 1, 0};
+    const ConvolutionKernel emboss_kernel  = {3, {-2, -1, 0, -1, 1, 1, 0, 1, 2}, 1, 0};
+    const ConvolutionKernel odd_kernel     = {5, {1, 0, 3, 0, -2,  4, 1, 0, 0, 0,  2, 2, 9, -1, 0,  0, 0, 1, 0, 5,  -3, 0, 0, 2, 1}, 7, 10};
+    const ConvolutionKernel tall_kernel    = {3, {0, 1, 0, 0, 0, 0, 0, 0, 0}, 1, 0};   // Reads the pixel above
+
+    auto box = [](int size) { return ConvolutionKernel{size, vector<int>(size * size, 1), size * size, 0}; };
+
+    const vector<tuple<string, ConvolutionKernel, function<void(Bitmap&, Border)>, bool>> filters = {
+        {"sharpen",    sharpen_kernel, [](Bitmap& b, Border border) { sharpen(b, border); }, false},
+        {"emboss",     emboss_kernel,  [](Bitmap& b, Border border) { emboss(b, border); }, false},
+        {"edges",      box(3),         [](Bitmap& b, Border border) { edgeDetect(b, border); }, true},
+        {"box 3",      box(3),         [](Bitmap& b, Border border) { boxBlur(b, 3, border); }, false},
+        {"box 5",      box(5),         [](Bitmap& b, Border border) { boxBlur(b, 5, border); }, false},
+        {"box 7",      box(7),         [](Bitmap& b, Border border) { boxBlur(b, 7, border); }, false},
+        {"5x5 kernel", odd_kernel,     [&](Bitmap& b, Border border) { convolve(b, odd_kernel, border); }, false},
+        {"up kernel",  tall_kernel,    [&](Bitmap& b, Border border) { convolve(b, tall_kernel, border); }, false},
+    };
+
+    cout << "convolution:" << endl;
+    for(const char *name : {"bear2_24", "bear3_32", "translucent", "premultiplied", "tiny"})
+    {
+        Bitmap source;
+        if(name == "translucent"s || name == "premultiplied"s) source = makeTranslucent(53, 41);
+        else
+        {
+            source = load("examples/" + string(name == "tiny"s ? "bear2_24" : name) + ".bmp");
+            if(name == "tiny"s) resize(source, 2, 3, ResampleFilter::Box);
+            else                resize(source, 67, 45, ResampleFilter::Bilinear);
+        }
+        if(name == "premultiplied"s) premultiply(source);
+
+        for(const auto& filter : filters)
+        {
+            for(Border border : {Border::Clamp, Border::Mirror})
+            {
+                Bitmap expected = convolveByHand(source, get<1>(filter), border, get<3>(filter));
+                bool   same = true;
+
+                for(SimdLevel level : supportedLevels())
+                {
+                    setSimdLevel(level);
+                    Bitmap b = source;
+                    get<2>(filter)(b, border);
+                    same = same && b.data == expected.data;
+                }
+                setSimdLevel(detectSimdLevel());
+                check(same, string(name) + " " + get<0>(filter) + (border == Border::Mirror ? " mirrored" : " clamped"));
+            }
+        }
+    }
+
+    // The compile-time kernels give the same bytes as the generic path on a whole image
+    Bitmap source = load("examples/bear3_24.bmp");
+    Bitmap b = source, expected = source;
+    sharpen(b);
+    convolve(expected, sharpen_kernel);
+    check(b.data == expected.data, "sharpen against the generic path");
+
+    int  rejected = 0;
+    for(const ConvolutionKernel& kernel : {ConvolutionKernel{2, {1, 1, 1, 1}, 4, 0}, ConvolutionKernel{3, {1, 1}, 1, 0},
+                                           ConvolutionKernel{3, vector<int>(9, 1), 0, 0}, ConvolutionKernel{1, {MAX_KERNEL_WEIGHT + 1}, 1, 0},
+                                           ConvolutionKernel{MAX_KERNEL_SIZE + 2, vector<int>((MAX_KERNEL_SIZE + 2) * (MAX_KERNEL_SIZE + 2), 1), 1, 0}})
+    {
+        try
+        {
+            convolve(b, kernel);
+        }
+        catch(BitmapException&)
+        {
+            rejected++;
+        }
+    }
+    check(rejected == 5, "bad kernels rejected");
+
+    ConvolutionKernel parsed;
+    int               size;
+    check(parseKernel("-kernel:1,2,1,2,4,2,1,2,1/16", parsed) && parsed.size == 3 && parsed.divisor == 16 &&
+          parsed.weights == vector<int>({1, 2, 1, 2, 4, 2, 1, 2, 1}) && parseKernel("-kernel:-3", parsed) && parsed.size == 1 &&
+          !parseKernel("-kernel:1,2", parsed) && !parseKernel("-kernel:1,1,1,1,1,1,1,1,1/0", parsed) &&
+          !parseKernel("-kernel:1,", parsed) && parseBoxSize("-box", size) && size == 3 && parseBoxSize("-box9", size) &&
+          size == 9 && !parseBoxSize("-box4", size), "kernel options");
+    check(parseBoxSize("-box" + to_string(MAX_KERNEL_SIZE), size) && !parseBoxSize("-box" + to_string(MAX_KERNEL_SIZE + 2), size) &&
+          !parseBoxSize("-box46341", size) && parseKernel("-kernel:" + to_string(-MAX_KERNEL_WEIGHT), parsed) &&
+          !parseKernel("-kernel:2000000000", parsed) && !parseKernel("-kernel:1/2000000000", parsed),
+          "kernel options past the limits rejected");
+    rejected = 0;
+    try
+    {
+        boxBlur(b, MAX_KERNEL_SIZE + 2);
+    }
+    catch(BitmapException&)
+    {
+        rejected++;
+    }
+    check(rejected == 1, "box blur past MAX_KERNEL_SIZE rejected");
+}
+
+// A pipeline (with its fused point-wise runs) has to match the filters run one at a time
+static void testPipeline()
+{
+    const vector<vector<string>> chains = {
+        {"-g", "-c"},
+        {"-c", "-g", "-b"},
+        {"-g", "-b3.5", "-r90"},
+        {"-grow", "-c", "-g", "-shrink", "-d1"},
+        {"-resize200x120:box", "-g", "-resize400x400"},
+        {"-g", "-p", "-b", "-c"},
+        {"-r90", "-c", "-p7x5", "-b3.5", "-shrink"},
+        {"-levels0.5", "-gamma2.2", "-g", "-equalize", "-gamma0.8"},
+        {"-sharpen", "-box5:mirror", "-c", "-edges"},
+        {"-r90", "-h", "-d2", "-v"},
+        {"-r180", "-g", "-v", "-r270", "-d1"},
+        {"-v", "-h", "-c"},
+    };
+    const vector<pair<string, function<void(Bitmap&)>>> filters = {
+        {"-c",      [](Bitmap& b) { cellShade(b); }},
+        {"-g",      [](Bitmap& b) { grayscale(b); }},
+        {"-p",      [](Bitmap& b) { pixelate(b); }},
+        {"-p7x5",   [](Bitmap& b) { pixelate(b, 7, 5); }},
+        {"-b",      [](Bitmap& b) { blur(b); }},
+        {"-b3.5",   [](Bitmap& b) { blur(b, 3.5); }},
+        {"-r90",    rot90},
+        {"-r180",   rot180},
+        {"-r270",   rot270},
+        {"-v",      flipv},
+        {"-h",      fliph},
+        {"-d1",     flipd1},
+        {"-d2",     flipd2},
+        {"-grow",   scaleUp},
+        {"-shrink", scaleDown},
+        {"-resize200x120:box", [](Bitmap& b) { resize(b, 200, 120, ResampleFilter::Box); }},
+        {"-resize400x400",     [](Bitmap& b) { resize(b, 400, 400, ResampleFilter::Bicubic); }},
+        {"-levels0.5", [](Bitmap& b) { autoLevels(b, 0.005); }},
+        {"-equalize",  equalize},
+        {"-gamma2.2",  [](Bitmap& b) { gammaCorrect(b, 2.2); }},
+        {"-gamma0.8",  [](Bitmap& b) { gammaCorrect(b, 0.8); }},
+        {"-sharpen",     [](Bitmap& b) { sharpen(b); }},
+        {"-box5:mirror", [](Bitmap& b) { boxBlur(b, 5, Border::Mirror); }},
+        {"-edges",       [](Bitmap& b) { edgeDetect(b); }},
+    };
+
+    cout << "pipelines against single filters:" << endl;
+    for(const char *name : {"bear2_24", "bear3_32"})
+    {
+        Bitmap source = load("examples/" + string(name) + ".bmp");
+
+        for(const auto& chain : chains)
+        {
+            Pipeline pipeline;
+            Bitmap   expected = source;
+            string   what = name;
+
+            for(const string& option : chain)
+            {
+                pipeline.add(option);
+                for(const auto& filter : filters)
+                {
+                    if(filter.first == option) filter.second(expected);
+                }
+                what += " " + option;
+            }
+
+            Bitmap b = source;
+            pipeline.run(b);
+            check(b.data == expected.data && b.width_in_pixels == expected.width_in_pixels, what);
+        }
+    }
+
+    Pipeline pipeline;
+    check(!pipeline.add("-x") && !pipeline.add("-b3x") && !pipeline.add("-resize0x5") && !pipeline.add("-resize5x5:sharp") &&
+          !pipeline.add("-gamma0") && !pipeline.add("-gamma") && !pipeline.add("-levels60") &&
+          pipeline.size() == 0, "unknown options rejected");
+}
+
+// A batch has to write the same files as the pipelines run one by one
+static void testBatch()
+{
+    const vector<pair<string, vector<string>>> lines = {
+        {"bear2_24", {"-g"}},
+        {"bear3_32", {"-b", "-r90"}},
+        {"bear2_24", {"-c", "-shrink"}},
+        {"bear2_24", {}},
+        {"bear3_32", {"-d2"}},
+    };
+    const string manifest = "/tmp/test_filters_manifest.txt";
+
+    cout << "batch:" << endl;
+    ofstream out(manifest);
+    out << "# input options output\n\n";
+    for(size_t i = 0; i < lines.size(); i++)
+    {
+        out << "examples/" << lines[i].first << ".bmp ";
+        for(const string& option : lines[i].second) out << option << " ";
+        out << "/tmp/test_filters_batch" << i << ".bmp\n";
+    }
+    out.close();
+
+    ostringstream report;
+    int failed = runBatch(readManifest(manifest), report);
+    check(failed == 0, "batch ran every job");
+    check(report.str().find("load cached") != string::npos, "batch decoded shared inputs once");
+
+    for(size_t i = 0; i < lines.size(); i++)
+    {
+        Pipeline pipeline;
+        for(const string& option : lines[i].second) pipeline.add(option);
+
+        Bitmap expected = load("examples/" + lines[i].first + ".bmp");
+        pipeline.run(expected);
+        Bitmap b = load("/tmp/test_filters_batch" + to_string(i) + ".bmp");
+        check(b.data == expected.data && b.width_in_pixels == expected.width_in_pixels,
+              "batch job " + to_string(i + 1));
+    }
+
+    out.open(manifest);
+    out << "examples/bear2_24.bmp -x /tmp/test_filters_batch.bmp\n";
+    out.close();
+    bool rejected = false;
+    try
+    {
+        readManifest(manifest);
+    }
+    catch(BitmapException&)
+    {
+        rejected = true;
+    }
+    check(rejected, "batch rejects unknown options");
+
+    // A blurred copy is a near duplicate of its source, but only for jobs with the same options
+    Bitmap blurred = load("examples/bear2_24.bmp");
+    blur(blurred);
+    blurred.save("/tmp/test_filters_blurred.bmp");
+    out.open(manifest);
+    out << "examples/bear2_24.bmp -g /tmp/test_filters_dedupe0.bmp\n"
+        << "/tmp/test_filters_blurred.bmp -g /tmp/test_filters_dedupe1.bmp\n"
+        << "/tmp/test_filters_blurred.bmp -c /tmp/test_filters_dedupe2.bmp\n"
+        << "examples/bear3_32.bmp -g /tmp/test_filters_dedupe3.bmp\n";
+    out.close();
+    remove("/tmp/test_filters_dedupe1.bmp");
+    ostringstream deduped;
+    failed = runBatch(readManifest(manifest), deduped, DUPLICATE_DISTANCE);
+    check(failed == 0 && deduped.str().find("near duplicate of examples/bear2_24.bmp") != string::npos &&
+          deduped.str().find("1 skipped") != string::npos, "batch skips a near duplicate");
+    check(!ifstream("/tmp/test_filters_dedupe1.bmp") && ifstream("/tmp/test_filters_dedupe2.bmp") &&
+          ifstream("/tmp/test_filters_dedupe3.bmp"), "batch runs the jobs that aren't duplicates");
+}
+
+// Buffers come back from the pool aligned, and a batch run a second time takes all its buffers from the pool
+static void testBufferPool()
+{
+    cout << "buffer pool:" << endl;
+
+    void           *first = acquireBuffer(1000);
+    BufferPoolStats before = getBufferPoolStats();
+    releaseBuffer(first, 1000);
+    void           *again = acquireBuffer(1000);
+    releaseBuffer(again, 1000);
+    check((size_t)first % BUFFER_ALIGNMENT == 0 && again == first && getBufferPoolStats().reuses == before.reuses + 1,
+          "released buffers are handed out again");
+
+    void *big = acquireBuffer(HUGE_PAGE_BYTES + 1);
+    check((size_t)big % HUGE_PAGE_BYTES == 0, "big buffers are aligned to huge pages");
+    releaseBuffer(big, HUGE_PAGE_BYTES + 1);
+
+    const string manifest = "/tmp/test_filters_pool.txt";
+    ofstream     out(manifest);
+    out << "examples/bear2_24.bmp -g -b -r90 -p /tmp/test_filters_pool0.bmp\n"
+        << "examples/bear3_32.bmp -resize300x200 -b2 -shrink /tmp/test_filters_pool1.bmp\n"
+        << "examples/bear2_24.bmp -grow -c /tmp/test_filters_pool2.bmp\n";
+    out.close();
+
+    setThreadCount(1);   // Same buffers in flight on each run
+    ostringstream report;
+    runBatch(readManifest(manifest), report);
+    size_t warm = getBufferPoolStats().allocations;
+    runBatch(readManifest(manifest), report);
+    check(getBufferPoolStats().allocations == warm, "a warmed-up batch allocates no buffers");
+    setThreadCount(0);
+}
+
+// Streaming a band at a time has to write the same image as filtering it whole
+static void testStream()
+{
+    const vector<vector<string>> chains = {
+        {"-n"},
+        {"-g", "-c"},
+        {"-p"},
+        {"-b"},
+        {"-b3.5", "-h"},
+        {"-shrink", "-p"},
+        {"-p7x5", "-b", "-p3"},
+        {"-p", "-b", "-shrink", "-b0.8", "-g"},
+    };
+
+    cout << "streaming against whole images:" << endl;
+    for(const char *name : {"bear2_24", "bear3_32"})
+    {
+        for(const auto& chain : chains)
+        {
+            Pipeline pipeline;
+            string   what = name;
+            for(const string& option : chain)
+            {
+                pipeline.add(option);
+                what += " " + option;
+            }
+
+            Bitmap expected = load("examples/" + string(name) + ".bmp");
+            pipeline.run(expected);
+
+            streamImage("examples/" + string(name) + ".bmp", "/tmp/test_filters_stream.bmp", chain);
+            Bitmap b = load("/tmp/test_filters_stream.bmp");
+            check(b.data == expected.data && b.width_in_pixels == expected.width_in_pixels &&
+                  b.length == expected.length, what);
+        }
+    }
+
+    // Bytes after the rows of a 32-bit file go across too
+    string   original = readFile("examples/bear3_32.bmp") + "sixteen trailers";
+    uint32_t length   = original.size();
+    memcpy(&original[2], &length, 4);
+    ofstream("/tmp/test_filters_stream_in.bmp", ios::binary) << original;
+    Bitmap expected = load("/tmp/test_filters_stream_in.bmp");
+    grayscale(expected);
+    blur(expected);
+    ostringstream whole;
+    whole << expected;
+    streamImage("/tmp/test_filters_stream_in.bmp", "/tmp/test_filters_stream.bmp", {"-g", "-b"});
+    check(readFile("/tmp/test_filters_stream.bmp") == whole.str(), "bear3_32 with trailing data -g -b");
+
+    check(!canStream("-r90") && !canStream("-grow") && canStream("-b2"), "streaming rejects whole-image filters");
+}
+
+// Every block (including the partial ones at the edges) has to be the floor of its average
+static bool pixelatedCorrectly(Bitmap& source, Bitmap& b, int x0, int y0, int x1, int y1, int block_width, int block_height)
+{
+    for(int by = y0; by < y1; by += block_height)
+    {
+        for(int bx = x0; bx < x1; bx += block_width)
+        {
+            uint sum[3] = {0, 0, 0}, count = 0, c[4];
+
+            for(int y = by; y < min(by + block_height, y1); y++)
+            {
+                for(int x = bx; x < min(bx + block_width, x1); x++, count++)
+                {
+                    source.readPixel(x, y, c[0], c[1], c[2], c[3]);
+                    for(int i = 0; i < 3; i++) sum[i] += c[i];
+                }
+            }
+            for(int y = by; y < min(by + block_height, y1); y++)
+            {
+                for(int x = bx; x < min(bx + block_width, x1); x++)
+                {
+                    b.readPixel(x, y, c[0], c[1], c[2], c[3]);
+                    for(int i = 0; i < 3; i++)
+                    {
+                        if(c[i] != sum[i] / count) return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static void testPixelate()
+{
+    cout << "pixelate against brute force:" << endl;
+    for(const char *name : {"bear2_24", "bear3_32"})
+    {
+        Bitmap source = load("examples/" + string(name) + ".bmp");
+        int    width  = source.width_in_pixels;
+        int    height = source.height_in_pixels;
+
+        for(auto size : vector<pair<int, int>>{{16, 16}, {7, 5}, {1, 3}, {40, 9}})
+        {
+            Bitmap b = source;
+            pixelate(b, size.first, size.second);
+            check(pixelatedCorrectly(source, b, 0, 0, width, height, size.first, size.second),
+                  string(name) + " " + to_string(size.first) + "x" + to_string(size.second));
+        }
+
+        // Two regions with different block sizes from one table; the pixels outside them stay put
+        IntegralImage sums(source);
+        Bitmap        b = source;
+        pixelate(b, sums, 10, 20, 100, 60, 6, 6);
+        pixelate(b, sums, width - 50, height - 30, 80, 80, 12, 4);
+
+        Bitmap outside = b;
+        pixelate(outside, sums, 10, 20, 100, 60, 1, 1);
+        pixelate(outside, sums, width - 50, height - 30, 80, 80, 1, 1);
+        check(pixelatedCorrectly(source, b, 10, 20, 110, 80, 6, 6) &&
+              pixelatedCorrectly(source, b, width - 50, height - 30, width, height, 12, 4) &&
+              outside.data == source.data, string(name) + " regions");
+    }
+}
+
+// Shrinking by a whole factor with the box filter is the rounded average of each block
+static bool averagedCorrectly(Bitmap& source, Bitmap& b, int factor)
+{
+    for(int y = 0; y < b.height_in_pixels; y++)
+    {
+        for(int x = 0; x < b.width_in_pixels; x++)
+        {
+            uint total[4] = {0, 0, 0, 0};
+            uint red, green, blue, alpha;
+
+            for(int dy = 0; dy < factor; dy++)
+            {
+                for(int dx = 0; dx < factor; dx++)
+                {
+                    source.readPixel(x*factor + dx, y*factor + dy, red, green, blue, alpha);
+                    total[0] += red;  total[1] += green;  total[2] += blue;  total[3] += alpha;
+                }
+            }
+
+            b.readPixel(x, y, red, green, blue, alpha);
+            uint area = factor * factor;
+            if(red   != (total[0] + area/2) / area || green != (total[1] + area/2) / area ||
+               blue  != (total[2] + area/2) / area || alpha != (total[3] + area/2) / area)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void testResize()
+{
+    cout << "resize:" << endl;
+    for(const char *name : {"bear2_24", "bear3_32"})
+    {
+        Bitmap source = load("examples/" + string(name) + ".bmp");
+        int    width  = source.width_in_pixels / 8 * 8;
+        int    height = source.height_in_pixels / 8 * 8;
+
+        // Cut down to a multiple of 8 pixels (nearest at scale 1 copies pixels straight across)
+        Bitmap cropped = source;
+        resize(cropped, width, height, ResampleFilter::Nearest);
+        check(cropped.height_in_pixels == height && cropped.width_in_pixels == width, string(name) + " nearest");
+
+        for(int factor : {2, 4, 8})
+        {
+            Bitmap b = cropped;
+            resize(b, width / factor, height / factor, ResampleFilter::Box);
+            check(averagedCorrectly(cropped, b, factor), string(name) + " box 1/" + to_string(factor));
+        }
+
+        Bitmap b = source;
+        scaleDown(b);
+        check(averagedCorrectly(source, b, 2), string(name) + " shrink");
+
+        // At the same size every filter is 1 on its own pixel and 0 on the others
+        for(ResampleFilter filter : {ResampleFilter::Box, ResampleFilter::Bilinear, ResampleFilter::Bicubic, ResampleFilter::Lanczos})
+        {
+            b = source;
+            resize(b, source.width_in_pixels, source.height_in_pixels, filter);
+            check(b.data == source.data, string(name) + " same size filter " + to_string((int)filter));
+        }
+
+        b = source;
+        resize(b, 1, 1, ResampleFilter::Lanczos);
+        resize(b, 3, 2, ResampleFilter::Bicubic);
+        check(b.width_in_pixels == 3 && b.height_in_pixels == 2, string(name) + " down to 1x1 and back up");
+    }
+
+    Bitmap b = load("examples/bear2_24.bmp");
+    bool   threw = false;
+    try
+    {
+        resize(b, 0, 10, ResampleFilter::Box);
+    }
+    catch(BitmapException&)
+    {
+        threw = true;
+    }
+    check(threw, "resize to 0 wide throws");
+
+    // Over 4 GiB doesn't fit in the header, and is turned away before anything is allocated
+    int width = b.width_in_pixels;
+    threw = false;
+    try
+    {
+        resize(b, 100000, 100000, ResampleFilter::Box);
+    }
+    catch(BitmapException&)
+    {
+        threw = true;
+    }
+    check(threw && b.width_in_pixels == width, "resize past 4 GiB throws and leaves the image alone");
+}
+
+// A wide gaussian has to come out as the exact one would, rather than flattening into a box, and sigmas too
+// big to run are turned away
+static void testBlurSigma()
+{
+    Bitmap source = load("examples/bear2_24.bmp");
+    resize(source, 160, 120, ResampleFilter::Box);
+    int    width  = source.width_in_pixels;
+    int    height = source.height_in_pixels;
+
+    cout << "blur sigma:" << endl;
+    for(double sigma : {0.3, 2.0, 30.0, 150.0})
+    {
+        int            radius = blurRadius(sigma);
+        vector<double> weights(2*radius + 1);
+        double         total = 0;
+        for(int i = -radius; i <= radius; i++) total += weights[i + radius] = exp(-(i * i) / (2 * sigma * sigma));
+
+        // Rows then columns, in doubles, repeating the edge pixels
+        vector<double> across((size_t)width * height * 3, 0);
+        for(int y = 0; y < height; y++)
+        {
+            const uint8_t *row = (const uint8_t*)source.row(y);
+            for(int x = 0; x < width; x++)
+            {
+                for(int k = -radius; k <= radius; k++)
+                {
+                    int from = min(max(x + k, 0), width - 1);
+                    for(int c = 0; c < 3; c++) across[((size_t)y * width + x) * 3 + c] += weights[k + radius] / total * row[from*3 + c];
+                }
+            }
+        }
+
+        Bitmap b = source;
+        blur(b, sigma);
+        int worst = 0;
+        for(int y = 0; y < height; y++)
+        {
+            const uint8_t *row = (const uint8_t*)b.row(y);
+            for(int x = 0; x < width * 3; x++)
+            {
+                double exact = 0;
+                for(int k = -radius; k <= radius; k++)
+                {
+                    exact += weights[k + radius] / total * across[(size_t)min(max(y + k, 0), height - 1) * width * 3 + x];
+                }
+                worst = max(worst, abs(row[x] - (int)lround(exact)));
+            }
+        }
+        ostringstream what;
+        what << "sigma " << sigma << " within 1 of the exact blur (off by " << worst << ")";
+        check(worst <= 1, what.str());
+    }
+
+    double sigma = 0;
+    check(parseSigma("-b200", sigma) && sigma == MAX_BLUR_SIGMA && !parseSigma("-b200.5", sigma) &&
+          !parseSigma("-b1e9", sigma) && !parseSigma("-binf", sigma) && !parseSigma("-bnan", sigma) &&
+          !parseSigma("-b0", sigma) && !parseSigma("-b-1", sigma) && parseSigma("-b0.01", sigma),
+          "sigmas of 0 or less or past MAX_BLUR_SIGMA aren't options");
+    check(blurRadius(1e300) == 3 * MAX_BLUR_SIGMA && blurRadius(nan("")) == 1, "radius of huge and NaN sigmas");
+
+    bool threw = false;
+    try
+    {
+        blur(source, 1e9);
+    }
+    catch(BitmapException&)
+    {
+        threw = true;
+    }
+    check(threw, "blur with a sigma past MAX_BLUR_SIGMA throws");
+}
+
+// save() has to write the same bytes as operator<<, from loaded and mapped images, direct or not
+static void testSave()
+{
+    const string path = "/tmp/test_filters_save.bmp";
+
+    cout << "save:" << endl;
+    for(const char *name : {"bear1_24", "bear2_24", "bear3_32"})
+    {
+        string original = readFile("examples/" + string(name) + ".bmp");
+
+        Bitmap mapped;
+        mapped.open_mapped("examples/" + string(name) + ".bmp");
+        mapped.save(path);
+        check(readFile(path) == original, string(name) + " saved from the mapping");
+
+        Bitmap b = load("examples/" + string(name) + ".bmp");
+        b.save(path);
+        check(readFile(path) == original, string(name) + " saved");
+
+        // Small enough to skip O_DIRECT, with padding on the 24-bit one
+        resize(b, 5, 3, ResampleFilter::Box);
+        ostringstream streamed;
+        streamed << b;
+        b.save(path);
+        check(readFile(path) == streamed.str(), string(name) + " 5x3 saved");
+    }
+
+    // A 32-bit file with bytes after its rows (counted in its length) comes back byte for byte, big enough for
+    // O_DIRECT and not
+    Bitmap small = load("examples/bear3_32.bmp");
+    resize(small, 5, 3, ResampleFilter::Box);
+    small.save("/tmp/test_filters_small.bmp");
+    for(const char *source : {"examples/bear3_32.bmp", "/tmp/test_filters_small.bmp"})
+    {
+        string   original = readFile(source) + "sixteen trailers";
+        uint32_t length   = original.size();
+        memcpy(&original[2], &length, 4);
+        const string trailing = "/tmp/test_filters_trailing.bmp";
+        ofstream(trailing, ios::binary) << original;
+
+        Bitmap mapped;
+        mapped.open_mapped(trailing);
+        mapped.save(path);
+        bool same = readFile(path) == original;
+        Bitmap loaded;
+        loaded.load(trailing);
+        loaded.save(path);
+        same = same && readFile(path) == original;
+        mapped.loadMapped();
+        ostringstream streamed;
+        streamed << mapped;
+        same = same && streamed.str() == original;
+        check(same, to_string(original.size()) + " bytes with trailing data saved");
+    }
+
+    Bitmap b = load("examples/bear2_24.bmp");
+    bool   threw = false;
+    try
+    {
+        b.save("/nonexistent/test_filters_save.bmp");
+    }
+    catch(BitmapException&)
+    {
+        threw = true;
+    }
+    check(threw, "save to a missing directory throws");
+}
+
+// load() has to read the same header and pixels as open_mapped() and loadMapped(), with and without padding
+static void testLoad()
+{
+    const string path = "/tmp/test_filters_load.bmp";
+
+    cout << "load:" << endl;
+    for(const char *name : {"bear1_24", "bear2_24", "bear3_32", "pikachu32"})
+    {
+        Bitmap b;
+        b.load("examples/" + string(name) + ".bmp");
+        Bitmap mapped = load("examples/" + string(name) + ".bmp");
+        check(b.width_in_pixels == mapped.width_in_pixels && b.height_in_pixels == mapped.height_in_pixels &&
+              b.length == mapped.length && b.color_depth == mapped.color_depth &&
+              b.format.alpha.mask == mapped.format.alpha.mask && !b.isMapped(), string(name) + " header");
+        check(b.data.size() == mapped.data.size() && memcmp(b.data.data(), mapped.data.data(), b.data.size()) == 0,
+              string(name) + " pixels");
+
+        // Odd widths have padding on 24-bit rows, and the test build saves them through O_DIRECT
+        for(int width : {1, 2, 3, 203})
+        {
+            Bitmap sized = mapped;
+            resize(sized, width, 171, ResampleFilter::Box);
+            sized.save(path);
+
+            Bitmap loaded;
+            loaded.load(path);
+            check(readFile(path).size() == sized.length &&
+                  memcmp(loaded.data.data(), sized.data.data(), sized.data.size()) == 0,
+                  string(name) + " " + to_string(width) + " wide round trip");
+        }
+    }
+
+    // A file cut short in the pixels
+    string bytes = readFile("examples/bear2_24.bmp");
+    ofstream(path, ios::binary).write(bytes.data(), bytes.size() - 100);
+    for(int mapped = 0; mapped < 2; mapped++)
+    {
+        Bitmap b;
+        bool   threw = false;
+        try
+        {
+            if(mapped) b.open_mapped(path);
+            else       b.load(path);
+        }
+        catch(BitmapException&)
+        {
+            threw = true;
+        }
+        check(threw, mapped ? "truncated file won't map" : "truncated file won't load");
+    }
+}
+
+// The ring and its fallback have to move the same bytes, in transfers of many parts, and fail at the end of a file
+static void testIoRing()
+{
+    const string path = "/tmp/test_filters_ioring.bmp";
+    string       original = readFile("examples/pikachu24.bmp");
+
+    cout << "io ring:" << endl;
+    for(unsigned depth : {0, 4, IORING_DEPTH})
+    {
+        IoRing ring(depth);
+        string name = ring.usesUring() ? "io_uring depth " + to_string(depth) : "fallback";
+
+        // Read the file as 3 transfers of 7-byte parts
+        int                     fd = open("examples/pikachu24.bmp", O_RDONLY);
+        string                  bytes(original.size(), '\0');
+        size_t                  third = original.size() / 3;
+        vector<IoTransfer>      transfers;
+        for(size_t start = 0; start < original.size(); start += third)
+        {
+            IoTransfer transfer{fd, {}, start, false};
+            for(size_t i = start; i < min(start + third, original.size()); i += 7)
+            {
+                transfer.parts.push_back({&bytes[i], min<size_t>(7, min(start + third, original.size()) - i)});
+            }
+            transfers.push_back(transfer);
+        }
+        check(ring.run(transfers) && bytes == original, name + " reads");
+
+        vector<IoTransfer> past_end = {{fd, {{&bytes[0], 16}}, original.size() - 8, false}};
+        check(!ring.run(past_end), name + " fails reading past the end");
+        close(fd);
+
+        Bitmap b;
+        b.load("examples/pikachu24.bmp", &ring);
+        Bitmap expected = load("examples/pikachu24.bmp");
+        check(b.data == expected.data, name + " loads");
+
+        resize(b, 301, 171, ResampleFilter::Box);   // Padded rows, through O_DIRECT in the test build
+        b.save(path, &ring);
+        ostringstream streamed;
+        streamed << b;
+        check(readFile(path) == streamed.str(), name + " saves");
+    }
+}
+
+// Results come back out of the cache unchanged, keyed by both the file and the options, and outputs served from
+// it can be written, even in place, without touching the cache
+static void testResultCache()
+{
+    const string directory = "/tmp/test_filters_cache";
+    const string output    = "/tmp/test_filters_cached.bmp";
+
+    cout << "result cache:" << endl;
+    check(hashBytes("", 0) == 0xef46db3751d8e999ull && hashBytes("abc", 3) == 0x44bc2cf5ad770999ull &&
+          hashBytes("Nobody inspects the spammish repetition", 39) == 0xfbcea83c8a378bf1ull, "xxHash64 of known strings");
+    check(canCache("-b3.5") && canCache("-resize200x100:box") && !canCache("-stats:/tmp/x.json") &&
+          !canCache("-overlay:logo.bmp@1,2"), "options that read or write other files aren't cached");
+
+    if(system(("rm -rf " + directory).c_str()) != 0) return;
+    ResultCache cache(directory);
+    string      bear2 = cache.hashFile("examples/bear2_24.bmp");
+    string      bear3 = cache.hashFile("examples/bear3_32.bmp");
+    check(bear2.size() == 32 && bear2 == cache.hashFile("examples/bear2_24.bmp") && bear2 != bear3 &&
+          cache.hashFile("/tmp/test_filters_no_such_file.bmp").empty(), "file hashes");
+    string bear2_bytes = readFile("examples/bear2_24.bmp");
+    char   both[33];
+    snprintf(both, sizeof(both), "%016llx%016llx", (unsigned long long)hashBytes(bear2_bytes.data(), bear2_bytes.size(), 0),
+             (unsigned long long)hashBytes(bear2_bytes.data(), bear2_bytes.size(), 2870177450012600261ull));
+    check(bear2 == both, "file hash is XXH64 with both seeds");
+    check(cache.key(bear2, "-g") != cache.key(bear2, "-c") && cache.key(bear2, "-g") != cache.key(bear3, "-g"),
+          "keys depend on the file and the options");
+    check(cache.fetch(cache.key(bear2, "-g"), output) == CacheHit::Miss, "nothing cached yet");
+
+    Bitmap gray = load("examples/bear2_24.bmp");
+    grayscale(gray);
+    gray.save(output);
+    string expected = readFile(output);
+    cache.store(cache.key(bear2, "-g"), output);
+    remove(output.c_str());
+
+    CacheHit hit = cache.fetch(cache.key(bear2, "-g"), output);
+    check(hit != CacheHit::Miss && readFile(output) == expected, string("cached result served (") + cacheHitName(hit) + ")");
+    check(cache.fetch(cache.key(bear2, "-g"), output) != CacheHit::Miss && readFile(output) == expected,
+          "cached result served over itself");
+
+    Bitmap other = load("examples/bear2_24.bmp");
+    other.save(output);
+    remove(output.c_str());
+    check(cache.fetch(cache.key(bear2, "-g"), output) != CacheHit::Miss && readFile(output) == expected,
+          "saving over a served result leaves the cache alone");
+
+    fstream in_place(output, ios::in | ios::out | ios::binary);
+    in_place.seekp(100);
+    in_place.write("written in place", 16);
+    in_place.close();
+    check(cache.fetch(cache.key(bear2, "-g"), output) != CacheHit::Miss && readFile(output) == expected,
+          "writing into a served result in place leaves the cache alone");
+
+    // A second batch gets every cacheable job from the cache and writes the same files
+    const string manifest = "/tmp/test_filters_cache.txt";
+    ofstream     out(manifest);
+    out << "examples/bear2_24.bmp -g -b /tmp/test_filters_cache0.bmp\n"
+        << "examples/bear3_32.bmp -r90 /tmp/test_filters_cache1.bmp\n"
+        << "examples/bear2_24.bmp -stats:/tmp/test_filters_cache.json /tmp/test_filters_cache2.bmp\n";
+    out.close();
+    ostringstream first, second;
+    runBatch(readManifest(manifest), first, -1, &cache);
+    string outputs[3];
+    for(int i = 0; i < 3; i++) outputs[i] = readFile("/tmp/test_filters_cache" + to_string(i) + ".bmp");
+    remove("/tmp/test_filters_cache1.bmp");
+    int failed = runBatch(readManifest(manifest), second, -1, &cache);
+    bool same = true;
+    for(int i = 0; i < 3; i++) same = same && readFile("/tmp/test_filters_cache" + to_string(i) + ".bmp") == outputs[i];
+    check(first.str().find("0 from the result cache") != string::npos && failed == 0 &&
+          second.str().find("2 from the result cache") != string::npos && same, "batch served from the cache");
+}
+
+int main()
+{
+    cout << "simd level: " << simdLevelName(detectSimdLevel()) << endl;
+
+    try
+    {
+        testKernels();
+        testExamples();
+        testAgainstScalar();
+        testPixelate();
+        testResize();
+        testBlurSigma();
+        testThreads();
+        testPlanar();
+        testTiled();
+        testAlpha();
+        testPointOps();
+        testStats();
+        testImageHash();
+        testConvolve();
+        testPipeline();
+        testBatch();
+        testBufferPool();
+        testStream();
+        testSave();
+        testLoad();
+        testIoRing();
+        testResultCache();
+    }
+    catch(BitmapException& e)
+    {
+        e.print_exception();
+        return 1;
+    }
+
+    cout << (failures ? "FAILED" : "all tests passed") << endl;
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,203 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <algorithm>
+#include "threadpool.h"
+
+// Set on pool threads (and on the caller while it works on a run), so nested runs go inline
+static thread_local bool inside_pool = false;
+
+ThreadPool::ThreadPool(int count) {
+    count = std::max(1, count);
+
+    for (int i = 0; i < count; i++) {
+        queues.push_back(std::unique_ptr<Queue>(new Queue));
+    }
+    for (int i = 1; i < count; i++) {
+        threads.emplace_back(&ThreadPool::work, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+int ThreadPool::size() const {
+    return queues.size();
+}
+
+void ThreadPool::run(size_t tasks, const std::function<void(size_t)>& task) {
+    if (tasks == 0) return;
+    // One run at a time: a second thread calling in while the pool is busy runs its tasks itself
+    std::unique_lock<std::mutex> busy(running, std::try_to_lock);
+    if (inside_pool || threads.empty() || tasks == 1 || !busy.owns_lock()) {
+        for (size_t i = 0; i < tasks; i++) task(i);
+        return;
+    }
+
+    // Hand each worker a contiguous chunk, so neighbouring tiles tend to stay on one core
+    size_t workers = queues.size();
+    for (size_t w = 0; w < workers; w++) {
+        std::lock_guard<std::mutex> guard(queues[w]->lock);
+        for (size_t i = tasks * w / workers; i < tasks * (w + 1) / workers; i++) {
+            queues[w]->tasks.push_back(i);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        current   = &task;
+        remaining = tasks;
+        error     = nullptr;
+        active    = 1;       // The caller
+        generation++;
+    }
+    wake.notify_all();
+
+    inside_pool = true;
+    drain(0, task);
+    inside_pool = false;
+
+    std::exception_ptr failure;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        active--;
+        done.wait(guard, [this]() { return remaining == 0 && active == 0; });
+        current = nullptr;
+        failure = error;
+    }
+
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+void ThreadPool::work(int worker) {
+    size_t seen = 0;    // The last run this worker joined
+
+    inside_pool = true;
+    for (;;) {
+        const std::function<void(size_t)> *task;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            if (current == nullptr) continue;  // Woke up after that run had already finished
+            task = current;
+            active++;
+        }
+
+        drain(worker, *task);
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (--active == 0 && remaining == 0) done.notify_all();
+    }
+}
+
+void ThreadPool::drain(int worker, const std::function<void(size_t)>& task) {
+    size_t index;
+
+    while (next(worker, index)) {
+        try {
+            task(index);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!error) error = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (--remaining == 0 && active == 0) done.notify_all();
+    }
+}
+
+bool ThreadPool::next(int worker, size_t& task) {
+    size_t workers = queues.size();
+
+    // Our own queue first, from the front
+    {
+        Queue& own = *queues[worker];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+
+    // Then steal from the back of everyone else's
+    for (size_t i = 1; i < workers; i++) {
+        Queue& victim = *queues[(worker + i) % workers];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/////////////////////////////////
+// Shared pool
+/////////////////////////////////
+
+static std::mutex                  shared_lock;
+static int                         requested_threads = 0;
+static std::shared_ptr<ThreadPool> shared_pool;
+
+void setThreadCount(int threads) {
+    std::lock_guard<std::mutex> guard(shared_lock);
+    requested_threads = std::max(0, threads);
+}
+
+int getThreadCount() {
+    std::lock_guard<std::mutex> guard(shared_lock);
+    if (requested_threads > 0) return requested_threads;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// The pool for the current thread count.  A pool replaced after the count changes lives on until the runs
+// still using it let go of it
+static std::shared_ptr<ThreadPool> sharedPool() {
+    int threads = getThreadCount();
+
+    std::lock_guard<std::mutex> guard(shared_lock);
+    if (!shared_pool || shared_pool->size() != threads) {
+        shared_pool = std::make_shared<ThreadPool>(threads);
+    }
+    return shared_pool;
+}
+
+void parallelFor(size_t tasks, const std::function<void(size_t)>& task) {
+    if (tasks <= 1 || inside_pool || getThreadCount() == 1) {
+        for (size_t i = 0; i < tasks; i++) task(i);
+        return;
+    }
+    sharedPool()->run(tasks, task);
+}
+
+void parallelRows(int rows, const std::function<void(int, int)>& body, int granularity) {
+    int threads = getThreadCount();
+    int band;
+
+    if (rows <= 0) return;
+
+    // About four bands per thread leaves room for stealing, in whole multiples of granularity
+    band = (rows + threads * 4 - 1) / (threads * 4);
+    band = std::max(granularity, (band + granularity - 1) / granularity * granularity);
+
+    parallelFor((rows + band - 1) / band, [&](size_t i) {
+        int first = i * band;
+        body(first, std::min(first + band, rows));
+    });
+}
@@ -0,0 +1,92 @@
+// Author:  Charles Lucas
+// CS510
+//
+// A small work-stealing thread pool for running the filters over tiles.
+//
+// Each run() hands out task indices to per-worker queues in contiguous
+// chunks.  A worker takes tasks from the front of its own queue, and when it
+// runs dry it steals from the back of another worker's queue, so uneven
+// tiles still keep every core busy.
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <exception>
+
+class ThreadPool
+{
+public:
+    /**
+     * Start threads-1 worker threads (the thread calling run() is the last worker).
+     */
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const;
+
+    /**
+     * Run task(i) for every i < tasks across the pool and wait for all of them.
+     * Called from inside a task, or from another thread while a run is in
+     * progress, it runs the tasks inline instead, so any thread can call it.
+     *
+     * @throws the first exception thrown by a task, once every task has finished.
+     */
+    void run(size_t tasks, const std::function<void(size_t)>& task);
+
+private:
+    struct Queue
+    {
+        std::mutex         lock;
+        std::deque<size_t> tasks;
+    };
+
+    void work(int worker);
+    void drain(int worker, const std::function<void(size_t)>& task);
+    bool next(int worker, size_t& task);
+
+    std::mutex                          running;  // Held by the thread whose run the workers are on
+    std::vector<std::unique_ptr<Queue>> queues;   // One queue per worker, the caller's is queues[0]
+    std::vector<std::thread>            threads;
+
+    std::mutex                          lock;     // Guards everything below
+    std::condition_variable             wake;     // Workers wait here for a new run
+    std::condition_variable             done;     // run() waits here for the last task
+    const std::function<void(size_t)>  *current = nullptr;
+    size_t                              generation = 0;
+    size_t                              remaining = 0;  // Tasks of the current run not finished yet
+    int                                 active = 0;     // Workers still holding on to current
+    std::exception_ptr                  error;
+    bool                                stopping = false;
+};
+
+/**
+ * The number of threads the filters use.  0 (the default) means one per core.
+ */
+void setThreadCount(int threads);
+int  getThreadCount();
+
+/**
+ * Run task(i) for every i < tasks on the shared pool.  Any thread can call
+ * it at any time, and setThreadCount() can change the pool while runs are
+ * still going (they finish on the pool they started on).
+ */
+void parallelFor(size_t tasks, const std::function<void(size_t)>& task);
+
+/**
+ * Split rows 0..rows-1 into bands and run body(first, last) on each band in parallel.
+ * Every band except the last starts and ends on a multiple of granularity.
+ */
+void parallelRows(int rows, const std::function<void(int, int)>& body, int granularity = 1);
+
+#endif
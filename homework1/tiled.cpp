@@ -0,0 +1,204 @@
+// Author:  Charles Lucas
+// CS510
+
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include "tiled.h"
+#include "pixelformat.h"
+#include "bitmap_simd.h"
+#include "threadpool.h"
+
+// Spread the low 32 bits of v out to the even bits
+static uint64_t spreadBits(uint64_t v) {
+    v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+    v = (v | (v << 8))  & 0x00FF00FF00FF00FFull;
+    v = (v | (v << 4))  & 0x0F0F0F0F0F0F0F0Full;
+    v = (v | (v << 2))  & 0x3333333333333333ull;
+    v = (v | (v << 1))  & 0x5555555555555555ull;
+    return v;
+}
+
+uint64_t mortonCode(uint32_t x, uint32_t y) {
+    return spreadBits(x) | (spreadBits(y) << 1);
+}
+
+/**
+ * The grid rarely has a power of two tiles on a side, so the tiles are
+ * sorted by their Z-order code and packed, which keeps the order without
+ * leaving holes.
+ */
+void TiledImage::layout() {
+    size_t count = (size_t)tiles_x * tiles_y;
+
+    order.resize(count);
+    slots.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return mortonCode(a % tiles_x, a / tiles_x) < mortonCode(b % tiles_x, b / tiles_x);
+    });
+    for (size_t position = 0; position < count; position++) {
+        slots[order[position]] = position;
+    }
+}
+
+TiledImage::TiledImage(const Bitmap& b) {
+    width    = b.width_in_pixels;
+    height   = b.height_in_pixels;
+    bytes    = b.color_depth / 8;
+    tiles_x  = (width  + TILE_SIZE - 1) / TILE_SIZE;
+    tiles_y  = (height + TILE_SIZE - 1) / TILE_SIZE;
+    origin_x = 0;
+    origin_y = 0;
+    keep     = 0xFFFFFFFF;
+    if (bytes == 4) {
+        keep = b.red_mask | b.green_mask | b.blue_mask | b.alpha_mask;
+    }
+
+    header.copyHeader(b);
+    layout();
+
+    size_t count = order.size();
+    memory.resize(2 * count * tileBytes());
+    tiles = memory.data();
+    spare = tiles + count * tileBytes();
+
+    // Each tile copies in the part of each of its rows that holds the image
+    parallelRows(count, [&](int first, int last) {
+        for (int position = first; position < last; position++) {
+            int      tx     = order[position] % tiles_x;
+            int      ty     = order[position] / tiles_x;
+            uint8_t *target = tiles + (size_t)position * tileBytes();
+            int      x0     = std::max(0, tx * TILE_SIZE - origin_x);
+            int      x1     = std::min(width, (tx + 1) * TILE_SIZE - origin_x);
+
+            for (int r = 0; r < TILE_SIZE; r++) {
+                int y = ty * TILE_SIZE + r - origin_y;
+                if (y < 0 || y >= height) continue;
+                memcpy(target + ((size_t)r * TILE_SIZE + x0 + origin_x - tx * TILE_SIZE) * bytes,
+                       b.row(y) + (size_t)x0 * bytes, (size_t)(x1 - x0) * bytes);
+            }
+        }
+    });
+}
+
+void TiledImage::merge(Bitmap& b) const {
+    b.copyHeaderForPixels(header);
+
+    parallelRows(order.size(), [&](int first, int last) {
+        for (int position = first; position < last; position++) {
+            int            tx     = order[position] % tiles_x;
+            int            ty     = order[position] / tiles_x;
+            const uint8_t *source = tiles + (size_t)position * tileBytes();
+            int            x0     = std::max(0, tx * TILE_SIZE - origin_x);
+            int            x1     = std::min(width, (tx + 1) * TILE_SIZE - origin_x);
+
+            for (int r = 0; r < TILE_SIZE; r++) {
+                int y = ty * TILE_SIZE + r - origin_y;
+                if (y < 0 || y >= height) continue;
+                memcpy(b.row(y) + (size_t)x0 * bytes,
+                       source + ((size_t)r * TILE_SIZE + x0 + origin_x - tx * TILE_SIZE) * bytes, (size_t)(x1 - x0) * bytes);
+            }
+        }
+    });
+}
+
+// Copy a row of a tile with its pixels in reverse order (the pixel size is fixed, so each copy is a move or two)
+template<int Bytes>
+static void reverseRow(const uint8_t *source, uint8_t *target) {
+    for (int x = 0; x < TILE_SIZE; x++) {
+        memcpy(target + x * Bytes, source + (TILE_SIZE - 1 - x) * Bytes, Bytes);
+    }
+}
+
+/**
+ * Every transform is a mirror in x and/or y, with or without a transpose
+ * first.  Mirroring the whole grid of tiles and each tile the same way
+ * mirrors the image, as long as the image moves to the other side of the
+ * padding (origin = grid size - image size - origin), so each target tile
+ * is one source tile run through the same transform.
+ */
+void TiledImage::transform(uint mode) {
+    static const char *names[] = {"rotate 90", "rotate 180", "rotate 270", "flip vertical",
+                                  "flip horizontal", "flip diagonal 1", "flip diagonal 2"};
+    bool transpose, mirror_x, mirror_y;
+
+    // For transposes, mirror_x and mirror_y are TransposeJob's flip_x and flip_y (see imageTransform())
+    switch (mode) {
+        case 0:  transpose = true;  mirror_x = true;  mirror_y = false; break;   // ROT90
+        case 1:  transpose = false; mirror_x = true;  mirror_y = true;  break;   // ROT180
+        case 2:  transpose = true;  mirror_x = false; mirror_y = true;  break;   // ROT270
+        case 3:  transpose = false; mirror_x = false; mirror_y = true;  break;   // FLIPV
+        case 4:  transpose = false; mirror_x = true;  mirror_y = false; break;   // FLIPH
+        case 5:  transpose = true;  mirror_x = true;  mirror_y = true;  break;   // FLIPD1
+        case 6:  transpose = true;  mirror_x = false; mirror_y = false; break;   // FLIPD2
+        default:
+            std::cout << "Error - Invalid tranform mode selected." << std::endl;
+            return;
+    }
+    std::cout << "Applying " << names[mode] << " transform." << std::endl;
+
+    int                   old_tiles_x = tiles_x;
+    int                   old_tiles_y = tiles_y;
+    std::vector<uint32_t> old_slots   = slots;
+    int                   flipped_x   = old_tiles_x * TILE_SIZE - width  - origin_x;   // The origins after a mirror
+    int                   flipped_y   = old_tiles_y * TILE_SIZE - height - origin_y;
+    size_t                row_bytes   = (size_t)TILE_SIZE * bytes;
+    SimdLevel             level       = getSimdLevel();
+
+    if (transpose) {
+        std::swap(width, height);
+        std::swap(tiles_x, tiles_y);
+        int x = mirror_y ? flipped_y : origin_y;
+        int y = mirror_x ? flipped_x : origin_x;
+        origin_x = x;
+        origin_y = y;
+        header.setDimensions(width, height);
+        layout();
+    }
+    else {
+        if (mirror_x) origin_x = flipped_x;
+        if (mirror_y) origin_y = flipped_y;
+    }
+
+    parallelRows(order.size(), [&](int first, int last) {
+        for (int position = first; position < last; position++) {
+            int      tx     = order[position] % tiles_x;
+            int      ty     = order[position] / tiles_x;
+            uint8_t *target = spare + (size_t)position * tileBytes();
+            int      sx, sy;
+
+            if (transpose) {
+                sx = mirror_x ? old_tiles_x - 1 - ty : ty;
+                sy = mirror_y ? old_tiles_y - 1 - tx : tx;
+            }
+            else {
+                sx = mirror_x ? old_tiles_x - 1 - tx : tx;
+                sy = mirror_y ? old_tiles_y - 1 - ty : ty;
+            }
+            const uint8_t *source = tiles + old_slots[(size_t)sy * old_tiles_x + sx] * tileBytes();
+
+            if (transpose) {
+                TransposeJob job = {source, target, TILE_SIZE, TILE_SIZE, bytes, mirror_x, mirror_y, keep};
+                transposeTile(job, 0, 0, TILE_SIZE, TILE_SIZE, level);
+                continue;
+            }
+
+            for (int r = 0; r < TILE_SIZE; r++) {
+                const uint8_t *from = source + (mirror_y ? TILE_SIZE - 1 - r : r) * row_bytes;
+                uint8_t       *to   = target + r * row_bytes;
+
+                if (!mirror_x)        memcpy(to, from, row_bytes);
+                else if (bytes == 3)  reverseRow<3>(from, to);
+                else                  reverseRow<4>(from, to);
+            }
+            if (bytes == 4 && keep != 0xFFFFFFFF) {
+                clearUnusedBits(target, (size_t)TILE_SIZE * TILE_SIZE, keep);
+            }
+        }
+    });
+
+    std::swap(tiles, spare);
+}
@@ -0,0 +1,96 @@
+// Author:  Charles Lucas
+// CS510
+//
+// Tiled images: pixels kept in TILE_SIZE x TILE_SIZE tiles, each tile one
+// contiguous block and the tiles laid out in Z-order.  Rotations and
+// diagonal flips turn source columns into target rows, which in row-major
+// pixels means a cache miss (and often a TLB miss) for every few pixels.  On
+// tiles they become a permutation of whole tiles plus a transpose inside
+// each tile, with both tiles in L1.  Images are tiled once, run through any
+// number of rotations and flips, and merged back into rows.
+
+#ifndef TILED_H
+#define TILED_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "bitmap.h"
+#include "bufferpool.h"
+
+#define TILE_SIZE 64   // Pixels on a side of a tile (a 32-bit tile is 16KB, so a source and target tile fit in L1)
+
+/**
+ * TiledImage - an image cut into square tiles.
+ *
+ * The image sits in a grid of whole tiles at an offset of (origin_x,
+ * origin_y) pixels, so the tiles at the edges hold some padding.  A flip
+ * moves the padding to the other side instead of shifting every pixel, which
+ * keeps every transform a whole-tile permutation.  Tiles hold whole pixels
+ * as they are in memory, so a round trip gives back exactly the pixels it
+ * started with.
+ */
+class TiledImage
+{
+public:
+    /**
+     * Tile a loaded or mapped image.
+     */
+    explicit TiledImage(const Bitmap& b);
+
+    TiledImage(const TiledImage&) = delete;
+    TiledImage& operator=(const TiledImage&) = delete;
+    TiledImage(TiledImage&&) = default;
+    TiledImage& operator=(TiledImage&&) = default;
+
+    /**
+     * Merge the tiles back into rows in b, which gets this image's header
+     * (with the dimensions turned, if a transform turned them).
+     */
+    void merge(Bitmap& b) const;
+
+    /**
+     * Transform the image, with the modes of imageTransform() (0 = ROT90,
+     * 1 = ROT180, 2 = ROT270, 3 = FLIPV, 4 = FLIPH, 5 = FLIPD1, 6 = FLIPD2),
+     * giving exactly the pixels imageTransform() would.
+     */
+    void transform(uint mode);
+
+    /**
+     * The tile in column tx and row ty of the grid (rows bottom up, like the
+     * rows of a Bitmap).
+     */
+    uint8_t*       tile(int tx, int ty)       { return tiles + slots[(size_t)ty * tiles_x + tx] * tileBytes(); }
+    const uint8_t* tile(int tx, int ty) const { return tiles + slots[(size_t)ty * tiles_x + tx] * tileBytes(); }
+    size_t         tileBytes() const          { return (size_t)TILE_SIZE * TILE_SIZE * bytes; }
+
+    int width;      // Image size in pixels
+    int height;
+    int bytes;      // Bytes per pixel
+    int tiles_x;    // Grid size in tiles
+    int tiles_y;
+    int origin_x;   // Grid pixel of image pixel (0, 0)
+    int origin_y;
+
+private:
+    /**
+     * Lay out a tiles_x x tiles_y grid in Z-order and make room for it.
+     */
+    void layout();
+
+    Bitmap                header;   // The source image without its pixels
+    uint32_t              keep;     // Bits of a 32-bit pixel that belong to a channel
+    std::vector<uint32_t> slots;    // Position in memory of each tile of the grid, row by row
+    std::vector<uint32_t> order;    // The grid index of each position in memory (the inverse of slots)
+    PooledVector<uint8_t> memory;   // The tiles, then room for as many again that transforms write into
+    uint8_t              *tiles;
+    uint8_t              *spare;
+};
+
+/**
+ * Interleave the bits of x and y (x in the even bits), which orders the
+ * tiles of a grid along a Z curve.
+ */
+uint64_t mortonCode(uint32_t x, uint32_t y);
+
+#endif